@@ -6,6 +6,7 @@
  */
 
 #include "librarymap.h"
+#include "rdbinary.h"
 
 const std::string LibraryMap::kInvalidString("INVALID");
 
@@ -22,15 +23,40 @@ struct LibraryMap::Entry LibraryMap::Lookup(ADDRINT address) {
   return LibraryMap::Entry(&kInvalidString, 0);
 }
 
-std::string LibraryMap::GetPythonString() {
-  std::string out("import collections\n"
-                  "LME = collections.namedtuple('LME', 'name base top')\n"
-                  "LibraryMap = [");
+void LibraryMap::WritePython(StatsWriter *out) {
+  out->Write("import collections\n"
+             "LME = collections.namedtuple('LME', 'name base top')\n"
+             "LibraryMap = [");
+  for (std::list<LibraryEntry>::iterator iter = images_.begin(); iter != images_.end(); ++iter) {
+    out->Write("LME('");
+    out->Write(iter->name);
+    out->Write("',");
+    out->Write(hexstr(iter->base_address));
+    out->Write(",");
+    out->Write(hexstr(iter->top_address));
+    out->Write("),");
+  }
+  out->Write("]\n");
+}
+
+void LibraryMap::WriteBinary(BinaryResultWriter *out) {
+  out->BeginRecord(BinaryResultWriter::kLibraryMapRecord, "LibraryMap");
+  out->BeginList();
   for (std::list<LibraryEntry>::iterator iter = images_.begin(); iter != images_.end(); ++iter) {
-    out += "LME('" + iter->name + "'," + hexstr(iter->base_address) + "," + hexstr(iter->top_address)
-        + "),";
+    out->BeginTuple();
+    out->String(iter->name.c_str());
+    out->HexInt(iter->base_address);
+    out->HexInt(iter->top_address);
+    out->End();
   }
-  out += "]\n";
+  out->End();
+}
+
+std::string LibraryMap::GetPythonString() {
+  std::string out;
+  StatsWriter writer(&out);
+  WritePython(&writer);
+  writer.Flush();
   return out;
 }
 
@@ -11,6 +11,9 @@
 #include <list>
 #include <string>
 #include "pin.H"
+#include "statswriter.h"
+
+class BinaryResultWriter;
 
 /*
  * Class to map a PC to a image+offset, because pin loads libraries in different places
@@ -27,6 +30,10 @@ public:
   void AddImage(ADDRINT base_address, ADDRINT top_address, const std::string &name);
   struct Entry Lookup(ADDRINT address);
   std::string GetPythonString();
+  // same output as GetPythonString, streamed to 'out'
+  void WritePython(StatsWriter *out);
+  // as a library map record, which converts back to the WritePython text
+  void WriteBinary(BinaryResultWriter *out);
 private:
   class LibraryEntry {
   public:
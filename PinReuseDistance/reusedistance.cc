@@ -37,11 +37,13 @@ END_LEGAL */
 #include <stdio.h>
 #include <sched.h>
 #include <tr1/unordered_map>
+#include <vector>
 #include <boost/lexical_cast.hpp>
 #include "pin.H"
 #include "instlib.H"
 #include "librarymap.h"
 #include "magicinstruction.h"
+#include "refpipeline.h"
 #include "stackholder.h"
 #include "ticket_lock.h"
 #include "futex_lock.h"
@@ -52,7 +54,8 @@ using INSTLIB::CONTROL_EVENT;
 using INSTLIB::CONTROL_START;
 using INSTLIB::CONTROL_STOP;
 
-#define SINGLE_THREAD
+// Without the -pipe pipeline, references from several threads are serialized by stacks_lock
+//#define SINGLE_THREAD
 //#define USE_TICKETLOCK
 
 #ifndef SINGLE_THREAD
@@ -84,12 +87,17 @@ using INSTLIB::CONTROL_STOP;
 
 CONTROL controller;
 LOCK_T stacks_lock;
-address_t inst_buffers[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+std::vector<address_t> inst_buffers;  ///< last fetched line, by thread id
+
+// StackHolder throws for thread ids at or past -mt, so those threads are not traced
+inline bool IsTracedThread(THREADID tid) { return tid < inst_buffers.size(); }
 
 bool enabled;
 THREADID last_thread = 0;
 //int consecutive_references = 0;
 StackHolder *stacks;
+RefPipeline *pipeline = NULL;  ///< with -pipe, the analysis callbacks only append to it
+bool concurrent_shared = false;  ///< with -cs, stacks->Access needs no lock
 bool fetch_enabled;
 LibraryMap library_map;
 
@@ -106,10 +114,23 @@ KNOB<int> KnobGranularity(KNOB_MODE_WRITEONCE, "pintool", "g",
                           "specify analysis granularity");
 
 KNOB<string> KnobStackImpl(KNOB_MODE_WRITEONCE, "pintool", "sti", kDefaultStackImpl,
-                           "specify stack implementation type");
+                           "specify stack implementation type: exact, approximate or sharded");
+
+KNOB<int> KnobMaxThreads(KNOB_MODE_WRITEONCE, "pintool", "mt",
+                         boost::lexical_cast<std::string>(StackHolder::kDefaultMaxThreads),
+                         "thread ids must be less than this");
+
+KNOB<int> KnobShardThreads(KNOB_MODE_WRITEONCE, "pintool", "sht", "1",
+                           "threads answering each shared stack's queries (with -sti sharded)");
+
+KNOB<int> KnobReplayThreads(KNOB_MODE_WRITEONCE, "pintool", "rpt", "1",
+                            "threads replaying the lazy/oracular stacks at parallel region ends");
 
 KNOB<string> KnobStackSharing(KNOB_MODE_WRITEONCE, "pintool", "s", kDefaultStackSharing,
-                              "specify private or shared stacks");
+                              "specify private, shared or both kinds of stacks");
+
+KNOB<string> KnobTopology(KNOB_MODE_WRITEONCE, "pintool", "topo", CacheTopology::kDefaultSpec,
+                          "shared cache levels as name:threads[:offset],... (see cachetopology.h)");
 
 KNOB<BOOL> KnobDoFetch(KNOB_MODE_WRITEONCE, "pintool", "f", "false",
                          "specify whether to include instruction fetches");
@@ -117,6 +138,28 @@ KNOB<BOOL> KnobDoFetch(KNOB_MODE_WRITEONCE, "pintool", "f", "false",
 KNOB<BOOL> KnobDoPrefetch(KNOB_MODE_WRITEONCE, "pintool", "p", "false",
                          "specify whether to perform prefetches");
 
+KNOB<int> KnobPCStatsLimit(KNOB_MODE_WRITEONCE, "pintool", "pcl", "0",
+                           "max PCs with full distance histograms (0 = unlimited)");
+
+KNOB<UINT64> KnobIntervalLength(KNOB_MODE_WRITEONCE, "pintool", "il", "0",
+                                "stream interval histograms every N references (0 = off)");
+
+KNOB<BOOL> KnobPeriodIntervals(KNOB_MODE_WRITEONCE, "pintool", "ip", "false",
+                               "stream interval histograms at every END_PERIOD marker");
+
+KNOB<BOOL> KnobBinaryOutput(KNOB_MODE_WRITEONCE, "pintool", "bin", "false",
+                            "write results in the binary format (convert with rdconvert)");
+
+KNOB<BOOL> KnobVariantThreads(KNOB_MODE_WRITEONCE, "pintool", "vt", "false",
+                              "update each kind of stack on its own thread (with -s both)");
+
+KNOB<BOOL> KnobPipeline(KNOB_MODE_WRITEONCE, "pintool", "pipe", "false",
+                        "only queue references in the program's threads, analyze on another");
+
+KNOB<BOOL> KnobConcurrentShared(KNOB_MODE_WRITEONCE, "pintool", "cs", "false",
+                                "log references per thread and merge them into the shared stacks "
+                                "on another thread, without a lock (with -s shared)");
+
 
 //handler to set/unset instrumentation
 VOID Handler(CONTROL_EVENT ev, VOID * v, CONTEXT * ctxt, VOID * ip, THREADID tid)
@@ -134,28 +177,63 @@ VOID Handler(CONTROL_EVENT ev, VOID * v, CONTEXT * ctxt, VOID * ip, THREADID tid
     break;
   }
 }
+// Everything but the per-reference calls: keeps the analysis off the stack holder, and with the
+// pipeline waits until the references so far have gone through
+VOID LockStacks() {
+  if (pipeline) {
+    pipeline->LockStacks();
+  } else {
+    GET_LOCK(&stacks_lock);
+  }
+}
+
+VOID UnlockStacks() {
+  if (pipeline) {
+    pipeline->UnlockStacks();
+  } else {
+    RELEASE_LOCK(&stacks_lock);
+  }
+}
+
 address_t kInstMask = ~0xF;
 //address_t
 VOID PIN_FAST_ANALYSIS_CALL RecordFetch(VOID * ip, UINT32 size, THREADID tid) {
-  if (!enabled) return;
+  if (!enabled || !IsTracedThread(tid)) return;
   address_t pc = reinterpret_cast<address_t>(ip);;
-  GET_LOCK(&stacks_lock);
+  // inst_buffers[tid] is only used by this thread, so the pipeline needs no lock here
+  if (!pipeline) GET_LOCK(&stacks_lock);
   //  printf("tid %d ip %p size %d buf %lx %s\n", tid, ip, size, inst_buffers[tid], (pc & kInstMask) == inst_buffers[tid] ? "hit" : "miss");
   if ((pc & kInstMask) != inst_buffers[tid]) {
     inst_buffers[tid] = pc & kInstMask;
-    stacks->Fetch(tid, inst_buffers[tid], 16);
+    if (pipeline) {
+      pipeline->Fetch(tid, inst_buffers[tid], 16);
+    } else {
+      stacks->Fetch(tid, inst_buffers[tid], 16);
+    }
   }
   if (((pc + size) & kInstMask) != inst_buffers[tid]) {
     inst_buffers[tid] = (pc + size) & kInstMask;
-    stacks->Fetch(tid, inst_buffers[tid], 16);
+    if (pipeline) {
+      pipeline->Fetch(tid, inst_buffers[tid], 16);
+    } else {
+      stacks->Fetch(tid, inst_buffers[tid], 16);
+    }
   }
-  RELEASE_LOCK(&stacks_lock);
+  if (!pipeline) RELEASE_LOCK(&stacks_lock);
 }
 
 // Print a memory read record
 VOID PIN_FAST_ANALYSIS_CALL RecordMemRead(VOID * ip, ADDRINT addr, UINT32 size, THREADID tid) {
   //if (size > 8) printf("Large read sz %ld at %p\n", size, ip);
-  if (!enabled) return;
+  if (!enabled || !IsTracedThread(tid)) return;
+  if (pipeline) {
+    pipeline->Access(tid, addr, size, reinterpret_cast<address_t>(ip), false);
+    return;
+  }
+  if (concurrent_shared) {
+    stacks->Access(tid, addr, size, reinterpret_cast<address_t>(ip), false);
+    return;
+  }
   GET_LOCK(&stacks_lock);
   //  if (last_thread == tid) consecutive_references++;
   //else consecutive_references = 0;
@@ -169,7 +247,15 @@ VOID PIN_FAST_ANALYSIS_CALL RecordMemRead(VOID * ip, ADDRINT addr, UINT32 size,
 // Print a memory write record
 VOID PIN_FAST_ANALYSIS_CALL RecordMemWrite(VOID * ip, ADDRINT addr, UINT32 size, THREADID tid) {
   //if (size > 8) printf("Large write sz %ld at %p\n", size, ip);
-  if (!enabled) return;
+  if (!enabled || !IsTracedThread(tid)) return;
+  if (pipeline) {
+    pipeline->Access(tid, addr, size, reinterpret_cast<address_t>(ip), true);
+    return;
+  }
+  if (concurrent_shared) {
+    stacks->Access(tid, addr, size, reinterpret_cast<address_t>(ip), true);
+    return;
+  }
   GET_LOCK(&stacks_lock);
   //if (last_thread == tid) consecutive_references++;
   //else consecutive_references = 0;
@@ -246,13 +332,13 @@ VOID EmulateMagicInstruction(ADDRINT rax_value, THREADID tid) {
     case CSM_CODE_STOP_TIMER:
       // call EndParallelRegion etc and stop instrumentation. same as above
       enabled = false;
-      GET_LOCK(&stacks_lock);
+      LockStacks();
       if (stacks->get_global_enable()) {
         stacks->EndParallelRegion();
         stacks->UpdateRatioPredictions();
         stacks->set_global_enable(false);
       }
-      RELEASE_LOCK(&stacks_lock);
+      UnlockStacks();
       printf("stacks global disable\n");
       break;
     // These cases are legal but ignored or shouldn't be seen in the pintool
@@ -266,20 +352,31 @@ VOID EmulateMagicInstruction(ADDRINT rax_value, THREADID tid) {
       break;
     case CSM_CODE_START_PERIOD:
       // r8 tells us the function here but we don't use it right now
+      LockStacks();
       stacks->EndParallelRegion();
+      UnlockStacks();
       break;
     case CSM_CODE_END_PERIOD:
+      LockStacks();
       stacks->EndParallelRegion();
       stacks->UpdateRatioPredictions();
+      if (KnobPeriodIntervals.Value()) stacks->EndInterval();
+      UnlockStacks();
       break;
     case CSM_CODE_LOCAL_START_PERIOD:
 #ifndef SINGLE_THREAD
+      if (!IsTracedThread(tid)) break;
+      LockStacks();
       stacks->SetThreadEnabled(tid, true);
+      UnlockStacks();
 #endif
       break;
     case CSM_CODE_LOCAL_END_PERIOD:
 #ifndef SINGLE_THREAD
+      if (!IsTracedThread(tid)) break;
+      LockStacks();
       stacks->SetThreadEnabled(tid, false);
+      UnlockStacks();
 #endif
       break;
     default:
@@ -311,10 +408,21 @@ VOID InstrumentLibraryMap(IMG image, VOID *v) {
 
 VOID Fini(INT32 code, VOID *v)
 {
+  delete pipeline;  // passes on the last references
+  pipeline = NULL;
   stacks->EndParallelRegion();
   stacks->UpdateRatioPredictions();
   std::string version(std::string("#") + __FILE__ + " version " + PINRD_GIT_VERSION + "\n");
-  stacks->DumpStatsPython(library_map.GetPythonString() + version);
+  stacks->DumpStatsPython("");
+  // the library map goes right after the stats, streamed rather than passed in as a string
+  if (stacks->binary_output()) {
+    library_map.WriteBinary(stacks->GetBinaryWriter());
+    stacks->GetBinaryWriter()->Text(version);
+  } else {
+    StatsWriter out(stacks->GetStatsFileHandle());
+    library_map.WritePython(&out);
+    out.Write(version);
+  }
   delete stacks;
 }
 
@@ -326,10 +434,18 @@ VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
       throw std::runtime_error(">1 thread with SINGLE_THREAD defined");
     }
 #endif
-    GET_LOCK(&stacks_lock);
+    if (!IsTracedThread(threadid)) {
+      static int warned = 0;
+      if (__sync_lock_test_and_set(&warned, 1) == 0) {
+        fprintf(stderr, "threads with ids of %d (-mt) or more are not traced, first is %d\n",
+                static_cast<int>(inst_buffers.size()), threadid);
+      }
+      return;
+    }
+    LockStacks();
     printf("thread begin %d\n", threadid);
     stacks->Allocate(threadid);
-    RELEASE_LOCK(&stacks_lock);
+    UnlockStacks();
 }
 
 int InitStackHolder() {
@@ -341,11 +457,13 @@ int InitStackHolder() {
     printf("Using %s stacks\n", KnobStackImpl.Value().c_str());
   }
   try {
-    stacks = new StackHolder(KnobOutputFile.Value(), KnobGranularity.Value(), KnobStackImpl.Value());
+    stacks = new StackHolder(KnobOutputFile.Value(), KnobGranularity.Value(), KnobStackImpl.Value(),
+                             KnobMaxThreads.Value());
   } catch (std::exception& e) {
     fprintf(stderr, "StackHolder constructor threw exception: %s\n", e.what());
     return -1;
   }
+  inst_buffers.resize(stacks->max_threads());
   if (KnobStackSharing.Value() == "private") {
     stacks->set_do_inval(true);
     stacks->set_do_shared(false);
@@ -362,11 +480,61 @@ int InitStackHolder() {
     stacks->set_do_single_stacks(false);
     stacks->set_do_lazy_stacks(false);
     stacks->set_do_oracular_stacks(false);
+  } else if (KnobStackSharing.Value() == "both") {
+    // private stacks and the shared topology levels, in one pass
+    stacks->set_do_inval(true);
+    stacks->set_do_shared(true);
+    stacks->set_do_sim_stacks(true);
+    stacks->set_do_single_stacks(false);
+    stacks->set_do_lazy_stacks(false);
+    stacks->set_do_oracular_stacks(false);
+    stacks->set_do_fetch(KnobDoFetch.Value());
+    stacks->set_do_prefetch(KnobDoPrefetch.Value());
   } else {
-    fprintf(stderr, "bad value for stack sharing type: must be private or shared\n");
+    fprintf(stderr, "bad value for stack sharing type: must be private, shared or both\n");
+    delete stacks;
+    return -1;
+  }
+  try {
+    stacks->set_topology(KnobTopology.Value());
+  } catch (std::invalid_argument& e) {
+    fprintf(stderr, "bad cache topology: %s\n", e.what());
+    delete stacks;
+    return -1;
+  }
+  if (KnobPCStatsLimit.Value() < 0) {
+    fprintf(stderr, "bad value for PC stats limit: must be >= 0\n");
     delete stacks;
     return -1;
   }
+  stacks->set_pc_stats_limit(KnobPCStatsLimit.Value());
+  stacks->set_interval_length(KnobIntervalLength.Value());
+  stacks->set_binary_output(KnobBinaryOutput.Value());
+  stacks->set_variant_threads(KnobVariantThreads.Value());
+  try {
+    stacks->set_shard_threads(KnobShardThreads.Value());
+  } catch (std::invalid_argument& e) {
+    fprintf(stderr, "bad value for shard threads: %s\n", e.what());
+    delete stacks;
+    return -1;
+  }
+  try {
+    stacks->set_replay_threads(KnobReplayThreads.Value());
+  } catch (std::invalid_argument& e) {
+    fprintf(stderr, "bad value for replay threads: %s\n", e.what());
+    delete stacks;
+    return -1;
+  }
+  if (KnobConcurrentShared.Value()) {
+    if (KnobStackSharing.Value() != "shared" || KnobPipeline.Value()) {
+      fprintf(stderr, "concurrent shared stacks need -s shared, and no -pipe\n");
+      delete stacks;
+      return -1;
+    }
+    stacks->set_concurrent_shared(true);
+    concurrent_shared = true;
+  }
+  if (KnobPipeline.Value()) pipeline = new RefPipeline(stacks);
   // for now use this instead of enabling or disabling instrumentation
   stacks->set_global_enable(false);
   enabled = false;
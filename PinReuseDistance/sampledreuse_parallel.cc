@@ -79,6 +79,18 @@ KNOB<string>KnobSampledStackType(KNOB_MODE_WRITEONCE, "pintool", "s", kDefaultSt
 KNOB<int>KnobSyncInterval(KNOB_MODE_WRITEONCE, "pintool", "si", decstr(kDefaultSyncInterval),
                           "synchronization interval");
 
+KNOB<int>KnobPCStatsLimit(KNOB_MODE_WRITEONCE, "pintool", "pcl", "0",
+                          "max PCs with full distance histograms (0 = unlimited)");
+
+KNOB<BOOL>KnobSketches(KNOB_MODE_WRITEONCE, "pintool", "sk", "false",
+                       "estimate distances with fixed-size sketches (shared stacks only)");
+
+KNOB<BOOL>KnobAsync(KNOB_MODE_WRITEONCE, "pintool", "async", "false",
+                    "merge samples in epochs instead of stopping all threads");
+
+KNOB<BOOL>KnobBatch(KNOB_MODE_WRITEONCE, "pintool", "batch", "false",
+                    "handle new samples and reuses together in fewer synchronization rounds");
+
 // Force each thread's data to be in its own data cache line so that
 // multiple threads do not contend for the same data cache line.
 // This avoids the false sharing problem.
@@ -452,8 +464,13 @@ VOID Fini(INT32 code, VOID *v) {
   std::string syncinterval(std::string("#sync interval ") + decstr(KnobSyncInterval.Value())
                            + "\n");
   std::string totalrefs(std::string("#totalrefs ") + decstr(total_refs) + "\n");
-  INT64 address_samples = ParallelSampledStack::DumpStatsPython(
-      library_map.GetPythonString() + version + samplerate + syncinterval + totalrefs);
+  INT64 address_samples = ParallelSampledStack::DumpStatsPython("");
+  // the library map goes right after the stats, streamed rather than passed in as a string
+  {
+    StatsWriter out(ParallelSampledStack::GetOutputFile());
+    library_map.WritePython(&out);
+    out.Write(version + samplerate + syncinterval + totalrefs);
+  }
   printf("total samples %ld, refs %ld, sampling %.2f%% of time\n",
          total_samples, total_refs, static_cast<double>(total_samples) / total_refs * 100.0);
   printf("overall average sampled addrs per ref: %.2f\n",
@@ -489,6 +506,10 @@ void InitSampler() {
   } else {
     throw std::invalid_argument("stack type must be \"private\" or \"shared\"");
   }
+  ParallelSampledStack::SetPCStatsLimit(KnobPCStatsLimit.Value());
+  ParallelSampledStack::SetDistanceSketches(KnobSketches.Value());
+  ParallelSampledStack::SetAsyncMerging(KnobAsync.Value());
+  ParallelSampledStack::SetSampleBatching(KnobBatch.Value());
   ParallelSampledStack::SetGlobalEnable(false);
   INIT_LOCK(&global_lock);
 }
@@ -0,0 +1,297 @@
+#include "blockset.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "rda-sync.h"
+
+const int BlockSet::kMaxArray;
+const int BlockSet::kBitmapWords;
+
+// Chunk storage pool: each thread keeps a free list per power-of-two size and trades whole
+// batches of blocks with a pool shared by all threads, so most calls take no lock
+static const int kMinSizeClass = 6;  // 32 array values
+static const int kBitmapSizeClass = 13;  // 8 KB, the bitmap or a full array
+static const int kBatchBytes = 64 * 1024;  // storage moved to or from the shared pool at once
+struct FreeBlock {
+  FreeBlock *next;
+  FreeBlock *next_batch;  ///< in the shared pool, kept by the first block of each batch
+  int batch_count;
+};
+struct FreeList {
+  FreeBlock *head;
+  int count;
+};
+struct ThreadBlockCache {
+  FreeList lists[kBitmapSizeClass + 1];
+};
+static RdaLock pool_lock;  // zero is unlocked
+static FreeBlock *free_batches[kBitmapSizeClass + 1];
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;  // hands a thread's blocks back to the pool when it exits
+static __thread ThreadBlockCache *thread_cache;
+
+static int BatchSize(int size_class) { return std::max(1, kBatchBytes >> size_class); }
+
+static void PushBatch(int size_class, FreeBlock *batch, int count) {
+  batch->batch_count = count;
+  LockHolder lh(&pool_lock);
+  batch->next_batch = free_batches[size_class];
+  free_batches[size_class] = batch;
+}
+
+static void FlushCache(void *arg) {
+  ThreadBlockCache *cache = static_cast<ThreadBlockCache *>(arg);
+  for (int c = 0; c <= kBitmapSizeClass; c++) {
+    if (cache->lists[c].head != NULL) PushBatch(c, cache->lists[c].head, cache->lists[c].count);
+  }
+  delete cache;
+  thread_cache = NULL;
+}
+
+static void CreateCacheKey() { pthread_key_create(&cache_key, FlushCache); }
+
+static FreeList &GetFreeList(int size_class) {
+  if (thread_cache == NULL) {
+    pthread_once(&cache_key_once, CreateCacheKey);
+    thread_cache = new ThreadBlockCache();
+    pthread_setspecific(cache_key, thread_cache);
+  }
+  return thread_cache->lists[size_class];
+}
+
+static void *AllocateBlock(int size_class) {
+  FreeList &list = GetFreeList(size_class);
+  if (list.head == NULL) {
+    LockHolder lh(&pool_lock);
+    FreeBlock *batch = free_batches[size_class];
+    if (batch != NULL) {
+      free_batches[size_class] = batch->next_batch;
+      list.head = batch;
+      list.count = batch->batch_count;
+    }
+  }
+  FreeBlock *block = list.head;
+  if (block != NULL) {
+    list.head = block->next;
+    list.count--;
+    return block;
+  }
+  void *data;
+  if (posix_memalign(&data, 64, static_cast<size_t>(1) << size_class) != 0) {
+    throw std::bad_alloc();
+  }
+  return data;
+}
+
+// A thread keeps up to two batches, so the blocks of sets freed on one thread and refilled on
+// another make their way back
+static void ReleaseBlock(void *data, int size_class) {
+  FreeList &list = GetFreeList(size_class);
+  FreeBlock *block = static_cast<FreeBlock *>(data);
+  block->next = list.head;
+  list.head = block;
+  int batch_size = BatchSize(size_class);
+  if (++list.count < 2 * batch_size) return;
+  FreeBlock *last = list.head;
+  for (int i = 1; i < batch_size; i++) last = last->next;
+  FreeBlock *batch = list.head;
+  list.head = last->next;
+  last->next = NULL;
+  list.count -= batch_size;
+  PushBatch(size_class, batch, batch_size);
+}
+
+// the smallest size class holding 'count' array values
+static int ArraySizeClass(int count) {
+  int size_class = kMinSizeClass;
+  while ((1 << size_class) < count * static_cast<int>(sizeof(uint16_t))) size_class++;
+  return size_class;
+}
+
+static void SetBits(uint64_t *bits, const uint16_t *values, int count) {
+  for (int i = 0; i < count; i++) bits[values[i] / 64] |= 1ULL << (values[i] % 64);
+}
+
+// ORs 'other' into 'bits' and returns the number of bits set in the result
+static int OrBitmap(uint64_t *bits, const uint64_t *other, int words) {
+#if defined(__SSE2__)
+  for (int i = 0; i < words; i += 2) {
+    __m128i *dest = reinterpret_cast<__m128i *>(bits + i);
+    __m128i src = _mm_load_si128(reinterpret_cast<const __m128i *>(other + i));
+    _mm_store_si128(dest, _mm_or_si128(_mm_load_si128(dest), src));
+  }
+#else
+  for (int i = 0; i < words; i++) bits[i] |= other[i];
+#endif
+  int count = 0;
+  for (int i = 0; i < words; i++) count += __builtin_popcountll(bits[i]);
+  return count;
+}
+
+BlockSet::const_iterator::const_iterator(const BlockSet *set, size_t chunk, int position)
+    : set_(set), chunk_(chunk), position_(position), value_(0) {
+  Settle();
+}
+
+BlockSet::const_iterator &BlockSet::const_iterator::operator++() {
+  position_++;
+  Settle();
+  return *this;
+}
+
+void BlockSet::const_iterator::Settle() {
+  for (; chunk_ < set_->chunks_.size(); chunk_++, position_ = 0) {
+    const Chunk &chunk = set_->chunks_[chunk_];
+    if (!chunk.bitmap) {
+      if (position_ < chunk.count) {
+        value_ = chunk.key << 16 | chunk.array()[position_];
+        return;
+      }
+      continue;
+    }
+    int word = position_ / 64;
+    if (word >= kBitmapWords) continue;
+    uint64_t bits = chunk.bits()[word] & (~0ULL << (position_ % 64));
+    while (bits == 0 && ++word < kBitmapWords) bits = chunk.bits()[word];
+    if (bits != 0) {
+      position_ = word * 64 + __builtin_ctzll(bits);
+      value_ = chunk.key << 16 | position_;
+      return;
+    }
+  }
+}
+
+bool BlockSet::Insert(uint64_t block) {
+  uint64_t key = block >> 16;
+  uint16_t low = block & 0xFFFF;
+  Chunk *chunk = FindChunk(key);
+  if (chunk == NULL) chunk = AddChunk(key);
+  if (!chunk->bitmap) {
+    uint16_t *array = chunk->array();
+    uint16_t *pos = std::lower_bound(array, array + chunk->count, low);
+    if (pos != array + chunk->count && *pos == low) return false;
+    if (chunk->count < (1 << chunk->size_class) / static_cast<int>(sizeof(uint16_t))) {
+      memmove(pos + 1, pos, (array + chunk->count - pos) * sizeof(uint16_t));
+      *pos = low;
+      chunk->count++;
+      size_++;
+      return true;
+    }
+    // full: grow, or switch to a bitmap at the array limit
+    if (chunk->count == kMaxArray) {
+      ToBitmap(chunk);
+    } else {
+      InsertArray(chunk, &low, 1);
+      size_++;
+      return true;
+    }
+  }
+  uint64_t &word = chunk->bits()[low / 64];
+  uint64_t bit = 1ULL << (low % 64);
+  if (word & bit) return false;
+  word |= bit;
+  chunk->count++;
+  size_++;
+  return true;
+}
+
+bool BlockSet::Contains(uint64_t block) const {
+  uint64_t key = block >> 16;
+  uint16_t low = block & 0xFFFF;
+  size_t index = ChunkIndex(key);
+  if (index == chunks_.size() || chunks_[index].key != key) return false;
+  const Chunk &chunk = chunks_[index];
+  if (chunk.bitmap) return (chunk.bits()[low / 64] >> (low % 64)) & 1;
+  return std::binary_search(chunk.array(), chunk.array() + chunk.count, low);
+}
+
+void BlockSet::UnionWith(const BlockSet &other) {
+  if (&other == this) return;
+  for (size_t i = 0; i < other.chunks_.size(); i++) {
+    const Chunk &theirs = other.chunks_[i];
+    Chunk *mine = FindChunk(theirs.key);
+    if (mine == NULL) mine = AddChunk(theirs.key);
+    size_ -= mine->count;
+    UnionChunk(mine, theirs);
+    size_ += mine->count;
+  }
+}
+
+void BlockSet::Clear() {
+  for (size_t i = 0; i < chunks_.size(); i++) {
+    ReleaseBlock(chunks_[i].data, chunks_[i].size_class);
+  }
+  chunks_.clear();
+  size_ = 0;
+  last_ = 0;
+}
+
+size_t BlockSet::ChunkIndex(uint64_t key) const {
+  return std::lower_bound(chunks_.begin(), chunks_.end(), key, KeyBefore) - chunks_.begin();
+}
+
+BlockSet::Chunk *BlockSet::FindChunk(uint64_t key) {
+  // accesses cluster, so most inserts go to the same chunk as the one before
+  if (last_ < chunks_.size() && chunks_[last_].key == key) return &chunks_[last_];
+  size_t index = ChunkIndex(key);
+  if (index == chunks_.size() || chunks_[index].key != key) return NULL;
+  last_ = index;
+  return &chunks_[index];
+}
+
+BlockSet::Chunk *BlockSet::AddChunk(uint64_t key) {
+  Chunk chunk;
+  chunk.key = key;
+  chunk.count = 0;
+  chunk.size_class = kMinSizeClass;
+  chunk.bitmap = false;
+  chunk.data = AllocateBlock(kMinSizeClass);
+  last_ = ChunkIndex(key);
+  return &*chunks_.insert(chunks_.begin() + last_, chunk);
+}
+
+void BlockSet::ToBitmap(Chunk *chunk) {
+  uint64_t *bits = static_cast<uint64_t *>(AllocateBlock(kBitmapSizeClass));
+  memset(bits, 0, kBitmapWords * sizeof(uint64_t));
+  SetBits(bits, chunk->array(), chunk->count);
+  ReleaseBlock(chunk->data, chunk->size_class);
+  chunk->data = bits;
+  chunk->size_class = kBitmapSizeClass;
+  chunk->bitmap = true;
+}
+
+// Adds the sorted 'values' to the chunk
+void BlockSet::InsertArray(Chunk *chunk, const uint16_t *values, int count) {
+  if (!chunk->bitmap && chunk->count + count > kMaxArray) ToBitmap(chunk);
+  if (chunk->bitmap) {
+    uint64_t *bits = chunk->bits();
+    for (int i = 0; i < count; i++) {
+      uint64_t bit = 1ULL << (values[i] % 64);
+      chunk->count += (bits[values[i] / 64] & bit) == 0;
+      bits[values[i] / 64] |= bit;
+    }
+    return;
+  }
+  int size_class = ArraySizeClass(chunk->count + count);
+  uint16_t *merged = static_cast<uint16_t *>(AllocateBlock(size_class));
+  uint16_t *end = std::set_union(chunk->array(), chunk->array() + chunk->count,
+                                 values, values + count, merged);
+  ReleaseBlock(chunk->data, chunk->size_class);
+  chunk->data = merged;
+  chunk->size_class = size_class;
+  chunk->count = end - merged;
+}
+
+void BlockSet::UnionChunk(Chunk *chunk, const Chunk &other) {
+  if (!other.bitmap) {
+    InsertArray(chunk, other.array(), other.count);
+    return;
+  }
+  if (!chunk->bitmap) ToBitmap(chunk);
+  chunk->count = OrBitmap(chunk->bits(), other.bits(), kBitmapWords);
+}
@@ -0,0 +1,81 @@
+#ifndef BLOCKSET_H_
+#define BLOCKSET_H_
+
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+#include "reusestack-common.h"
+
+/*
+ * Exact set of block numbers, split roaring-style into 2^16-value chunks keyed by the high bits.
+ * A chunk is a sorted array of its low 16 bits while small and a 8 KB bitmap once it has more
+ * than kMaxArray values (arrays never take more room than the bitmap would). Chunk storage comes
+ * from per-thread free lists backed by a process-wide pool, so the sets of finished samples are
+ * recycled by new ones.
+ */
+class BlockSet {
+public:
+  static const int kMaxArray = 4096;
+  class const_iterator {
+  public:
+    uint64_t operator*() const { return value_; }
+    const_iterator &operator++();
+    bool operator==(const const_iterator &other) const {
+      return chunk_ == other.chunk_ && position_ == other.position_;
+    }
+    bool operator!=(const const_iterator &other) const { return !(*this == other); }
+  private:
+    friend class BlockSet;
+    const_iterator(const BlockSet *set, size_t chunk, int position);
+    void Settle();  ///< moves to the first value at or after the current position
+    const BlockSet *set_;
+    size_t chunk_;
+    int position_;  ///< index into an array chunk, bit number in a bitmap chunk
+    uint64_t value_;
+  };
+
+  BlockSet() : size_(0), last_(0) {}
+  ~BlockSet() { Clear(); }
+  // Returns true if 'block' was not already in the set
+  bool Insert(uint64_t block);
+  bool Contains(uint64_t block) const;
+  // Adds every block of 'other' to this set
+  void UnionWith(const BlockSet &other);
+  // Empties the set and returns its storage to the pool
+  void Clear();
+  void Swap(BlockSet &other) {
+    chunks_.swap(other.chunks_);
+    std::swap(size_, other.size_);
+    std::swap(last_, other.last_);
+  }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const_iterator begin() const { return const_iterator(this, 0, 0); }
+  const_iterator end() const { return const_iterator(this, chunks_.size(), 0); }
+
+private:
+  static const int kBitmapWords = (1 << 16) / 64;
+  struct Chunk {
+    uint64_t key;  ///< the blocks' bits above the low 16
+    int count;
+    int size_class;  ///< log2 of the storage bytes
+    bool bitmap;
+    void *data;  ///< uint16_t[] sorted, or uint64_t[kBitmapWords]
+    uint16_t *array() const { return static_cast<uint16_t *>(data); }
+    uint64_t *bits() const { return static_cast<uint64_t *>(data); }
+  };
+  static bool KeyBefore(const Chunk &chunk, uint64_t key) { return chunk.key < key; }
+  size_t ChunkIndex(uint64_t key) const;  ///< the first chunk with a key >= 'key'
+  Chunk *FindChunk(uint64_t key);
+  Chunk *AddChunk(uint64_t key);
+  static void ToBitmap(Chunk *chunk);
+  static void InsertArray(Chunk *chunk, const uint16_t *values, int count);
+  static void UnionChunk(Chunk *chunk, const Chunk &other);
+
+  std::vector<Chunk> chunks_;  ///< sorted by key
+  size_t size_;
+  size_t last_;  ///< the chunk the last insert went to
+  DISALLOW_COPY_AND_ASSIGN(BlockSet);
+};
+
+#endif /* BLOCKSET_H_ */
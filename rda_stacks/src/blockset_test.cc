@@ -0,0 +1,109 @@
+#include <pthread.h>
+#include <gtest/gtest.h>
+#include <set>
+#include "blockset.h"
+
+static void ExpectSame(const std::set<uint64_t> &expected, const BlockSet &actual) {
+  EXPECT_EQ(expected.size(), actual.size());
+  std::set<uint64_t>::const_iterator want = expected.begin();
+  for (BlockSet::const_iterator it = actual.begin(); it != actual.end(); ++it, ++want) {
+    ASSERT_TRUE(want != expected.end());
+    EXPECT_EQ(*want, *it);
+  }
+  EXPECT_TRUE(want == expected.end());
+}
+
+TEST(BlockSetTest, Insert) {
+  BlockSet set;
+  std::set<uint64_t> expected;
+  EXPECT_TRUE(set.empty());
+  EXPECT_TRUE(set.begin() == set.end());
+  // a sparse chunk, a chunk that turns into a bitmap, and values near the chunk edges
+  for (uint64_t i = 0; i < 100; i++) {
+    EXPECT_TRUE(set.Insert(0x123450000ULL + i * 97));
+    expected.insert(0x123450000ULL + i * 97);
+  }
+  for (uint64_t i = 0; i <= BlockSet::kMaxArray + 10; i++) {
+    EXPECT_EQ(expected.insert((i * 7919) % 65536).second, set.Insert((i * 7919) % 65536));
+  }
+  EXPECT_TRUE(set.Insert(0xffff));
+  expected.insert(0xffff);
+  EXPECT_TRUE(set.Insert(0x10000));
+  expected.insert(0x10000);
+  EXPECT_FALSE(set.Insert(0x123450000ULL + 97));
+  ExpectSame(expected, set);
+  EXPECT_TRUE(set.Contains(0x123450000ULL + 97));
+  EXPECT_FALSE(set.Contains(0x123450000ULL + 98));
+  EXPECT_FALSE(set.Contains(0x20000));
+  set.Clear();
+  EXPECT_TRUE(set.empty());
+  EXPECT_TRUE(set.begin() == set.end());
+}
+
+TEST(BlockSetTest, Union) {
+  // every pairing of array and bitmap chunks, plus chunks only one side has
+  BlockSet a, b;
+  std::set<uint64_t> expected;
+  for (uint64_t i = 0; i < 5000; i++) {
+    uint64_t values[] = { i * 3, 0x10000 + i * 13, 0x20000 + i % 200, 0x30000 + i % 300 * 2,
+                          0x50000 + i };
+    for (int j = 0; j < 5; j++) {
+      a.Insert(values[j]);
+      expected.insert(values[j]);
+    }
+    uint64_t others[] = { i * 4, 0x10000 + i % 100 * 7, 0x20000 + i * 7, 0x30000 + i % 300 * 3,
+                          0x60000 + i % 10 };
+    for (int j = 0; j < 5; j++) {
+      b.Insert(others[j]);
+      expected.insert(others[j]);
+    }
+  }
+  a.UnionWith(b);
+  ExpectSame(expected, a);
+  a.UnionWith(a);
+  ExpectSame(expected, a);
+  // recycled storage starts out clean
+  b.Clear();
+  BlockSet c;
+  c.Insert(0x20000 + 5);
+  c.Insert(0x20000 + 6000);
+  std::set<uint64_t> small;
+  small.insert(0x20000 + 5);
+  small.insert(0x20000 + 6000);
+  ExpectSame(small, c);
+}
+
+// Fills sets that the main thread empties, so storage moves between the threads' free lists
+static void *FillSets(void *arg) {
+  std::vector<BlockSet *> *sets = static_cast<std::vector<BlockSet *> *>(arg);
+  for (size_t i = 0; i < sets->size(); i++) {
+    BlockSet scratch;
+    for (uint64_t v = 0; v < 3000; v++) {
+      (*sets)[i]->Insert(i << 16 | (v * 37) % 65536);
+      scratch.Insert(v * 65536);
+    }
+  }
+  return NULL;
+}
+
+TEST(BlockSetTest, ThreadCaches) {
+  const int kThreads = 4;
+  const int kSets = 20;
+  std::vector<BlockSet *> sets[kThreads];
+  for (int round = 0; round < 3; round++) {
+    pthread_t threads[kThreads];
+    for (int t = 0; t < kThreads; t++) {
+      for (int i = 0; i < kSets; i++) sets[t].push_back(new BlockSet());
+      ASSERT_EQ(0, pthread_create(&threads[t], NULL, FillSets, &sets[t]));
+    }
+    for (int t = 0; t < kThreads; t++) pthread_join(threads[t], NULL);
+    for (int t = 0; t < kThreads; t++) {
+      for (int i = 0; i < kSets; i++) {
+        EXPECT_EQ(3000u, sets[t][i]->size());
+        EXPECT_TRUE(sets[t][i]->Contains(static_cast<uint64_t>(i) << 16 | 37));
+        delete sets[t][i];
+      }
+      sets[t].clear();
+    }
+  }
+}
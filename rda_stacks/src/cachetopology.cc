@@ -0,0 +1,71 @@
+#include "cachetopology.h"
+#include <cctype>
+#include <cstdlib>
+#include <boost/format.hpp>
+
+using std::string;
+
+const char CacheTopology::kDefaultSpec[] = "pair:2:1";
+const int CacheTopology::kMaxNameLength;
+
+// Parses a positive (or, if 'zero_ok', non-negative) decimal number
+static int ParseCount(const string &text, bool zero_ok) {
+  if (text.empty() || text.size() > 6 || text.find_first_not_of("0123456789") != string::npos) {
+    throw std::invalid_argument("bad number '" + text + "' in cache topology");
+  }
+  int value = atoi(text.c_str());
+  if (value == 0 && !zero_ok) throw std::invalid_argument("cache topology sizes must be > 0");
+  return value;
+}
+
+void CacheTopology::Parse(const string &spec) {
+  levels_.clear();
+  if (spec.empty()) return;
+  size_t start = 0;
+  while (true) {
+    size_t end = spec.find(',', start);
+    string item(spec, start, end == string::npos ? string::npos : end - start);
+    std::vector<string> fields;
+    for (size_t pos = 0;;) {
+      size_t colon = item.find(':', pos);
+      fields.push_back(item.substr(pos, colon == string::npos ? string::npos : colon - pos));
+      if (colon == string::npos) break;
+      pos = colon + 1;
+    }
+    if (fields.size() < 2 || fields.size() > 3) {
+      throw std::invalid_argument("cache topology levels must be name:size[:offset], not '" +
+                                  item + "'");
+    }
+    Level level;
+    level.name = fields[0];
+    if (level.name.empty() || level.name.size() > static_cast<size_t>(kMaxNameLength) ||
+        !isalpha(level.name[0])) {
+      throw std::invalid_argument("bad cache topology level name '" + level.name + "'");
+    }
+    for (size_t i = 0; i < level.name.size(); i++) {
+      if (!isalnum(level.name[i]) && level.name[i] != '_') {
+        throw std::invalid_argument("bad cache topology level name '" + level.name + "'");
+      }
+    }
+    for (size_t i = 0; i < levels_.size(); i++) {
+      if (levels_[i].name == level.name) {
+        throw std::invalid_argument("duplicate cache topology level '" + level.name + "'");
+      }
+    }
+    level.domain_size = ParseCount(fields[1], false);
+    level.offset = fields.size() == 3 ? ParseCount(fields[2], true) : 0;
+    levels_.push_back(level);
+    if (end == string::npos) break;
+    start = end + 1;
+  }
+}
+
+string CacheTopology::GetSpec() const {
+  string spec;
+  for (size_t i = 0; i < levels_.size(); i++) {
+    if (i > 0) spec += ",";
+    spec += boost::str(boost::format("%s:%d") % levels_[i].name % levels_[i].domain_size);
+    if (levels_[i].offset) spec += boost::str(boost::format(":%d") % levels_[i].offset);
+  }
+  return spec;
+}
@@ -0,0 +1,43 @@
+#ifndef CACHETOPOLOGY_H_
+#define CACHETOPOLOGY_H_
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Describes the shared cache levels to model, as a comma separated list of levels written
+ * "name:size[:offset]". Each level splits the threads into sharing domains of 'size'
+ * consecutive threads (SMT siblings, a CCX, a socket...), and each domain gets one shared
+ * stack. The first 'offset' threads are added to the first domain, for thread numberings that
+ * do not start at 0. For example "smt:2,ccx:8,socket:16" models an SMT pair, CCX and socket;
+ * the default "pair:2:1" is the original pairing, where threads 0-2 share pair 0.
+ */
+class CacheTopology {
+public:
+  static const char kDefaultSpec[];
+  static const int kMaxNameLength = 32;
+  struct Level {
+    std::string name;
+    int domain_size;
+    int offset;
+  };
+
+  CacheTopology() { Parse(kDefaultSpec); }
+  // Throws std::invalid_argument if 'spec' is malformed
+  explicit CacheTopology(const std::string &spec) { Parse(spec); }
+  int GetLevelCount() const { return levels_.size(); }
+  const Level &GetLevel(int level) const { return levels_[level]; }
+  int DomainOf(int level, int thread) const {
+    const Level &l = levels_[level];
+    return thread < l.offset ? 0 : (thread - l.offset) / l.domain_size;
+  }
+  // Canonical form of the spec, e.g. for recording it in the output
+  std::string GetSpec() const;
+
+private:
+  void Parse(const std::string &spec);
+  std::vector<Level> levels_;
+};
+
+#endif /* CACHETOPOLOGY_H_ */
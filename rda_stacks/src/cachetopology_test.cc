@@ -0,0 +1,37 @@
+#include <gtest/gtest.h>
+#include "cachetopology.h"
+
+// The default reproduces the original pairing, where threads 0-2 share pair 0
+TEST(CacheTopologyTest, Default) {
+  CacheTopology topology;
+  ASSERT_EQ(1, topology.GetLevelCount());
+  EXPECT_EQ("pair", topology.GetLevel(0).name);
+  const int kOriginalPairs[] = {0, 0, 0, 1, 1, 2, 2, 3, 3};
+  for (int t = 0; t < 9; t++) EXPECT_EQ(kOriginalPairs[t], topology.DomainOf(0, t)) << t;
+  EXPECT_EQ(31, topology.DomainOf(0, 63));
+  EXPECT_EQ(CacheTopology::kDefaultSpec, topology.GetSpec());
+}
+
+TEST(CacheTopologyTest, Levels) {
+  CacheTopology topology("smt:2,ccx:8,socket:16");
+  ASSERT_EQ(3, topology.GetLevelCount());
+  EXPECT_EQ("ccx", topology.GetLevel(1).name);
+  EXPECT_EQ(8, topology.GetLevel(1).domain_size);
+  EXPECT_EQ(0, topology.GetLevel(1).offset);
+  EXPECT_EQ(4, topology.DomainOf(0, 9));
+  EXPECT_EQ(1, topology.DomainOf(1, 9));
+  EXPECT_EQ(0, topology.DomainOf(2, 9));
+  EXPECT_EQ(3, topology.DomainOf(2, 63));
+  EXPECT_EQ("smt:2,ccx:8,socket:16", topology.GetSpec());
+  EXPECT_EQ(0, CacheTopology("").GetLevelCount());
+  EXPECT_EQ(4, CacheTopology("l3:4:0").DomainOf(0, 17));
+}
+
+TEST(CacheTopologyTest, BadSpecs) {
+  const char *kBad[] = {"pair", "pair:", "pair:0", "pair:2:", "pair:2:1:1", ":2", "2x:2",
+                        "pa-ir:2", "pair:2,", "pair:2,pair:4", "pair:-2", "pair:2x",
+                        "a234567890123456789012345678901234:2"};
+  for (unsigned int i = 0; i < sizeof(kBad) / sizeof(kBad[0]); i++) {
+    EXPECT_THROW(CacheTopology topology(kBad[i]), std::invalid_argument) << kBad[i];
+  }
+}
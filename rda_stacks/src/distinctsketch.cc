@@ -0,0 +1,87 @@
+#include "distinctsketch.h"
+#include <math.h>
+#include <algorithm>
+#include <stdexcept>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+const int DistinctSketch::kDefaultPrecision;
+
+DistinctSketch::DistinctSketch(int precision) : precision_(precision) {
+  if (precision < 4 || precision > 18) {
+    throw std::invalid_argument("sketch precision must be between 4 and 18");
+  }
+  registers_.assign(1 << precision, 0);
+}
+
+void DistinctSketch::Merge(const DistinctSketch &other) {
+  if (other.precision_ != precision_) {
+    throw std::invalid_argument("can't merge sketches of different precision");
+  }
+  uint8_t *mine = &registers_[0];
+  const uint8_t *theirs = &other.registers_[0];
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 16 <= registers_.size(); i += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mine + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(theirs + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(mine + i), _mm_max_epu8(a, b));
+  }
+#endif
+  for (; i < registers_.size(); i++) mine[i] = std::max(mine[i], theirs[i]);
+}
+
+acc_count_t DistinctSketch::Estimate() const {
+  double m = registers_.size();
+  double sum = 0.0;
+  int zeros = 0;
+  for (size_t i = 0; i < registers_.size(); i++) {
+    sum += ldexp(1.0, -registers_[i]);
+    if (registers_[i] == 0) zeros++;
+  }
+  double alpha;
+  if (registers_.size() == 16) {
+    alpha = 0.673;
+  } else if (registers_.size() == 32) {
+    alpha = 0.697;
+  } else if (registers_.size() == 64) {
+    alpha = 0.709;
+  } else {
+    alpha = 0.7213 / (1.0 + 1.079 / m);
+  }
+  double estimate = alpha * m * m / sum;
+  // with 64-bit hashes only the small-range correction is needed
+  if (estimate <= 2.5 * m && zeros != 0) estimate = m * log(m / zeros);
+  return static_cast<acc_count_t>(estimate + 0.5);
+}
+
+void DistinctSketch::Clear() {
+  std::fill(registers_.begin(), registers_.end(), 0);
+}
+
+SlidingDistinctSketch::SlidingDistinctSketch(int precision) : precision_(precision) {
+  if (precision < 4 || precision > 18) {
+    throw std::invalid_argument("sketch precision must be between 4 and 18");
+  }
+  registers_.resize(1 << precision);
+}
+
+void SlidingDistinctSketch::MergeSince(acc_count_t since, DistinctSketch *sketch) const {
+  if (sketch->precision_ != precision_) {
+    throw std::invalid_argument("can't merge sketches of different precision");
+  }
+  for (size_t i = 0; i < registers_.size(); i++) {
+    const std::vector<Entry> &reg = registers_[i];
+    // the earliest entry after 'since' has the highest rank among those after it
+    size_t first = reg.size();
+    while (first > 0 && reg[first - 1].time > since) first--;
+    if (first < reg.size() && sketch->registers_[i] < reg[first].rank) {
+      sketch->registers_[i] = reg[first].rank;
+    }
+  }
+}
+
+void SlidingDistinctSketch::Clear() {
+  for (size_t i = 0; i < registers_.size(); i++) registers_[i].clear();
+}
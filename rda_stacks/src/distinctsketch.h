@@ -0,0 +1,83 @@
+#ifndef DISTINCTSKETCH_H_
+#define DISTINCTSKETCH_H_
+
+#include <vector>
+#include "reusestack-common.h"
+
+/*
+ * HyperLogLog estimate of the number of distinct values added, in 2^precision one-byte
+ * registers. The relative standard error is 1.04 / sqrt(2^precision), about 3.3% at the default
+ * precision (1 KB): roughly two thirds of estimates are within one standard error and almost
+ * all within three. Small counts use linear counting, which does better. Merging two sketches
+ * gives exactly the sketch of the union of their values, so merges add no error of their own.
+ */
+class DistinctSketch {
+public:
+  static const int kDefaultPrecision = 10;
+  // Throws std::invalid_argument unless 4 <= precision <= 18
+  explicit DistinctSketch(int precision = kDefaultPrecision);
+  void Add(uint64_t value) { AddHash(Hash(value)); }
+  // For adding one value to many sketches: hash it once with Hash()
+  void AddHash(uint64_t hash) {
+    uint8_t rank = Rank(hash, precision_);
+    uint8_t &reg = registers_[hash >> (64 - precision_)];
+    if (reg < rank) reg = rank;
+  }
+  // Throws std::invalid_argument if the precisions differ
+  void Merge(const DistinctSketch &other);
+  acc_count_t Estimate() const;
+  void Clear();
+  static uint64_t Hash(uint64_t value) {
+    // 64-bit finalizer from MurmurHash3
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+  }
+
+private:
+  friend class SlidingDistinctSketch;
+  static uint8_t Rank(uint64_t hash, int precision) {
+    return __builtin_clzll((hash << precision) | (1ULL << (precision - 1))) + 1;
+  }
+  int precision_;
+  std::vector<uint8_t> registers_;
+};
+
+/*
+ * HyperLogLog registers for a stream of timestamped values that can give the sketch of the
+ * values added after any time. Each register keeps the ranks that are still its maximum for
+ * some start time, each with the latest time it was seen (a "list of future possible maxima"),
+ * so adding is amortized O(1) and a register holds O(log n) entries for n values. One of these
+ * serves every window that starts in it, instead of one sketch per window.
+ */
+class SlidingDistinctSketch {
+public:
+  // Throws std::invalid_argument unless 4 <= precision <= 18
+  explicit SlidingDistinctSketch(int precision = DistinctSketch::kDefaultPrecision);
+  // 'time' must not be less than the last one added
+  void AddHash(uint64_t hash, acc_count_t time) {
+    uint8_t rank = DistinctSketch::Rank(hash, precision_);
+    std::vector<Entry> &reg = registers_[hash >> (64 - precision_)];
+    // older entries of lower or equal rank can never be a maximum again
+    while (!reg.empty() && reg.back().rank <= rank) reg.pop_back();
+    Entry entry = {time, rank};
+    reg.push_back(entry);
+  }
+  // Raises 'sketch' to include the values added after 'since'. Throws std::invalid_argument if
+  // the precisions differ.
+  void MergeSince(acc_count_t since, DistinctSketch *sketch) const;
+  void Clear();
+
+private:
+  struct Entry {
+    acc_count_t time;
+    uint8_t rank;
+  };
+  int precision_;
+  std::vector<std::vector<Entry> > registers_;  ///< by time, so by decreasing rank
+};
+
+#endif /* DISTINCTSKETCH_H_ */
@@ -0,0 +1,63 @@
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include "distinctsketch.h"
+
+TEST(DistinctSketchTest, Estimate) {
+  DistinctSketch sketch;
+  EXPECT_EQ(0, sketch.Estimate());
+  // linear counting range: standard error about 2.3 here
+  for (uint64_t i = 0; i < 100; i++) sketch.Add(i * 64);
+  acc_count_t estimate = sketch.Estimate();
+  EXPECT_NEAR(100, estimate, 7);
+  // adding values again changes nothing
+  for (uint64_t i = 0; i < 100; i++) sketch.Add(i * 64);
+  EXPECT_EQ(estimate, sketch.Estimate());
+  // well within the HLL range: 4 standard errors
+  for (uint64_t i = 100; i < 200000; i++) sketch.Add(i * 64);
+  EXPECT_NEAR(200000, sketch.Estimate(), 200000 * 4 * 0.0325);
+  sketch.Clear();
+  EXPECT_EQ(0, sketch.Estimate());
+}
+
+TEST(DistinctSketchTest, Merge) {
+  DistinctSketch a, b, both;
+  for (uint64_t i = 0; i < 50000; i++) {
+    a.Add(i);
+    both.Add(i);
+  }
+  for (uint64_t i = 25000; i < 90000; i++) {
+    b.Add(i);
+    both.Add(i);
+  }
+  a.Merge(b);
+  EXPECT_EQ(both.Estimate(), a.Estimate());
+  EXPECT_NEAR(90000, a.Estimate(), 90000 * 4 * 0.0325);
+  DistinctSketch other(12);
+  EXPECT_THROW(a.Merge(other), std::invalid_argument);
+  EXPECT_THROW(DistinctSketch(3), std::invalid_argument);
+}
+
+// the sketch of any suffix of the stream is exactly the one built from that suffix alone
+TEST(DistinctSketchTest, SlidingWindows) {
+  const int kValues = 60000;
+  SlidingDistinctSketch sliding;
+  for (int i = 0; i < kValues; i++) {
+    // values repeat, so some are seen again inside a window
+    uint64_t value = (i * 7919ULL) % 40000;
+    sliding.AddHash(DistinctSketch::Hash(value), i + 1);
+  }
+  const int kStarts[] = {0, 10, 5000, 45000, kValues - 1, kValues};
+  for (int s = 0; s < 6; s++) {
+    DistinctSketch window;
+    for (int i = kStarts[s]; i < kValues; i++) window.Add((i * 7919ULL) % 40000);
+    DistinctSketch merged;
+    sliding.MergeSince(kStarts[s], &merged);
+    EXPECT_EQ(window.Estimate(), merged.Estimate()) << kStarts[s];
+  }
+  DistinctSketch other(12);
+  EXPECT_THROW(sliding.MergeSince(0, &other), std::invalid_argument);
+  sliding.Clear();
+  DistinctSketch empty;
+  sliding.MergeSince(0, &empty);
+  EXPECT_EQ(0, empty.Estimate());
+}
@@ -17,6 +17,7 @@ public:
   static const int kStreamTableSize = 8;
   virtual address_t Access(address_t addr, address_t PC, acc_count_t distance, bool write);
   virtual std::string GetStatsString();
+  virtual void WriteStatsBinary(BinaryResultWriter *out) {}
   virtual ~GlobalStreamPrefetcher();
 private:
   //confidence stats from AMD memory prefetcher docs
@@ -0,0 +1,67 @@
+#include "livetimestamps.h"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+const size_t LiveTimestamps::kMinSlots;
+
+void LiveTimestamps::Append(acc_count_t stamp) {
+  if (stamps_.size() + 1 >= tree_.size()) Compact();
+  stamps_.push_back(stamp);
+  live_.push_back(1);
+  Add(stamps_.size() - 1, 1);
+  ++live_count_;
+}
+
+void LiveTimestamps::Remove(acc_count_t stamp) {
+  size_t slot = std::lower_bound(stamps_.begin(), stamps_.end(), stamp) - stamps_.begin();
+  if (slot == stamps_.size() || stamps_[slot] != stamp || !live_[slot]) {
+    throw std::runtime_error("timestamp is not live");
+  }
+  live_[slot] = 0;
+  Add(slot, -1);
+  --live_count_;
+}
+
+acc_count_t LiveTimestamps::CountAfter(acc_count_t stamp) const {
+  size_t slots = std::upper_bound(stamps_.begin(), stamps_.end(), stamp) - stamps_.begin();
+  return live_count_ - Prefix(slots);
+}
+
+void LiveTimestamps::Clear() {
+  stamps_.clear();
+  live_.clear();
+  tree_.clear();
+  live_count_ = 0;
+}
+
+void LiveTimestamps::Add(size_t slot, int delta) {
+  for (size_t i = slot + 1; i < tree_.size(); i += i & -i) tree_[i] += delta;
+}
+
+acc_count_t LiveTimestamps::Prefix(size_t slots) const {
+  acc_count_t sum = 0;
+  for (size_t i = slots; i > 0; i -= i & -i) sum += tree_[i];
+  return sum;
+}
+
+// Drops the dead slots and leaves at least as many free slots as live ones, so the rebuild is
+// paid for by the appends before the next one
+void LiveTimestamps::Compact() {
+  size_t live = 0;
+  for (size_t i = 0; i < stamps_.size(); i++) {
+    if (live_[i]) stamps_[live++] = stamps_[i];
+  }
+  stamps_.resize(live);
+  live_.assign(live, 1);
+  if (2 * live + 1 > static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+    throw std::overflow_error("too many live timestamps");
+  }
+  tree_.assign(std::max(kMinSlots, 2 * live) + 1, 0);
+  // linear-time Fenwick build
+  for (size_t i = 1; i < tree_.size(); i++) {
+    if (i <= live) tree_[i] += 1;
+    size_t parent = i + (i & -i);
+    if (parent < tree_.size()) tree_[parent] += tree_[i];
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef LIVETIMESTAMPS_H_
+#define LIVETIMESTAMPS_H_
+
+#include <stddef.h>
+#include <vector>
+#include "reusestack-common.h"
+
+/*
+ * The access timestamps that are still some block's latest, for counting the distinct blocks
+ * accessed since a given time. Timestamps must be appended in increasing order. Each one gets a
+ * slot, and a Fenwick tree over the slots counts the live ones, so every operation is
+ * O(log n); dead slots are dropped when the slots run out.
+ */
+class LiveTimestamps {
+public:
+  LiveTimestamps() : live_count_(0) {}
+  void Append(acc_count_t stamp);
+  // Throws std::runtime_error if 'stamp' is not live
+  void Remove(acc_count_t stamp);
+  // number of live timestamps after 'stamp'
+  acc_count_t CountAfter(acc_count_t stamp) const;
+  acc_count_t live_count() const { return live_count_; }
+  void Clear();
+
+private:
+  static const size_t kMinSlots = 64;
+  void Add(size_t slot, int delta);
+  acc_count_t Prefix(size_t slots) const;  ///< live timestamps in the first 'slots' slots
+  void Compact();
+
+  std::vector<acc_count_t> stamps_;
+  std::vector<uint8_t> live_;
+  std::vector<int32_t> tree_;  ///< Fenwick tree over the slots, 1-based
+  acc_count_t live_count_;
+};
+
+#endif /* LIVETIMESTAMPS_H_ */
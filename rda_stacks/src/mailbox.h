@@ -0,0 +1,45 @@
+#ifndef MAILBOX_H_
+#define MAILBOX_H_
+
+#include <stddef.h>
+#include "reusestack-common.h"
+
+/*
+ * Lock-free many-producer, single-consumer queue of messages linked through their 'next'
+ * pointers. Producers push onto a stack with compare-and-swap; the consumer takes the whole
+ * stack at once and reverses it, so each producer's messages come out in the order it posted
+ * them. Messages belong to the consumer once posted.
+ */
+template<class T> class Mailbox {
+public:
+  Mailbox() : head_(NULL) {}
+  void Post(T *message) { Post(message, message); }
+  // Posts a batch linked newest first (as built by prepending), ending in 'oldest'
+  void Post(T *newest, T *oldest) {
+    T *head;
+    do {
+      head = head_;
+      oldest->next = head;
+    } while (!__sync_bool_compare_and_swap(&head_, head, newest));
+  }
+  // Consumer only: all messages posted so far, oldest first, or NULL
+  T *TakeAll() {
+    if (head_ == NULL) return NULL;
+    T *message = __sync_lock_test_and_set(&head_, static_cast<T *>(NULL));
+    T *oldest = NULL;
+    while (message != NULL) {
+      T *next = message->next;
+      message->next = oldest;
+      oldest = message;
+      message = next;
+    }
+    return oldest;
+  }
+  bool Empty() const { return head_ == NULL; }
+
+private:
+  T *volatile head_;
+  DISALLOW_COPY_AND_ASSIGN(Mailbox);
+};
+
+#endif /* MAILBOX_H_ */
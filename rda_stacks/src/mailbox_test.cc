@@ -0,0 +1,75 @@
+#include <pthread.h>
+#include <sched.h>
+#include <gtest/gtest.h>
+#include "mailbox.h"
+
+struct Letter {
+  int sender;
+  int sequence;
+  Letter *next;
+};
+
+TEST(MailboxTest, Order) {
+  Mailbox<Letter> mailbox;
+  EXPECT_TRUE(mailbox.Empty());
+  EXPECT_TRUE(mailbox.TakeAll() == NULL);
+  Letter letters[5];
+  for (int i = 0; i < 5; i++) letters[i].sequence = i;
+  mailbox.Post(&letters[0]);
+  // a batch of 1..3, linked newest first
+  letters[3].next = &letters[2];
+  letters[2].next = &letters[1];
+  mailbox.Post(&letters[3], &letters[1]);
+  mailbox.Post(&letters[4]);
+  EXPECT_FALSE(mailbox.Empty());
+  int expected = 0;
+  for (Letter *letter = mailbox.TakeAll(); letter != NULL; letter = letter->next) {
+    EXPECT_EQ(expected++, letter->sequence);
+  }
+  EXPECT_EQ(5, expected);
+  EXPECT_TRUE(mailbox.Empty());
+}
+
+static const int kSenders = 4;
+static const int kLettersPerSender = 100000;
+
+struct PostOffice {
+  Mailbox<Letter> mailbox;
+  Letter letters[kSenders][kLettersPerSender];
+  int sender;
+};
+
+static void *Send(void *arg) {
+  PostOffice *office = static_cast<PostOffice *>(arg);
+  int sender = __sync_fetch_and_add(&office->sender, 1);
+  for (int i = 0; i < kLettersPerSender; i++) {
+    Letter *letter = &office->letters[sender][i];
+    letter->sender = sender;
+    letter->sequence = i;
+    office->mailbox.Post(letter);
+  }
+  return NULL;
+}
+
+// Every letter arrives once, and each sender's in order
+TEST(MailboxTest, Senders) {
+  PostOffice *office = new PostOffice();
+  office->sender = 0;
+  pthread_t senders[kSenders];
+  for (int i = 0; i < kSenders; i++) {
+    ASSERT_EQ(0, pthread_create(&senders[i], NULL, Send, office));
+  }
+  int next[kSenders] = { 0 };
+  int received = 0;
+  while (received < kSenders * kLettersPerSender) {
+    if (office->mailbox.Empty()) sched_yield();
+    for (Letter *letter = office->mailbox.TakeAll(); letter != NULL; letter = letter->next) {
+      ASSERT_EQ(next[letter->sender], letter->sequence);
+      next[letter->sender]++;
+      received++;
+    }
+  }
+  for (int i = 0; i < kSenders; i++) pthread_join(senders[i], NULL);
+  EXPECT_TRUE(office->mailbox.Empty());
+  delete office;
+}
@@ -0,0 +1,134 @@
+#ifndef ORDEREDRINGS_H_
+#define ORDEREDRINGS_H_
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "reusestack-common.h"
+#include "spscring.h"
+
+/*
+ * Per-producer lock-free rings whose elements come out in one global order. Each Push takes a
+ * timestamp from a shared counter, so the consumer sees the elements in the order the
+ * timestamps were handed out, which is an order the producers could have had under a lock.
+ * Producers never wait for each other, only for room in their own ring. If the next timestamp
+ * has been taken but not pushed yet, the consumer waits for it.
+ *
+ * The consumer keeps a min-heap of the fronts of the rings it has seen non-empty, so finding the
+ * next element costs O(log producers). Only when the next element is in none of those rings does
+ * it look at the rings it last saw empty.
+ */
+template<class T> class OrderedRings {
+public:
+  OrderedRings(int producers, int ring_size) : producers_(producers), ring_size_(ring_size),
+      next_timestamp_(0), popped_(0), front_(-1) {
+    if (producers < 1 || ring_size < 1) throw std::invalid_argument("bad ordered ring sizes");
+    rings_ = new Ring * volatile[producers];
+    for (int i = 0; i < producers; i++) rings_[i] = NULL;
+    fronts_.reserve(producers);
+    idle_.reserve(producers);
+    for (int i = producers - 1; i >= 0; i--) idle_.push_back(i);
+  }
+  ~OrderedRings() {
+    for (int i = 0; i < producers_; i++) delete rings_[i];
+    delete[] rings_;
+  }
+  // Only one thread at a time may push for each producer. Throws std::invalid_argument if
+  // 'producer' is out of range.
+  void Push(int producer, const T &value) {
+    Ring *ring = static_cast<unsigned>(producer) < static_cast<unsigned>(producers_) ?
+        rings_[producer] : NULL;
+    if (!ring) ring = CreateRing(producer);
+    Stamped stamped = {__sync_fetch_and_add(&next_timestamp_, 1), value};
+    ring->Push(stamped);
+  }
+  // consumer side. Front returns false if the next element has not been pushed yet.
+  bool Front(T *value) {
+    if (front_ < 0) front_ = FindTimestamp(popped_);
+    if (front_ < 0) return false;
+    Stamped stamped;
+    rings_[front_]->Front(&stamped);
+    *value = stamped.value;
+    return true;
+  }
+  void Pop() {
+    Ring *ring = rings_[front_];
+    ring->Pop();
+    Stamped stamped;
+    if (ring->Front(&stamped)) {
+      AddFront(stamped.timestamp, front_);
+    } else {
+      idle_.push_back(front_);
+    }
+    front_ = -1;
+    popped_ = popped_ + 1;
+  }
+  // Elements pushed so far, and popped so far; everything pushed before a call to pushed() has
+  // been popped once popped() reaches it
+  uint64_t pushed() const { return next_timestamp_; }
+  uint64_t popped() const { return popped_; }
+  void WaitUntilPopped(uint64_t count) const {
+    for (int spins = 0; popped_ < count; spins++) Ring::Wait(spins);
+  }
+
+private:
+  struct Stamped {
+    uint64_t timestamp;
+    T value;
+  };
+  typedef SpscRing<Stamped> Ring;
+  typedef std::pair<uint64_t, int> RingFront;  ///< a ring's front timestamp, and its producer
+  typedef std::greater<RingFront> FrontOrder;  ///< makes the heap a min-heap
+
+  Ring *CreateRing(int producer) {
+    if (producer < 0 || producer >= producers_) {
+      throw std::invalid_argument("producer out of range");
+    }
+    // only 'producer' itself gets here for its slot, but the consumer reads all of them
+    Ring *ring = new Ring(ring_size_);
+    __sync_synchronize();
+    rings_[producer] = ring;
+    return ring;
+  }
+  void AddFront(uint64_t timestamp, int producer) {
+    fronts_.push_back(RingFront(timestamp, producer));
+    std::push_heap(fronts_.begin(), fronts_.end(), FrontOrder());
+  }
+  // The producer whose ring's front holds 'timestamp', or -1 if it has not been pushed yet. The
+  // front is taken off the heap; Pop puts the ring back.
+  int FindTimestamp(uint64_t timestamp) {
+    if (fronts_.empty() || fronts_.front().first != timestamp) {
+      // every smaller timestamp is popped, so it is the front of a ring that was empty
+      for (size_t i = 0; i < idle_.size(); ) {
+        Ring *ring = rings_[idle_[i]];
+        Stamped stamped;
+        if (ring && ring->Front(&stamped)) {
+          AddFront(stamped.timestamp, idle_[i]);
+          idle_[i] = idle_.back();
+          idle_.pop_back();
+        } else {
+          i++;
+        }
+      }
+      if (fronts_.empty() || fronts_.front().first != timestamp) return -1;
+    }
+    int producer = fronts_.front().second;
+    std::pop_heap(fronts_.begin(), fronts_.end(), FrontOrder());
+    fronts_.pop_back();
+    return producer;
+  }
+
+  const int producers_;
+  Ring * volatile *rings_;  ///< created on a producer's first push
+  const int ring_size_;
+  volatile uint64_t next_timestamp_;
+  volatile uint64_t popped_;
+  int front_;  ///< the producer whose ring holds the next element, or -1 if not found yet
+  std::vector<RingFront> fronts_;  ///< heap of the non-empty rings' fronts, other than front_
+  std::vector<int> idle_;  ///< producers whose rings were empty (or missing) when last seen
+  DISALLOW_COPY_AND_ASSIGN(OrderedRings);
+};
+
+#endif /* ORDEREDRINGS_H_ */
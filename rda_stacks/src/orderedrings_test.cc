@@ -0,0 +1,106 @@
+#include <pthread.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include "orderedrings.h"
+
+static const int kProducers = 4;
+static const int kItemsPerProducer = 100000;
+
+struct Item {
+  int producer;
+  int sequence;
+};
+
+// With one pushing thread, the items come out in push order across all producers' rings
+TEST(OrderedRingsTest, PushOrder) {
+  OrderedRings<Item> rings(3, 4);
+  Item item;
+  EXPECT_FALSE(rings.Front(&item));
+  for (int i = 0; i < 4; i++) {
+    int producers[] = {2, 0, 2, 1};
+    Item pushed = {producers[i], i};
+    rings.Push(producers[i], pushed);
+  }
+  EXPECT_EQ(4u, rings.pushed());
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(rings.Front(&item));
+    EXPECT_EQ(i, item.sequence);
+    rings.Pop();
+  }
+  EXPECT_FALSE(rings.Front(&item));
+  EXPECT_EQ(4u, rings.popped());
+  EXPECT_THROW(rings.Push(3, item), std::invalid_argument);
+  EXPECT_THROW(rings.Push(-1, item), std::invalid_argument);
+  EXPECT_THROW(OrderedRings<Item> bad(0, 4), std::invalid_argument);
+}
+
+// Rings that drain and fill again between pops still come out in push order
+TEST(OrderedRingsTest, RingsRefill) {
+  const int kManyProducers = 64;
+  OrderedRings<Item> rings(kManyProducers, 4);
+  Item item;
+  int pushed = 0;
+  int popped = 0;
+  for (int round = 0; round < 50; round++) {
+    for (int i = 0; i < 3; i++) {
+      int producer = (round * 37 + i * 11) % kManyProducers;
+      Item value = {producer, pushed++};
+      rings.Push(producer, value);
+    }
+    // leave some behind, so the heap and the empty rings both hold the next one sometimes
+    for (int i = 0; i < 2 + round % 2 && popped < pushed; i++) {
+      ASSERT_TRUE(rings.Front(&item));
+      EXPECT_EQ(popped++, item.sequence);
+      rings.Pop();
+    }
+  }
+  while (popped < pushed) {
+    ASSERT_TRUE(rings.Front(&item));
+    EXPECT_EQ(popped++, item.sequence);
+    rings.Pop();
+  }
+  EXPECT_FALSE(rings.Front(&item));
+}
+
+struct ProducerArgs {
+  OrderedRings<Item> *rings;
+  int producer;
+};
+
+static void *Produce(void *arg) {
+  ProducerArgs *args = static_cast<ProducerArgs *>(arg);
+  for (int i = 0; i < kItemsPerProducer; i++) {
+    Item item = {args->producer, i};
+    args->rings->Push(args->producer, item);
+  }
+  return NULL;
+}
+
+// Every item arrives once, and each producer's items stay in order
+TEST(OrderedRingsTest, Producers) {
+  OrderedRings<Item> rings(kProducers, 16);  // small, so producers wait for room
+  pthread_t threads[kProducers];
+  ProducerArgs args[kProducers];
+  for (int p = 0; p < kProducers; p++) {
+    args[p].rings = &rings;
+    args[p].producer = p;
+    ASSERT_EQ(0, pthread_create(&threads[p], NULL, Produce, &args[p]));
+  }
+  std::vector<int> next(kProducers, 0);
+  int spins = 0;
+  for (int received = 0; received < kProducers * kItemsPerProducer; ) {
+    Item item;
+    if (!rings.Front(&item)) {
+      SpscRing<int>::Wait(spins++);
+      continue;
+    }
+    spins = 0;
+    ASSERT_EQ(next[item.producer], item.sequence);
+    next[item.producer]++;
+    rings.Pop();
+    received++;
+  }
+  for (int p = 0; p < kProducers; p++) pthread_join(threads[p], NULL);
+  EXPECT_EQ(rings.pushed(), rings.popped());
+  for (int p = 0; p < kProducers; p++) EXPECT_EQ(kItemsPerProducer, next[p]);
+}
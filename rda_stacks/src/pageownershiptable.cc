@@ -0,0 +1,70 @@
+#include "pageownershiptable.h"
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+
+const int PageOwnershipTable::kPageBits;
+const int PageOwnershipTable::kPageBytes;
+const int PageOwnershipTable::kDefaultTableBits;
+const int PageOwnershipTable::kMaxThreads;
+const int PageOwnershipTable::kNoOwner;
+
+PageOwnershipTable::PageOwnershipTable(int table_bits)
+    : table_(NULL), table_mask_((static_cast<uint64_t>(1) << table_bits) - 1),
+      table_shift_(64 - table_bits) {
+  if (table_bits < 1 || table_bits > 32) {
+    throw std::invalid_argument("page ownership table bits must be between 1 and 32");
+  }
+  // calloc, so the pages of the table are only mapped when used
+  table_ = static_cast<volatile uint64_t *>(calloc(table_mask_ + 1, sizeof(uint64_t)));
+  if (table_ == NULL) throw std::bad_alloc();
+}
+
+PageOwnershipTable::~PageOwnershipTable() {
+  free(const_cast<uint64_t *>(table_));
+}
+
+volatile uint64_t *PageOwnershipTable::FindSlot(address_t page, bool insert) const {
+  uint64_t slot = (page * 0x9e3779b97f4a7c15ULL) >> table_shift_;
+  for (int probe = 0; probe < kMaxProbes; probe++) {
+    volatile uint64_t *entry = &table_[(slot + probe) & table_mask_];
+    uint64_t value = *entry;
+    if (value == 0) return insert ? entry : NULL;
+    if (value >> kStateBits == page) return entry;
+  }
+  return NULL;
+}
+
+bool PageOwnershipTable::Touch(address_t address, int thread, int *previous_owner) {
+  *previous_owner = kNoOwner;
+  if (thread < 0 || thread >= kMaxThreads) return false;
+  address_t page = PageOf(address);
+  uint64_t mine = Entry(page, thread + 1);
+  while (true) {
+    volatile uint64_t *entry = FindSlot(page, true);
+    if (entry == NULL) return false;  // table full
+    uint64_t value = *entry;
+    if (value == mine) return true;
+    if (value == 0) {
+      if (__sync_bool_compare_and_swap(entry, 0, mine)) return true;
+      continue;  // someone else took the slot, maybe for this page
+    }
+    uint64_t state = value & kStateMask;
+    if (state == kShared) return false;
+    if (__sync_bool_compare_and_swap(entry, value, Entry(page, kShared))) {
+      *previous_owner = static_cast<int>(state) - 1;
+      return false;
+    }
+  }
+}
+
+bool PageOwnershipTable::IsPrivate(address_t address, int thread) const {
+  return GetOwner(address) == thread && thread != kNoOwner;
+}
+
+int PageOwnershipTable::GetOwner(address_t address) const {
+  volatile uint64_t *entry = FindSlot(PageOf(address), false);
+  if (entry == NULL) return kNoOwner;
+  uint64_t state = *entry & kStateMask;
+  return state == kShared ? kNoOwner : static_cast<int>(state) - 1;
+}
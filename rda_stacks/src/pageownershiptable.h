@@ -0,0 +1,52 @@
+#ifndef PAGEOWNERSHIPTABLE_H_
+#define PAGEOWNERSHIPTABLE_H_
+
+#include "reusestack-common.h"
+
+/*
+ * Tracks which thread first touched each page and whether any other thread has touched it
+ * since. While a page is private to one thread no other thread can hold any of its blocks, so
+ * writes to it need no invalidation work. Pages go from untouched to private to shared and never
+ * back, and Touch reports the private to shared transition exactly once, to the thread that
+ * caused it, so callers can catch up on whatever they skipped while the page was private.
+ *
+ * Lock-free: each page is one word (page number and state) in a fixed-size open addressing
+ * table, updated with compare-and-swap. If the table fills up, untracked pages are reported as
+ * shared, which is always safe.
+ */
+class PageOwnershipTable {
+public:
+  static const int kPageBits = 12;
+  static const int kPageBytes = 1 << kPageBits;
+  static const int kDefaultTableBits = 20;  ///< 8MB, only touched parts are ever paged in
+  static const int kMaxThreads = 4094;
+  static const int kNoOwner = -1;
+
+  explicit PageOwnershipTable(int table_bits = kDefaultTableBits);
+  ~PageOwnershipTable();
+  // Records a touch of the page holding 'address'. Returns true if 'thread' is still the only
+  // thread that has touched the page. If this touch made the page shared, *previous_owner is
+  // the thread that owned it until now; otherwise it is kNoOwner.
+  bool Touch(address_t address, int thread, int *previous_owner);
+  // True if no thread other than 'thread' has touched the page holding 'address'
+  bool IsPrivate(address_t address, int thread) const;
+  // kNoOwner for untouched and shared pages
+  int GetOwner(address_t address) const;
+  static address_t PageOf(address_t address) { return address >> kPageBits; }
+
+private:
+  static const int kStateBits = 12;
+  static const uint64_t kStateMask = (static_cast<uint64_t>(1) << kStateBits) - 1;
+  static const uint64_t kShared = kStateMask;  ///< private pages store owner + 1
+  static const int kMaxProbes = 64;
+  static uint64_t Entry(address_t page, uint64_t state) { return page << kStateBits | state; }
+  // Returns the slot holding 'page', or the empty slot for it if 'insert', or NULL
+  volatile uint64_t *FindSlot(address_t page, bool insert) const;
+
+  volatile uint64_t *table_;  ///< 0 is an empty slot; no valid entry is 0
+  const uint64_t table_mask_;
+  const int table_shift_;
+  DISALLOW_COPY_AND_ASSIGN(PageOwnershipTable);
+};
+
+#endif /* PAGEOWNERSHIPTABLE_H_ */
@@ -0,0 +1,92 @@
+#include <pthread.h>
+#include <gtest/gtest.h>
+#include "pageownershiptable.h"
+
+TEST(PageOwnershipTableTest, Transitions) {
+  PageOwnershipTable pages;
+  int previous_owner;
+  EXPECT_EQ(PageOwnershipTable::kNoOwner, pages.GetOwner(0x1000));
+  EXPECT_FALSE(pages.IsPrivate(0x1000, 0));
+  EXPECT_TRUE(pages.Touch(0x1000, 3, &previous_owner));
+  EXPECT_EQ(PageOwnershipTable::kNoOwner, previous_owner);
+  EXPECT_TRUE(pages.Touch(0x1ff8, 3, &previous_owner));
+  EXPECT_TRUE(pages.IsPrivate(0x1234, 3));
+  EXPECT_FALSE(pages.IsPrivate(0x1234, 2));
+  EXPECT_EQ(3, pages.GetOwner(0x1000));
+  // page 0 is a valid page too
+  EXPECT_TRUE(pages.Touch(0, 0, &previous_owner));
+  EXPECT_TRUE(pages.IsPrivate(0xfff, 0));
+
+  // the first other thread makes it shared, and learns the old owner
+  EXPECT_FALSE(pages.Touch(0x1010, 5, &previous_owner));
+  EXPECT_EQ(3, previous_owner);
+  EXPECT_FALSE(pages.Touch(0x1010, 5, &previous_owner));
+  EXPECT_EQ(PageOwnershipTable::kNoOwner, previous_owner);
+  EXPECT_FALSE(pages.Touch(0x1010, 3, &previous_owner));
+  EXPECT_EQ(PageOwnershipTable::kNoOwner, previous_owner);
+  EXPECT_FALSE(pages.IsPrivate(0x1000, 3));
+  EXPECT_EQ(PageOwnershipTable::kNoOwner, pages.GetOwner(0x1000));
+
+  EXPECT_TRUE(pages.Touch(static_cast<address_t>(-1), 7, &previous_owner));
+  EXPECT_EQ(7, pages.GetOwner(static_cast<address_t>(-1)));
+}
+
+// Pages that don't fit are shared, which is always safe
+TEST(PageOwnershipTableTest, Full) {
+  PageOwnershipTable pages(4);
+  int previous_owner;
+  int private_count = 0;
+  for (int i = 0; i < 100; i++) {
+    if (pages.Touch(i * PageOwnershipTable::kPageBytes, 1, &previous_owner)) private_count++;
+  }
+  EXPECT_EQ(16, private_count);
+  for (int i = 0; i < 100; i++) {
+    if (pages.IsPrivate(i * PageOwnershipTable::kPageBytes, 1)) private_count--;
+  }
+  EXPECT_EQ(0, private_count);
+}
+
+static const int kTestThreads = 4;
+static const int kTestPages = 20000;
+struct TouchArgs {
+  PageOwnershipTable *pages;
+  int thread;
+  int transitions;
+};
+
+static void *TouchPages(void *arg) {
+  TouchArgs *args = static_cast<TouchArgs *>(arg);
+  for (int i = 0; i < kTestPages; i++) {
+    // every page is touched by thread 0 and by one other thread, in varying order
+    int page = args->thread % 2 ? kTestPages - 1 - i : i;
+    if (args->thread != 0 && page % (kTestThreads - 1) != args->thread - 1) continue;
+    int previous_owner;
+    args->pages->Touch(static_cast<address_t>(page) << PageOwnershipTable::kPageBits,
+                       args->thread, &previous_owner);
+    if (previous_owner != PageOwnershipTable::kNoOwner) args->transitions++;
+  }
+  return NULL;
+}
+
+// Every page becomes shared exactly once, however the threads race
+TEST(PageOwnershipTableTest, Concurrent) {
+  PageOwnershipTable pages;
+  pthread_t threads[kTestThreads];
+  TouchArgs args[kTestThreads];
+  for (int t = 0; t < kTestThreads; t++) {
+    args[t].pages = &pages;
+    args[t].thread = t;
+    args[t].transitions = 0;
+    pthread_create(&threads[t], NULL, TouchPages, &args[t]);
+  }
+  int transitions = 0;
+  for (int t = 0; t < kTestThreads; t++) {
+    pthread_join(threads[t], NULL);
+    transitions += args[t].transitions;
+  }
+  EXPECT_EQ(kTestPages, transitions);
+  for (int i = 0; i < kTestPages; i++) {
+    EXPECT_EQ(PageOwnershipTable::kNoOwner,
+              pages.GetOwner(static_cast<address_t>(i) << PageOwnershipTable::kPageBits));
+  }
+}
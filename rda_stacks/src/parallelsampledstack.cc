@@ -6,25 +6,84 @@
  */
 
 #include "parallelsampledstack.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <algorithm>
 #include <list>
+#include <new>
 #include <stdexcept>
+#include <vector>
 #include <assert.h>
 #include <boost/format.hpp>
+#include "spscring.h"
+#include "statswriter.h"
 #include "version.h"
 
-const int kMaxThreads = 16;
+// Initialize's thread count is what the tool expects to see; never allow fewer than this
+const int kMinThreadLimit = 16;
 const int kPruneSampleThreshold = 100;
 const double kPruneTarget = 0.99;
 
+// The merge helper's view of one sample
+struct SampleProgress {
+  SampleProgress() : owner(-1), write_sets(0), pending(NULL), finalized(false) {}
+  int owner;
+  int write_sets;  ///< threads holding a write set for the sample
+  WriteSet *pending;  ///< blocks collected since the last merge result went to the owner
+  bool finalized;
+};
+typedef std::tr1::unordered_map<DistanceSet *, SampleProgress> SampleProgressMap;
+
+struct AsyncMergeState {
+  AsyncMergeState() : in_flight(0), stop(false), failed(false), threads(0) {}
+  pthread_t thread;
+  Mailbox<MergeMessage> mailbox;
+  volatile int in_flight;  ///< messages posted to the helper and not yet handled
+  volatile bool stop;
+  volatile bool failed;
+  std::string error;
+  // helper thread only
+  int threads;
+  SampleProgressMap samples;
+  std::vector<DistanceSet *> dirty;  ///< samples that may have pending blocks
+};
+
+static SampleProgress &FindProgress(AsyncMergeState *state, DistanceSet *ds) {
+  SampleProgressMap::iterator it = state->samples.find(ds);
+  if (it == state->samples.end()) throw std::runtime_error("merge message for an unknown sample");
+  return it->second;
+}
+
+// Combines 'blocks' into the blocks waiting to go to the sample's owner
+static void AddPending(SampleProgress *progress, WriteSet *blocks) {
+  if (progress->pending == NULL) {
+    progress->pending = blocks;
+    return;
+  }
+  if (progress->pending->sketch != NULL) {
+    progress->pending->sketch->Merge(*blocks->sketch);
+  } else {
+    progress->pending->set.UnionWith(blocks->set);
+  }
+  delete blocks;
+}
+
 bool ParallelSampledStack::initialized_ = false;
 FILE *ParallelSampledStack::output_file_;
 int ParallelSampledStack::block_bytes_;
 address_t ParallelSampledStack::block_mask_;
+int ParallelSampledStack::block_shift_;
+int ParallelSampledStack::max_threads_;
+int ParallelSampledStack::pc_stats_limit_;
 bool ParallelSampledStack::global_enabled_;
 ParallelSampledStack::StackType ParallelSampledStack::stack_type_;
+bool ParallelSampledStack::sketches_;
+bool ParallelSampledStack::batching_;
+AsyncMergeState *ParallelSampledStack::async_ = NULL;
 CircularThreadQueue<ParallelSampledStack *> ParallelSampledStack::threads_;
 
 PssGlobalData *ParallelSampledStack::global_rw_;
+PageOwnershipTable *ParallelSampledStack::page_table_;
 ThreadedOutputTrace ParallelSampledStack::trace_;
 
 bool ParallelSampledStack::Initialize(const std::string &output_filename, int granularity,
@@ -41,8 +100,10 @@ bool ParallelSampledStack::Initialize(const std::string &output_filename, int gr
   }
   block_bytes_ = granularity;
   block_mask_ = static_cast<address_t>(-1);
+  block_shift_ = 0;
   while (granularity > 1) {
     block_mask_ <<= 1;
+    block_shift_++;
     granularity >>= 1;
   }
   if ((block_bytes_ & static_cast<int>(block_mask_)) != block_bytes_) {
@@ -50,19 +111,27 @@ bool ParallelSampledStack::Initialize(const std::string &output_filename, int gr
     printf("warning: granularity must be a power of 2, using %d instead\n", block_bytes_);
   }
   stack_type_ = stack_type;
-  threads_.Initialize(kMaxThreads);
+  sketches_ = false;
+  batching_ = false;
+  pc_stats_limit_ = 0;
+  max_threads_ = std::max(threads, kMinThreadLimit);
   // in Pin, thread ids start at 0 so this array can be indexed by thread id
-  //threads_.resize(threads, NULL);
+  threads_.Initialize(max_threads_);
   global_rw_ = new PssGlobalData();
-  global_rw_->barrier.Init(&threads_);
+  global_rw_->barrier.Init(&threads_, max_threads_);
+  page_table_ = new PageOwnershipTable();
   RdaInitLock(&global_rw_->threads_lock);
-  trace_.Init(output_filename + "-trace");
+  trace_.Init(output_filename + "-trace", max_threads_);
   global_enabled_ = false;
   initialized_ = true;
   return true;
 }
 
 void ParallelSampledStack::CleanUp() {
+  if (async_ != NULL) {
+    if (!async_->failed) Quiesce();
+    StopHelper();
+  }
   initialized_ = false;
   if (output_file_ != NULL) {
     fclose(output_file_);
@@ -75,27 +144,112 @@ void ParallelSampledStack::CleanUp() {
       ds = ds->next;
       delete del;
     }
-    WriteSet *ws = threads_[i]->write_sets_;
-    while(ws) {
-      WriteSet *del = ws;
-      ws = ws->next;
-      delete del;
+    for (size_t j = 0; j < threads_[i]->write_sets_.size(); j++) {
+      delete threads_[i]->write_sets_[j];
     }
     delete threads_[i];
   }
   trace_.CleanUp();
   delete global_rw_;
+  delete page_table_;
+  page_table_ = NULL;
 }
 
-ParallelSampledStack::ParallelSampledStack(int threadid) : distance_sets_(NULL), write_sets_(NULL),
-    enabled_(false), threadid_(threadid), sampled_access_count_(0),
+ParallelSampledStack::ParallelSampledStack(int threadid) : distance_sets_(NULL),
+    oldest_distance_set_(NULL), epoch_accesses_(0), recent_count_(0),
+    batch_start_(kNoBatch), batched_samples_(0), enabled_(false), threadid_(threadid), sampled_access_count_(0),
     synchronization_count_(0), addresses_per_sample_total_(0), reference_lifetime_total_(0),
     invalidation_count_(0), prune_count_(0), private_stats_(block_bytes_), private_read_stats_(block_bytes_),
-    new_thread_(true) {
+    own_sketch_(NULL), pc_stats_(NULL), new_thread_(true) {
   if (!initialized_) {
     throw std::runtime_error("ParallelSampledStack::Initialize must be called before any instantiation");
   }
   RdaInitLock(&write_set_lock_);
+  if (batching_) recent_.resize(kRecentAccesses);
+  void *memory;
+  if (posix_memalign(&memory, CACHE_LINE_SIZE, sizeof(PCStatsShard)) != 0) throw std::bad_alloc();
+  pc_stats_ = new (memory) PCStatsShard();
+  if (sketches_) own_sketch_ = new SlidingDistinctSketch();
+}
+
+ParallelSampledStack::~ParallelSampledStack() {
+  delete own_sketch_;
+  pc_stats_->~PCStatsShard();
+  free(pc_stats_);
+}
+
+void ParallelSampledStack::SetPCStatsLimit(int limit) {
+  if (!initialized_) {
+    throw std::runtime_error("ParallelSampledStack::Initialize must be called before SetPCStatsLimit");
+  }
+  if (limit < 0) throw std::invalid_argument("tracked PC limit must be >= 0");
+  pc_stats_limit_ = limit;
+}
+
+void ParallelSampledStack::MergePCStats(PCStats *all, PCStats *reads) {
+  for (int i = 0; i < threads_.GetThreadCount(); i++) {
+    all->Merge(threads_[i]->pc_stats_->all);
+    reads->Merge(threads_[i]->pc_stats_->reads);
+  }
+  // the shards are unbounded, so this evicts by exact counts and each PC at most once
+  all->SetMaxTrackedPCs(pc_stats_limit_);
+  reads->SetMaxTrackedPCs(pc_stats_limit_);
+}
+
+void ParallelSampledStack::SetDistanceSketches(bool enable) {
+  if (!initialized_) {
+    throw std::runtime_error("ParallelSampledStack::Initialize must be called before SetDistanceSketches");
+  }
+  if (enable && stack_type_ != kSharedStacks) {
+    throw std::invalid_argument("distance sketches need shared stacks");
+  }
+  if (threads_.GetThreadCount() != 0) {
+    throw std::runtime_error("SetDistanceSketches must be called before any thread stack exists");
+  }
+  sketches_ = enable;
+}
+
+void ParallelSampledStack::SetAsyncMerging(bool enable) {
+  if (!initialized_) {
+    throw std::runtime_error("ParallelSampledStack::Initialize must be called before SetAsyncMerging");
+  }
+  if (threads_.GetThreadCount() != 0) {
+    throw std::runtime_error("SetAsyncMerging must be called before any thread stack exists");
+  }
+  if (enable == (async_ != NULL)) return;
+  if (enable && batching_) {
+    throw std::invalid_argument("asynchronous merging and sample batching don't mix");
+  }
+  if (!enable) {
+    StopHelper();
+    return;
+  }
+  async_ = new AsyncMergeState();
+  if (pthread_create(&async_->thread, NULL, HelperMain, NULL) != 0) {
+    delete async_;
+    async_ = NULL;
+    throw std::runtime_error("could not start the merge helper thread");
+  }
+}
+
+void ParallelSampledStack::SetSampleBatching(bool enable) {
+  if (!initialized_) {
+    throw std::runtime_error("ParallelSampledStack::Initialize must be called before SetSampleBatching");
+  }
+  if (threads_.GetThreadCount() != 0) {
+    throw std::runtime_error("SetSampleBatching must be called before any thread stack exists");
+  }
+  if (enable && async_ != NULL) {
+    throw std::invalid_argument("asynchronous merging and sample batching don't mix");
+  }
+  batching_ = enable;
+}
+
+void ParallelSampledStack::StopHelper() {
+  async_->stop = true;
+  pthread_join(async_->thread, NULL);
+  delete async_;
+  async_ = NULL;
 }
 
 ParallelSampledStack * ParallelSampledStack::GetThreadStack(int thread) {
@@ -116,12 +270,22 @@ ParallelSampledStack * ParallelSampledStack::GetThreadStack(int thread) {
   global_rw_->thread_count++;
   assert(global_rw_->thread_count == threads_.GetThreadCount());
   threads_[thread]->SetThreadEnable(true);
+  if (async_ != NULL) {
+    MergeMessage *message = new MergeMessage(MergeMessage::kNewThread, NULL);
+    message->thread = thread;
+    PostToHelper(message, message, 1);
+    return p;
+  }
   global_rw_->synchronize = 1;
   global_rw_->merge_needed = true;
   return p;
 }
 
 void ParallelSampledStack::MergeAllSamples() {
+  if (async_ != NULL) {
+    PublishEpoch();
+    return;
+  }
   global_rw_->synchronize = 1;
   global_rw_->merge_needed = true;
   events_.Log(EventBuffer::kMerge);
@@ -129,6 +293,9 @@ void ParallelSampledStack::MergeAllSamples() {
   SynchronizedOperations(kMerge, NULL);
 }
 
+// Each awake thread handles itself and the sleeping threads after it. Only the barrier's later
+// stages are grouped: the walks here, like each sample's merge over every thread's write set,
+// still grow linearly with the thread count.
 void ParallelSampledStack::SynchronizedOperations(SyncAction action, DistanceSet *newDS) {
   //entered if sync flag is set
   int generation;
@@ -136,16 +303,25 @@ void ParallelSampledStack::SynchronizedOperations(SyncAction action, DistanceSet
   if ((generation = global_rw_->barrier.WaitStart(threadid_)) != 0) {
     bool merge_needed = global_rw_->merge_needed;  // cache these values so we can reset them
     bool finalize_needed = global_rw_->finalize_needed;
+    // queued samples and finalizations, of any thread (batched mode)
+    bool batch_needed = global_rw_->batched_work != 0;
     //gfn = global_rw_->finalize_needed;
     // first stage. threads may update each other's write sets (each thread's sets list has a lock)
     int end_sleepers = -2;//threads_.GetNextIndex(threadid_);
-    if (merge_needed || finalize_needed) {
+    if (merge_needed || finalize_needed || batch_needed) {
       events_.Log(EventBuffer::kMergeNeeded);
       end_sleepers = global_rw_->barrier.GetAdjacentSleepers(threadid_);
       if (end_sleepers == threadid_) end_sleepers = -1;  // all threads but this one are asleep
       if (end_sleepers == -1) events_.Log(EventBuffer::kAdjacentSleeper);
     }
-    if (finalize_needed) {
+    if (batch_needed) {
+      // before finalizing: replaying the logs can end queued samples
+      for (int t = threadid_; t != end_sleepers; t = threads_.GetNextIndex(t)) {
+        AddBatchedWriteSets(t);
+        if (end_sleepers == -1 && threads_.GetNextIndex(t) == threadid_) break;
+      }
+    }
+    if (finalize_needed || batch_needed) {
       // some thread reused/invalidated one of this thread's samples
       // remove the sample from all writesets
       for (int t = threadid_; t != end_sleepers; t = threads_.GetNextIndex(t)) {
@@ -164,11 +340,12 @@ void ParallelSampledStack::SynchronizedOperations(SyncAction action, DistanceSet
     if (action == kNewSampledAddress) {
       // add to everyone's write sets (acquire lock for each)
       for (int i = threads_.GetNextIndex(threadid_); i != threadid_; i = threads_.GetNextIndex(i)) {
-        WriteSet *ws = new WriteSet(newDS->sample_addr, newDS);
+        WriteSet *ws = new WriteSet(newDS->sample_addr, newDS, threadid_);
+        ws->sketch = NewSketch();
         ws->creation_time = threads_[i]->sampled_access_count_;
+        newDS->thread_write_sets[i] = ws;
         LockHolder lh(&threads_[i]->write_set_lock_);
-        ws->next = threads_[i]->write_sets_;
-        threads_[i]->write_sets_ = ws;
+        threads_[i]->LinkWriteSet(ws);
       }
     }
     else if (new_thread_) {  // action will be kMerge in this case
@@ -177,9 +354,14 @@ void ParallelSampledStack::SynchronizedOperations(SyncAction action, DistanceSet
       for (int i = threads_.GetNextIndex(threadid_); i != threadid_; i = threads_.GetNextIndex(i)) {
         DistanceSet *ds = threads_[i]->distance_sets_;
         while (ds) {
-          WriteSet *ws = new WriteSet(ds->sample_addr, ds);
-          ws->next = write_sets_;
-          write_sets_ = ws;
+          if (ds->batched) {  // its owner adds those
+            ds = ds->next;
+            continue;
+          }
+          WriteSet *ws = new WriteSet(ds->sample_addr, ds, i);
+          ws->sketch = NewSketch();
+          ds->thread_write_sets[threadid_] = ws;
+          LinkWriteSet(ws);
           ds = ds->next;
         }
       }
@@ -188,14 +370,17 @@ void ParallelSampledStack::SynchronizedOperations(SyncAction action, DistanceSet
     ValidateActiveSamples(newDS != NULL);
     global_rw_->barrier.WaitStage(1, threadid_);
     // second stage - merging and finalizing. every thread's write sets must be stable
-    if (merge_needed || finalize_needed) {
+    if (merge_needed || finalize_needed || batch_needed) {
       // if all threads but this are asleep, need to do all threads (but only once) so end_sleepers
       // becomes -1 and the special case below keeps it to one loop around (this also works for
       // the case of only one total thread)
       for (int t = threadid_; t != end_sleepers; t = threads_.GetNextIndex(t)) {
         DistanceSet *ds = threads_[t]->distance_sets_;
         DistanceSet *prev = NULL;
+        threads_[t]->batch_start_ = kNoBatch;
+        threads_[t]->batched_samples_ = 0;
         while (ds) {
+          ds->batched = false;
           if (ds->finalize != DistanceSet::kActive) {
             // finalize and unlink
             DistanceSet *del = ds;
@@ -205,6 +390,7 @@ void ParallelSampledStack::SynchronizedOperations(SyncAction action, DistanceSet
               assert(ds->next == NULL);
               threads_[t]->oldest_distance_set_ = prev;
             }
+            threads_[t]->samples_.Remove(ds);
             if (prev == NULL) {
               threads_[t]->distance_sets_ = ds->next;
             } else {
@@ -213,6 +399,7 @@ void ParallelSampledStack::SynchronizedOperations(SyncAction action, DistanceSet
             }
             ds = ds->next;
             delete del;
+            AtomicDecrement(&global_rw_->linked_samples);
           } else {
             if (merge_needed) { // just do this anyway?
               if (stack_type_ == kPrivateStacks) MergeInvalidationsThreads(t, ds);
@@ -226,6 +413,7 @@ void ParallelSampledStack::SynchronizedOperations(SyncAction action, DistanceSet
       }
       global_rw_->merge_needed = false;
       global_rw_->finalize_needed = false;
+      global_rw_->batched_work = 0;
     }
     global_rw_->synchronize = 0;
     global_rw_->barrier.WaitStage(2, threadid_);
@@ -236,6 +424,8 @@ void ParallelSampledStack::SynchronizedOperations(SyncAction action, DistanceSet
       if (distance_sets_ == NULL) oldest_distance_set_ = newDS;
       newDS->next = distance_sets_;
       distance_sets_ = newDS;
+      samples_.Add(newDS->sample_addr, newDS);
+      AtomicIncrement(&global_rw_->linked_samples);
     }
     //global_rw_->barrier.WaitStage(3, threadid_); // not needed.
   } else {
@@ -243,29 +433,135 @@ void ParallelSampledStack::SynchronizedOperations(SyncAction action, DistanceSet
   }
 }
 
-//only want to merge when we have a sample
+// Batched mode: links a new sample in right away, so this thread counts its own accesses, and
+// leaves the other threads' write sets to the next round
+void ParallelSampledStack::QueueSample(DistanceSet *ds) {
+  int thread_count = threads_.GetThreadCount();
+  ds->thread_times.assign(thread_count, 0);
+  for (int i = 0; i < thread_count; i++) {
+    if (i != threadid_) ds->thread_times[i] = threads_[i]->sampled_access_count_;
+  }
+  ds->batched = true;
+  CheckOldestSample();  // a pruned sample waits for the round too
+  if (distance_sets_ == NULL) oldest_distance_set_ = ds;
+  ds->next = distance_sets_;
+  distance_sets_ = ds;
+  samples_.Add(ds->sample_addr, ds);
+  AtomicIncrement(&global_rw_->linked_samples);
+  __sync_fetch_and_add(&global_rw_->batched_work, 1);
+  if (++batched_samples_ >= kMaxBatchSamples) {
+    global_rw_->synchronize = 2;
+    SynchronizedOperations(kNoAction, NULL);
+  }
+}
 
-DistanceSet *FindDS(DistanceSet *ds, address_t address) {
-  while (ds && ds->sample_addr != address) {
-    ds = ds->next;
+// Batched mode: starts the round once this thread has made kBatchAccesses accesses since it
+// first saw queued work, which keeps every sample's window within the access logs
+void ParallelSampledStack::CheckBatch() {
+  if (batch_start_ == kNoBatch) {
+    batch_start_ = sampled_access_count_;
+  } else if (sampled_access_count_ - batch_start_ >= kBatchAccesses) {
+    global_rw_->synchronize = 1;
+    SynchronizedOperations(kNoAction, NULL);
+  }
+}
+
+// Gives the other threads write sets for 'thread's queued samples, filled from their logs
+void ParallelSampledStack::AddBatchedWriteSets(int thread) {
+  for (DistanceSet *ds = threads_[thread]->distance_sets_; ds != NULL; ds = ds->next) {
+    if (!ds->batched) continue;
+    for (int i = threads_.GetNextIndex(thread); i != thread; i = threads_.GetNextIndex(i)) {
+      WriteSet *ws = new WriteSet(ds->sample_addr, ds, thread);
+      ws->sketch = NewSketch();
+      // a thread that started after the sample made all its accesses since
+      if (static_cast<size_t>(i) < ds->thread_times.size()) ws->creation_time = ds->thread_times[i];
+      else ws->creation_time = 0;
+      threads_[i]->ReplayRecentAccesses(ws);
+      ds->thread_write_sets[i] = ws;
+      LockHolder lh(&threads_[i]->write_set_lock_);
+      threads_[i]->LinkWriteSet(ws);
+    }
   }
-  return ds;
 }
 
+// Adds this thread's logged accesses since the write set's creation to it. An access to the
+// sample itself ends the sample, as it would have in Access.
+void ParallelSampledStack::ReplayRecentAccesses(WriteSet *ws) const {
+  const acc_count_t mask = kRecentAccesses - 1;
+  acc_count_t first = recent_count_ > static_cast<acc_count_t>(kRecentAccesses) ?
+      recent_count_ - kRecentAccesses : 0;
+  // the log is in time order
+  acc_count_t low = first;
+  acc_count_t high = recent_count_;
+  while (low < high) {
+    acc_count_t middle = low + (high - low) / 2;
+    if (recent_[middle & mask].time <= ws->creation_time) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low == first && first != 0) {
+    throw std::runtime_error("batched sample outlived the access log");
+  }
+  for (acc_count_t i = low; i < recent_count_; i++) {
+    const RecentAccess &access = recent_[i & mask];
+    if (access.address == ws->sample_addr) {
+      DistanceSet *ds = ws->owner;
+      if (ds->finalize == DistanceSet::kActive) {
+        ds->finalize = stack_type_ == kPrivateStacks ?
+            DistanceSet::kInvalidateFinalize : DistanceSet::kRemoteReuseFinalize;
+        ds->final_pc = access.pc;
+        ds->final_ref_is_write = access.is_write;
+      }
+      break;
+    }
+    if (ws->sketch != NULL) {
+      ws->sketch->Add(BlockNumber(access.address));
+    } else {
+      ws->set.Insert(BlockNumber(access.address));
+    }
+  }
+}
+
+//only want to merge when we have a sample
+
 void ParallelSampledStack::NewSampledAddress(address_t address, address_t PC) {
   address = GetBlock(address);
-  if (!enabled_ || !global_enabled_ || (FindDS(distance_sets_, address) != NULL)){
+  if (!enabled_ || !global_enabled_ || samples_.Find(address) >= 0) {
     // SampleTrigger has incremented this but we are going to ignore it, so decrement again
     AtomicDecrement(&global_rw_->active_sample_count);
     return;
   }
+  int previous_owner;
+  page_table_->Touch(address, threadid_, &previous_owner);
   //trace_.TraceNewSampledAddress(threadid_, address * block_bytes_);
-  global_rw_->synchronize = 2;
   events_.Log(EventBuffer::kNewAddress);
   DistanceSet *newDS = new DistanceSet(address);
+  newDS->sketch = NewSketch();
   newDS->creation_time = sampled_access_count_;
   newDS->final_pc = PC;
   newDS->final_ref_is_write = false;
+  // sized up front, so threads filling in their own entries never reallocate it
+  newDS->thread_write_sets.assign(max_threads_, NULL);
+  if (async_ != NULL) {
+    if (CheckOldestSample()) RetireSample(oldest_distance_set_);
+    if (distance_sets_ == NULL) oldest_distance_set_ = newDS;
+    newDS->next = distance_sets_;
+    distance_sets_ = newDS;
+    samples_.Add(newDS->sample_addr, newDS);
+    AtomicIncrement(&global_rw_->linked_samples);
+    // the helper gives the other threads write sets for it
+    MergeMessage *message = new MergeMessage(MergeMessage::kNewSample, newDS);
+    message->thread = threadid_;
+    PostToHelper(message, message, 1);
+    return;
+  }
+  if (batching_) {
+    QueueSample(newDS);
+    return;
+  }
+  global_rw_->synchronize = 2;
   if(CheckOldestSample()) global_rw_->finalize_needed = 1; // check to prune
   // newDS is linked into distance_sets_ list at end of sync ops
   SynchronizedOperations(kNewSampledAddress, newDS);
@@ -286,76 +582,124 @@ bool ParallelSampledStack::Access(address_t address, address_t PC, bool is_write
     events_.Log(EventBuffer::kNoAction);
     SynchronizedOperations(kNoAction, NULL);
   }
+  if (global_rw_->batched_work != 0 && enabled_ && global_enabled_) CheckBatch();
+  if (async_ != NULL && (!mailbox_.Empty() || epoch_accesses_ >= kEpochAccesses)) {
+    PublishEpoch();
+  }
   if (!enabled_ || !global_enabled_) return false;
+  epoch_accesses_++;
   address = GetBlock(address);
   //trace_.TraceAccess(threadid_, address * block_bytes_, is_write);
   sampled_access_count_++;
+  // no other thread has touched a private page, so it can't be in any of their distance sets
+  int previous_owner;
+  bool private_page = page_table_->Touch(address, threadid_, &previous_owner);
   //addresses_per_sample_total_ += global_rw_->active_sample_count;
 
+  // the samples' distances come from the last-access index, so only a reuse of one of them
+  // has to be found here
   int do_finalize = 0;
-  int ll1 = ListLength(distance_sets_);
-  DistanceSet *ds = distance_sets_;
-  while (ds) {
-    if (ds->sample_addr == address) {
+  DistanceSet *reused = NULL;
+  if (distance_sets_ != NULL) {
+    int sample = samples_.Find(address);
+    if (sample >= 0) {
+      DistanceSet *ds = samples_.entry(sample);
+      reused = ds;
       ds->finalize = DistanceSet::kReuseFinalize;
       ds->final_pc = PC;
       ds->final_ref_is_write = is_write;
       do_finalize = DistanceSet::kReuseFinalize;  // can be only one reuse finalization per access
       events_.Log(EventBuffer::kFinalizeSelf);
+    }
+    if (sketches_) {
+      own_sketch_->AddHash(DistinctSketch::Hash(BlockNumber(address)), sampled_access_count_);
     } else {
-      if (ds->holes > 0 && ds->set.count(address) == 0) ds->holes--;
-      ds->set.insert(address);
+      RecordAccess(address);
     }
-    ds = ds->next;
+  } else if (!last_access_.empty()) {
+    // nothing left to count for; later samples only look at later accesses
+    last_access_.clear();
+    access_times_.Clear();
   }
 
-  // do my other addresses - if write, add address to invalidation sets
-  if (stack_type_ == kPrivateStacks && is_write) {
-    WriteSet *ws = write_sets_;
-    while (ws) {
-      if (address == ws->sample_addr) {
-        // invalidate the address, owning thread will finalize
-        ws->owner->finalize = DistanceSet::kInvalidateFinalize;
-        ws->owner->final_pc = PC;
-        ws->owner->final_ref_is_write = is_write;
-        do_finalize = DistanceSet::kInvalidateFinalize;
+  // do my other addresses - if write, add address to invalidation sets. for shared stacks,
+  // every access goes into the other threads' distance sets
+  if ((stack_type_ == kPrivateStacks && is_write && !private_page) ||
+      stack_type_ == kSharedStacks) {
+    // invalidate (private) or remote-reuse (shared) the address, owning thread will finalize
+    DistanceSet::FinalizeStatus status = stack_type_ == kPrivateStacks ?
+        DistanceSet::kInvalidateFinalize : DistanceSet::kRemoteReuseFinalize;
+    if (async_ != NULL) {
+      // the owners finalize when they read the requests; stop matching those samples meanwhile
+      for (int i = remote_samples_.Find(address); i >= 0; i = remote_samples_.Find(address, i)) {
+        WriteSet *ws = remote_samples_.entry(i);
+        MergeMessage *message = new MergeMessage(MergeMessage::kFinalizeRequest, ws->owner);
+        message->status = status;
+        message->pc = PC;
+        message->is_write = is_write;
+        PostToThread(ws->owner_thread, message);
+        remote_samples_.Remove(ws);
         events_.Log(EventBuffer::kFinalizeInval);
-      } else {
-        ws->set.insert(address);
       }
-      ws = ws->next;
-    }
-  } else if (stack_type_ == kSharedStacks) {
-    WriteSet *ws = write_sets_;
-    while (ws) {
-      if (address == ws->sample_addr) {
-        // remote-reuse the address, owning thread will finalize
-        ws->owner->finalize = DistanceSet::kRemoteReuseFinalize;
+    } else {
+      for (int i = remote_samples_.Find(address); i >= 0;
+           i = remote_samples_.Find(address, i + 1)) {
+        WriteSet *ws = remote_samples_.entry(i);
+        if (ws->owner->retiring) continue;  // reused already, waiting for the round
+        ws->owner->finalize = status;
         ws->owner->final_pc = PC;
         ws->owner->final_ref_is_write = is_write;
-        do_finalize = DistanceSet::kRemoteReuseFinalize;
+        do_finalize = status;
         events_.Log(EventBuffer::kFinalizeInval);
+      }
+    }
+    if (batching_) {
+      RecentAccess &access = recent_[recent_count_++ & (kRecentAccesses - 1)];
+      access.time = sampled_access_count_;
+      access.address = address;
+      access.pc = PC;
+      access.is_write = is_write;
+    }
+    uint64_t hash = sketches_ ? DistinctSketch::Hash(BlockNumber(address)) : 0;
+    for (size_t i = 0; i < write_sets_.size(); i++) {
+      WriteSet *ws = write_sets_[i];
+      if (address == ws->sample_addr) continue;
+      if (ws->sketch != NULL) {
+        ws->sketch->AddHash(hash);
       } else {
-        ws->set.insert(address);
+        ws->set.Insert(BlockNumber(address));
       }
-      ws = ws->next;
     }
   }
 
+  if (async_ != NULL) {
+    if (reused != NULL) RetireSample(reused);
+    return global_rw_->active_sample_count == 0;
+  }
+  if (batching_ && reused != NULL) {
+    // this thread's part is fixed now; the round collects the rest
+    reused->own_count = OwnCount(reused);
+    if (reused->sketch != NULL) own_sketch_->MergeSince(reused->creation_time, reused->sketch);
+    reused->retiring = true;
+    samples_.Remove(reused);
+    __sync_fetch_and_add(&global_rw_->batched_work, 1);
+    if (do_finalize == DistanceSet::kReuseFinalize) do_finalize = 0;
+  }
   // must not do sync ops while traversing the ds list and ws list because they can change
   if (do_finalize) {
+    int ll1 = ListLength(distance_sets_);
     global_rw_->finalize_needed = do_finalize;
     global_rw_->synchronize = 3;
     SynchronizedOperations(kFinalize, NULL);
-  }
 
-  ds = distance_sets_;
-  if ( (do_finalize == DistanceSet::kReuseFinalize) && (ListLength(ds) >= ll1) )
-    throw std::runtime_error("length");
-  while(ds) {
-    if (ds->finalize == DistanceSet::kReuseFinalize)
-      throw std::runtime_error("still final");
-    ds = ds->next;
+    DistanceSet *ds = distance_sets_;
+    if ( (do_finalize == DistanceSet::kReuseFinalize) && (ListLength(ds) >= ll1) )
+      throw std::runtime_error("length");
+    while(ds) {
+      if (ds->finalize == DistanceSet::kReuseFinalize)
+        throw std::runtime_error("still final");
+      ds = ds->next;
+    }
   }
   return global_rw_->active_sample_count == 0;
 }
@@ -364,24 +708,14 @@ void ParallelSampledStack::MergeInvalidationsThreads(int thread, DistanceSet *my
   // work on behalf of thread with id 'thread'
   // iterate over all other threads, invalidate their write sets in my distance set
   // where "my" distance set is the DS from 'thread'
-  address_t address = myDS->sample_addr;
   for (int i = threads_.GetNextIndex(thread); i != thread; i = threads_.GetNextIndex(i)) {
-    //not necessary to acquire, no modification to linklist and only one thread owns each address
-    //LockHolder lh(&threads_[i]->write_set_lock_);
-    WriteSet *ws = threads_[i]->write_sets_;
-    while (ws && !(ws->sample_addr == address && ws->owner == myDS)) ws = ws->next;
+    //not necessary to acquire, no modification to write_sets_ and only one thread owns each address
+    WriteSet *ws = myDS->thread_write_sets[i];
     if (!ws) {
       throw std::runtime_error("merged address not found in remote thread's write sets");
     }
-    for(AddressSet::iterator it = ws->set.begin(); it != ws->set.end(); ++it) {
-      assert(*it != address);
-      if (myDS->set.count(*it) > 0) {
-        //threads_[i]->invalidation_count_++;
-        myDS->set.erase(*it);
-        myDS->holes++;
-      }
-    }
-    ws->set.clear();
+    threads_[thread]->RemoveAddresses(myDS, ws->set);
+    ws->set.Clear();
   }
 }
 
@@ -391,20 +725,19 @@ void ParallelSampledStack::MergeDistanceSetsThreads(int thread, DistanceSet *myD
   // where "my" distance set is the DS from 'thread'
   address_t address = myDS->sample_addr;
   for (int i = threads_.GetNextIndex(thread); i != thread; i = threads_.GetNextIndex(i)) {
-    //not necessary to acquire, no modification to linklist and only one thread owns each address
-    //LockHolder lh(&threads_[i]->write_set_lock_);
-    WriteSet *theirDS = threads_[i]->write_sets_;
-    while (theirDS && !(theirDS->sample_addr == address && theirDS->owner == myDS)) {
-      theirDS = theirDS->next;
-    }
+    //not necessary to acquire, no modification to write_sets_ and only one thread owns each address
+    WriteSet *theirDS = myDS->thread_write_sets[i];
     if (!theirDS) {
       throw std::runtime_error("merged address not found in remote thread's write sets");
     }
-    for(AddressSet::iterator it = theirDS->set.begin(); it != theirDS->set.end(); ++it) {
-      assert(*it != address);
-      myDS->set.insert(*it);
+    if (myDS->sketch != NULL) {
+      // merging the same registers again later is harmless, so no need to clear them
+      myDS->sketch->Merge(*theirDS->sketch);
+      continue;
     }
-    theirDS->set.clear();
+    assert(!theirDS->set.Contains(BlockNumber(address)));
+    myDS->set.UnionWith(theirDS->set);
+    theirDS->set.Clear();
   }
 }
 
@@ -420,14 +753,7 @@ void ParallelSampledStack::MergeInvalidationsList(DistanceSet *myDS, int thread)
     // creation_time now holds the total time (access count) in the respective thread
     total_lifetime += ws->creation_time;
     assert(ws->sample_addr == address && ws->owner == myDS);
-    for(AddressSet::iterator it = ws->set.begin(); it != ws->set.end(); ++it) {
-      assert(*it != address);
-      if (myDS->set.count(*it) > 0) {
-        //threads_[thread]->invalidation_count_++;//race condition here. ignore it rather than sync
-        myDS->set.erase(*it);
-        myDS->holes++;
-      }
-    }
+    threads_[thread]->RemoveAddresses(myDS, ws->set);
     WriteSet *f = ws;
     ws = ws->next;
     delete f;
@@ -446,9 +772,11 @@ void ParallelSampledStack::MergeDistanceSetsList(DistanceSet *myDS, int thread)
     // creation_time now holds the total time (access count) in the respective thread
     total_lifetime += mds->creation_time;
     assert(mds->sample_addr == address && mds->owner == myDS);
-    for(AddressSet::iterator it = mds->set.begin(); it != mds->set.end(); ++it) {
-      assert(*it != address);
-      myDS->set.insert(*it);
+    assert(!mds->set.Contains(BlockNumber(address)));
+    if (myDS->sketch != NULL) {
+      myDS->sketch->Merge(*mds->sketch);
+    } else {
+      myDS->set.UnionWith(mds->set);
     }
     WriteSet *f = mds;
     mds = mds->next;
@@ -462,23 +790,13 @@ void ParallelSampledStack::RemoveWriteSetFromAll(DistanceSet *ds, int thread) {
   //fprintf(stderr, "%d removing %ld for %d gen %d\n", threadid_, address, threadid, global_rw_->barrier.generation_);
   // remove the finalized sample from everyone's write set lists
   for (int i = threads_.GetNextIndex(thread); i != thread; i = threads_.GetNextIndex(i)) {
-    WriteSet *prevWS = NULL;
-    LockHolder lh(&threads_[i]->write_set_lock_);
-    WriteSet *ws = threads_[i]->write_sets_;
-    while (ws && !(ws->sample_addr == ds->sample_addr && ws->owner == ds)) {
-      prevWS = ws;
-      ws = ws->next;
-    }
+    WriteSet *ws = ds->thread_write_sets[i];
     if (!ws) {
       throw std::runtime_error("finalized address not found in remote write set");
     }
-    //unlink from write set
-    if (prevWS == NULL) {
-      threads_[i]->write_sets_ = ws->next;
-    }
-    else {
-      prevWS->next = ws->next;
-    }
+    ds->thread_write_sets[i] = NULL;
+    LockHolder lh(&threads_[i]->write_set_lock_);
+    threads_[i]->UnlinkWriteSet(ws);
     //calculate reference lifetime in thread i
     ws->creation_time = threads_[i]->sampled_access_count_ - ws->creation_time;
     //link into to-merge list
@@ -492,8 +810,9 @@ void ParallelSampledStack::RemoveWriteSetFromAll(DistanceSet *ds, int thread) {
 // if my reuse, already pulled from other write sets
 // if discovered overwrite, have not
 void ParallelSampledStack::FinalizeSample(int thread, DistanceSet *myDS, address_t PC) {
+  // asynchronous mode retires the write sets afterwards
   if (myDS->write_sets == NULL)
-      assert(threads_.GetThreadCount() == 1);
+      assert(threads_.GetThreadCount() == 1 || async_ != NULL);
   if (stack_type_ == kPrivateStacks) MergeInvalidationsList(myDS, thread);
   else MergeDistanceSetsList(myDS, thread);
   acc_count_t distance;
@@ -502,7 +821,7 @@ void ParallelSampledStack::FinalizeSample(int thread, DistanceSet *myDS, address
   } else if( myDS->finalize == DistanceSet::kPruneFinalize) {
     distance = kColdMiss;
   } else {
-    distance = myDS->set.size() + myDS->holes;
+    distance = threads_[thread]->Distance(myDS);
   }
 
   if (myDS->finalize == DistanceSet::kInvalidateFinalize) threads_[thread]->invalidation_count_++;
@@ -513,17 +832,15 @@ void ParallelSampledStack::FinalizeSample(int thread, DistanceSet *myDS, address
   threads_[thread]->reference_lifetime_total_ +=
       threads_[thread]->sampled_access_count_ - myDS->creation_time;
 
-  RdaGetLock(&global_rw_->stats_lock);
-  global_rw_->pc_stats.AddSample(PC, distance);
+  // this thread's shard, whichever thread owns the sample
+  pc_stats_->all.AddSample(PC, distance);
   if (!myDS->final_ref_is_write) {
-    global_rw_->read_pc_stats.AddSample(PC, distance);
+    pc_stats_->reads.AddSample(PC, distance);
   }
-  RdaReleaseLock(&global_rw_->stats_lock);
 
   //fprintf(stderr, "%d finalized %ld for %d gen %d\n", threadid_,
   //        address, thread, global_rw_->barrier.generation_);
   AtomicDecrement(&global_rw_->active_sample_count);
-  //RdaReleaseLock(&global_rw_->stats_lock);
 #ifdef UNITTEST
   global_rw_->last_finalized_distance = distance;
 #endif
@@ -537,8 +854,7 @@ bool ParallelSampledStack::CheckOldestSample() {
   if(private_stats_.GetTotalSamples() > kPruneSampleThreshold) {
     if(oldest_distance_set_ != NULL &&
        oldest_distance_set_->finalize == DistanceSet::kActive &&
-       (static_cast<acc_count_t>(oldest_distance_set_->set.size()) + oldest_distance_set_->holes >
-         private_stats_.GetTargetSize(kPruneTarget))) {
+       Distance(oldest_distance_set_) > private_stats_.GetTargetSize(kPruneTarget)) {
       oldest_distance_set_->finalize = DistanceSet::kPruneFinalize;
       prune_count_++;
       return true;
@@ -554,11 +870,11 @@ int ParallelSampledStack::RecordLeftovers() {
     DistanceSet *ds = threads_[i]->distance_sets_;
     while(ds) {
       printf(" %"PRIaddr" dist %"PRIacc" lifetime %.2f%% of run, ", ds->sample_addr * block_bytes_,
-             ds->set.size() + ds->holes,
+             threads_[i]->Distance(ds),
              (threads_[i]->sampled_access_count_ - ds->creation_time)
                / static_cast<double>(threads_[i]->sampled_access_count_) * 100.0 );
       threads_[i]->private_stats_.AddSample(ds->sample_addr, kColdMiss);
-      global_rw_->pc_stats.AddSample(ds->final_pc, kColdMiss);
+      threads_[i]->pc_stats_->all.AddSample(ds->final_pc, kColdMiss);
       leftovers++;
       ds = ds->next;
     }
@@ -573,6 +889,7 @@ int64_t ParallelSampledStack::DumpStatsPython(const std::string &extra) {
     printf("ParallelSampledStack not initialized!\n");
     return -1;
   }
+  Quiesce();
   int leftover_addresses = RecordLeftovers();
   //combine stats
   int64_t addresses_per_sample_total = 0;
@@ -601,49 +918,71 @@ int64_t ParallelSampledStack::DumpStatsPython(const std::string &extra) {
     }
     lifetime_total += threads_[i]->reference_lifetime_total_;
   }
-  fprintf(output_file_, "#librda version %s\n", LIBRDA_GIT_VERSION);
-  fprintf(output_file_, "#Enabled samples %"PRIacc", average addresses per enabled sample %.2f\n",
-          sampled_access_count, addresses_per_sample_total / static_cast<double>(sampled_access_count));
-  fprintf(output_file_, "#Synchronization count %ld\n", synchronization_count);
+  StatsWriter out(output_file_);
+  out.Printf("#librda version %s\n", LIBRDA_GIT_VERSION);
+  out.Printf("#Enabled samples %"PRIacc", average addresses per enabled sample %.2f\n",
+             sampled_access_count, addresses_per_sample_total / static_cast<double>(sampled_access_count));
+  out.Printf("#Synchronization count %ld\n", synchronization_count);
   if (stack_type_ == kSharedStacks) {
-    fprintf(output_file_, "#Using shared stacks\n");
+    out.Write("#Using shared stacks\n");
+  }
+  if (sketches_) {
+    out.Write("#Distances estimated with sketches\n");
   }
-  fprintf(output_file_, "singleStacks = {}\nsimStacks = {}\ndelayStacks = {}\n"
-          "preStacks = {}\nsimSharedStack = {}\n");
+  out.Write("singleStacks = {}\nsimStacks = {}\ndelayStacks = {}\n"
+            "preStacks = {}\nsimSharedStack = {}\n");
   // convert leftover addresses?
-  fprintf(output_file_, "pairStacks = {}\n");
-  fprintf(output_file_, "cacheHits = {}\npairHits = {}\nshareHits = {}\n");
+  out.Write("pairStacks = {}\n");
+  out.Write("cacheHits = {}\npairHits = {}\nshareHits = {}\n");
   for (int thread = 0; thread < threads_.GetThreadCount(); thread++) {
     if (stack_type_ == kPrivateStacks) {
-      fprintf(output_file_, "#rddata simStacks[%d] = ", thread);
+      out.Printf("#rddata simStacks[%d] = ", thread);
     } else {
-      fprintf(output_file_, "#rddata simSharedStack[%d] = ", thread);
+      out.Printf("#rddata simSharedStack[%d] = ", thread);
     }
     // reusestack-like output
-    fprintf(output_file_, "{");
-    fprintf(output_file_, "'histogram':%s,", threads_[thread]->private_stats_.GetHistogramString().c_str());
+    out.Write("{");
+    out.Write("'histogram':");
+    threads_[thread]->private_stats_.WriteHistogram(&out);
+    out.Write(",");
     //  attributes
     //fprintf(output_file_, "{'sampledAddresses':%"PRIacc", ", sampled_address_count_[thread]);
-    fprintf(output_file_, "'attributes':{'accessCount':%"PRIacc", ", threads_[thread]->private_stats_.GetTotalSamples());
-    fprintf(output_file_, "'blockAccessCount':%"PRIacc", ", threads_[thread]->private_stats_.GetTotalSamples());
-    fprintf(output_file_, "'addrPerSamp':%.2f, ",
-            threads_[thread]->addresses_per_sample_total_ /
-            static_cast<double>(threads_[thread]->sampled_access_count_));
-    fprintf(output_file_, "'limitCount': %"PRIacc", ", threads_[thread]->prune_count_);
-    fprintf(output_file_, "'invalidationCount': %"PRIacc", ",threads_[thread]->invalidation_count_);
-    fprintf(output_file_, "%s", threads_[thread]->private_stats_.GetAttributes().c_str());
-    fprintf(output_file_, "},");  // end attribute dict
+    out.Printf("'attributes':{'accessCount':%"PRIacc", ", threads_[thread]->private_stats_.GetTotalSamples());
+    out.Printf("'blockAccessCount':%"PRIacc", ", threads_[thread]->private_stats_.GetTotalSamples());
+    out.Printf("'addrPerSamp':%.2f, ",
+               threads_[thread]->addresses_per_sample_total_ /
+               static_cast<double>(threads_[thread]->sampled_access_count_));
+    out.Printf("'limitCount': %"PRIacc", ", threads_[thread]->prune_count_);
+    out.Printf("'invalidationCount': %"PRIacc", ",threads_[thread]->invalidation_count_);
+    threads_[thread]->private_stats_.WriteAttributes(&out);
+    out.Write("},");  // end attribute dict
     //new read histogram
-    fprintf(output_file_, "'read_histo':{'histogram':%s, 'attributes':{%s}}, ",
-        threads_[thread]->private_read_stats_.GetHistogramString().c_str(),
-        threads_[thread]->private_read_stats_.GetAttributes().c_str());
-    fprintf(output_file_, "}\n");
+    out.Write("'read_histo':{'histogram':");
+    threads_[thread]->private_read_stats_.WriteHistogram(&out);
+    out.Write(", 'attributes':{");
+    threads_[thread]->private_read_stats_.WriteAttributes(&out);
+    out.Write("}}, ");
+    out.Write("}\n");
     //threads_[i]->private_stats_.DumpStatistics();
   }
 
-  fprintf(output_file_, "PCDist = %s\n", global_rw_->pc_stats.GetStatsString().c_str());
-  fprintf(output_file_, "PCDistRead = %s\n", global_rw_->read_pc_stats.GetStatsString().c_str());
-  fprintf(output_file_, "%s", extra.c_str());
+  PCStats pc_stats;
+  PCStats read_pc_stats;
+  MergePCStats(&pc_stats, &read_pc_stats);
+  out.Write("PCDist = ");
+  pc_stats.WriteStats(&out);
+  out.Write("\nPCDistRead = ");
+  read_pc_stats.WriteStats(&out);
+  out.Write("\n");
+  if (pc_stats.IsBounded()) {
+    out.Write("PCDistOther = ");
+    pc_stats.WriteOtherStats(&out);
+    out.Write("\nPCDistReadOther = ");
+    read_pc_stats.WriteOtherStats(&out);
+    out.Write("\n");
+  }
+  out.Write(extra);
+  out.Flush();
 
   printf("Enabled sampling accesses %"PRIacc", average addresses per enabled sample %.2f\n",
             sampled_access_count, addresses_per_sample_total / static_cast<double>(sampled_access_count));
@@ -659,22 +998,375 @@ int64_t ParallelSampledStack::DumpStatsPython(const std::string &extra) {
 }
 
 const DistanceSet *ParallelSampledStack::GetDS(address_t address) {
-  DistanceSet *ds = distance_sets_;
-  while (ds && ds->sample_addr != GetBlock(address)) ds = ds->next;
-  return ds;
+  int sample = samples_.Find(GetBlock(address));
+  return sample < 0 ? NULL : samples_.entry(sample);
 }
 
-void ParallelSampledStack::ValidateActiveSamples(bool has_new) {
-  int sample_count = 0;
-  for (int i = 0; i < threads_.GetThreadCount(); i++) {
-    DistanceSet *ds = threads_[i]->distance_sets_;
-    while (ds) {
-      sample_count++;
-      ds = ds->next;
+acc_count_t ParallelSampledStack::LastAccess(address_t address) const {
+  AddressTimes::const_iterator last = last_access_.find(address);
+  return last == last_access_.end() ? 0 : last->second;
+}
+
+void ParallelSampledStack::RecordAccess(address_t address) {
+  std::pair<AddressTimes::iterator, bool> last =
+      last_access_.insert(std::make_pair(address, sampled_access_count_));
+  if (!last.second) {
+    access_times_.Remove(last.first->second);
+    last.first->second = sampled_access_count_;
+  }
+  access_times_.Append(sampled_access_count_);
+}
+
+// This thread's distinct addresses since the sample's creation, adjusted by what the other
+// threads did: their accesses for shared stacks, their invalidations for private stacks.
+acc_count_t ParallelSampledStack::SetSize(const DistanceSet *ds) const {
+  acc_count_t size = OwnCount(ds);
+  // (a retiring sample's blocks this thread touched after it started retiring count as its own)
+  if (stack_type_ == kPrivateStacks) {
+    for (AddressTimes::const_iterator it = ds->removed.begin(); it != ds->removed.end(); ++it) {
+      if (LastAccess(it->first) == it->second) size--;
+    }
+  } else {
+    for (BlockSet::const_iterator it = ds->set.begin(); it != ds->set.end(); ++it) {
+      if (LastAccess(BlockAddress(*it)) <= ds->creation_time) size++;
+    }
+  }
+  return size;
+}
+
+// This thread's distinct addresses since the sample's creation
+acc_count_t ParallelSampledStack::OwnCount(const DistanceSet *ds) const {
+  if (ds->retiring) return ds->own_count;
+  acc_count_t count = access_times_.CountAfter(ds->creation_time);
+  // the reuse itself is an access after the creation
+  if (ds->finalize == DistanceSet::kReuseFinalize) count--;
+  return count;
+}
+
+// Between merges the set only grows, so the peak over its lifetime is the larger of the peak
+// before the last merge and the current size
+acc_count_t ParallelSampledStack::Distance(const DistanceSet *ds) const {
+  if (stack_type_ == kPrivateStacks) return std::max(ds->peak, SetSize(ds));
+  if (ds->sketch != NULL) return SketchDistance(ds);
+  return SetSize(ds);
+}
+
+// Sketch mode: the other threads' addresses in the sample's sketch, plus this thread's since
+// the creation (already in the sketch once the sample retires)
+acc_count_t ParallelSampledStack::SketchDistance(const DistanceSet *ds) const {
+  acc_count_t estimate;
+  if (ds->retiring) {
+    estimate = ds->sketch->Estimate();
+  } else {
+    DistinctSketch all(*ds->sketch);
+    own_sketch_->MergeSince(ds->creation_time, &all);
+    estimate = all.Estimate();
+  }
+  // the reuse itself is an access after the creation
+  if (ds->finalize == DistanceSet::kReuseFinalize && estimate > 0) estimate--;
+  return estimate;
+}
+
+// add a write set for another thread's sample; the caller holds write_set_lock_ if needed
+void ParallelSampledStack::LinkWriteSet(WriteSet *ws) {
+  ws->slot = static_cast<int>(write_sets_.size());
+  write_sets_.push_back(ws);
+  remote_samples_.Add(ws->sample_addr, ws);
+}
+
+// remove a write set in O(1) by moving the last one into its slot
+void ParallelSampledStack::UnlinkWriteSet(WriteSet *ws) {
+  assert(ws->slot >= 0 && write_sets_[ws->slot] == ws);
+  WriteSet *last = write_sets_.back();
+  write_sets_[ws->slot] = last;
+  last->slot = ws->slot;
+  write_sets_.pop_back();
+  ws->slot = -1;
+  remote_samples_.Remove(ws);
+}
+
+// Private stacks: takes the addresses other threads wrote out of the sample's set
+void ParallelSampledStack::RemoveAddresses(DistanceSet *ds, const BlockSet &blocks) {
+  ds->peak = std::max(ds->peak, SetSize(ds));
+  for (AddressTimes::iterator it = ds->removed.begin(); it != ds->removed.end(); ) {
+    if (LastAccess(it->first) != it->second) {
+      ds->removed.erase(it++);  // accessed again since
+    } else {
+      ++it;
     }
   }
+  for (BlockSet::const_iterator it = blocks.begin(); it != blocks.end(); ++it) {
+    address_t address = BlockAddress(*it);
+    assert(address != ds->sample_addr);
+    acc_count_t time = LastAccess(address);
+    if (time > ds->creation_time) ds->removed[address] = time;
+  }
+}
+
+void ParallelSampledStack::ValidateActiveSamples(bool has_new) {
+  // every thread runs this in every round, so use the running count rather than walk the lists
+  int sample_count = global_rw_->linked_samples;
   if (global_rw_->active_sample_count > sample_count + threads_.GetThreadCount() + has_new + 1) {
     throw std::runtime_error("sample count mismatch");
     //printf("sample count mismatch\n");
   }
 }
+
+void ParallelSampledStack::Quiesce() {
+  if (async_ == NULL) return;
+  // done once a round over all threads finds nothing to do with the helper idle
+  bool busy = true;
+  while (busy) {
+    WaitForHelper();
+    busy = false;
+    for (int i = 0; i < threads_.GetThreadCount(); i++) {
+      if (threads_[i]->PublishEpoch()) busy = true;
+    }
+  }
+}
+
+// Takes this thread's mail and sends what its write sets collected to the helper. Returns
+// true if there was anything to do.
+bool ParallelSampledStack::PublishEpoch() {
+  bool busy = false;
+  MergeMessage *message = mailbox_.TakeAll();
+  while (message != NULL) {
+    MergeMessage *next = message->next;
+    HandleMessage(message);
+    message = next;
+    busy = true;
+  }
+  MergeMessage *newest = NULL;
+  MergeMessage *oldest = NULL;
+  int count = 0;
+  for (size_t i = 0; i < write_sets_.size(); i++) {
+    WriteSet *ws = write_sets_[i];
+    // a sketch gets every access, so it only has news if there were any
+    if (ws->sketch != NULL ? epoch_accesses_ == 0 : ws->set.empty()) continue;
+    WriteSet *blocks = new WriteSet(ws->sample_addr, ws->owner, ws->owner_thread);
+    if (ws->sketch != NULL) {
+      blocks->sketch = ws->sketch;
+      ws->sketch = NewSketch();
+    } else {
+      blocks->set.Swap(ws->set);
+    }
+    MergeMessage *contribution = new MergeMessage(MergeMessage::kContribution, ws->owner);
+    contribution->ws = blocks;
+    contribution->next = newest;
+    newest = contribution;
+    if (oldest == NULL) oldest = contribution;
+    count++;
+  }
+  epoch_accesses_ = 0;
+  if (count != 0) {
+    PostToHelper(newest, oldest, count);
+    busy = true;
+  }
+  return busy;
+}
+
+void ParallelSampledStack::HandleMessage(MergeMessage *message) {
+  DistanceSet *ds = message->ds;
+  switch (message->type) {
+    case MergeMessage::kAddWriteSet:
+      message->ws->creation_time = sampled_access_count_;
+      ds->thread_write_sets[threadid_] = message->ws;
+      LinkWriteSet(message->ws);
+      break;
+    case MergeMessage::kRetireWriteSet: {
+      // only this thread touches its own entry, so no lock is needed
+      WriteSet *ws = ds->thread_write_sets[threadid_];
+      if (ws == NULL) throw std::runtime_error("retired sample not found in write sets");
+      ds->thread_write_sets[threadid_] = NULL;
+      UnlinkWriteSet(ws);  // its sample may be out of remote_samples_ already, after a finalize request
+      // what it collected goes into the final merge
+      MergeMessage *reply = new MergeMessage(MergeMessage::kRetired, ds);
+      reply->ws = ws;
+      PostToHelper(reply, reply, 1);
+      break;
+    }
+    case MergeMessage::kMergeResult:
+      MergeBlocks(ds, message->ws);
+      delete message->ws;
+      break;
+    case MergeMessage::kFinalizeRequest:
+      // there can be several, and they can cross with the sample's own finalization
+      if (ds->finalize == DistanceSet::kActive) {
+        ds->finalize = message->status;
+        ds->final_pc = message->pc;
+        ds->final_ref_is_write = message->is_write;
+        RetireSample(ds);
+      }
+      break;
+    case MergeMessage::kRetireDone:
+      // the final merge; no other thread refers to the sample any more
+      if (message->ws != NULL) {
+        MergeBlocks(ds, message->ws);
+        delete message->ws;
+      }
+      FinalizeSample(threadid_, ds, ds->final_pc);
+      delete ds;
+      break;
+    default:
+      throw std::runtime_error("unexpected merge message for an application thread");
+  }
+  delete message;
+}
+
+// Starts finalizing one of this thread's samples: it stops counting this thread's accesses, and
+// the helper collects the other threads' write sets for the final merge
+void ParallelSampledStack::RetireSample(DistanceSet *ds) {
+  ds->own_count = OwnCount(ds);
+  if (ds->sketch != NULL) own_sketch_->MergeSince(ds->creation_time, ds->sketch);
+  ds->retiring = true;
+  DistanceSet *prev = NULL;
+  for (DistanceSet *it = distance_sets_; it != ds; it = it->next) prev = it;
+  if (oldest_distance_set_ == ds) oldest_distance_set_ = prev;
+  if (prev == NULL) {
+    distance_sets_ = ds->next;
+  } else {
+    prev->next = ds->next;
+  }
+  samples_.Remove(ds);
+  AtomicDecrement(&global_rw_->linked_samples);
+  MergeMessage *message = new MergeMessage(MergeMessage::kFinalized, ds);
+  PostToHelper(message, message, 1);
+}
+
+void ParallelSampledStack::MergeBlocks(DistanceSet *ds, const WriteSet *blocks) {
+  if (stack_type_ == kPrivateStacks) {
+    RemoveAddresses(ds, blocks->set);
+  } else if (ds->sketch != NULL) {
+    ds->sketch->Merge(*blocks->sketch);
+  } else {
+    ds->set.UnionWith(blocks->set);
+  }
+}
+
+void ParallelSampledStack::PostToHelper(MergeMessage *newest, MergeMessage *oldest, int count) {
+  __sync_add_and_fetch(&async_->in_flight, count);
+  async_->mailbox.Post(newest, oldest);
+}
+
+void ParallelSampledStack::PostToThread(int thread, MergeMessage *message) {
+  threads_[thread]->mailbox_.Post(message);
+}
+
+void *ParallelSampledStack::HelperMain(void *arg) {
+  RunHelper();
+  return NULL;
+}
+
+void ParallelSampledStack::RunHelper() {
+  for (int spins = 0; ; spins++) {
+    MergeMessage *message = async_->mailbox.TakeAll();
+    if (message == NULL) {
+      if (async_->stop) break;
+      SpscRing<MergeMessage *>::Wait(spins);
+      continue;
+    }
+    spins = 0;
+    int taken = 0;
+    for (MergeMessage *m = message; m != NULL; m = m->next) taken++;
+    if (!async_->failed) {
+      try {
+        while (message != NULL) {
+          MergeMessage *next = message->next;
+          HandleHelperMessage(message);
+          message = next;
+        }
+        ForwardMergeResults();
+      } catch (std::exception &e) {
+        // the rest of the work is dropped; Quiesce reports it
+        async_->error = e.what();
+        async_->failed = true;
+      }
+    }
+    __sync_sub_and_fetch(&async_->in_flight, taken);
+  }
+}
+
+void ParallelSampledStack::HandleHelperMessage(MergeMessage *message) {
+  AsyncMergeState *state = async_;
+  DistanceSet *ds = message->ds;
+  switch (message->type) {
+    case MergeMessage::kNewThread:
+      // threads join in tid order; the new one needs write sets for the active samples
+      state->threads = message->thread + 1;
+      for (SampleProgressMap::iterator it = state->samples.begin();
+           it != state->samples.end(); ++it) {
+        if (it->second.finalized) continue;
+        SendWriteSet(message->thread, it->first, it->second.owner);
+        it->second.write_sets++;
+      }
+      break;
+    case MergeMessage::kNewSample: {
+      SampleProgress &progress = state->samples[ds];
+      progress.owner = message->thread;
+      for (int t = 0; t < state->threads; t++) {
+        if (t == progress.owner) continue;
+        SendWriteSet(t, ds, progress.owner);
+        progress.write_sets++;
+      }
+      break;
+    }
+    case MergeMessage::kContribution: {
+      SampleProgress &progress = FindProgress(state, ds);
+      if (progress.pending == NULL && !progress.finalized) state->dirty.push_back(ds);
+      AddPending(&progress, message->ws);
+      break;
+    }
+    case MergeMessage::kFinalized:
+    case MergeMessage::kRetired: {
+      SampleProgress &progress = FindProgress(state, ds);
+      if (message->type == MergeMessage::kFinalized) {
+        progress.finalized = true;
+        for (int t = 0; t < state->threads; t++) {
+          if (t != progress.owner) {
+            PostToThread(t, new MergeMessage(MergeMessage::kRetireWriteSet, ds));
+          }
+        }
+      } else {
+        AddPending(&progress, message->ws);
+        progress.write_sets--;
+      }
+      if (progress.finalized && progress.write_sets == 0) {
+        // everything is in: the owner does the final merge and frees the sample
+        MergeMessage *done = new MergeMessage(MergeMessage::kRetireDone, ds);
+        done->ws = progress.pending;
+        PostToThread(progress.owner, done);
+        state->samples.erase(ds);
+      }
+      break;
+    }
+    default:
+      throw std::runtime_error("unexpected merge message for the merge helper");
+  }
+  delete message;
+}
+
+void ParallelSampledStack::SendWriteSet(int thread, DistanceSet *ds, int owner) {
+  MergeMessage *message = new MergeMessage(MergeMessage::kAddWriteSet, ds);
+  message->ws = new WriteSet(ds->sample_addr, ds, owner);
+  message->ws->sketch = NewSketch();
+  PostToThread(thread, message);
+}
+
+// Sends the blocks combined from this batch's contributions to the samples' owners
+void ParallelSampledStack::ForwardMergeResults() {
+  for (size_t i = 0; i < async_->dirty.size(); i++) {
+    SampleProgressMap::iterator it = async_->samples.find(async_->dirty[i]);
+    if (it == async_->samples.end() || it->second.pending == NULL) continue;
+    if (it->second.finalized) continue;  // goes with the final merge
+    MergeMessage *message = new MergeMessage(MergeMessage::kMergeResult, it->first);
+    message->ws = it->second.pending;
+    it->second.pending = NULL;
+    PostToThread(it->second.owner, message);
+  }
+  async_->dirty.clear();
+}
+
+void ParallelSampledStack::WaitForHelper() {
+  for (int spins = 0; async_->in_flight != 0; spins++) SpscRing<MergeMessage *>::Wait(spins);
+  if (async_->failed) throw std::runtime_error("merge helper failed: " + async_->error);
+}
@@ -10,33 +10,39 @@
 
 #include <stdio.h>
 #include <string>
-#include <tr1/unordered_set>
+#include <vector>
+#include <tr1/unordered_map>
+#include "blockset.h"
+#include "distinctsketch.h"
+#include "livetimestamps.h"
+#include "mailbox.h"
+#include "pageownershiptable.h"
 #include "rda-sync.h"
 #include "reusestack-common.h"
 #include "reusestackstats.h"
+#include "sampletable.h"
 #include "trace.h"
 
 #define CACHE_LINE_SIZE 64
-#define DISTANCE_SET_INIT_BUCKETS 4000
-#define WRITE_SET_INIT_BUCKETS 400
 
 // put shared writeable global data in a struct to control the layout (well, control it better)
 struct PssGlobalData {
   PssGlobalData() : thread_count(0), synchronize(false), finalize_needed(false),
-      merge_needed(false), barrier(),
+      merge_needed(false), batched_work(0), barrier(),
 #if defined(UNITTEST)
       last_finalized_distance(0),
 #endif
-      active_sample_count(0) {
+      active_sample_count(0), linked_samples(0) {
     RdaInitLock(&threads_lock);
-    RdaInitLock(&stats_lock);
   }
     RdaLock threads_lock;
     int thread_count;
     volatile int synchronize;
     volatile int finalize_needed;
     volatile int merge_needed;
-    char buf1[CACHE_LINE_SIZE - sizeof(RdaLock) - sizeof(int) - sizeof(int) - sizeof(int)];
+    volatile int batched_work;  ///< samples and finalizations queued in batched mode
+    char buf1[CACHE_LINE_SIZE - sizeof(RdaLock) - sizeof(int) - sizeof(int) - sizeof(int)
+              - sizeof(int)];
   //MultistageBarrier<3> barrier __attribute__((aligned(64)));
 #if !defined(UNITTEST) && !defined(SEQUENTIAL)
   MultistageBarrier barrier __attribute__((aligned(64)));
@@ -49,46 +55,98 @@ struct PssGlobalData {
   //Barrier barrier2 __attribute__((aligned(64)));
   //char buf3[CACHE_LINE_SIZE - sizeof(Barrier)];
   volatile int active_sample_count __attribute__((aligned(64)));
+  volatile int linked_samples;  ///< distance sets in the threads' lists
   //char buf4[CACHE_LINE_SIZE - sizeof(int)];
-  RdaLock stats_lock __attribute__((aligned(64)));
-  //ReuseStackStats stats;
-  PCStats pc_stats;
-  PCStats read_pc_stats;
+};
+
+// One thread's per-PC statistics. Only its thread adds samples, so it needs no lock; the
+// shards are merged for output, and the PC stats limit only applies to the merged stats.
+// Allocated on its own cache line, and the padding keeps the next allocation off its
+// last one.
+struct PCStatsShard {
+  PCStats all;
+  PCStats reads;  ///< samples whose final reference was a read
+  char pad[CACHE_LINE_SIZE];
 };
 
 class ParallelSampledStack;
-typedef std::tr1::unordered_set<address_t> AddressSet;
+typedef std::tr1::unordered_map<address_t, acc_count_t> AddressTimes;
 struct WriteSet;
 
+// The owning thread's own accesses since creation_time are counted with its last-access index
+// (see ParallelSampledStack::SetSize), so only what other threads contribute is kept here
 struct DistanceSet {
   enum FinalizeStatus { kActive = 0, kReuseFinalize, kInvalidateFinalize,
                         kPruneFinalize, kRemoteReuseFinalize };
-  explicit DistanceSet(address_t addr) : sample_addr(addr), set(DISTANCE_SET_INIT_BUCKETS), holes(0),
-      finalize(kActive), final_pc(0), write_sets(NULL), next(NULL) {}
-  ~DistanceSet() {next = NULL; write_sets = (WriteSet *)-1; finalize = (FinalizeStatus)-2;}
+  explicit DistanceSet(address_t addr) : sample_addr(addr), sketch(NULL), peak(0),
+      own_count(0), retiring(false), batched(false), finalize(kActive), final_pc(0),
+      write_sets(NULL), next(NULL) {}
+  ~DistanceSet() {
+    delete sketch;
+    next = NULL; write_sets = (WriteSet *)-1; finalize = (FinalizeStatus)-2;
+  }
   const address_t sample_addr;
-  AddressSet set;
-  int holes;
+  BlockSet set;  ///< block numbers of other threads' accesses merged in (shared stacks)
+  // sketch mode (shared stacks): the other threads' addresses merged in, in place of 'set'. The
+  // owner's own come from its sliding sketch, and are added here when the sample retires.
+  DistinctSketch *sketch;
+  // private stacks: addresses invalidated by other threads, with the owner's access time they
+  // invalidated (a later access puts them back), and the largest set size before any merge.
+  // Invalidations leave holes, so the distance never drops below the peak.
+  AddressTimes removed;
+  acc_count_t peak;
+  // asynchronous and batched modes: the owner's part, fixed when finalization starts; the
+  // other threads' write sets arrive later
+  acc_count_t own_count;
+  bool retiring;
+  // batched mode: queued for the next synchronization round, which gives the other threads
+  // write sets starting at their access counts at creation
+  bool batched;
+  std::vector<acc_count_t> thread_times;
   acc_count_t creation_time; //creation time measured in references, also holds lifetime in finalize
   // used for finalizing
   FinalizeStatus finalize;
   address_t final_pc; // PC of the finalizing access. for pruned/cold referenes, use the initial PC
   bool final_ref_is_write;
   WriteSet *write_sets; // link to a chain of write sets, used for finalizing
+  std::vector<WriteSet *> thread_write_sets;  ///< its write set in each other thread, by id
   // for distance_sets_ list
   DistanceSet *next;
 };
 
 struct WriteSet {
-  WriteSet(address_t addr, DistanceSet *owning_ds) : sample_addr(addr), set(WRITE_SET_INIT_BUCKETS),
-      owner(owning_ds), next(NULL) {}
+  WriteSet(address_t addr, DistanceSet *owning_ds, int owning_thread) : sample_addr(addr),
+      sketch(NULL), owner(owning_ds), owner_thread(owning_thread), slot(-1), next(NULL) {}
+  ~WriteSet() { delete sketch; }
   address_t sample_addr;
-  AddressSet set;
+  BlockSet set;  ///< block numbers this thread accessed (or wrote, for private stacks)
+  DistinctSketch *sketch;  ///< replaces 'set' in sketch mode
   acc_count_t creation_time;
   DistanceSet *owner;
+  int owner_thread;
+  int slot;  ///< index in the holding thread's write_sets_
   WriteSet *next;
 };
 
+// Asynchronous mode (see ParallelSampledStack::SetAsyncMerging): work passed between the
+// application threads and the merge helper thread through their mailboxes
+struct MergeMessage {
+  enum Type { kNewThread, kNewSample, kAddWriteSet, kContribution, kMergeResult,
+              kFinalizeRequest, kFinalized, kRetireWriteSet, kRetired, kRetireDone };
+  MergeMessage(Type message_type, DistanceSet *sample) : type(message_type), ds(sample),
+      ws(NULL), thread(-1), status(DistanceSet::kActive), pc(0), is_write(false), next(NULL) {}
+  Type type;
+  DistanceSet *ds;
+  WriteSet *ws;  ///< a write set to link, or blocks to merge
+  int thread;  ///< kNewThread: the new thread; kNewSample: the owner
+  // kFinalizeRequest
+  DistanceSet::FinalizeStatus status;
+  address_t pc;
+  bool is_write;
+  MergeMessage *next;
+};
+struct AsyncMergeState;
+
 #define DEBUG
 class EventBuffer {
 public:
@@ -118,13 +176,43 @@ public:
   const static int kDefaultGranularity = 64;
   const static int kDefaultThreads = 4;
   friend class ParallelSampledStackTest;
+  // 'threads' is the most threads the tool will run (at least 16 are always allowed); the
+  // per-thread state is sized for it here
   static bool Initialize(const std::string &output_filename, int granularity,
                          int threads, StackType stack_type);
   static void CleanUp();
   static void SetGlobalEnable(bool enable) { global_enabled_ = enable; }
+  static void SetPCStatsLimit(int limit);// must be called after Initialize
+  // Combines the threads' PC statistics into 'all' and 'reads' and then applies the PC stats
+  // limit to them. No thread may be finalizing samples meanwhile: call it between
+  // synchronization rounds, or after Quiesce.
+  static void MergePCStats(PCStats *all, PCStats *reads);
+  // Estimate shared-stack distances with fixed-size sketches (see DistinctSketch) instead of
+  // exact sets. Must be called after Initialize and before any thread stack exists; throws
+  // std::invalid_argument for private stacks, whose holes need exact per-address times.
+  static void SetDistanceSketches(bool enable);
+  // Replace the stop-the-world synchronization with epochs: samples are announced and
+  // finalized through mailboxes, a helper thread combines what the write sets collected, and
+  // each thread takes its mail at its next access and hands over its write sets every
+  // kEpochAccesses accesses (or on MergeAllSamples). No thread waits for another, so a
+  // distance can be off by the few accesses made while a sample's messages are in flight.
+  // Must be called after Initialize and before any thread stack exists.
+  static void SetAsyncMerging(bool enable);
+  // Keep the barrier, but queue new samples and this thread's own reuses and handle them all
+  // in one synchronization round once a thread has made kBatchAccesses accesses since the
+  // first was queued, or kMaxBatchSamples samples are queued on one thread. Each thread logs
+  // its last kRecentAccesses accesses that write sets would see, and the round replays them
+  // into the new write sets, so samples still count from their creation. Reused samples are
+  // charged the other threads' accesses up to the round. Must be called after Initialize and
+  // before any thread stack exists; not together with SetAsyncMerging.
+  static void SetSampleBatching(bool enable);
+  // Asynchronous mode: settles all outstanding work, so the stats are complete. The
+  // application threads must be stopped; runs their epochs on their behalf.
+  static void Quiesce();
   static ParallelSampledStack * GetThreadStack(int thread);
   void MergeAllSamples();
   static int64_t DumpStatsPython(const std::string &extra);//fully synchronized, no need for better
+  static FILE *GetOutputFile() { return output_file_; }
   static bool HasActiveSamples() { return global_rw_->active_sample_count != 0; }
   static void ActivateSampledAddress() { AtomicIncrement(&global_rw_->active_sample_count); }
   void NewSampledAddress(address_t address, address_t PC);//fully synchronized, or finegrain?
@@ -132,12 +220,57 @@ public:
   void SetThreadEnable(bool enable) { enabled_ = enable; }
   void Sleep() { global_rw_->barrier.Sleep(threadid_); }
   void Wake() { global_rw_->barrier.Wake(threadid_); }
+  ~ParallelSampledStack();
 private:
   const DistanceSet *GetDS(address_t address);
+  // Distinct addresses in a sample's reuse interval so far, and its distance counting holes
+  acc_count_t SetSize(const DistanceSet *ds) const;
+  acc_count_t OwnCount(const DistanceSet *ds) const;
+  acc_count_t Distance(const DistanceSet *ds) const;
+  acc_count_t SketchDistance(const DistanceSet *ds) const;
+  acc_count_t LastAccess(address_t address) const;
+  void RecordAccess(address_t address);
+  void LinkWriteSet(WriteSet *ws);
+  void UnlinkWriteSet(WriteSet *ws);
+  void RemoveAddresses(DistanceSet *ds, const BlockSet &blocks);
+  static DistinctSketch *NewSketch() { return sketches_ ? new DistinctSketch() : NULL; }
+  // asynchronous mode
+  static const int kEpochAccesses = 1024;
+  bool PublishEpoch();
+  void HandleMessage(MergeMessage *message);
+  void RetireSample(DistanceSet *ds);
+  void MergeBlocks(DistanceSet *ds, const WriteSet *blocks);
+  static void PostToHelper(MergeMessage *newest, MergeMessage *oldest, int count);
+  static void PostToThread(int thread, MergeMessage *message);
+  static void *HelperMain(void *arg);
+  static void RunHelper();
+  static void HandleHelperMessage(MergeMessage *message);
+  static void SendWriteSet(int thread, DistanceSet *ds, int owner);
+  static void ForwardMergeResults();
+  static void WaitForHelper();
+  static void StopHelper();
+  // batched mode
+  static const int kBatchAccesses = 1024;
+  static const int kMaxBatchSamples = 16;
+  static const int kRecentAccesses = 4096;
+  static const acc_count_t kNoBatch = static_cast<acc_count_t>(-1);
+  struct RecentAccess {
+    acc_count_t time;
+    address_t address;
+    address_t pc;
+    bool is_write;
+  };
+  void QueueSample(DistanceSet *ds);
+  void CheckBatch();
+  static void AddBatchedWriteSets(int thread);
+  void ReplayRecentAccesses(WriteSet *ws) const;
   static void ValidateActiveSamples(bool has_new);
   enum SyncAction { kNoAction, kNewSampledAddress, kMerge, kFinalize };
   ParallelSampledStack(int threadid);
   address_t GetBlock(address_t address) { return address & block_mask_; }
+  // BlockSets hold block numbers rather than block addresses, to keep their chunks dense
+  static uint64_t BlockNumber(address_t block) { return block >> block_shift_; }
+  static address_t BlockAddress(uint64_t number) { return number << block_shift_; }
   void SynchronizedOperations(SyncAction action, DistanceSet *newDS);
   static void RemoveWriteSetFromAll(DistanceSet *ds, int thread);
   static void MergeInvalidationsThreads(int thread, DistanceSet *myDS);
@@ -151,8 +284,23 @@ private:
   //local data: vector of sets, for each active sampled address
   DistanceSet *distance_sets_;  //one for each of my sampled addresses
   DistanceSet *oldest_distance_set_;
+  SampleTable<DistanceSet> samples_;  ///< the sampled addresses of distance_sets_
+  // while this thread has samples: each address's latest access (in sampled_access_count_
+  // time), and those times, for counting the distinct addresses since a sample's creation
+  AddressTimes last_access_;
+  LiveTimestamps access_times_;
+  SlidingDistinctSketch *own_sketch_;  ///< sketch mode: replaces the two above
   RdaLock write_set_lock_;
-  WriteSet *write_sets_; //one for each of other threads's sampled addresses
+  std::vector<WriteSet *> write_sets_; //one for each of other threads's sampled addresses
+  SampleTable<WriteSet> remote_samples_;  ///< the sampled addresses of write_sets_
+  Mailbox<MergeMessage> mailbox_;  ///< asynchronous mode
+  int epoch_accesses_;
+  // batched mode: a ring of the accesses write sets see, the access count when this thread
+  // first saw queued work (or kNoBatch), and its own queued samples
+  std::vector<RecentAccess> recent_;
+  acc_count_t recent_count_;
+  acc_count_t batch_start_;
+  int batched_samples_;
   bool enabled_;
   int threadid_;
   EventBuffer events_;
@@ -167,6 +315,7 @@ private:
   acc_count_t prune_count_;
   ReuseStackStats private_stats_;
   ReuseStackStats private_read_stats_;
+  PCStatsShard *pc_stats_;  ///< samples this thread finalized, for any owner
   bool new_thread_;
 
   // write-once(/rarely) global data
@@ -174,12 +323,20 @@ private:
   static FILE *output_file_;
   static int block_bytes_;
   static address_t block_mask_;
+  static int block_shift_;
+  static int max_threads_;  ///< thread ids must be less than this
+  static int pc_stats_limit_;
   static bool global_enabled_;
   static StackType stack_type_;
+  static bool sketches_;
+  static bool batching_;
+  static AsyncMergeState *async_;  ///< NULL unless in asynchronous mode
   static CircularThreadQueue<ParallelSampledStack *> threads_;
 
   //read-write global data
   static PssGlobalData *global_rw_;
+  // writes to pages only this thread has touched can't invalidate anyone's samples
+  static PageOwnershipTable *page_table_;
 
 
   DISALLOW_COPY_AND_ASSIGN(ParallelSampledStack);
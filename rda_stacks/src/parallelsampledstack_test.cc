@@ -6,6 +6,8 @@
  */
 
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <stdexcept>
 #include "parallelsampledstack.h"
 #include "sampledreusestack.h"
 
@@ -23,18 +25,44 @@ protected:
   const DistanceSet *GetDS(int thread, address_t address) {
     return threads_[thread]->GetDS(address);
   }
+  // what the sample's address set and hole count used to hold
+  acc_count_t GetSetSize(int thread, address_t address) {
+    return threads_[thread]->SetSize(GetDS(thread, address));
+  }
+  acc_count_t GetHoles(int thread, address_t address) {
+    const DistanceSet *ds = GetDS(thread, address);
+    return threads_[thread]->Distance(ds) - threads_[thread]->SetSize(ds);
+  }
   acc_count_t GetActiveSamples(int thread) {
     return threads_[thread]->global_rw_->active_sample_count;
   }
-  void SetUp() {
+  int GetWriteSetCount(int thread) {
+    return static_cast<int>(ParallelSampledStack::threads_[thread]->write_sets_.size());
+  }
+  acc_count_t GetShardSamples(int thread, address_t pc) {
+    return threads_[thread]->pc_stats_->all.GetSampleCount(pc);
+  }
+  int GetSyncCount(int thread) {
+    return threads_[thread]->synchronization_count_;
+  }
+  int GetMaxBatchSamples() { return ParallelSampledStack::kMaxBatchSamples; }
+  int GetBatchAccesses() { return ParallelSampledStack::kBatchAccesses; }
+  enum MergeMode { kBarrier, kAsync, kBatched };
+  void InitializeStacks(ParallelSampledStack::StackType type, bool sketches, MergeMode mode) {
     ASSERT_TRUE(ParallelSampledStack::Initialize("parallelsampledstack-test", kDefaultGranularity,
-                                                 kDefaultThreads, ParallelSampledStack::kPrivateStacks));
+                                                 kDefaultThreads, type));
+    ParallelSampledStack::SetDistanceSketches(sketches);
+    ParallelSampledStack::SetAsyncMerging(mode == kAsync);
+    ParallelSampledStack::SetSampleBatching(mode == kBatched);
     ParallelSampledStack::SetGlobalEnable(true);
     for (int i = 0; i < kDefaultThreads; i++) {
       threads_[i] = ParallelSampledStack::GetThreadStack(i);
       threads_[i]->SetThreadEnable(true);
     }
   }
+  void SetUp() {
+    InitializeStacks(ParallelSampledStack::kPrivateStacks, false, kBarrier);
+  }
   void TearDown() {
     ParallelSampledStack::CleanUp();
   }
@@ -100,15 +128,15 @@ TEST_F(ParallelSampledStackTest, AccessHolesFillHalfNoMerge) {
   }
   // hasnt been any merging yet
   ASSERT_TRUE(GetDS(0, kDefaultAddress) != NULL);
-  EXPECT_EQ(kAccessCount, GetDS(0, kDefaultAddress)->set.size());
-  EXPECT_EQ(0, GetDS(0, kDefaultAddress)->holes);
+  EXPECT_EQ(kAccessCount, GetSetSize(0, kDefaultAddress));
+  EXPECT_EQ(0, GetHoles(0, kDefaultAddress));
   // fill some holes (with addresses other than their originals)
   for (int i = kAccessCount; i < kAccessCount*2; i++) {
     if (i % 4 == 0) threads_[0]->Access(i * kDefaultGranularity + kAccessCount, kDefaultPC, false);
   }
   ASSERT_TRUE(GetDS(0, kDefaultAddress) != NULL);
-  EXPECT_EQ(kAccessCount * 5 / 4, GetDS(0, kDefaultAddress)->set.size());
-  EXPECT_EQ(0, GetDS(0, kDefaultAddress)->holes);
+  EXPECT_EQ(kAccessCount * 5 / 4, GetSetSize(0, kDefaultAddress));
+  EXPECT_EQ(0, GetHoles(0, kDefaultAddress));
   // with the final merge, kAccessCount / 2 are invalidated but holes added == invals
   EXPECT_TRUE(threads_[0]->Access(kDefaultAddress, kDefaultPC, false));
   EXPECT_EQ(kAccessCount * 5 / 4, GetLastDistance(0));
@@ -133,8 +161,8 @@ TEST_F(ParallelSampledStackTest, AccessHolesFillNoMerge) {
   }
   // hasn't been any merging yet
   ASSERT_TRUE(GetDS(0, kDefaultAddress) != NULL);
-  EXPECT_EQ(kAccessCount * 2, GetDS(0, kDefaultAddress)->set.size());
-  EXPECT_EQ(0, GetDS(0, kDefaultAddress)->holes);
+  EXPECT_EQ(kAccessCount * 2, GetSetSize(0, kDefaultAddress));
+  EXPECT_EQ(0, GetHoles(0, kDefaultAddress));
   EXPECT_TRUE(threads_[0]->Access(kDefaultAddress, kDefaultPC, false));
   EXPECT_EQ(kAccessCount * 2, GetLastDistance(0));
 }
@@ -154,16 +182,16 @@ TEST_F(ParallelSampledStackTest, AccessHolesFillHalfMerge) {
   }
   threads_[0]->MergeAllSamples();
   ASSERT_TRUE(GetDS(0, kDefaultAddress) != NULL);
-  EXPECT_EQ(kAccessCount / 2, GetDS(0, kDefaultAddress)->set.size());
-  EXPECT_EQ(kAccessCount / 2, GetDS(0, kDefaultAddress)->holes);
+  EXPECT_EQ(kAccessCount / 2, GetSetSize(0, kDefaultAddress));
+  EXPECT_EQ(kAccessCount / 2, GetHoles(0, kDefaultAddress));
   // fill some holes (with addresses other than their originals)
   for (int i = kAccessCount; i < kAccessCount*2; i++) {
     if (i % 4 == 0) threads_[0]->Access(i * kDefaultGranularity + kAccessCount, kDefaultPC, false);
   }
   threads_[0]->MergeAllSamples();
   ASSERT_TRUE(GetDS(0, kDefaultAddress) != NULL);
-  EXPECT_EQ(kAccessCount * 3 / 4, GetDS(0, kDefaultAddress)->set.size());
-  EXPECT_EQ(kAccessCount / 4, GetDS(0, kDefaultAddress)->holes);
+  EXPECT_EQ(kAccessCount * 3 / 4, GetSetSize(0, kDefaultAddress));
+  EXPECT_EQ(kAccessCount / 4, GetHoles(0, kDefaultAddress));
   EXPECT_TRUE(threads_[0]->Access(kDefaultAddress, kDefaultPC, false));
   EXPECT_EQ(kAccessCount , GetLastDistance(0));
 }
@@ -187,8 +215,8 @@ TEST_F(ParallelSampledStackTest, AccessHolesFillMerge) {
   }
 
   ASSERT_TRUE(GetDS(0, kDefaultAddress) != NULL);
-  EXPECT_EQ(kAccessCount * 3 / 2, GetDS(0, kDefaultAddress)->set.size());
-  EXPECT_EQ(0, GetDS(0, kDefaultAddress)->holes);
+  EXPECT_EQ(kAccessCount * 3 / 2, GetSetSize(0, kDefaultAddress));
+  EXPECT_EQ(0, GetHoles(0, kDefaultAddress));
   EXPECT_TRUE(threads_[0]->Access(kDefaultAddress, kDefaultPC, false));
   EXPECT_EQ(kAccessCount + kAccessCount / 2, GetLastDistance(0));
 }
@@ -232,6 +260,274 @@ TEST_F(ParallelSampledStackTest, OverlappedDistance) {
   EXPECT_EQ(0/*kAccessCount * 3 + 4*/, GetActiveSamples(0));
 }
 
+TEST_F(ParallelSampledStackTest, SketchesNeedSharedStacks) {
+  EXPECT_THROW(ParallelSampledStack::SetDistanceSketches(true), std::invalid_argument);
+}
+
+class ParallelSampledStackSketchTest : public ParallelSampledStackTest {
+protected:
+  void SetUp() {
+    InitializeStacks(ParallelSampledStack::kSharedStacks, true, kBarrier);
+  }
+};
+
+// overlapping accesses from two threads, in the linear-counting and the HLL ranges
+TEST_F(ParallelSampledStackSketchTest, SharedDistance) {
+  const int kCounts[] = { kAccessCount, 2000 };
+  const address_t kSampleAddress = kDefaultGranularity * 100000;  // clear of the others
+  for (int c = 0; c < 2; c++) {
+    ParallelSampledStack::ActivateSampledAddress();
+    threads_[0]->NewSampledAddress(kSampleAddress, kDefaultPC);
+    for (int i = 0; i < kCounts[c]; i++) {
+      threads_[0]->Access(i * kDefaultGranularity, kDefaultPC, false);
+      threads_[1]->Access((i + kCounts[c] / 2) * kDefaultGranularity, kDefaultPC, true);
+    }
+    EXPECT_TRUE(threads_[0]->Access(kSampleAddress, kDefaultPC, false));
+    double expected = kCounts[c] * 3 / 2;
+    EXPECT_NEAR(expected, GetLastDistance(0), std::max(2.0, expected * 4 * 0.0325));
+  }
+}
+
+// every active sample's own part comes from the thread's one sliding sketch
+TEST_F(ParallelSampledStackSketchTest, OverlappingSamples) {
+  const int kSamples = 4;
+  const int kAccessesPerSample = 500;
+  const address_t kSampleAddress = kDefaultGranularity * 100000;
+  for (int k = 0; k < kSamples; k++) {
+    ParallelSampledStack::ActivateSampledAddress();
+    threads_[0]->NewSampledAddress(kSampleAddress + k * kDefaultGranularity, kDefaultPC);
+    for (int i = 0; i < kAccessesPerSample; i++) {
+      threads_[0]->Access((k * kAccessesPerSample + i) * kDefaultGranularity, kDefaultPC, false);
+    }
+  }
+  for (int k = 0; k < kSamples; k++) {
+    threads_[0]->Access(kSampleAddress + k * kDefaultGranularity, kDefaultPC, false);
+    // the later accesses, and the reuses of the earlier samples
+    double expected = (kSamples - k) * kAccessesPerSample + k;
+    EXPECT_NEAR(expected, GetLastDistance(0), std::max(2.0, expected * 4 * 0.0325)) << k;
+  }
+}
+
+class ParallelSampledStackAsyncTest : public ParallelSampledStackTest {
+protected:
+  void SetUp() {
+    InitializeStacks(ParallelSampledStack::kPrivateStacks, false, kAsync);
+  }
+};
+
+// invalidated blocks become holes once the writes reach the owner
+TEST_F(ParallelSampledStackAsyncTest, AccessHoles) {
+  ParallelSampledStack::ActivateSampledAddress();
+  threads_[0]->NewSampledAddress(kDefaultAddress, kDefaultPC);
+  ParallelSampledStack::Quiesce();
+  EXPECT_EQ(1, GetWriteSetCount(1));
+  for (int i = 0; i < kAccessCount; i++) {
+    threads_[0]->Access(i * kDefaultGranularity, kDefaultPC, false);
+  }
+  for (int i = 0; i < kAccessCount; i++) {
+    if (i % 2 == 0) threads_[1]->Access(i * kDefaultGranularity, kDefaultPC, true);
+  }
+  ParallelSampledStack::Quiesce();
+  EXPECT_EQ(kAccessCount / 2, GetSetSize(0, kDefaultAddress));
+  EXPECT_EQ(kAccessCount / 2, GetHoles(0, kDefaultAddress));
+  threads_[0]->Access(kDefaultAddress, kDefaultPC, false);
+  ParallelSampledStack::Quiesce();
+  EXPECT_FALSE(ParallelSampledStack::HasActiveSamples());
+  EXPECT_EQ(kAccessCount, GetLastDistance(0));
+  for (int i = 0; i < kDefaultThreads; i++) EXPECT_EQ(0, GetWriteSetCount(i));
+}
+
+TEST_F(ParallelSampledStackAsyncTest, RemoteInvalidation) {
+  ParallelSampledStack::ActivateSampledAddress();
+  threads_[0]->NewSampledAddress(kDefaultAddress, kDefaultPC);
+  ParallelSampledStack::Quiesce();
+  threads_[1]->Access(kDefaultAddress, kDefaultPC, true);
+  threads_[1]->Access(kDefaultAddress, kDefaultPC, true);
+  EXPECT_EQ(1, GetActiveSamples(0));
+  ParallelSampledStack::Quiesce();
+  EXPECT_EQ(0, GetActiveSamples(0));
+  EXPECT_EQ(kInvalidationMiss, GetLastDistance(0));
+  for (int i = 0; i < kDefaultThreads; i++) EXPECT_EQ(0, GetWriteSetCount(i));
+}
+
+class ParallelSampledStackAsyncSharedTest : public ParallelSampledStackTest {
+protected:
+  void SetUp() {
+    InitializeStacks(ParallelSampledStack::kSharedStacks, false, kAsync);
+  }
+};
+
+// the other threads' accesses count although no epoch handed them over before the reuse
+TEST_F(ParallelSampledStackAsyncSharedTest, SharedDistance) {
+  ParallelSampledStack::ActivateSampledAddress();
+  threads_[0]->NewSampledAddress(kDefaultAddress, kDefaultPC);
+  ParallelSampledStack::Quiesce();
+  for (int i = 0; i < kAccessCount; i++) {
+    threads_[0]->Access(i * kDefaultGranularity, kDefaultPC, false);
+    threads_[1]->Access((i + kAccessCount / 2) * kDefaultGranularity, kDefaultPC, false);
+  }
+  threads_[0]->Access(kDefaultAddress, kDefaultPC, false);
+  // the final merge is still on its way
+  EXPECT_TRUE(ParallelSampledStack::HasActiveSamples());
+  ParallelSampledStack::Quiesce();
+  EXPECT_FALSE(ParallelSampledStack::HasActiveSamples());
+  EXPECT_EQ(kAccessCount * 3 / 2, GetLastDistance(0));
+  for (int i = 0; i < kDefaultThreads; i++) EXPECT_EQ(0, GetWriteSetCount(i));
+}
+
+// each thread records the samples it finalizes; the dump merges them
+TEST_F(ParallelSampledStackTest, PCStatsShards) {
+  const address_t kOtherAddress = kDefaultAddress + kDefaultGranularity;
+  const address_t kOtherPC = 2;
+  ParallelSampledStack::ActivateSampledAddress();
+  threads_[0]->NewSampledAddress(kDefaultAddress, kDefaultPC);
+  ParallelSampledStack::ActivateSampledAddress();
+  threads_[1]->NewSampledAddress(kOtherAddress, kOtherPC);
+  threads_[0]->Access(kDefaultAddress, kDefaultPC, false);
+  EXPECT_TRUE(threads_[1]->Access(kOtherAddress, kDefaultPC, true));
+  EXPECT_EQ(1, GetShardSamples(0, kDefaultPC));
+  EXPECT_EQ(1, GetShardSamples(1, kDefaultPC));
+  PCStats all;
+  PCStats reads;
+  ParallelSampledStack::MergePCStats(&all, &reads);
+  EXPECT_EQ(2, all.GetSampleCount(kDefaultPC));
+  EXPECT_EQ(1, reads.GetSampleCount(kDefaultPC));
+  EXPECT_EQ(0, all.GetSampleCount(kOtherPC));
+}
+
+// the limit applies to the merged counts, so a PC every shard evicts is only counted once
+TEST_F(ParallelSampledStackTest, PCStatsLimitAfterMerge) {
+  const address_t kOtherPC = 2;
+  const int kSamplesPerThread = 3;
+  ParallelSampledStack::SetPCStatsLimit(1);
+  for (int i = 0; i < kDefaultThreads * kSamplesPerThread; i++) {
+    ParallelSampledStack::ActivateSampledAddress();
+    threads_[i / kSamplesPerThread]->NewSampledAddress(kDefaultAddress + i * kDefaultGranularity,
+                                                       kDefaultPC);
+  }
+  // each thread reuses one sample at kOtherPC and then two at kDefaultPC
+  for (int i = 0; i < kDefaultThreads * kSamplesPerThread; i++) {
+    address_t pc = i % kSamplesPerThread == 0 ? kOtherPC : kDefaultPC;
+    threads_[i / kSamplesPerThread]->Access(kDefaultAddress + i * kDefaultGranularity, pc, false);
+  }
+  EXPECT_EQ(1, GetShardSamples(0, kOtherPC));
+  EXPECT_EQ(2, GetShardSamples(1, kDefaultPC));
+  PCStats all;
+  PCStats reads;
+  ParallelSampledStack::MergePCStats(&all, &reads);
+  EXPECT_EQ(1, all.GetTrackedPCCount());
+  const int kOtherSamples = kDefaultThreads;  // one per shard
+  EXPECT_EQ(kOtherSamples * 2, all.GetSampleCount(kDefaultPC));
+  EXPECT_EQ(kOtherSamples, all.GetOtherSampleCount());
+  EXPECT_EQ(1, all.GetEvictedPCCount());
+  EXPECT_EQ(1, reads.GetEvictedPCCount());
+}
+
+// thread ids past the old fixed limit of 16
+TEST_F(ParallelSampledStackTest, ManyThreads) {
+  const int kManyThreads = 40;
+  ParallelSampledStack::CleanUp();
+  ASSERT_TRUE(ParallelSampledStack::Initialize("parallelsampledstack-test", kDefaultGranularity,
+                                               kManyThreads, ParallelSampledStack::kPrivateStacks));
+  ParallelSampledStack::SetGlobalEnable(true);
+  std::vector<ParallelSampledStack *> stacks;
+  for (int i = 0; i < kManyThreads; i++) {
+    stacks.push_back(ParallelSampledStack::GetThreadStack(i));
+    stacks[i]->SetThreadEnable(true);
+    stacks[i]->MergeAllSamples();  // the new thread's first round
+  }
+  std::copy(stacks.begin(), stacks.begin() + kDefaultThreads, threads_);  // for the helpers
+  ParallelSampledStack::ActivateSampledAddress();
+  stacks[0]->NewSampledAddress(kDefaultAddress, kDefaultPC);
+  EXPECT_EQ(1, GetWriteSetCount(kManyThreads - 1));
+  for (int i = 0; i < kAccessCount; i++) {
+    stacks[0]->Access(i * kDefaultGranularity, kDefaultPC, false);
+  }
+  // the last threads invalidate some of them, leaving holes
+  for (int i = 0; i < kAccessCount / 2; i++) {
+    stacks[kManyThreads - 1 - i]->Access(i * kDefaultGranularity, kDefaultPC, true);
+  }
+  stacks[0]->MergeAllSamples();
+  EXPECT_EQ(kAccessCount / 2, GetSetSize(0, kDefaultAddress));
+  EXPECT_TRUE(stacks[0]->Access(kDefaultAddress, kDefaultPC, false));
+  EXPECT_EQ(kAccessCount, GetLastDistance(0));
+  for (int i = 0; i < kManyThreads; i++) EXPECT_EQ(0, GetWriteSetCount(i));
+}
+
+TEST_F(ParallelSampledStackTest, BatchingExcludesAsync) {
+  ParallelSampledStack::CleanUp();
+  ASSERT_TRUE(ParallelSampledStack::Initialize("parallelsampledstack-test", kDefaultGranularity,
+                                               kDefaultThreads, ParallelSampledStack::kPrivateStacks));
+  ParallelSampledStack::SetAsyncMerging(true);
+  EXPECT_THROW(ParallelSampledStack::SetSampleBatching(true), std::invalid_argument);
+  ParallelSampledStack::SetAsyncMerging(false);
+  ParallelSampledStack::SetSampleBatching(true);
+  EXPECT_THROW(ParallelSampledStack::SetAsyncMerging(true), std::invalid_argument);
+  threads_[0] = ParallelSampledStack::GetThreadStack(0);
+}
+
+class ParallelSampledStackBatchedTest : public ParallelSampledStackTest {
+protected:
+  void SetUp() {
+    InitializeStacks(ParallelSampledStack::kSharedStacks, false, kBatched);
+  }
+};
+
+// the other threads' accesses before the round still count
+TEST_F(ParallelSampledStackBatchedTest, SharedDistance) {
+  threads_[0]->MergeAllSamples();  // takes in the new threads
+  int syncs = GetSyncCount(0);
+  ParallelSampledStack::ActivateSampledAddress();
+  threads_[0]->NewSampledAddress(kDefaultAddress, kDefaultPC);
+  EXPECT_EQ(0, GetWriteSetCount(1));
+  for (int i = 0; i < kAccessCount; i++) {
+    threads_[0]->Access(i * kDefaultGranularity, kDefaultPC, false);
+    threads_[1]->Access((i + kAccessCount / 2) * kDefaultGranularity, kDefaultPC, false);
+  }
+  threads_[0]->Access(kDefaultAddress, kDefaultPC, false);
+  EXPECT_EQ(syncs, GetSyncCount(0));
+  EXPECT_TRUE(ParallelSampledStack::HasActiveSamples());
+  threads_[0]->MergeAllSamples();
+  EXPECT_FALSE(ParallelSampledStack::HasActiveSamples());
+  EXPECT_EQ(kAccessCount * 3 / 2, GetLastDistance(0));
+  for (int i = 0; i < kDefaultThreads; i++) EXPECT_EQ(0, GetWriteSetCount(i));
+}
+
+// a reuse by another thread before the round ends the sample there
+TEST_F(ParallelSampledStackBatchedTest, RemoteReuse) {
+  ParallelSampledStack::ActivateSampledAddress();
+  threads_[0]->NewSampledAddress(kDefaultAddress, kDefaultPC);
+  for (int i = 0; i < kAccessCount; i++) {
+    threads_[0]->Access(i * kDefaultGranularity, kDefaultPC, false);
+  }
+  threads_[1]->Access(kDefaultAddress, kDefaultPC, false);
+  for (int i = 0; i < kAccessCount; i++) {
+    threads_[1]->Access((i + kAccessCount) * kDefaultGranularity, kDefaultPC, false);
+  }
+  threads_[0]->MergeAllSamples();
+  EXPECT_FALSE(ParallelSampledStack::HasActiveSamples());
+  EXPECT_EQ(kAccessCount, GetLastDistance(0));
+}
+
+// a full queue, or enough accesses by any thread, starts the round
+TEST_F(ParallelSampledStackBatchedTest, RoundTriggers) {
+  const int kMaxSamples = GetMaxBatchSamples();
+  const address_t kSampleAddress = kDefaultGranularity * 100000;  // clear of the accesses
+  for (int i = 0; i <= kMaxSamples; i++) {
+    if (i == kMaxSamples) {
+      EXPECT_EQ(kMaxSamples, GetWriteSetCount(1));
+    }
+    ParallelSampledStack::ActivateSampledAddress();
+    threads_[0]->NewSampledAddress(kSampleAddress + i * kDefaultGranularity, kDefaultPC);
+  }
+  for (int i = 0; i < GetBatchAccesses(); i++) {
+    threads_[2]->Access(i * kDefaultGranularity, kDefaultPC, false);
+  }
+  EXPECT_EQ(kMaxSamples, GetWriteSetCount(1));
+  threads_[2]->Access(0, kDefaultPC, false);
+  EXPECT_EQ(kMaxSamples + 1, GetWriteSetCount(1));
+}
+
 const std::string kTraceFile("../rddata/applu-10k_sampled-fulltrace");
 
 TEST_F(ParallelSampledStackTest, CompareSingleStack) {
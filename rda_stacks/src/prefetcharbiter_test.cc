@@ -16,6 +16,7 @@ public:
   }
   /* Returns string containing stats */
   virtual std::string GetStatsString() { return std::string(); }
+  virtual void WriteStatsBinary(BinaryResultWriter *out) {}
   virtual ~MockPrefetcher() {}
 protected:
   int index_;
@@ -7,6 +7,7 @@
 
 #include <boost/format.hpp>
 #include "prefetcher.h"
+#include "rdbinary.h"
 
 using std::string;
 using boost::format;
@@ -120,6 +121,41 @@ string PrefetchArbiter::GetStatsString() {
   return out;
 }
 
+void PrefetchArbiter::WriteStatsBinary(BinaryResultWriter *out) {
+  acc_count_t total_accepted = 0;
+  acc_count_t total_dropped = 0;
+  for (unsigned int i = 0; i < prefetchers_.size(); i++) {
+    total_accepted += accepted_requests_[i];
+    total_dropped += dropped_requests_[i];
+  }
+  out->BeginDict();
+  out->IntItem("prefetches", total_accepted);
+  out->IntItem("dropped", total_dropped);
+  out->IntItem("canceled", queue_cancels_);
+  out->String("prefetchers");
+  out->BeginList();
+  for (unsigned int i = 0; i < prefetchers_.size(); i++) {
+    out->BeginDict();
+    out->IntItem("accepted", accepted_requests_[i]);
+    out->IntItem("dropped", dropped_requests_[i]);
+    prefetchers_[i]->WriteStatsBinary(out);
+    out->End();
+  }
+  out->End();
+  out->String("PCs");
+  out->BeginDict();
+  for (PrefetchedPCStats::iterator iter = pc_stats_.begin(); iter != pc_stats_.end(); ++iter) {
+    out->Int(iter->first);
+    out->BeginTuple();
+    out->Int(iter->second.requests);
+    out->Int(iter->second.prefetched_hits);
+    out->Int(iter->second.prefetched_misses);
+    out->End();
+  }
+  out->End();
+  out->End();
+}
+
 PrefetchArbiter::~PrefetchArbiter() {
   for (PrefetcherList::iterator iter = prefetchers_.begin(); iter != prefetchers_.end(); ++iter) {
     delete *iter;
@@ -130,6 +166,14 @@ DCUPrefetcher::DCUPrefetcher() : prefetches_(0), miss_triggers_(0), prefetch_hit
     current_access_(0), recent_accesses_(kRequestProximity, kStackNotFound) {
 }
 
+void DCUPrefetcher::WriteStatsBinary(BinaryResultWriter *out) {
+  out->String("name");
+  out->String("DCU");
+  out->IntItem("prefetches", prefetches_);
+  out->IntItem("miss_triggers", miss_triggers_);
+  out->IntItem("prefetch_hit_triggers", prefetch_hit_triggers_);
+}
+
 address_t DCUPrefetcher::Access(address_t addr, address_t PC, acc_count_t distance, bool write) {
   address_t ret = kAddressMax;
   // check for 2 accesses to the same block within short time, and issue
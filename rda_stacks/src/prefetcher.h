@@ -16,6 +16,8 @@
 #include <vector>
 #include "reusestack-common.h"
 
+class BinaryResultWriter;
+
 /* Interface for prefetchers, including the arbiter*/
 class PrefetcherInterface {
 public:
@@ -23,6 +25,8 @@ public:
   virtual address_t Access(address_t addr, address_t PC, acc_count_t distance, bool write) = 0;
   /* Returns string containing stats */
   virtual std::string GetStatsString() = 0;
+  /* Writes the same stats in the binary format (see rdbinary.h) */
+  virtual void WriteStatsBinary(BinaryResultWriter *out) = 0;
   virtual ~PrefetcherInterface() = 0;
  protected:
   const static acc_count_t kMissDistance = (64 * 1024) / 64;//specify this in BLOCKS
@@ -39,6 +43,7 @@ public:
   PrefetchArbiter(int delay) : kPrefetchDelay(delay), current_time_(0), queue_cancels_(0) {}
   virtual address_t Access(address_t addr, address_t PC, acc_count_t distance, bool write);
   virtual std::string GetStatsString();
+  virtual void WriteStatsBinary(BinaryResultWriter *out);
   void AddPrefetcher(PrefetcherInterface *pf);
   virtual ~PrefetchArbiter();
 private:
@@ -96,6 +101,7 @@ public:
   virtual address_t Access(address_t addr, address_t PC, acc_count_t distance, bool write);
   /* Returns string containing stats */
   virtual std::string GetStatsString();
+  virtual void WriteStatsBinary(BinaryResultWriter *out);
 private:
   acc_count_t prefetches_;
   acc_count_t miss_triggers_;
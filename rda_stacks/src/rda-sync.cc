@@ -5,11 +5,56 @@
  *      Author: dschuff
  */
 #include "rda-sync.h"
+#include <stdlib.h>
+#include <new>
+
+void MultistageBarrier::Init(CircularThreadQueue<ParallelSampledStack *> *tq, int max_threads) {
+  if (max_threads < 1) throw std::invalid_argument("barrier needs at least one thread");
+  FreeThreadState();
+  thread_queue_ = tq;
+  RdaInitLock(&lock_);
+  max_threads_ = max_threads;
+  awake_ = new bool[max_threads];
+  stages = new int[max_threads];
+  generations = new int[max_threads];
+  threads = new int[max_threads];
+  for (int i = 0; i < max_threads; i++) {
+    awake_[i] = false;  // until AddThread
+    stages[i] = 0;
+    generations[i] = 0;
+    threads[i] = 0;
+  }
+  int group_count = (max_threads + kBarrierFanout - 1) / kBarrierFanout;
+  void *memory;
+  if (posix_memalign(&memory, 64, group_count * sizeof(Group)) != 0) throw std::bad_alloc();
+  groups_ = static_cast<Group *>(memory);
+  for (int i = 0; i < group_count; i++) {
+    groups_[i].arrived = 0;
+    groups_[i].expected = 0;
+    groups_[i].awake = 0;
+  }
+  active_groups_ = 0;
+  groups_arrived_ = 0;
+  for (int i = 0; i < stage_count; i++) {
+    count_[i] = 0;
+  }
+}
+
+void MultistageBarrier::FreeThreadState() {
+  delete[] awake_;
+  delete[] stages;
+  delete[] generations;
+  delete[] threads;
+  free(groups_);
+  awake_ = NULL;
+  stages = generations = threads = NULL;
+  groups_ = NULL;
+}
 
 //template<int stage_count, int max_threads>
 int MultistageBarrier::AddThread() {
     RdaGetLock(&lock_);
-    if (total_threads_ == max_threads) {
+    if (total_threads_ == max_threads_) {
       RdaReleaseLock(&lock_);
       return -1;
     }
@@ -24,6 +69,7 @@ int MultistageBarrier::AddThread() {
     }
     next_threads_++;
     awake_[thread] = true;
+    groups_[thread / kBarrierFanout].awake++;
     RdaReleaseLock(&lock_);
     return thread;
   }
@@ -44,6 +90,8 @@ int MultistageBarrier::AddThread() {
         threads_ = next_threads_;
       }
       threads[thread] = threads_;
+      // the threads that start the round are the ones the later stages wait for
+      if (groups_[thread / kBarrierFanout].expected++ == 0) active_groups_++;
       count_[0]++;
       if (count_[0] == threads_) {
         count_[0] = 0;
@@ -64,34 +112,42 @@ int MultistageBarrier::AddThread() {
     if (!awake_[thread] || stage == 0 || stage >= stage_count) {
       throw std::invalid_argument("Sleeping thread or stage 0 in wait");
     }
-    RdaGetLock(&lock_);
     if (stage_ != stage)
       throw std::runtime_error("stage wrong in wait");
     stages[thread] = stage;
-    count_[stage]++;
-    if (count_[stage] == threads_) {
-      count_[stage] = 0;
-      stage_++;
-      generations[thread] = generation_;
-      if (stage_ == stage_count) {
-        stage_ = 0;
-        generation_++;
-      }
-      RdaReleaseLock(&lock_);
-    } else {
-      generations[thread] = generation_;
-      RdaReleaseLock(&lock_);
-      int i = 0;
-      while(stage_ == stage){
-        asm volatile("pause" ::: "memory");
-        if (++i % 10000 == 0) WaitConsistency(thread);
+    generations[thread] = generation_;
+    Group *group = &groups_[thread / kBarrierFanout];
+    if (__sync_add_and_fetch(&group->arrived, 1) == group->expected) {
+      // last of its group: nobody else in the group reads its counts until the stage changes
+      group->arrived = 0;
+      if (stage == stage_count - 1) group->expected = 0;
+      if (__sync_add_and_fetch(&groups_arrived_, 1) == active_groups_) {
+        groups_arrived_ = 0;
+        // under the lock, so WaitStart, Wake and AddThread see the whole transition
+        RdaGetLock(&lock_);
+        if (stage == stage_count - 1) active_groups_ = 0;
+        stage_++;
+        if (stage_ == stage_count) {
+          stage_ = 0;
+          generation_++;
+        }
+        RdaReleaseLock(&lock_);
+        return;
       }
     }
+    int i = 0;
+    while(stage_ == stage){
+      asm volatile("pause" ::: "memory");
+      if (++i % 10000 == 0) WaitConsistency(thread);
+    }
   }
   void MultistageBarrier::WaitConsistency(int thread) {
     RdaGetLock(&lock_);
     int threads = 0;
     for (int i = 0; i < stage_count; i++) threads += count_[i];
+    for (int i = 0; i < (max_threads_ + kBarrierFanout - 1) / kBarrierFanout; i++) {
+      threads += groups_[i].arrived;
+    }
     if (threads > threads_)
       throw std::runtime_error("sum of threads too high");
     //int gen = generations[thread];
@@ -115,6 +171,7 @@ int MultistageBarrier::AddThread() {
     }
     next_threads_++;
     awake_[thread] = true;
+    groups_[thread / kBarrierFanout].awake++;
     int gens = generation_ - generations[thread];
     RdaReleaseLock(&lock_);
     return gens;
@@ -123,6 +180,7 @@ int MultistageBarrier::AddThread() {
   void MultistageBarrier::Sleep(int thread) {
     RdaGetLock(&lock_);
     next_threads_--;
+    if (awake_[thread]) groups_[thread / kBarrierFanout].awake--;
     awake_[thread] = false;
     // if threads are waiting at stage 0, this sleep could release them
     if (stage_ == 0 && count_[0] != 0) {
@@ -143,9 +201,16 @@ int MultistageBarrier::AddThread() {
   // returns threadid)
 //template<int stage_count, int max_threads>
   int MultistageBarrier::GetAdjacentSleepers(int threadid) {
-    for (int i = thread_queue_->GetNextIndex(threadid); i != threadid;
-        i = thread_queue_->GetNextIndex(i)) {
+    int count = thread_queue_->GetThreadCount();
+    for (int i = thread_queue_->GetNextIndex(threadid); i != threadid; ) {
+      // threadid's own group is awake, so this never skips past it
+      if (i % kBarrierFanout == 0 && groups_[i / kBarrierFanout].awake == 0) {
+        i += kBarrierFanout;
+        if (i >= count) i = 0;
+        continue;
+      }
       if (awake_[i]) return i;
+      i = thread_queue_->GetNextIndex(i);
     }
     if (threads_ == 1) return threadid;
     throw std::runtime_error("wrapped around adjacent sleepers, awake[threadid] not set");
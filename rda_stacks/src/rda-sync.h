@@ -81,23 +81,22 @@ private:
 };
 
 //template<int stage_count, int max_threads=MAX_THREADS> class MultistageBarrier {
-#define max_threads 16
 #define stage_count 3
 class ParallelSampledStack;
+// Threads are split into groups of kBarrierFanout. Arrivals at the stages after the start are
+// counted per group, and only the last thread of each group touches the shared root count. The
+// start of a round still takes the lock once per thread, since sleeping and waking threads join
+// and leave there. The groups' awake counts let GetAdjacentSleepers skip over sleeping groups.
 class MultistageBarrier {
 public:
+  static const int kBarrierFanout = 8;
+  static const int kDefaultMaxThreads = 16;
   MultistageBarrier() : thread_queue_(NULL), threads_(0), next_threads_(0), stage_(0),
-  generation_(1), total_threads_(0) {}
-  void Init(CircularThreadQueue<ParallelSampledStack *> *tq) {
-    thread_queue_ = tq;
-    RdaInitLock(&lock_);
-    for (int i = 0; i < max_threads; i++) {
-      awake_[i] = true;
-    }
-    for (int i = 0; i < stage_count; i++) {
-      count_[i] = 0;
-    }
-  }
+  generation_(1), total_threads_(0), max_threads_(0), awake_(NULL), groups_(NULL),
+  active_groups_(0), groups_arrived_(0), stages(NULL), generations(NULL), threads(NULL) {}
+  // sizes the per-thread state for up to max_threads threads
+  void Init(CircularThreadQueue<ParallelSampledStack *> *tq,
+            int max_threads = kDefaultMaxThreads);
   int AddThread() ;
   int WaitStart(int thread) ;
   void WaitStage(int stage, int thread) ;
@@ -109,35 +108,48 @@ public:
   int GetAdjacentSleepers(int threadid) ;
   ~MultistageBarrier() {
     //make sure all the threads get released
-    LockHolder l(&lock_);
-    for (int i = 0; i < stage_count; i++) {
-      if (count_[i] != 0){
-        printf("error: Tried to delete barrier with threads still waiting");
+    {
+      LockHolder l(&lock_);
+      for (int i = 0; i < stage_count; i++) {
+        if (count_[i] != 0){
+          printf("error: Tried to delete barrier with threads still waiting");
+        }
+        stage_++;
       }
-      stage_++;
+      generation_++;
     }
-    generation_++;
+    FreeThreadState();
   }
 //private:
+  struct Group {
+    volatile int arrived;  ///< threads of the group at the current stage
+    int expected;  ///< threads of the group taking part in this round
+    int awake;
+  } __attribute__((aligned(64)));
   RdaLock(lock_);
   CircularThreadQueue<ParallelSampledStack *> *thread_queue_;
   int threads_;
   int next_threads_;
   volatile int count_[stage_count];
-  volatile bool awake_[max_threads];
   volatile int stage_;
   volatile int generation_;
   int total_threads_;
-  int stages[max_threads];
-  int generations[max_threads];
-  int threads[max_threads];
+  int max_threads_;
+  volatile bool *awake_;
+  Group *groups_;
+  int active_groups_;  ///< groups taking part in this round
+  volatile int groups_arrived_;
+  int *stages;
+  int *generations;
+  int *threads;
   void WaitForEnd(int generation);
+  void FreeThreadState();
 };
 
 class FakeBarrier { // for testing. all methods just return
 public:
   FakeBarrier() : total_threads_(0) {}
-  void Init(void *tq) {}
+  void Init(void *tq, int max_threads = 16) {}
   int AddThread() { return total_threads_++;}
   int WaitStart(int thread) {return 1;}
   void WaitStage(int stage, int thread) {}
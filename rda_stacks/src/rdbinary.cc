@@ -0,0 +1,266 @@
+#include "rdbinary.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include "version.h"
+
+const char BinaryResultWriter::kMagic[8] = {'\x89', 'R', 'D', 'A', '\r', '\n', '\x1a', '\n'};
+const int BinaryResultWriter::kFormatVersion;
+const int BinaryResultWriter::kFirstSkippableRecord;
+
+const int BinaryResultWriter::kMaxStrings;
+const int BinaryResultWriter::kStringSlots;
+
+BinaryResultWriter::BinaryResultWriter(FILE *file) : out_(file), record_out_(&record_),
+    record_kind_(0), string_slots_(kStringSlots, -1) {
+  WriteHeader();
+}
+
+BinaryResultWriter::BinaryResultWriter(std::string *out) : out_(out), record_out_(&record_),
+    record_kind_(0), string_slots_(kStringSlots, -1) {
+  WriteHeader();
+}
+
+void BinaryResultWriter::WriteHeader() {
+  out_.Write(kMagic, sizeof(kMagic));
+  Varint(kFormatVersion, &out_);
+  char tag = kStringTag;
+  out_.Write(&tag, 1);
+  Varint(strlen(LIBRDA_GIT_VERSION), &out_);
+  out_.Write(LIBRDA_GIT_VERSION);
+}
+
+void BinaryResultWriter::BeginRecord(RecordKind kind, const char *name) {
+  EndRecord();
+  record_kind_ = kind;
+  Varint(strlen(name));
+  record_out_.Write(name);
+}
+
+void BinaryResultWriter::EndRecord() {
+  if (record_kind_ == 0) return;
+  record_out_.Flush();
+  char c = record_kind_;
+  out_.Write(&c, 1);
+  Varint(record_.size(), &out_);
+  out_.Write(record_);
+  record_.clear();
+  record_kind_ = 0;
+}
+
+void BinaryResultWriter::Text(const std::string &text) {
+  BeginRecord(kTextRecord, "");
+  Tag(kStringTag);
+  Varint(text.size());
+  record_out_.Write(text);
+}
+
+void BinaryResultWriter::Varint(uint64_t value, StatsWriter *out) {
+  char bytes[10];
+  int count = 0;
+  while (value >= 0x80) {
+    bytes[count++] = static_cast<char>(value | 0x80);
+    value >>= 7;
+  }
+  bytes[count++] = static_cast<char>(value);
+  out->Write(bytes, count);
+}
+
+void BinaryResultWriter::Int(int64_t value) {
+  Tag(kIntTag);
+  // zigzag, so small negative numbers stay small
+  Varint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+void BinaryResultWriter::HexInt(uint64_t value) {
+  Tag(kHexIntTag);
+  Varint(value);
+}
+
+void BinaryResultWriter::Double(double value, int decimals) {
+  Tag(kDoubleTag);
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  char bytes[9];
+  bytes[0] = static_cast<char>(decimals);
+  for (int i = 0; i < 8; i++) bytes[i + 1] = static_cast<char>(bits >> (8 * i));  // little endian
+  record_out_.Write(bytes, sizeof(bytes));
+}
+
+void BinaryResultWriter::Pow2(int numerator, int denominator) {
+  Tag(kPow2Tag);
+  Varint(numerator);
+  Varint(denominator);
+}
+
+void BinaryResultWriter::String(const char *value) {
+  uint32_t hash = 2166136261u;  // FNV-1a
+  size_t length = 0;
+  for (const char *c = value; *c; c++, length++) {
+    hash = (hash ^ static_cast<uint8_t>(*c)) * 16777619u;
+  }
+  int slot = hash % kStringSlots;
+  while (string_slots_[slot] >= 0) {
+    if (strings_[string_slots_[slot]] == value) {
+      Tag(kStringRefTag);
+      Varint(string_slots_[slot]);
+      return;
+    }
+    slot = (slot + 1) % kStringSlots;
+  }
+  if (static_cast<int>(strings_.size()) < kMaxStrings && record_kind_ < kFirstSkippableRecord) {
+    string_slots_[slot] = strings_.size();
+    strings_.push_back(value);
+    Tag(kStringDefTag);
+  } else {
+    Tag(kStringTag);
+  }
+  Varint(length);
+  record_out_.Write(value, length);
+}
+
+BinaryResultReader::BinaryResultReader(std::istream &in) : in_(in), format_version_(0) {
+  char magic[sizeof(BinaryResultWriter::kMagic)];
+  if (!in_.read(magic, sizeof(magic)) ||
+      memcmp(magic, BinaryResultWriter::kMagic, sizeof(magic)) != 0) {
+    throw std::runtime_error("not a binary result file");
+  }
+  format_version_ = ReadVarint();
+  if (format_version_ > BinaryResultWriter::kFormatVersion) {
+    throw std::runtime_error("unsupported binary result format version");
+  }
+  if (ReadByte() != BinaryResultWriter::kStringTag) {
+    throw std::runtime_error("bad binary result file header");
+  }
+  librda_version_ = ReadString();
+}
+
+bool BinaryResultReader::IsBinary(std::istream &in) {
+  char magic[sizeof(BinaryResultWriter::kMagic)];
+  std::streampos start = in.tellg();
+  bool binary = in.read(magic, sizeof(magic)) &&
+      memcmp(magic, BinaryResultWriter::kMagic, sizeof(magic)) == 0;
+  in.clear();
+  in.seekg(start);
+  return binary;
+}
+
+int BinaryResultReader::ReadByte() {
+  int c = in_.get();
+  if (c == EOF) throw std::runtime_error("unexpected end of binary result file");
+  return c;
+}
+
+uint64_t BinaryResultReader::ReadVarint() {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = ReadByte();
+    value |= static_cast<uint64_t>(c & 0x7f) << shift;
+    if (!(c & 0x80)) return value;
+  }
+  throw std::runtime_error("bad varint in binary result file");
+}
+
+std::string BinaryResultReader::ReadString() {
+  uint64_t length = ReadVarint();
+  std::string value;
+  // read in chunks so a corrupt length fails at the end of the file instead of in the allocator
+  while (value.size() < length) {
+    char buffer[4096];
+    size_t count = std::min<uint64_t>(sizeof(buffer), length - value.size());
+    if (!in_.read(buffer, count)) throw std::runtime_error("unexpected end of binary result file");
+    value.append(buffer, count);
+  }
+  return value;
+}
+
+ResultValue BinaryResultReader::ReadValue(int tag) {
+  switch (tag) {
+    case BinaryResultWriter::kIntTag: {
+      uint64_t zigzag = ReadVarint();
+      return ResultValue::MakeInt(static_cast<int64_t>(zigzag >> 1) ^
+                                  -static_cast<int64_t>(zigzag & 1));
+    }
+    case BinaryResultWriter::kHexIntTag:
+      return ResultValue::MakeHexInt(ReadVarint());
+    case BinaryResultWriter::kDoubleTag: {
+      int decimals = ReadByte();
+      uint64_t bits = 0;
+      for (int i = 0; i < 8; i++) bits |= static_cast<uint64_t>(ReadByte()) << (8 * i);
+      double value;
+      memcpy(&value, &bits, sizeof(value));
+      return ResultValue::MakeDouble(value, decimals);
+    }
+    case BinaryResultWriter::kPow2Tag: {
+      int numerator = ReadVarint();
+      int denominator = ReadVarint();
+      if (denominator == 0) throw std::runtime_error("bad histogram key in binary result file");
+      return ResultValue::MakeDouble(pow(2, numerator / static_cast<double>(denominator)), 6);
+    }
+    case BinaryResultWriter::kStringTag:
+      return ResultValue::MakeString(ReadString());
+    case BinaryResultWriter::kStringDefTag:
+      strings_.push_back(ReadString());
+      return ResultValue::MakeString(strings_.back());
+    case BinaryResultWriter::kStringRefTag: {
+      uint64_t index = ReadVarint();
+      if (index >= strings_.size()) {
+        throw std::runtime_error("bad string reference in binary result file");
+      }
+      return ResultValue::MakeString(strings_[index]);
+    }
+    case BinaryResultWriter::kDictTag:
+    case BinaryResultWriter::kListTag:
+    case BinaryResultWriter::kTupleTag: {
+      ResultValue value(tag == BinaryResultWriter::kDictTag ? ResultValue::kDict :
+                        (tag == BinaryResultWriter::kListTag ? ResultValue::kList :
+                         ResultValue::kTuple));
+      for (int item_tag = ReadByte(); item_tag != BinaryResultWriter::kEndTag;
+           item_tag = ReadByte()) {
+        if (tag == BinaryResultWriter::kDictTag) {
+          ResultValue key(ReadValue(item_tag));
+          value.Set(key, ReadValue(ReadByte()));
+        } else {
+          value.Append(ReadValue(item_tag));
+        }
+      }
+      return value;
+    }
+    default:
+      throw std::runtime_error("bad value tag in binary result file");
+  }
+}
+
+void BinaryResultReader::Skip(uint64_t count) {
+  char buffer[4096];
+  while (count > 0) {
+    size_t chunk = std::min<uint64_t>(sizeof(buffer), count);
+    if (!in_.read(buffer, chunk)) throw std::runtime_error("unexpected end of binary result file");
+    count -= chunk;
+  }
+}
+
+bool BinaryResultReader::Next(BinaryRecord *record) {
+  int kind;
+  while (true) {
+    kind = in_.get();
+    if (kind == EOF) return false;
+    if (format_version_ < 2) break;
+    uint64_t length = ReadVarint();
+    if (kind > 0 && kind <= BinaryResultWriter::kLibraryMapRecord) break;
+    Skip(length);  // written by a newer librda
+  }
+  record->kind = static_cast<BinaryResultWriter::RecordKind>(kind);
+  record->name = ReadString();
+  record->value = ReadValue(ReadByte());
+  record->text.clear();
+  if (record->kind == BinaryResultWriter::kTextRecord) {
+    if (record->value.type() != ResultValue::kString) {
+      throw std::runtime_error("bad text record in binary result file");
+    }
+    record->text = record->value.text();
+    record->value = ResultValue();
+  }
+  return true;
+}
@@ -0,0 +1,127 @@
+#ifndef RDBINARY_H_
+#define RDBINARY_H_
+
+#include <cstdio>
+#include <istream>
+#include <string>
+#include <vector>
+#include "reusestack-common.h"
+#include "resultfile.h"
+#include "statswriter.h"
+
+/*
+ * Compact binary result format. A file is a header (magic, format version, librda version)
+ * followed by records, each of which is the binary form of one line of the text format: a
+ * record kind, the length of the rest of the record, a name and one value. Values are tagged,
+ * so files can be read without knowing what was dumped: integers are zigzag varints (optionally
+ * marked for hex display, e.g. PCs), doubles are 8 bytes plus the number of decimals used by the
+ * text format, and dicts, lists and tuples are delimited by begin and end tags. Strings (mostly
+ * dict keys like 'histogram' or 'sampleCount') are numbered the first time they are written and
+ * referred to by number after that, and histogram bucket keys are written as their exponent.
+ * Readers skip the records of kinds they do not know by their length, so new kinds can be added
+ * without bumping the format version. Version 1 files have no record lengths.
+ *
+ * The writer formats each record into a buffer, without building value trees, and writes it out
+ * with its length when the next one begins. Dict contents are written as alternating keys and
+ * values.
+ */
+class BinaryResultWriter {
+public:
+  static const char kMagic[8];
+  static const int kFormatVersion = 2;
+  enum RecordKind {
+    kDataRecord = 1,  ///< '#rddata name = value'
+    kIntervalRecord,  ///< '#rdinterval name = value'
+    kPredictionRecord,  ///< '#preds value', belongs to the last data record
+    kAssignmentRecord,  ///< 'name = value'
+    kTextRecord,  ///< verbatim text lines (comments)
+    kLibraryMapRecord,  ///< the pintools' library map, a list of (name, base, top) tuples
+  };
+  // Older readers skip records of this kind and later ones, so they add no strings to the table
+  static const int kFirstSkippableRecord = kLibraryMapRecord;
+  enum ValueTag {
+    kEndTag = 0,
+    kIntTag,
+    kHexIntTag,
+    kDoubleTag,
+    kStringTag,
+    kDictTag,
+    kListTag,
+    kTupleTag,
+    kStringDefTag,  ///< string that is also added to the string table
+    kStringRefTag,  ///< index into the string table
+    kPow2Tag,  ///< 2^(n/d), as used for histogram bucket keys, printed with 6 decimals
+  };
+  // Both write the file header
+  explicit BinaryResultWriter(FILE *file);
+  explicit BinaryResultWriter(std::string *out);
+  ~BinaryResultWriter() { EndRecord(); }
+  void BeginRecord(RecordKind kind, const char *name);
+  void Text(const std::string &text);  // a complete text record
+  void BeginDict() { Tag(kDictTag); }
+  void BeginList() { Tag(kListTag); }
+  void BeginTuple() { Tag(kTupleTag); }
+  void End() { Tag(kEndTag); }
+  void Int(int64_t value);
+  void HexInt(uint64_t value);
+  void Double(double value, int decimals);
+  // pow(2, numerator / static_cast<double>(denominator)), in 2-3 bytes instead of 10
+  void Pow2(int numerator, int denominator);
+  void String(const char *value);
+  // a dict key followed by an int value, for the common attribute case
+  void IntItem(const char *key, int64_t value) { String(key); Int(value); }
+  void Flush() {
+    EndRecord();
+    out_.Flush();
+  }
+private:
+  void WriteHeader();
+  void EndRecord();  ///< writes out the current record, if any
+  void Tag(ValueTag tag) { char c = tag; record_out_.Write(&c, 1); }
+  void Varint(uint64_t value) { Varint(value, &record_out_); }
+  static void Varint(uint64_t value, StatsWriter *out);
+  static const int kMaxStrings = 1024;  ///< the rest are written inline
+  static const int kStringSlots = 2 * kMaxStrings;
+  StatsWriter out_;
+  std::string record_;
+  StatsWriter record_out_;  ///< into record_
+  int record_kind_;  ///< of record_, 0 if there is none
+  std::vector<std::string> strings_;
+  std::vector<int> string_slots_;  ///< open addressing hash of strings_ indices, -1 if empty
+  DISALLOW_COPY_AND_ASSIGN(BinaryResultWriter);
+};
+
+struct BinaryRecord {
+  BinaryResultWriter::RecordKind kind;
+  std::string name;
+  ResultValue value;  ///< unused for text records
+  std::string text;  ///< only for text records
+};
+
+/*
+ * Reads the records of a binary result file one at a time. Throws std::runtime_error on
+ * malformed input or an unsupported format version.
+ */
+class BinaryResultReader {
+public:
+  explicit BinaryResultReader(std::istream &in);
+  // Returns false at the end of the file
+  bool Next(BinaryRecord *record);
+  int format_version() const { return format_version_; }
+  const std::string &librda_version() const { return librda_version_; }
+  // True if the stream starts with the binary magic; does not consume anything
+  static bool IsBinary(std::istream &in);
+private:
+  uint64_t ReadVarint();
+  std::string ReadString();
+  ResultValue ReadValue(int tag);
+  int ReadByte();
+  void Skip(uint64_t count);
+  std::istream &in_;
+  std::vector<std::string> strings_;
+  int format_version_;
+  std::string librda_version_;
+  DISALLOW_COPY_AND_ASSIGN(BinaryResultReader);
+};
+
+#endif /* RDBINARY_H_ */
@@ -0,0 +1,264 @@
+#include <sstream>
+#include <gtest/gtest.h>
+#include "prefetcher.h"
+#include "rdbinary.h"
+#include "resultfile.h"
+#include "reusestack.h"
+#include "strideprefetcher.h"
+
+using std::string;
+
+class BinaryResultTest : public testing::Test {
+protected:
+  static string ReadAll(FILE *file) {
+    rewind(file);
+    string contents;
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) contents.append(buffer, count);
+    return contents;
+  }
+  static void ParseText(const string &text, ResultFile *file) {
+    std::istringstream in(text);
+    file->Parse(in);
+  }
+  static void ParseBinary(const string &data, ResultFile *file) {
+    std::istringstream in(data);
+    ASSERT_TRUE(BinaryResultReader::IsBinary(in));
+    file->ParseBinary(in);
+  }
+  // Both parsed results must print the same, i.e. converting binary gives the text output
+  static void ExpectSame(const ResultFile &text, const ResultFile &binary, const string &name) {
+    const ResultValue *text_value = text.Find(name);
+    const ResultValue *binary_value = binary.Find(name);
+    ASSERT_TRUE(text_value != NULL) << name;
+    ASSERT_TRUE(binary_value != NULL) << name;
+    EXPECT_EQ(text_value->ToString(), binary_value->ToString()) << name;
+  }
+};
+
+TEST_F(BinaryResultTest, Values) {
+  string data;
+  {
+    BinaryResultWriter out(&data);
+    out.BeginRecord(BinaryResultWriter::kAssignmentRecord, "values");
+    out.BeginDict();
+    out.IntItem("small", -3);
+    out.IntItem("big", -(static_cast<int64_t>(1) << 62));
+    out.HexInt(0x400123);
+    out.BeginTuple();
+    out.Double(2.5, 2);
+    out.String("x y");
+    out.BeginList();
+    out.End();
+    out.End();
+    out.End();
+    out.Text("# a comment\nother = [1, 2]");
+  }
+  std::istringstream in(data);
+  BinaryResultReader reader(in);
+  EXPECT_EQ(BinaryResultWriter::kFormatVersion, reader.format_version());
+  BinaryRecord record;
+  ASSERT_TRUE(reader.Next(&record));
+  EXPECT_EQ(BinaryResultWriter::kAssignmentRecord, record.kind);
+  EXPECT_EQ("values", record.name);
+  EXPECT_EQ("{'small':-3, 'big':-4611686018427387904, 0x400123:(2.50, 'x y', [], ), }",
+            record.value.ToString());
+  EXPECT_EQ(0x400123, record.value.key(2).AsInt());
+  ASSERT_TRUE(reader.Next(&record));
+  EXPECT_EQ(BinaryResultWriter::kTextRecord, record.kind);
+  EXPECT_EQ("# a comment\nother = [1, 2]", record.text);
+  EXPECT_FALSE(reader.Next(&record));
+
+  // text records are read like lines of a text file
+  ResultFile file;
+  ParseBinary(data, &file);
+  ASSERT_TRUE(file.Find("other") != NULL);
+  EXPECT_EQ(2, file.Find("other")->size());
+}
+
+// A stack dumped in binary converts to the same values as the text dump
+TEST_F(BinaryResultTest, StackDump) {
+  FILE *outfile = tmpfile();
+  ASSERT_TRUE(outfile != NULL);
+  ReuseStack stack(outfile, 1, ReuseStack::kTreeStack);
+  PCStats pc_stats;
+  for (int i = 0; i < 5000; i++) {
+    address_t address = (i * 7919) % 1000;
+    acc_count_t distance = stack.Access(address, 1, i % 3 ? ReuseStackBase::kRead :
+                                        ReuseStackBase::kWrite);
+    pc_stats.AddSample(0x400000 + i % 17, distance);
+    if (i % 1000 == 0) stack.UpdateRatioPredictions();
+  }
+  stack.Snoop(5, 1);
+  stack.Access(5, 1, ReuseStackBase::kRead);
+
+  fputs("#rddata simStacks[0] = ", outfile);
+  stack.DumpStatistics();
+  fprintf(outfile, "PCDist = %s\n", pc_stats.GetStatsString().c_str());
+  string text_data(ReadAll(outfile));
+  fclose(outfile);
+  ResultFile text;
+  ParseText(text_data, &text);
+
+  string data;
+  {
+    BinaryResultWriter out(&data);
+    out.BeginRecord(BinaryResultWriter::kDataRecord, "simStacks[0]");
+    stack.DumpStatisticsBinary(&out);
+    out.BeginRecord(BinaryResultWriter::kAssignmentRecord, "PCDist");
+    pc_stats.WriteBinary(&out);
+  }
+  ResultFile binary;
+  ParseBinary(data, &binary);
+  ExpectSame(text, binary, "simStacks[0]");
+  ExpectSame(text, binary, "#preds simStacks[0]");
+  ExpectSame(text, binary, "PCDist");
+
+  EXPECT_LT(data.size() * 5, text_data.size() * 3);  // even for a small dump
+}
+
+TEST_F(BinaryResultTest, Intervals) {
+  FILE *outfile = tmpfile();
+  ASSERT_TRUE(outfile != NULL);
+  ReuseStack text_stack(outfile, 1, ReuseStack::kTreeStack);
+  ReuseStack binary_stack(outfile, 1, ReuseStack::kTreeStack);
+  string data;
+  BinaryResultWriter out(&data);
+  for (int interval = 0; interval < 2; interval++) {
+    for (int i = 0; i < 300; i++) {
+      text_stack.Access(i % (50 + interval * 100), 1, ReuseStackBase::kRead);
+      binary_stack.Access(i % (50 + interval * 100), 1, ReuseStackBase::kRead);
+    }
+    fprintf(outfile, "#rdinterval simStacks[0][%d] = ", interval);
+    text_stack.DumpInterval();
+    char name[64];
+    snprintf(name, sizeof(name), "simStacks[0][%d]", interval);
+    out.BeginRecord(BinaryResultWriter::kIntervalRecord, name);
+    binary_stack.DumpIntervalBinary(&out);
+  }
+  out.Flush();
+  ResultFile text, binary;
+  ParseText(ReadAll(outfile), &text);
+  fclose(outfile);
+  ParseBinary(data, &binary);
+  ExpectSame(text, binary, "#rdinterval simStacks[0][0]");
+  ExpectSame(text, binary, "#rdinterval simStacks[0][1]");
+}
+
+// Records of kinds the reader does not know are skipped by their length
+TEST_F(BinaryResultTest, UnknownRecordKinds) {
+  string data;
+  {
+    BinaryResultWriter out(&data);
+    out.BeginRecord(BinaryResultWriter::kAssignmentRecord, "before");
+    out.Int(1);
+    out.BeginRecord(static_cast<BinaryResultWriter::RecordKind>(42), "future");
+    out.BeginDict();
+    out.IntItem("new key", 2);
+    out.String("something");
+    out.Pow2(3, 4);
+    out.End();
+    out.BeginRecord(BinaryResultWriter::kAssignmentRecord, "after");
+    out.BeginDict();
+    out.IntItem("new key", 3);  // the skipped record did not add the key to the string table
+    out.End();
+  }
+  std::istringstream in(data);
+  BinaryResultReader reader(in);
+  BinaryRecord record;
+  ASSERT_TRUE(reader.Next(&record));
+  EXPECT_EQ("before", record.name);
+  ASSERT_TRUE(reader.Next(&record));
+  EXPECT_EQ("after", record.name);
+  EXPECT_EQ("{'new key':3, }", record.value.ToString());
+  EXPECT_FALSE(reader.Next(&record));
+}
+
+// Version 1 files have no record lengths
+TEST_F(BinaryResultTest, FormatVersion1) {
+  string data(BinaryResultWriter::kMagic, sizeof(BinaryResultWriter::kMagic));
+  data += '\x01';
+  data += static_cast<char>(BinaryResultWriter::kStringTag);
+  data += "\x03old";
+  data += static_cast<char>(BinaryResultWriter::kAssignmentRecord);
+  data += "\x01x";
+  data += static_cast<char>(BinaryResultWriter::kIntTag);
+  data += '\x0a';
+  std::istringstream in(data);
+  BinaryResultReader reader(in);
+  EXPECT_EQ(1, reader.format_version());
+  EXPECT_EQ("old", reader.librda_version());
+  BinaryRecord record;
+  ASSERT_TRUE(reader.Next(&record));
+  EXPECT_EQ("x", record.name);
+  EXPECT_EQ(5, record.value.AsInt());
+  EXPECT_FALSE(reader.Next(&record));
+}
+
+// The library map and prefetch stats are typed records that read back as the text output
+TEST_F(BinaryResultTest, LibraryMapAndPrefetchStats) {
+  PrefetchArbiter prefetcher;
+  prefetcher.AddPrefetcher(new StridePrefetcher());
+  prefetcher.AddPrefetcher(new DCUPrefetcher());
+  for (int i = 0; i < 2000; i++) {
+    prefetcher.Access(i % 7 * 1000 + i / 7 * 2, 0x400000 + i % 7, i % 3 ? 5000 : 1, false);
+  }
+  string text_data("import collections\n"
+                   "LME = collections.namedtuple('LME', 'name base top')\n"
+                   "LibraryMap = [LME('libc.so',0x1000,0x2000),LME('a.out',0x400000,0x401000),]\n");
+  text_data += "prefetchStats[0] = " + prefetcher.GetStatsString();
+  string data;
+  {
+    BinaryResultWriter out(&data);
+    out.BeginRecord(BinaryResultWriter::kLibraryMapRecord, "LibraryMap");
+    out.BeginList();
+    out.BeginTuple();
+    out.String("libc.so");
+    out.HexInt(0x1000);
+    out.HexInt(0x2000);
+    out.End();
+    out.BeginTuple();
+    out.String("a.out");
+    out.HexInt(0x400000);
+    out.HexInt(0x401000);
+    out.End();
+    out.End();
+    out.BeginRecord(BinaryResultWriter::kAssignmentRecord, "prefetchStats[0]");
+    prefetcher.WriteStatsBinary(&out);
+  }
+  ResultFile text, binary;
+  ParseText(text_data, &text);
+  ParseBinary(data, &binary);
+  ExpectSame(text, binary, "prefetchStats[0]");
+  std::ostringstream text_out, binary_out;
+  text.Write(text_out);
+  binary.Write(binary_out);
+  EXPECT_EQ(text_out.str(), binary_out.str());
+}
+
+TEST_F(BinaryResultTest, Malformed) {
+  string data;
+  {
+    BinaryResultWriter out(&data);
+    out.BeginRecord(BinaryResultWriter::kDataRecord, "simStacks[0]");
+    out.BeginDict();
+    out.IntItem("accessCount", 12345);
+    out.End();
+  }
+  ResultFile file;
+  // truncated
+  EXPECT_THROW(ParseBinary(data.substr(0, data.size() - 3), &file), std::runtime_error);
+  // bad tag
+  string bad(data);
+  bad[bad.size() - 1] = 99;
+  EXPECT_THROW(ParseBinary(bad, &file), std::runtime_error);
+  // newer format version
+  string newer(data);
+  newer[sizeof(BinaryResultWriter::kMagic)] = BinaryResultWriter::kFormatVersion + 1;
+  EXPECT_THROW(ParseBinary(newer, &file), std::runtime_error);
+  // not binary at all
+  std::istringstream text("simStacks = {}\n");
+  EXPECT_FALSE(BinaryResultReader::IsBinary(text));
+  EXPECT_THROW(BinaryResultReader reader(text), std::runtime_error);
+}
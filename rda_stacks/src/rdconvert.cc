@@ -0,0 +1,47 @@
+/*
+ * Convert a binary result file (see rdbinary.h) to the text format read by rddata.py.
+ */
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include "resultfile.h"
+
+static void Usage(const char *name) {
+  fprintf(stderr, "usage: %s [-o output] file\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  std::string output;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+      case 'o':
+        output = optarg;
+        break;
+      default:
+        Usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) Usage(argv[0]);
+  try {
+    // text files are accepted too, which normalizes their formatting
+    ResultFile file;
+    file.ReadFile(argv[optind]);
+    if (output.empty()) {
+      file.Write(std::cout);
+    } else {
+      std::ofstream out(output.c_str());
+      if (!out.is_open()) throw std::runtime_error("could not open output file " + output);
+      file.Write(out);
+    }
+  } catch (std::exception &e) {
+    fprintf(stderr, "rdconvert: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Merge rddata result files from several shards of a run into one result file.
+ */
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include "resultfile.h"
+
+static void Usage(const char *name) {
+  fprintf(stderr, "usage: %s [-j threads] [-o output] file1 file2 ...\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int threads = 1;
+  std::string output;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:o:")) != -1) {
+    switch (opt) {
+      case 'j':
+        threads = atoi(optarg);
+        if (threads < 1) Usage(argv[0]);
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      default:
+        Usage(argv[0]);
+    }
+  }
+  if (optind >= argc) Usage(argv[0]);
+  std::vector<std::string> paths(argv + optind, argv + argc);
+  try {
+    ResultFile merged;
+    ResultFile::MergeFiles(paths, threads, &merged);
+    if (output.empty()) {
+      merged.Write(std::cout);
+    } else {
+      std::ofstream out(output.c_str());
+      if (!out.is_open()) throw std::runtime_error("could not open output file " + output);
+      merged.Write(out);
+    }
+  } catch (std::exception &e) {
+    fprintf(stderr, "rdmerge: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
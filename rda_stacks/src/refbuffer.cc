@@ -0,0 +1,104 @@
+#include "refbuffer.h"
+#include <stdexcept>
+#include <unistd.h>
+
+const int RefBuffer::kDefaultChunkRefs;
+
+static void PutVarint(uint64_t value, std::vector<char> *out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+static uint64_t GetVarint(const char **pos, const char *end) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+    uint8_t c = *(*pos)++;
+    value |= static_cast<uint64_t>(c & 0x7f) << shift;
+    if (!(c & 0x80)) return value;
+  }
+  throw std::runtime_error("corrupt reference buffer spill file");
+}
+
+RefBuffer::RefBuffer(int chunk_refs) : chunk_refs_(chunk_refs), spill_file_(NULL),
+    spill_offset_(0), spilled_refs_(0) {
+  if (chunk_refs < 1) throw std::invalid_argument("reference buffer chunks must be > 0");
+  chunk_.reserve(chunk_refs_);
+}
+
+RefBuffer::~RefBuffer() {
+  if (spill_file_) fclose(spill_file_);
+}
+
+void RefBuffer::Clear() {
+  chunk_.clear();
+  spilled_.clear();
+  spill_offset_ = 0;
+  spilled_refs_ = 0;
+}
+
+void RefBuffer::Spill() {
+  if (spill_file_ == NULL) {
+    spill_file_ = tmpfile();
+    if (spill_file_ == NULL) throw std::runtime_error("could not create reference spill file");
+  }
+  encoded_.clear();
+  address_t last = 0;
+  for (std::vector<BufferedRef>::const_iterator ref = chunk_.begin(); ref != chunk_.end();
+       ++ref) {
+    // zigzag address delta, so both directions of a strided walk stay small
+    int64_t delta = static_cast<int64_t>(ref->address - last);
+    PutVarint((static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63),
+              &encoded_);
+    PutVarint(static_cast<uint64_t>(ref->size) << 1 | (ref->is_write ? 1 : 0), &encoded_);
+    last = ref->address;
+  }
+  // flushed right away so that readers can pread() it without touching the FILE
+  if (fseeko(spill_file_, spill_offset_, SEEK_SET) != 0 ||
+      fwrite(&encoded_[0], 1, encoded_.size(), spill_file_) != encoded_.size() ||
+      fflush(spill_file_) != 0) {
+    throw std::runtime_error("error writing reference spill file");
+  }
+  SpilledChunk spilled = {spill_offset_, static_cast<int>(encoded_.size()),
+                          static_cast<int>(chunk_.size())};
+  spilled_.push_back(spilled);
+  spill_offset_ += encoded_.size();
+  spilled_refs_ += chunk_.size();
+  chunk_.clear();
+}
+
+RefBuffer::Reader::Reader(const RefBuffer &buffer) : buffer_(buffer), next_chunk_(0),
+    refs_(&decoded_), position_(0) {
+}
+
+bool RefBuffer::Reader::NextChunk() {
+  position_ = 0;
+  if (next_chunk_ > buffer_.spilled_.size()) return false;
+  if (next_chunk_ == buffer_.spilled_.size()) {
+    next_chunk_++;
+    refs_ = &buffer_.chunk_;
+    return !refs_->empty();
+  }
+  const SpilledChunk &chunk = buffer_.spilled_[next_chunk_++];
+  std::vector<char> encoded(chunk.bytes);
+  if (pread(fileno(buffer_.spill_file_), &encoded[0], chunk.bytes, chunk.offset) != chunk.bytes) {
+    throw std::runtime_error("error reading reference spill file");
+  }
+  decoded_.resize(chunk.refs);
+  const char *pos = &encoded[0];
+  const char *end = pos + encoded.size();
+  address_t address = 0;
+  for (int i = 0; i < chunk.refs; i++) {
+    uint64_t zigzag = GetVarint(&pos, end);
+    address += static_cast<address_t>(static_cast<int64_t>(zigzag >> 1) ^
+                                      -static_cast<int64_t>(zigzag & 1));
+    uint64_t size_write = GetVarint(&pos, end);
+    decoded_[i].address = address;
+    decoded_[i].size = static_cast<uint8_t>(size_write >> 1);
+    decoded_[i].is_write = static_cast<uint8_t>(size_write & 1);
+  }
+  refs_ = &decoded_;
+  return true;
+}
@@ -0,0 +1,71 @@
+#ifndef REFBUFFER_H_
+#define REFBUFFER_H_
+
+#include <cstdio>
+#include <vector>
+#include "reusestack.h"
+
+/*
+ * Buffers one thread's references for replay at the end of a parallel region with bounded
+ * memory. References are kept in memory in chunks; full chunks are compressed (address deltas
+ * and sizes as varints, about 3 bytes per reference instead of 10) and spilled to a temporary
+ * file, and are read back a chunk at a time by a Reader. Throws std::runtime_error if the
+ * temporary file can't be created or written.
+ */
+class RefBuffer {
+public:
+  static const int kDefaultChunkRefs = 1 << 16;
+  explicit RefBuffer(int chunk_refs = kDefaultChunkRefs);
+  ~RefBuffer();
+  void Append(address_t address, int size, bool is_write) {
+    BufferedRef ref;
+    ref.address = address;
+    ref.is_write = is_write;
+    ref.size = size;
+    chunk_.push_back(ref);
+    if (chunk_.size() == chunk_refs_) Spill();
+  }
+  // Discards all references (the temporary file is kept for reuse)
+  void Clear();
+  acc_count_t size() const { return spilled_refs_ + chunk_.size(); }
+  int64_t spilled_bytes() const { return spill_offset_; }
+
+  // Reads the references back in order. The buffer must not be changed while reading, but any
+  // number of readers can read it at the same time, from different threads.
+  class Reader {
+  public:
+    explicit Reader(const RefBuffer &buffer);
+    bool Next(BufferedRef *ref) {
+      if (position_ == refs_->size() && !NextChunk()) return false;
+      *ref = (*refs_)[position_++];
+      return true;
+    }
+  private:
+    bool NextChunk();
+    const RefBuffer &buffer_;
+    size_t next_chunk_;  ///< next spilled chunk to read, then the in-memory one
+    std::vector<BufferedRef> decoded_;
+    const std::vector<BufferedRef> *refs_;  ///< decoded_ or the buffer's in-memory chunk
+    size_t position_;
+    DISALLOW_COPY_AND_ASSIGN(Reader);
+  };
+
+private:
+  struct SpilledChunk {
+    int64_t offset;
+    int bytes;
+    int refs;
+  };
+  void Spill();
+
+  const size_t chunk_refs_;
+  std::vector<BufferedRef> chunk_;
+  std::vector<SpilledChunk> spilled_;
+  std::vector<char> encoded_;  ///< encoding buffer, kept to avoid reallocating
+  FILE *spill_file_;  ///< created on the first spill
+  int64_t spill_offset_;
+  acc_count_t spilled_refs_;
+  DISALLOW_COPY_AND_ASSIGN(RefBuffer);
+};
+
+#endif /* REFBUFFER_H_ */
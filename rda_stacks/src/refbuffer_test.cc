@@ -0,0 +1,62 @@
+#include <vector>
+#include <gtest/gtest.h>
+#include "refbuffer.h"
+
+static void Fill(RefBuffer *buffer, std::vector<BufferedRef> *expected, int count, int seed) {
+  address_t address = 0x7fff0000 + seed;
+  for (int i = 0; i < count; i++) {
+    // mostly small strides in both directions, with some far jumps
+    address += (i % 7 == 0) ? -24 : 8;
+    if (i % 1000 == seed) address ^= static_cast<address_t>(i) << 40;
+    BufferedRef ref;
+    ref.address = address;
+    ref.size = 1 + (i + seed) % 64;
+    ref.is_write = i % 3 == 0;
+    expected->push_back(ref);
+    buffer->Append(ref.address, ref.size, ref.is_write);
+  }
+}
+
+static void ExpectContents(const RefBuffer &buffer, const std::vector<BufferedRef> &expected) {
+  EXPECT_EQ(static_cast<acc_count_t>(expected.size()), buffer.size());
+  RefBuffer::Reader reader(buffer);
+  BufferedRef ref;
+  for (size_t i = 0; i < expected.size(); i++) {
+    ASSERT_TRUE(reader.Next(&ref)) << i;
+    EXPECT_EQ(expected[i].address, ref.address) << i;
+    EXPECT_EQ(expected[i].size, ref.size) << i;
+    EXPECT_EQ(expected[i].is_write, ref.is_write) << i;
+  }
+  EXPECT_FALSE(reader.Next(&ref));
+}
+
+TEST(RefBufferTest, InMemory) {
+  RefBuffer buffer;
+  std::vector<BufferedRef> expected;
+  ExpectContents(buffer, expected);
+  Fill(&buffer, &expected, 1000, 1);
+  ExpectContents(buffer, expected);
+  EXPECT_EQ(0, buffer.spilled_bytes());
+}
+
+TEST(RefBufferTest, Spill) {
+  const int kChunk = 1000;
+  RefBuffer buffer(kChunk);
+  std::vector<BufferedRef> expected;
+  Fill(&buffer, &expected, 10 * kChunk + 123, 2);
+  ExpectContents(buffer, expected);
+  ExpectContents(buffer, expected);  // can be read more than once
+  EXPECT_GT(buffer.spilled_bytes(), 0);
+  EXPECT_LT(buffer.spilled_bytes(), 10 * kChunk * static_cast<int64_t>(sizeof(BufferedRef)) / 3);
+
+  // appending after reading, and exactly full chunks
+  Fill(&buffer, &expected, kChunk - 123, 3);
+  ExpectContents(buffer, expected);
+
+  // the spill file is reused after a clear
+  buffer.Clear();
+  expected.clear();
+  ExpectContents(buffer, expected);
+  Fill(&buffer, &expected, 3 * kChunk + 5, 4);
+  ExpectContents(buffer, expected);
+}
@@ -0,0 +1,81 @@
+#include "refpipeline.h"
+#include <new>
+#include <stdexcept>
+
+const int RefPipeline::kDefaultRingSize;
+const int RefPipeline::kBatchSize;
+
+RefPipeline::RefPipeline(StackHolder *stacks, int ring_size) : stacks_(stacks),
+    refs_(stacks->max_threads(), ring_size), stop_(false), failed_(false), bad_alloc_(false) {
+  RdaInitLock(&stacks_lock_);
+  if (pthread_create(&analysis_thread_, NULL, AnalysisMain, this) != 0) {
+    throw std::runtime_error("could not start the analysis thread");
+  }
+}
+
+RefPipeline::~RefPipeline() {
+  refs_.WaitUntilPopped(refs_.pushed());
+  stop_ = true;
+  pthread_join(analysis_thread_, NULL);
+}
+
+void *RefPipeline::AnalysisMain(void *arg) {
+  static_cast<RefPipeline *>(arg)->Run();
+  return NULL;
+}
+
+void RefPipeline::Run() {
+  PipelineRef ref;
+  for (int spins = 0; ; spins++) {
+    if (!refs_.Front(&ref)) {
+      // the next reference has not been pushed yet, or nothing is left
+      if (stop_ && refs_.popped() == refs_.pushed()) break;
+      SpscRing<PipelineRef>::Wait(spins);
+      continue;
+    }
+    spins = 0;
+    RdaGetLock(&stacks_lock_);
+    for (int i = 0; i < kBatchSize && refs_.Front(&ref); i++) {
+      if (!failed_) Process(ref);
+      refs_.Pop();
+    }
+    RdaReleaseLock(&stacks_lock_);
+  }
+}
+
+void RefPipeline::Process(const PipelineRef &ref) {
+  try {
+    if (ref.type == ReuseStackBase::kFetch) {
+      stacks_->Fetch(ref.thread, ref.PC, ref.size);
+    } else {
+      stacks_->Access(ref.thread, ref.address, ref.size, ref.PC,
+                      ref.type == ReuseStackBase::kWrite);
+    }
+  } catch (std::bad_alloc &e) {
+    bad_alloc_ = true;
+    failed_ = true;
+  } catch (std::exception &e) {
+    error_ = e.what();
+    failed_ = true;
+  }
+}
+
+void RefPipeline::Drain() {
+  LockStacks();
+  UnlockStacks();
+}
+
+void RefPipeline::LockStacks() {
+  refs_.WaitUntilPopped(refs_.pushed());
+  RdaGetLock(&stacks_lock_);
+  try {
+    if (failed_) {
+      if (bad_alloc_) throw std::bad_alloc();
+      throw std::runtime_error(error_);
+    }
+    stacks_->Drain();
+  } catch (...) {
+    RdaReleaseLock(&stacks_lock_);
+    throw;
+  }
+}
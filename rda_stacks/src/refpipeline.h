@@ -0,0 +1,70 @@
+#ifndef REFPIPELINE_H_
+#define REFPIPELINE_H_
+
+#include <pthread.h>
+#include <string>
+#include "orderedrings.h"
+#include "rda-sync.h"
+#include "stackholder.h"
+
+/*
+ * Decouples the instrumented program from the analysis. Application threads only append their
+ * references to their own lock-free ring (see OrderedRings). An analysis thread takes them out in
+ * one global order, as if the references had been serialized by a lock, and passes them to the
+ * StackHolder. The stack holder's variant and replay threads spread the rest of the work.
+ *
+ * Everything else done with the stack holder while the pipeline runs (allocating threads, ending
+ * regions, dumping) has to go between LockStacks and UnlockStacks.
+ */
+class RefPipeline {
+public:
+  static const int kDefaultRingSize = 1 << 14;  ///< references per application thread
+  explicit RefPipeline(StackHolder *stacks, int ring_size = kDefaultRingSize);
+  // Passes on everything appended so far and stops the analysis thread
+  ~RefPipeline();
+  // Called by application thread 'thread' only. Throws std::invalid_argument for thread ids
+  // the stack holder does not take.
+  void Access(int thread, address_t address, int size, address_t PC, bool is_write) {
+    Append(thread, address, size, PC, is_write ? ReuseStackBase::kWrite : ReuseStackBase::kRead);
+  }
+  void Fetch(int thread, address_t PC, int size) {
+    Append(thread, PC, size, PC, ReuseStackBase::kFetch);
+  }
+  // Waits until every reference appended before the call has been passed to the stack holder
+  // (and handled by its variant threads). Throws if the analysis thread failed.
+  void Drain();
+  // Drain, then keep the analysis thread away from the stack holder until UnlockStacks
+  void LockStacks();
+  void UnlockStacks() { RdaReleaseLock(&stacks_lock_); }
+  uint64_t ref_count() const { return refs_.pushed(); }
+
+private:
+  struct PipelineRef {
+    address_t address;
+    address_t PC;
+    int size;
+    int16_t thread;
+    uint8_t type;  ///< a ReuseStackBase::AccessType
+  };
+  static const int kBatchSize = 1024;  ///< references handled per acquisition of the lock
+
+  void Append(int thread, address_t address, int size, address_t PC, uint8_t type) {
+    PipelineRef ref = {address, PC, size, static_cast<int16_t>(thread), type};
+    refs_.Push(thread, ref);
+  }
+  static void *AnalysisMain(void *arg);
+  void Run();
+  void Process(const PipelineRef &ref);
+
+  StackHolder *stacks_;
+  OrderedRings<PipelineRef> refs_;  ///< one ring per application thread
+  RdaLock stacks_lock_;  ///< held by the analysis thread while it drives the stack holder
+  pthread_t analysis_thread_;
+  volatile bool stop_;
+  volatile bool failed_;  ///< the rest of the references are dropped
+  bool bad_alloc_;
+  std::string error_;
+  DISALLOW_COPY_AND_ASSIGN(RefPipeline);
+};
+
+#endif /* REFPIPELINE_H_ */
@@ -0,0 +1,158 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <gtest/gtest.h>
+#include "refpipeline.h"
+#include "resultfile.h"
+
+using std::string;
+
+static const int kProducers = 4;
+static const int kRefsPerProducer = 20000;
+
+class RefPipelineTest : public testing::Test {
+protected:
+  static string OutputPath(const char *name) {
+    std::ostringstream path;
+    path << "/tmp/refpipeline_test_" << getpid() << "_" << name;
+    return path.str();
+  }
+  static string ReadAll(const string &path) {
+    std::ifstream in(path.c_str());
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+  }
+  static void Configure(StackHolder *stacks) {
+    stacks->set_do_lazy_stacks(true);
+    stacks->set_do_shared(true);
+    for (int t = 0; t < kProducers; t++) stacks->Allocate(t);
+  }
+  static address_t Address(int thread, int i) {
+    return ((i * 7919 + thread * 131) % 3000) * 8;
+  }
+};
+
+// With one application thread, the stacks see exactly what direct calls would give them
+TEST_F(RefPipelineTest, SameAsDirect) {
+  string direct_path(OutputPath("direct"));
+  string piped_path(OutputPath("piped"));
+  {
+    StackHolder direct(direct_path, 64, "exact");
+    StackHolder piped(piped_path, 64, "exact");
+    Configure(&direct);
+    Configure(&piped);
+    RefPipeline pipeline(&piped, 64);  // small, so it fills up
+    for (int i = 0; i < kRefsPerProducer; i++) {
+      int thread = i % kProducers;
+      direct.Access(thread, Address(thread, i), 4, 0x400000 + i % 11, i % 3 == 0);
+      pipeline.Access(thread, Address(thread, i), 4, 0x400000 + i % 11, i % 3 == 0);
+      if (i % 5000 == 4999) {
+        direct.EndParallelRegion();
+        pipeline.LockStacks();
+        piped.EndParallelRegion();
+        pipeline.UnlockStacks();
+      }
+    }
+    EXPECT_EQ(static_cast<uint64_t>(kRefsPerProducer), pipeline.ref_count());
+    pipeline.Drain();
+    direct.DumpStatsPython("");
+    piped.DumpStatsPython("");
+  }
+  string expected(ReadAll(direct_path));
+  EXPECT_FALSE(expected.empty());
+  EXPECT_EQ(expected, ReadAll(piped_path));
+  unlink(direct_path.c_str());
+  unlink(piped_path.c_str());
+}
+
+struct ProducerArgs {
+  RefPipeline *pipeline;
+  int thread;
+};
+
+static void *Produce(void *arg) {
+  ProducerArgs *args = static_cast<ProducerArgs *>(arg);
+  for (int i = 0; i < kRefsPerProducer; i++) {
+    // private addresses, so the result does not depend on the interleaving
+    args->pipeline->Access(args->thread, (args->thread << 20) + (i % 500) * 64, 8, 0x400000,
+                           i % 2 == 0);
+  }
+  return NULL;
+}
+
+// Every reference of every application thread arrives
+TEST_F(RefPipelineTest, ManyThreads) {
+  string path(OutputPath("threads"));
+  {
+    StackHolder stacks(path, 64, "exact");
+    stacks.set_variant_threads(true);
+    Configure(&stacks);
+    RefPipeline pipeline(&stacks, 256);
+    pthread_t producers[kProducers];
+    ProducerArgs args[kProducers];
+    for (int t = 0; t < kProducers; t++) {
+      args[t].pipeline = &pipeline;
+      args[t].thread = t;
+      ASSERT_EQ(0, pthread_create(&producers[t], NULL, Produce, &args[t]));
+    }
+    for (int t = 0; t < kProducers; t++) pthread_join(producers[t], NULL);
+    pipeline.LockStacks();
+    stacks.EndParallelRegion();
+    stacks.DumpStatsPython("");
+    pipeline.UnlockStacks();
+  }
+  ResultFile result;
+  result.ReadFile(path);
+  for (int t = 0; t < kProducers; t++) {
+    std::ostringstream name;
+    name << "simStacks[" << t << "]";
+    const ResultValue *stack = result.Find(name.str());
+    ASSERT_TRUE(stack != NULL) << name.str();
+    const ResultValue *attributes = stack->Find("attributes");
+    ASSERT_TRUE(attributes != NULL);
+    EXPECT_EQ(kRefsPerProducer, attributes->Find("accessCount")->AsInt()) << name.str();
+    EXPECT_EQ(500, attributes->Find("coldCount")->AsInt()) << name.str();
+  }
+  const ResultValue *shared = result.Find("simSharedStack");
+  ASSERT_TRUE(shared != NULL);
+  EXPECT_EQ(kProducers * kRefsPerProducer,
+            shared->Find("attributes")->Find("accessCount")->AsInt());
+  unlink(path.c_str());
+}
+
+TEST_F(RefPipelineTest, BadThread) {
+  string path(OutputPath("bad"));
+  {
+    StackHolder stacks(path, 64, "exact", 8);
+    RefPipeline pipeline(&stacks);
+    EXPECT_THROW(pipeline.Access(8, 0, 4, 0, false),
+                 std::invalid_argument);
+    EXPECT_THROW(pipeline.Access(-1, 0, 4, 0, false), std::invalid_argument);
+    EXPECT_EQ(0u, pipeline.ref_count());
+  }
+  unlink(path.c_str());
+}
+
+// The pipeline's rings are sized by the stack holder's thread limit, not by 64
+TEST_F(RefPipelineTest, WideThreadLimit) {
+  const int kThreads = 130;
+  string path(OutputPath("many"));
+  {
+    StackHolder stacks(path, 64, "exact", kThreads);
+    stacks.set_do_single_stacks(false);
+    stacks.set_do_shared(true);
+    for (int t = 0; t < kThreads; t++) stacks.Allocate(t);
+    RefPipeline pipeline(&stacks);
+    pipeline.Access(6, 0x1000, 4, 0, false);
+    pipeline.Access(kThreads - 1, 0x1000, 4, 0, true);
+    EXPECT_THROW(pipeline.Access(kThreads, 0x1000, 4, 0, false), std::invalid_argument);
+    pipeline.LockStacks();
+    EXPECT_EQ(kInvalidationMiss, stacks.Access(6, 0x1000, 4, 0, false));
+    pipeline.UnlockStacks();
+    EXPECT_EQ(2u, pipeline.ref_count());
+  }
+  unlink(path.c_str());
+}
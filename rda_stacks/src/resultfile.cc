@@ -0,0 +1,626 @@
+#include "resultfile.h"
+#include <pthread.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include "rdbinary.h"
+#include "reusestackstats.h"
+
+static void SkipSpace(const std::string &text, size_t *pos) {
+  while (*pos < text.size() && isspace(text[*pos])) (*pos)++;
+}
+
+static void ParseError(const std::string &text, size_t pos, const char *what) {
+  throw std::runtime_error(boost::str(boost::format("%s at column %u: %.40s") % what % pos %
+                                      text.substr(pos)));
+}
+
+ResultValue ResultValue::Parse(const std::string &text, size_t *pos) {
+  ResultValue value;
+  SkipSpace(text, pos);
+  if (*pos >= text.size()) ParseError(text, *pos, "unexpected end of value");
+  char c = text[*pos];
+  if (c == '{' || c == '[' || c == '(') {
+    char close = c == '{' ? '}' : (c == '[' ? ']' : ')');
+    value.type_ = c == '{' ? kDict : (c == '[' ? kList : kTuple);
+    (*pos)++;
+    for (;;) {
+      SkipSpace(text, pos);
+      if (*pos >= text.size()) ParseError(text, *pos, "unterminated container");
+      if (text[*pos] == close) break;
+      if (value.type_ == kDict) {
+        ResultValue key(Parse(text, pos));
+        SkipSpace(text, pos);
+        if (*pos >= text.size() || text[*pos] != ':') ParseError(text, *pos, "expected ':'");
+        (*pos)++;
+        value.Set(key, Parse(text, pos));
+      } else {
+        value.items_.push_back(Parse(text, pos));
+      }
+      SkipSpace(text, pos);
+      if (*pos < text.size() && text[*pos] == ',') {
+        (*pos)++;
+      } else if (*pos >= text.size() || text[*pos] != close) {
+        ParseError(text, *pos, "expected ',' or end of container");
+      }
+    }
+    (*pos)++;
+  } else if (c == '\'' || c == '"') {
+    size_t end = *pos + 1;
+    while (end < text.size() && text[end] != c) {
+      if (text[end] == '\\') end++;
+      end++;
+    }
+    if (end >= text.size()) ParseError(text, *pos, "unterminated string");
+    value.type_ = kString;
+    value.quote_ = c;
+    value.text_ = text.substr(*pos + 1, end - *pos - 1);
+    *pos = end + 1;
+  } else {
+    size_t start = *pos;
+    if (c == '-' || c == '+') (*pos)++;
+    while (*pos < text.size() && (isalnum(text[*pos]) || text[*pos] == '.' || text[*pos] == '_' ||
+           ((text[*pos] == '-' || text[*pos] == '+') &&
+            (text[*pos - 1] == 'e' || text[*pos - 1] == 'E')))) {
+      (*pos)++;
+    }
+    value.text_ = text.substr(start, *pos - start);
+    if (value.text_.empty()) ParseError(text, start, "unexpected character");
+    const char *token = value.text_.c_str();
+    const char *digits = (c == '-' || c == '+') ? token + 1 : token;
+    char *end;
+    if (digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+      value.type_ = kInt;
+      value.int_ = static_cast<int64_t>(strtoull(digits, &end, 16));
+      if (c == '-') value.int_ = -value.int_;
+    } else if (isdigit(digits[0]) || digits[0] == '.') {
+      value.int_ = strtoll(token, &end, 10);
+      if (*end != '\0') {
+        value.type_ = kFloat;
+        value.float_ = strtod(token, &end);
+        const char *point = strchr(token, '.');
+        value.decimals_ = point ? strcspn(point + 1, "eE") : 0;
+      } else {
+        value.type_ = kInt;
+      }
+    } else if (strcmp(digits, "nan") == 0 || strcmp(digits, "inf") == 0) {
+      value.type_ = kFloat;
+      value.float_ = strtod(token, &end);
+      end = const_cast<char *>(token) + value.text_.size();
+    } else {
+      value.type_ = kOther;  // True, False, None
+      end = const_cast<char *>(token) + value.text_.size();
+      SkipSpace(text, pos);
+      if (*pos < text.size() && text[*pos] == '(') ParseError(text, start, "calls are not literals");
+    }
+    if (*end != '\0') ParseError(text, start, "bad number");
+  }
+  return value;
+}
+
+ResultValue ResultValue::MakeInt(int64_t value) {
+  ResultValue result;
+  result.SetInt(value);
+  return result;
+}
+
+ResultValue ResultValue::MakeHexInt(uint64_t value) {
+  ResultValue result;
+  result.type_ = kInt;
+  result.int_ = static_cast<int64_t>(value);
+  result.text_ = boost::str(boost::format("0x%x") % value);
+  return result;
+}
+
+ResultValue ResultValue::MakeDouble(double value, int decimals) {
+  ResultValue result;
+  result.SetDouble(value);
+  result.decimals_ = decimals;
+  return result;
+}
+
+ResultValue ResultValue::MakeString(const std::string &value) {
+  ResultValue result;
+  result.type_ = kString;
+  result.text_ = value;
+  return result;
+}
+
+void ResultValue::SetInt(int64_t value) {
+  type_ = kInt;
+  int_ = value;
+  text_.clear();
+}
+
+void ResultValue::SetDouble(double value) {
+  type_ = kFloat;
+  float_ = value;
+  text_.clear();
+}
+
+std::string ResultValue::KeyText(const ResultValue &key) {
+  return key.text_.empty() ? key.ToString() : key.text_;
+}
+
+const ResultValue *ResultValue::Find(const std::string &key) const {
+  std::tr1::unordered_map<std::string, int>::const_iterator iter = index_.find(key);
+  return iter == index_.end() ? NULL : &items_[iter->second];
+}
+
+ResultValue *ResultValue::Find(const std::string &key) {
+  std::tr1::unordered_map<std::string, int>::const_iterator iter = index_.find(key);
+  return iter == index_.end() ? NULL : &items_[iter->second];
+}
+
+void ResultValue::Set(const ResultValue &key, const ResultValue &value) {
+  std::string text(KeyText(key));
+  std::tr1::unordered_map<std::string, int>::iterator iter = index_.find(text);
+  if (iter != index_.end()) {
+    items_[iter->second] = value;
+  } else {
+    index_[text] = items_.size();
+    keys_.push_back(key);
+    items_.push_back(value);
+  }
+}
+
+void ResultValue::Merge(const ResultValue &other) {
+  if (IsNumber() && other.IsNumber()) {
+    if (type_ == kInt && other.type_ == kInt) {
+      SetInt(int_ + other.int_);
+    } else {
+      SetDouble(AsDouble() + other.AsDouble());
+    }
+  } else if (type_ == kDict && other.type_ == kDict) {
+    if (IsStackDump() && other.IsStackDump()) {
+      MergeStackDump(other);
+      return;
+    }
+    for (unsigned int i = 0; i < other.items_.size(); i++) {
+      ResultValue *mine = Find(KeyText(other.keys_[i]));
+      if (mine) {
+        mine->Merge(other.items_[i]);
+      } else {
+        Set(other.keys_[i], other.items_[i]);
+      }
+    }
+  } else if (type_ == other.type_ && (type_ == kList || type_ == kTuple)) {
+    for (unsigned int i = 0; i < other.items_.size(); i++) {
+      if (i < items_.size()) {
+        items_[i].Merge(other.items_[i]);
+      } else {
+        items_.push_back(other.items_[i]);
+      }
+    }
+  } else if (type_ != other.type_) {
+    throw std::runtime_error("cannot merge values of different types: " + ToString() + " and " +
+                             other.ToString());
+  }
+  // strings and other tokens keep the first value
+}
+
+bool ResultValue::IsStackDump() const {
+  const ResultValue *histogram = Find("histogram");
+  const ResultValue *attributes = Find("attributes");
+  return histogram && attributes && histogram->type_ == kDict && attributes->type_ == kDict;
+}
+
+// Histograms and counts are summed; per-access averages are weighted by access count, the stack
+// size is the max over the inputs (a lower bound when the inputs touched disjoint data), and
+// everything derived from the histogram is recomputed.
+void ResultValue::MergeStackDump(const ResultValue &other) {
+  static const char *kWeightedAttributes[] = { "avgSize", "addrPerSamp" };
+  ResultValue *attributes = Find("attributes");
+  const ResultValue *other_attributes = other.Find("attributes");
+  const ResultValue *weight = attributes->Find("accessCount");
+  const ResultValue *other_weight = other_attributes->Find("accessCount");
+  double weighted[2] = { 0.0, 0.0 };
+  for (int i = 0; i < 2; i++) {
+    const ResultValue *mine = attributes->Find(kWeightedAttributes[i]);
+    const ResultValue *theirs = other_attributes->Find(kWeightedAttributes[i]);
+    if (mine && theirs && weight && other_weight) {
+      // averages over zero accesses are nan and carry no weight
+      if (weight->AsDouble()) weighted[i] += mine->AsDouble() * weight->AsDouble();
+      if (other_weight->AsDouble()) weighted[i] += theirs->AsDouble() * other_weight->AsDouble();
+    }
+  }
+  ResultValue *stack_size = attributes->Find("stackSize");
+  const ResultValue *other_stack_size = other_attributes->Find("stackSize");
+  int64_t max_stack_size = 0;
+  if (stack_size && other_stack_size) {
+    max_stack_size = std::max(stack_size->AsInt(), other_stack_size->AsInt());
+  }
+
+  for (unsigned int i = 0; i < other.items_.size(); i++) {
+    ResultValue *mine = Find(KeyText(other.keys_[i]));
+    if (mine) {
+      mine->Merge(other.items_[i]);
+    } else {
+      Set(other.keys_[i], other.items_[i]);
+    }
+  }
+
+  attributes = Find("attributes");
+  weight = attributes->Find("accessCount");
+  for (int i = 0; i < 2; i++) {
+    ResultValue *merged = attributes->Find(kWeightedAttributes[i]);
+    if (merged && weight && other_weight && other_attributes->Find(kWeightedAttributes[i])) {
+      merged->SetDouble(weight->AsDouble() ? weighted[i] / weight->AsDouble() : 0.0);
+    }
+  }
+  if (stack_size && other_stack_size) attributes->Find("stackSize")->SetInt(max_stack_size);
+  RecomputeStackAttributes();
+}
+
+void ResultValue::RecomputeStackAttributes() {
+  const ResultValue *histogram = Find("histogram");
+  ResultValue *attributes = Find("attributes");
+  std::vector<ReuseStackStats::HistogramEntry> entries;
+  for (unsigned int i = 0; i < histogram->items_.size(); i++) {
+    entries.push_back(ReuseStackStats::HistogramEntry(histogram->keys_[i].AsDouble(),
+                                                      histogram->items_[i].AsInt()));
+  }
+  const ResultValue *total_distance = attributes->Find("totalDist");
+  const ResultValue *prediction_accesses = attributes->Find("totalPredictionAccesses");
+  const ResultValue *prediction_hits = attributes->Find("totalPredictionHits");
+  ReuseStackStats stats(1);  // block size only affects predictions, which are not recomputed
+  stats.AddDumpedStats(entries, total_distance ? total_distance->AsInt() : 0,
+                       prediction_accesses ? prediction_accesses->AsInt() : 0,
+                       prediction_hits ? prediction_hits->AsInt() : 0);
+  std::string derived_text("{" + stats.GetAttributes() + "}");
+  size_t pos = 0;
+  ResultValue derived(Parse(derived_text, &pos));
+  for (unsigned int i = 0; i < derived.items_.size(); i++) {
+    ResultValue *attribute = attributes->Find(KeyText(derived.keys_[i]));
+    if (attribute) *attribute = derived.items_[i];
+  }
+}
+
+std::string ResultValue::ToString() const {
+  std::string out;
+  WriteTo(&out);
+  return out;
+}
+
+void ResultValue::WriteTo(std::string *out) const {
+  switch (type_) {
+    case kDict:
+      *out += "{";
+      for (unsigned int i = 0; i < items_.size(); i++) {
+        keys_[i].WriteTo(out);
+        *out += ":";
+        items_[i].WriteTo(out);
+        *out += ", ";
+      }
+      *out += "}";
+      break;
+    case kList:
+    case kTuple:
+      *out += type_ == kList ? "[" : "(";
+      for (unsigned int i = 0; i < items_.size(); i++) {
+        items_[i].WriteTo(out);
+        *out += ", ";
+      }
+      *out += type_ == kList ? "]" : ")";
+      break;
+    case kString:
+      *out += quote_;
+      *out += text_;
+      *out += quote_;
+      break;
+    case kInt:
+      *out += text_.empty() ? boost::str(boost::format("%d") % int_) : text_;
+      break;
+    case kFloat:
+      if (text_.empty()) {
+        *out += boost::str(boost::format(boost::str(boost::format("%%.%df") % decimals_)) % float_);
+      } else {
+        *out += text_;
+      }
+      break;
+    default:
+      *out += text_;
+  }
+}
+
+// A per-PC entry is (total distance, sample count, {bucket: (count, avg distance) or count})
+static void MergeDistanceStats(ResultValue *into, const ResultValue &from) {
+  if (into->type() != ResultValue::kTuple || from.type() != ResultValue::kTuple ||
+      into->size() != 3 || from.size() != 3) {
+    throw std::runtime_error("bad per-PC distance entry: " + from.ToString());
+  }
+  into->item(0).Merge(from.item(0));
+  into->item(1).Merge(from.item(1));
+  ResultValue *histogram = &into->item(2);
+  const ResultValue &other_histogram = from.item(2);
+  for (int i = 0; i < other_histogram.size(); i++) {
+    const ResultValue &bucket = other_histogram.item(i);
+    ResultValue *mine = histogram->Find(other_histogram.key(i).text());
+    if (mine && mine->type() == ResultValue::kTuple && bucket.type() == ResultValue::kTuple) {
+      double count = mine->item(0).AsDouble();
+      double other_count = bucket.item(0).AsDouble();
+      double average = count + other_count == 0 ? 0.0 :
+          (mine->item(1).AsDouble() * count + bucket.item(1).AsDouble() * other_count)
+          / (count + other_count);
+      mine->item(0).Merge(bucket.item(0));
+      mine->item(1).SetDouble(average);
+    } else if (mine) {
+      mine->Merge(bucket);
+    } else {
+      histogram->Set(other_histogram.key(i), bucket);
+    }
+  }
+}
+
+static void MergePCDist(ResultValue *into, const ResultValue &from) {
+  if (into->type() == ResultValue::kTuple) {
+    MergeDistanceStats(into, from);  // aggregate of evicted PCs
+    return;
+  }
+  for (int i = 0; i < from.size(); i++) {
+    ResultValue *mine = into->Find(from.key(i).text());
+    if (mine) {
+      MergeDistanceStats(mine, from.item(i));
+    } else {
+      into->Set(from.key(i), from.item(i));
+    }
+  }
+}
+
+static bool IsName(const std::string &name) {
+  if (name.empty() || !(isalpha(name[0]) || name[0] == '_')) return false;
+  for (unsigned int i = 0; i < name.size(); i++) {
+    if (!isalnum(name[i]) && name[i] != '_' && name[i] != '[' && name[i] != ']') return false;
+  }
+  return true;
+}
+
+static const std::string kRddataPrefix("#rddata ");
+static const std::string kIntervalPrefix("#rdinterval ");
+static const std::string kPredsPrefix("#preds ");
+
+void ResultFile::Parse(std::istream &in) {
+  entries_.clear();
+  index_.clear();
+  merged_count_ = 1;
+  std::string line;
+  std::string last_rddata;
+  int line_number = 0;
+  while (std::getline(in, line)) {
+    ParseLine(line, ++line_number, &last_rddata);
+  }
+}
+
+void ResultFile::ParseLine(const std::string &line, int line_number, std::string *last_rddata) {
+  Entry entry;
+  size_t pos = 0;
+  bool required = false;
+  if (line.compare(0, kRddataPrefix.size(), kRddataPrefix) == 0 ||
+      line.compare(0, kIntervalPrefix.size(), kIntervalPrefix) == 0) {
+    required = true;
+    entry.prefix = line[3] == 'd' ? kRddataPrefix : kIntervalPrefix;
+    size_t equals = line.find('=');
+    if (equals == std::string::npos) {
+      throw std::runtime_error(boost::str(boost::format("line %d: missing '='") % line_number));
+    }
+    entry.name = line.substr(entry.prefix.size(), equals - entry.prefix.size());
+    entry.name.erase(entry.name.find_last_not_of(' ') + 1);
+    if (entry.prefix == kRddataPrefix) {
+      *last_rddata = entry.name;
+      entry.key = entry.name;
+    } else {
+      entry.key = kIntervalPrefix + entry.name;
+    }
+    pos = equals + 1;
+  } else if (line.compare(0, kPredsPrefix.size(), kPredsPrefix) == 0) {
+    required = true;
+    entry.prefix = kPredsPrefix;
+    entry.key = kPredsPrefix + *last_rddata;
+    pos = kPredsPrefix.size();
+  } else {
+    size_t equals = line.find(" = ");
+    if (equals != std::string::npos && IsName(line.substr(0, equals))) {
+      entry.name = line.substr(0, equals);
+      entry.key = entry.name;
+      pos = equals + 3;
+    }
+  }
+  if (!entry.key.empty()) {
+    try {
+      entry.value = ResultValue::Parse(line, &pos);
+      SkipSpace(line, &pos);
+      if (pos != line.size()) ParseError(line, pos, "trailing characters");
+    } catch (std::runtime_error &e) {
+      if (required) {
+        throw std::runtime_error(boost::str(boost::format("line %d: %s") % line_number %
+                                            e.what()));
+      }
+      entry.key.clear();  // not a literal (e.g. the library map), keep it as text
+    }
+  }
+  if (entry.key.empty()) {
+    entry.name.clear();
+    entry.prefix.clear();
+    entry.text = line;
+  }
+  AddEntry(entry);
+}
+
+void ResultFile::ParseBinary(std::istream &in) {
+  entries_.clear();
+  index_.clear();
+  merged_count_ = 1;
+  BinaryResultReader reader(in);
+  BinaryRecord record;
+  std::string last_rddata;
+  int record_number = 0;
+  while (reader.Next(&record)) {
+    record_number++;
+    Entry entry;
+    entry.name = record.name;
+    entry.value = record.value;
+    switch (record.kind) {
+      case BinaryResultWriter::kDataRecord:
+        entry.prefix = kRddataPrefix;
+        entry.key = entry.name;
+        last_rddata = entry.name;
+        break;
+      case BinaryResultWriter::kIntervalRecord:
+        entry.prefix = kIntervalPrefix;
+        entry.key = kIntervalPrefix + entry.name;
+        break;
+      case BinaryResultWriter::kPredictionRecord:
+        entry.prefix = kPredsPrefix;
+        entry.key = kPredsPrefix + last_rddata;
+        break;
+      case BinaryResultWriter::kAssignmentRecord:
+        entry.key = entry.name;
+        break;
+      case BinaryResultWriter::kTextRecord: {
+        // handled line by line exactly as in a text file
+        size_t start = 0;
+        while (start < record.text.size()) {
+          size_t end = record.text.find('\n', start);
+          if (end == std::string::npos) end = record.text.size();
+          ParseLine(record.text.substr(start, end - start), record_number, &last_rddata);
+          start = end + 1;
+        }
+        continue;
+      }
+      case BinaryResultWriter::kLibraryMapRecord: {
+        // the same lines as the pintools' text output (LibraryMap::WritePython)
+        ParseLine("import collections", record_number, &last_rddata);
+        ParseLine("LME = collections.namedtuple('LME', 'name base top')", record_number,
+                  &last_rddata);
+        std::string line("LibraryMap = [");
+        for (int i = 0; i < record.value.size(); i++) {
+          const ResultValue &image = record.value.item(i);
+          if (image.size() != 3) throw std::runtime_error("bad library map in binary result file");
+          line += "LME('" + image.item(0).text() + "'," + image.item(1).ToString() + "," +
+              image.item(2).ToString() + "),";
+        }
+        ParseLine(line + "]", record_number, &last_rddata);
+        continue;
+      }
+      default:
+        continue;  // written by a newer librda, skip it
+    }
+    AddEntry(entry);
+  }
+}
+
+void ResultFile::ReadFile(const std::string &path) {
+  std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+  if (!in.is_open()) throw std::runtime_error("could not open result file " + path);
+  ResultFile file;
+  try {
+    if (BinaryResultReader::IsBinary(in)) {
+      file.ParseBinary(in);
+    } else {
+      file.Parse(in);
+    }
+  } catch (std::runtime_error &e) {
+    throw std::runtime_error(path + ": " + e.what());
+  }
+  Merge(file);
+}
+
+void ResultFile::AddEntry(const Entry &entry) {
+  if (!entry.key.empty()) {
+    std::tr1::unordered_map<std::string, int>::iterator iter = index_.find(entry.key);
+    if (iter != index_.end()) {
+      Entry &mine = entries_[iter->second];
+      if (entry.key.compare(0, 6, "PCDist") == 0) {
+        MergePCDist(&mine.value, entry.value);
+      } else {
+        mine.value.Merge(entry.value);
+      }
+      return;
+    }
+    index_[entry.key] = entries_.size();
+  }
+  entries_.push_back(entry);
+}
+
+void ResultFile::Merge(const ResultFile &other) {
+  if (merged_count_ == 0) {
+    *this = other;
+    return;
+  }
+  for (unsigned int i = 0; i < other.entries_.size(); i++) {
+    if (!other.entries_[i].key.empty()) AddEntry(other.entries_[i]);
+  }
+  merged_count_ += other.merged_count_;
+}
+
+void ResultFile::Write(std::ostream &out) const {
+  for (unsigned int i = 0; i < entries_.size(); i++) {
+    const Entry &entry = entries_[i];
+    if (entry.key.empty()) {
+      out << entry.text << "\n";
+    } else if (entry.name.empty()) {
+      out << entry.prefix << entry.value.ToString() << "\n";  // #preds lines have no name
+    } else {
+      out << entry.prefix << entry.name << " = " << entry.value.ToString() << "\n";
+    }
+  }
+  if (merged_count_ > 1) out << "#merged " << merged_count_ << " result files\n";
+}
+
+const ResultValue *ResultFile::Find(const std::string &name) const {
+  std::tr1::unordered_map<std::string, int>::const_iterator iter = index_.find(name);
+  return iter == index_.end() ? NULL : &entries_[iter->second].value;
+}
+
+struct MergeTask {
+  const std::vector<std::string> *paths;
+  int begin;
+  int end;
+  ResultFile result;
+  std::string error;
+};
+
+static void *MergeWorker(void *arg) {
+  MergeTask *task = reinterpret_cast<MergeTask *>(arg);
+  try {
+    for (int i = task->begin; i < task->end; i++) {
+      task->result.ReadFile((*task->paths)[i]);
+    }
+  } catch (std::exception &e) {
+    task->error = e.what();
+  }
+  return NULL;
+}
+
+// Each thread merges a contiguous range of files, and the partial results are merged in order,
+// so the output does not depend on scheduling.
+void ResultFile::MergeFiles(const std::vector<std::string> &paths, int threads, ResultFile *out) {
+  int file_count = paths.size();
+  if (threads > file_count) threads = file_count;
+  if (threads < 1) threads = 1;
+  std::vector<MergeTask> tasks(threads);
+  std::vector<pthread_t> thread_ids(threads);
+  std::vector<bool> started(threads, false);
+  for (int i = 0; i < threads; i++) {
+    tasks[i].paths = &paths;
+    tasks[i].begin = static_cast<int64_t>(file_count) * i / threads;
+    tasks[i].end = static_cast<int64_t>(file_count) * (i + 1) / threads;
+  }
+  for (int i = 1; i < threads; i++) {
+    started[i] = pthread_create(&thread_ids[i], NULL, MergeWorker, &tasks[i]) == 0;
+  }
+  for (int i = 0; i < threads; i++) {
+    if (!started[i]) MergeWorker(&tasks[i]);
+  }
+  for (int i = 1; i < threads; i++) {
+    if (started[i]) pthread_join(thread_ids[i], NULL);
+  }
+  for (int i = 0; i < threads; i++) {
+    if (!tasks[i].error.empty()) throw std::runtime_error(tasks[i].error);
+    out->Merge(tasks[i].result);
+  }
+}
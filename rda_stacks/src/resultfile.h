@@ -0,0 +1,111 @@
+#ifndef RESULTFILE_H_
+#define RESULTFILE_H_
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+#include "reusestack-common.h"
+
+/*
+ * A python literal value from a result file: numbers, strings and nested dicts, lists and
+ * tuples. Numbers that are not modified are written back with their original text.
+ */
+class ResultValue {
+public:
+  enum Type { kOther, kInt, kFloat, kString, kDict, kList, kTuple };
+  ResultValue() : type_(kOther), int_(0), float_(0.0), decimals_(6), quote_('\'') {}
+  // an empty dict, list or tuple
+  explicit ResultValue(Type type) : type_(type), int_(0), float_(0.0), decimals_(6), quote_('\'') {}
+  static ResultValue MakeInt(int64_t value);
+  static ResultValue MakeHexInt(uint64_t value);  // written as 0x...
+  static ResultValue MakeDouble(double value, int decimals);
+  static ResultValue MakeString(const std::string &value);
+  // Parses one literal starting at *pos and advances *pos past it. Throws std::runtime_error.
+  static ResultValue Parse(const std::string &text, size_t *pos);
+
+  Type type() const { return type_; }
+  bool IsNumber() const { return type_ == kInt || type_ == kFloat; }
+  bool IsContainer() const { return type_ == kDict || type_ == kList || type_ == kTuple; }
+  int64_t AsInt() const { return type_ == kFloat ? static_cast<int64_t>(float_) : int_; }
+  double AsDouble() const { return type_ == kFloat ? float_ : static_cast<double>(int_); }
+  void SetInt(int64_t value);
+  void SetDouble(double value);  // keeps the number of decimals of the original text
+  const std::string &text() const { return text_; }
+
+  int size() const { return items_.size(); }
+  const ResultValue &item(int i) const { return items_[i]; }
+  ResultValue &item(int i) { return items_[i]; }
+  // dict access; keys are looked up by their text without quotes
+  const ResultValue &key(int i) const { return keys_[i]; }
+  const ResultValue *Find(const std::string &key) const;
+  ResultValue *Find(const std::string &key);
+  // Replaces the value for key, or appends it if the key is new.
+  void Set(const ResultValue &key, const ResultValue &value);
+  // list/tuple append
+  void Append(const ResultValue &item) { items_.push_back(item); }
+
+  // Sums numbers, merges dicts key by key and lists/tuples element by element. Dicts that look
+  // like reuse stack dumps get stack-specific treatment of their attributes.
+  void Merge(const ResultValue &other);
+  std::string ToString() const;
+
+private:
+  static std::string KeyText(const ResultValue &key);
+  bool IsStackDump() const;
+  void MergeStackDump(const ResultValue &other);
+  void RecomputeStackAttributes();
+  void WriteTo(std::string *out) const;
+
+  Type type_;
+  int64_t int_;
+  double float_;
+  int decimals_;
+  std::string text_;  ///< original text for numbers, contents for strings, raw token otherwise
+  char quote_;
+  std::vector<ResultValue> keys_;
+  std::vector<ResultValue> items_;
+  std::tr1::unordered_map<std::string, int> index_;
+};
+
+/*
+ * A parsed rddata result file, as written by StackHolder::DumpStatsPython or
+ * ParallelSampledStack::DumpStatsPython. Result files from different shards of a run can be
+ * merged: histograms are summed per thread, per stack and per PC, counts are summed and derived
+ * attributes (averages, median and hit-rate sizes) are recomputed.
+ */
+class ResultFile {
+public:
+  ResultFile() : merged_count_(0) {}
+  void Parse(std::istream &in);
+  // Reads a file in the binary format (see rdbinary.h)
+  void ParseBinary(std::istream &in);
+  // Reads either format
+  void ReadFile(const std::string &path);
+  // Lines that are not data (comments, imports) are kept from the first file only.
+  void Merge(const ResultFile &other);
+  void Write(std::ostream &out) const;
+  // name is e.g. "simStacks[0]", "PCDist", "#preds simStacks[0]" for predictions or
+  // "#rdinterval simStacks[0][3]" for intervals
+  const ResultValue *Find(const std::string &name) const;
+  int merged_count() const { return merged_count_; }
+  // Reads and merges the files in order, spreading the work over 'threads' threads.
+  static void MergeFiles(const std::vector<std::string> &paths, int threads, ResultFile *out);
+
+private:
+  struct Entry {
+    std::string key;  ///< lookup key, empty for text lines
+    std::string name;
+    std::string prefix;
+    ResultValue value;
+    std::string text;
+  };
+  void ParseLine(const std::string &line, int line_number, std::string *last_rddata);
+  void AddEntry(const Entry &entry);
+  std::vector<Entry> entries_;
+  std::tr1::unordered_map<std::string, int> index_;
+  int merged_count_;
+};
+
+#endif /* RESULTFILE_H_ */
@@ -0,0 +1,150 @@
+#include <sstream>
+#include <gtest/gtest.h>
+#include "resultfile.h"
+#include "reusestackstats.h"
+
+using std::string;
+
+class ResultFileTest : public testing::Test {
+protected:
+  static const int kBlockSize = 64;
+  // A result file in the format written by StackHolder::DumpStatsPython
+  static string MakeResult(const ReuseStackStats &stats, int access_count, double avg_size,
+                           int stack_size, const PCStats &pc_stats) {
+    std::ostringstream out;
+    out << "#librda version test\n";
+    out << "simStacks = {}\n";
+    out << "#rddata simStacks[0] = {'histogram':" << stats.GetHistogramString() << ","
+        << "'attributes':{'accessCount':" << access_count << ", 'avgSize':" << avg_size
+        << ", 'stackSize': " << stack_size << ", " << stats.GetAttributes() << "},"
+        << "'read_histo':{'histogram':" << stats.GetHistogramString() << ", 'attributes':{"
+        << stats.GetAttributes() << "}}, }\n";
+    out << "#preds " << stats.GetPredictions();
+    out << "PCDist = " << pc_stats.GetStatsString() << "\n";
+    out << "LibraryMap = [LME('libc.so',0x1000,0x2000),]\n";
+    return out.str();
+  }
+  static void ParseString(const string &text, ResultFile *file) {
+    std::istringstream in(text);
+    file->Parse(in);
+  }
+  static const ResultValue &Attribute(const ResultFile &file, const string &name) {
+    const ResultValue *stack = file.Find("simStacks[0]");
+    EXPECT_TRUE(stack != NULL);
+    const ResultValue *value = stack->Find("attributes")->Find(name);
+    EXPECT_TRUE(value != NULL) << name;
+    return *value;
+  }
+};
+
+TEST_F(ResultFileTest, ParseValues) {
+  string text("{'a':[1, 2.50, -3], 0x10:(nan, 'x y',), \"b\":{}, }");
+  size_t pos = 0;
+  ResultValue value(ResultValue::Parse(text, &pos));
+  EXPECT_EQ(text.size(), pos);
+  ASSERT_EQ(ResultValue::kDict, value.type());
+  ASSERT_EQ(3, value.size());
+  const ResultValue *list = value.Find("a");
+  ASSERT_TRUE(list != NULL);
+  EXPECT_EQ(ResultValue::kList, list->type());
+  EXPECT_EQ(-3, list->item(2).AsInt());
+  EXPECT_DOUBLE_EQ(2.5, list->item(1).AsDouble());
+  const ResultValue *tuple = value.Find("0x10");
+  ASSERT_TRUE(tuple != NULL);
+  EXPECT_EQ(16, value.key(1).AsInt());
+  EXPECT_EQ("x y", tuple->item(1).text());
+  // unmodified values keep their text
+  EXPECT_EQ("{'a':[1, 2.50, -3, ], 0x10:(nan, 'x y', ), \"b\":{}, }", value.ToString());
+  pos = 0;
+  string bad("{'a':1");
+  EXPECT_THROW(ResultValue::Parse(bad, &pos), std::runtime_error);
+}
+
+// Merging two result files gives the same histogram and attributes as merging the stats
+TEST_F(ResultFileTest, MergeStacks) {
+  ReuseStackStats first(kBlockSize), second(kBlockSize), combined(kBlockSize);
+  PCStats first_pcs, second_pcs;
+  for (acc_count_t i = 0; i < 1000; i++) {
+    first.AddSample(0, i % 37);
+    first_pcs.AddSample(1, i % 37);
+    second.AddSample(0, i % 1500);
+    second_pcs.AddSample(i % 2 + 1, i % 1500);
+  }
+  first.AddSample(0, kColdMiss);
+  second.AddSample(0, kInvalidationMiss);
+  combined.Merge(first);
+  combined.Merge(second);
+
+  ResultFile file, other;
+  ParseString(MakeResult(first, 100, 4.0, 10, first_pcs), &file);
+  ParseString(MakeResult(second, 300, 8.0, 20, second_pcs), &other);
+  file.Merge(other);
+  EXPECT_EQ(2, file.merged_count());
+
+  size_t pos = 0;
+  string histogram_text(combined.GetHistogramString());
+  ResultValue expected_histogram(ResultValue::Parse(histogram_text, &pos));
+  const ResultValue *histogram = file.Find("simStacks[0]")->Find("histogram");
+  ASSERT_EQ(expected_histogram.size(), histogram->size());
+  for (int i = 0; i < expected_histogram.size(); i++) {
+    const ResultValue *bucket = histogram->Find(expected_histogram.key(i).text());
+    ASSERT_TRUE(bucket != NULL) << expected_histogram.key(i).text();
+    EXPECT_EQ(expected_histogram.item(i).AsInt(), bucket->AsInt());
+  }
+
+  pos = 0;
+  string attributes_text("{" + combined.GetAttributes() + "}");
+  ResultValue expected(ResultValue::Parse(attributes_text, &pos));
+  for (int i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected.item(i).ToString(), Attribute(file, expected.key(i).text()).ToString())
+        << expected.key(i).text();
+  }
+  EXPECT_EQ(400, Attribute(file, "accessCount").AsInt());
+  EXPECT_DOUBLE_EQ(7.0, Attribute(file, "avgSize").AsDouble());
+  EXPECT_EQ(20, Attribute(file, "stackSize").AsInt());
+  const ResultValue *read_attributes = file.Find("simStacks[0]")->Find("read_histo")->Find("attributes");
+  EXPECT_EQ(expected.Find("medianDist")->AsInt(), read_attributes->Find("medianDist")->AsInt());
+
+  // per-PC stats are summed per PC
+  const ResultValue *pc_dist = file.Find("PCDist");
+  ASSERT_TRUE(pc_dist != NULL);
+  EXPECT_EQ(2, pc_dist->size());
+  EXPECT_EQ(1500, pc_dist->Find("0x1")->item(1).AsInt());
+  EXPECT_EQ(500, pc_dist->Find("0x2")->item(1).AsInt());
+
+  // non-data lines are kept once and the output parses again
+  std::ostringstream out;
+  file.Write(out);
+  size_t version = out.str().find("librda version");
+  ASSERT_NE(string::npos, version);
+  EXPECT_EQ(string::npos, out.str().find("librda version", version + 1));
+  EXPECT_NE(string::npos, out.str().find("LibraryMap = [LME("));
+  EXPECT_NE(string::npos, out.str().find("\nPCDist = {"));
+  EXPECT_NE(string::npos, out.str().find("\n#preds {"));
+  ResultFile reparsed;
+  ParseString(out.str(), &reparsed);
+  EXPECT_EQ(Attribute(file, "totalDist").AsInt(), Attribute(reparsed, "totalDist").AsInt());
+}
+
+// Per-PC bucket averages are weighted by bucket counts
+TEST_F(ResultFileTest, MergePCAverages) {
+  ResultFile file, other;
+  ParseString("PCDist = {0x1:(10,2,{2.000000:(2,2.500000),}), }\n", &file);
+  ParseString("PCDist = {0x1:(3,1,{2.000000:(1,3.000000),}), 0x3:(1,1,{0:(1,0.0),}), }\n", &other);
+  file.Merge(other);
+  const ResultValue *pc = file.Find("PCDist")->Find("0x1");
+  ASSERT_TRUE(pc != NULL);
+  EXPECT_EQ(13, pc->item(0).AsInt());
+  EXPECT_EQ(3, pc->item(1).AsInt());
+  const ResultValue *bucket = pc->item(2).Find("2.000000");
+  EXPECT_EQ(3, bucket->item(0).AsInt());
+  EXPECT_NEAR(8.0 / 3, bucket->item(1).AsDouble(), 1e-9);
+  EXPECT_TRUE(file.Find("PCDist")->Find("0x3") != NULL);
+}
+
+TEST_F(ResultFileTest, MalformedData) {
+  ResultFile file;
+  EXPECT_THROW(ParseString("#rddata simStacks[0] = {'histogram':{\n", &file), std::runtime_error);
+  std::vector<string> paths(1, "/nonexistent/result/file");
+  EXPECT_THROW(ResultFile::MergeFiles(paths, 2, &file), std::runtime_error);
+}
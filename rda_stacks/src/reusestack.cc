@@ -1,18 +1,36 @@
 
 #include "reusestack.h"
+#include "rdbinary.h"
+#include "statswriter.h"
+
+void ReuseStackBase::DumpStatisticsBinary(BinaryResultWriter *out) const {
+  out->BeginList();
+  for (int i = 0; i < 3; i++) {
+    out->BeginDict();
+    out->End();
+  }
+  out->End();
+}
+
+void ReuseStackBase::DumpIntervalBinary(BinaryResultWriter *out) {
+  out->BeginDict();
+  out->End();
+}
 
 
-ReuseStack::ReuseStack(FILE *outf, int granularity, StackImplementationTypes stack_type)
+ReuseStack::ReuseStack(FILE *outf, int granularity, StackImplementationTypes stack_type,
+                       int shard_threads)
     : ReuseStackBase(outf, granularity),
       blockBytes(granularity), kStackType(stack_type),
       maxAddr(kMaxAddress - blockBytes),
       accessCount(0), blockAccessCount(0),
       invalCount(0), coldCount(0), invalidateCalls(0), coherenceMisses(0), /*doCheckRace(false),*/
-      writeCount(0), prefetchCount(0), prefetchCoherenceMisses(0), prefetchColdCount(0),
-      outfile(outf), totalSize(0), stats_(blockBytes), read_stats_(blockBytes), 
+      writeCount(0), fetchCount(0), prefetchCount(0), prefetchCoherenceMisses(0),
+      prefetchColdCount(0),
+      lastIntervalAccessCount(0), outfile(outf), totalSize(0), stats_(blockBytes), read_stats_(blockBytes), 
       write_stats_(blockBytes), fetch_stats_(blockBytes), prefetch_stats_(blockBytes)
 {
-    stackImpl.reset(GetStackImpl(outf, blockBytes));
+    stackImpl.reset(GetStackImpl(outf, blockBytes, shard_threads));
 }
 
 //void ReuseStack::setBlockBytes(int granularity)
@@ -133,31 +151,126 @@ void ReuseStack::Snoop(address_t addr, int size)
 
 void ReuseStack::DumpStatistics() const
 {
-  fprintf(outfile, "{");  // begin rddata dict
-  fprintf(outfile, "'histogram':%s,", stats_.GetHistogramString().c_str());  // print histogram dict
+  StatsWriter out(outfile);
+  out.Write("{");  // begin rddata dict
+  out.Write("'histogram':");  // print histogram dict
+  stats_.WriteHistogram(&out);
+  out.Write(",");
   // begin attribute dict
-  fprintf(outfile, "'attributes':{'accessCount':%"PRIacc", 'blockAccessCount':%"PRIacc", 'avgSize':%.2f, "
-          "'coldCount':%"PRIacc", 'invalCount': %"PRIacc", 'stackSize': %"PRIacc", "
-          "'coherenceMisses':%"PRIacc", 'writeCount':%"PRIacc", "
-	  "'fetchCount':%"PRIacc", 'invalidateCalls':%"PRIacc", ",
-          accessCount, blockAccessCount, (float)totalSize / accessCount,
-          coldCount, invalCount, stackImpl->GetStackSize(),
-          coherenceMisses, writeCount, fetchCount, invalidateCalls);
-  fprintf(outfile, "'prefetchCount':%"PRIacc", 'prefetchColdCount':%"PRIacc", 'prefetchCoherenceMisses':%"
-	  PRIacc", ", prefetchCount, prefetchColdCount, prefetchCoherenceMisses);
-  fprintf(outfile, "%s", stats_.GetAttributes().c_str());  // print stats attributes
-  fprintf(outfile, "},");  // end attribute dict
+  out.Printf("'attributes':{'accessCount':%"PRIacc", 'blockAccessCount':%"PRIacc", 'avgSize':%.2f, "
+             "'coldCount':%"PRIacc", 'invalCount': %"PRIacc", 'stackSize': %"PRIacc", "
+             "'coherenceMisses':%"PRIacc", 'writeCount':%"PRIacc", "
+             "'fetchCount':%"PRIacc", 'invalidateCalls':%"PRIacc", ",
+             accessCount, blockAccessCount, (float)totalSize / accessCount,
+             coldCount, invalCount, stackImpl->GetStackSize(),
+             coherenceMisses, writeCount, fetchCount, invalidateCalls);
+  out.Printf("'prefetchCount':%"PRIacc", 'prefetchColdCount':%"PRIacc", 'prefetchCoherenceMisses':%"
+             PRIacc", ", prefetchCount, prefetchColdCount, prefetchCoherenceMisses);
+  stats_.WriteAttributes(&out);  // print stats attributes
+  out.Write("},");  // end attribute dict
   //read/write/fetch histos go here
-  fprintf(outfile, "'read_histo':{'histogram':%s, 'attributes':{%s}}, ",
-	  read_stats_.GetHistogramString().c_str(), read_stats_.GetAttributes().c_str());
-  fprintf(outfile, "'write_histo':{'histogram':%s, 'attributes':{%s}}, ",
-	  write_stats_.GetHistogramString().c_str(), write_stats_.GetAttributes().c_str());
-  fprintf(outfile, "'fetch_histo':{'histogram':%s, 'attributes':{%s}}, ",
-	  fetch_stats_.GetHistogramString().c_str(), fetch_stats_.GetAttributes().c_str());
-  fprintf(outfile, "'prefetch_histo':{'histogram':%s, 'attributes':{%s}}, ",
-    prefetch_stats_.GetHistogramString().c_str(), prefetch_stats_.GetAttributes().c_str());
-  fprintf(outfile, "}\n"); // end rddata dict
-  fprintf(outfile, "#preds %s", stats_.GetPredictions().c_str());
+  WriteHisto(&out, "read_histo", read_stats_);
+  WriteHisto(&out, "write_histo", write_stats_);
+  WriteHisto(&out, "fetch_histo", fetch_stats_);
+  WriteHisto(&out, "prefetch_histo", prefetch_stats_);
+  out.Write("}\n"); // end rddata dict
+  out.Write("#preds ");
+  stats_.WritePredictions(&out);
+}
+
+void ReuseStack::DumpStatisticsBinary(BinaryResultWriter *out) const
+{
+  out->BeginDict();
+  out->String("histogram");
+  stats_.WriteBinaryHistogram(out);
+  out->String("attributes");
+  out->BeginDict();
+  out->IntItem("accessCount", accessCount);
+  out->IntItem("blockAccessCount", blockAccessCount);
+  out->String("avgSize");
+  out->Double((float)totalSize / accessCount, 2);
+  out->IntItem("coldCount", coldCount);
+  out->IntItem("invalCount", invalCount);
+  out->IntItem("stackSize", stackImpl->GetStackSize());
+  out->IntItem("coherenceMisses", coherenceMisses);
+  out->IntItem("writeCount", writeCount);
+  out->IntItem("fetchCount", fetchCount);
+  out->IntItem("invalidateCalls", invalidateCalls);
+  out->IntItem("prefetchCount", prefetchCount);
+  out->IntItem("prefetchColdCount", prefetchColdCount);
+  out->IntItem("prefetchCoherenceMisses", prefetchCoherenceMisses);
+  stats_.WriteBinaryAttributes(out);
+  out->End();
+  WriteBinaryHisto(out, "read_histo", read_stats_);
+  WriteBinaryHisto(out, "write_histo", write_stats_);
+  WriteBinaryHisto(out, "fetch_histo", fetch_stats_);
+  WriteBinaryHisto(out, "prefetch_histo", prefetch_stats_);
+  out->End();
+  out->BeginRecord(BinaryResultWriter::kPredictionRecord, "");
+  stats_.WriteBinaryPredictions(out);
+}
+
+void ReuseStack::WriteBinaryHisto(BinaryResultWriter *out, const char *name,
+                                  const ReuseStackStats &stats)
+{
+  out->String(name);
+  out->BeginDict();
+  out->String("histogram");
+  stats.WriteBinaryHistogram(out);
+  out->String("attributes");
+  out->BeginDict();
+  stats.WriteBinaryAttributes(out);
+  out->End();
+  out->End();
+}
+
+void ReuseStack::WriteHisto(StatsWriter *out, const char *name, const ReuseStackStats &stats)
+{
+  out->Printf("'%s':{'histogram':", name);
+  stats.WriteHistogram(out);
+  out->Write(", 'attributes':{");
+  stats.WriteAttributes(out);
+  out->Write("}}, ");
+}
+
+void ReuseStack::DumpInterval()
+{
+  ReuseStackStats interval(stats_.GetIntervalStats());
+  ReuseStackStats read_interval(read_stats_.GetIntervalStats());
+  StatsWriter out(outfile);
+  out.Write("{'histogram':");
+  interval.WriteHistogram(&out);
+  out.Printf(",'attributes':{'accessCount':%"PRIacc", ", accessCount - lastIntervalAccessCount);
+  interval.WriteAttributes(&out);
+  out.Write("},");
+  WriteHisto(&out, "read_histo", read_interval);
+  out.Write("}\n");
+  out.Flush();
+  FinishInterval();
+}
+
+void ReuseStack::DumpIntervalBinary(BinaryResultWriter *out)
+{
+  ReuseStackStats interval(stats_.GetIntervalStats());
+  ReuseStackStats read_interval(read_stats_.GetIntervalStats());
+  out->BeginDict();
+  out->String("histogram");
+  interval.WriteBinaryHistogram(out);
+  out->String("attributes");
+  out->BeginDict();
+  out->IntItem("accessCount", accessCount - lastIntervalAccessCount);
+  interval.WriteBinaryAttributes(out);
+  out->End();
+  WriteBinaryHisto(out, "read_histo", read_interval);
+  out->End();
+  FinishInterval();
+}
+
+void ReuseStack::FinishInterval()
+{
+  stats_.EndInterval();
+  read_stats_.EndInterval();
+  lastIntervalAccessCount = accessCount;
 }
 
 void ReuseStack::SetRatioPredictionSizes(std::vector<int> &sizes)
@@ -191,12 +304,16 @@ void ReuseStack::UpdateRatioPredictions()
   lastCold = coldCount;
 }
 
-ReuseStackImplInterface *ReuseStack::GetStackImpl(FILE *outf, int granularity) {
+ReuseStackImplInterface *ReuseStack::GetStackImpl(FILE *outf, int granularity,
+                                                  int shard_threads) {
   switch(kStackType) {
     case kTreeStack:
       return new TreeReuseStack(outf, granularity);
     case kApproximateStack:
       return new approximateReuseStack(outf, granularity);
+    case kShardedStack:
+      return new ShardedReuseStack(outf, granularity, ShardedReuseStack::kDefaultShards,
+                                   shard_threads);
     default:
       return NULL;
   }
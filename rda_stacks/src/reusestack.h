@@ -19,6 +19,7 @@
 #include "reusestackstats.h"
 #include "treereusestack.h"
 #include "approximatereusestack.h"
+#include "shardedreusestack.h"
 
 static const address_t kMaxAddress = std::numeric_limits<int64_t>::max();
 
@@ -42,6 +43,11 @@ public:
 
   virtual int GetGranularity(){return 0;}
   virtual void DumpStatistics() const {fprintf(outfile, "[{},{},{}]\n");}
+  // dump the histogram delta since the last call and start a new interval
+  virtual void DumpInterval() {fprintf(outfile, "{}\n");}
+  // binary format versions of the above: write the value of an already begun record
+  virtual void DumpStatisticsBinary(BinaryResultWriter *out) const;
+  virtual void DumpIntervalBinary(BinaryResultWriter *out);
   virtual void SetRatioPredictionSizes(std::vector<int> &sizes){}
   virtual std::vector<int> GetRatioPredictionSizes() {std::vector<int> sizes; return sizes;}
   virtual void AddRatioPredictionSize(int size) {}
@@ -63,9 +69,11 @@ public:
   enum StackImplementationTypes {
     kTreeStack,
     kApproximateStack,
+    kShardedStack,
   };
+  // 'shard_threads' is only used by kShardedStack (see ShardedReuseStack)
   ReuseStack(FILE * outfile, int granularity,
-             StackImplementationTypes stack_type);
+             StackImplementationTypes stack_type, int shard_threads = 1);
   virtual ~ReuseStack() {}
   //void setOutfile(FILE * outf, int granularity=DEFAULT_GRANULARITY);
   acc_count_t Access(address_t addr, int size, AccessType type);
@@ -73,6 +81,9 @@ public:
   void Snoop(address_t addr, int size);
   int GetGranularity() { return blockBytes;}
   void DumpStatistics() const;
+  void DumpInterval();
+  void DumpStatisticsBinary(BinaryResultWriter *out) const;
+  void DumpIntervalBinary(BinaryResultWriter *out);
 
   void SetRatioPredictionSizes(std::vector<int> &sizes);
   std::vector<int> GetRatioPredictionSizes();
@@ -87,7 +98,11 @@ protected:
   //int getBlockBytes() { return blockBytes;}
 private:
   typedef std::tr1::unordered_map<address_t, int> AddressCount;
-  ReuseStackImplInterface *GetStackImpl(FILE * outfile, int granularity);
+  ReuseStackImplInterface *GetStackImpl(FILE * outfile, int granularity, int shard_threads);
+  static void WriteHisto(StatsWriter *out, const char *name, const ReuseStackStats &stats);
+  static void WriteBinaryHisto(BinaryResultWriter *out, const char *name,
+                               const ReuseStackStats &stats);
+  void FinishInterval();  // start the next interval's deltas from the current counts
 
   int blockBytes; ///< Bytes per tracked block (aka the tracking granularity)
   const StackImplementationTypes kStackType;
@@ -110,6 +125,7 @@ private:
   AddressCount invalidatedAddrs;
 
   acc_count_t lastCoherence, lastCold;
+  acc_count_t lastIntervalAccessCount;
 
   FILE * outfile;
   acc_count_t totalSize;
@@ -8,6 +8,7 @@
 #include <gtest/gtest.h>
 #include "treereusestack.h"
 #include "reusestack.h"
+#include "resultfile.h"
 
 class TreeReuseStackTest: public testing::Test
 {
@@ -108,3 +109,33 @@ TEST(ReuseStackTest, Prefetch) {
   EXPECT_EQ(100 - 4, stack.Prefetch(3));
   EXPECT_EQ(100 - 45, stack.Prefetch(45));
 }
+
+// Each interval dump holds only the accesses since the previous one
+TEST(ReuseStackTest, DumpInterval) {
+  FILE *outfile = tmpfile();
+  ASSERT_TRUE(outfile != NULL);
+  ReuseStack stack(outfile, 1, ReuseStack::kTreeStack);
+  for (int i = 0; i < 10; i++) stack.Access(i, 1, ReuseStackBase::kRead);
+  stack.DumpInterval();
+  for (int i = 0; i < 10; i++) stack.Access(i, 1, ReuseStackBase::kWrite);
+  stack.Access(100, 1, ReuseStackBase::kRead);
+  stack.DumpInterval();
+  rewind(outfile);
+  char line[4096];
+  int64_t expected_access_counts[2] = { 10, 11 };
+  int64_t expected_cold_counts[2] = { 10, 1 };
+  int64_t expected_read_counts[2] = { 10, 1 };
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(fgets(line, sizeof(line), outfile) != NULL);
+    std::string text(line);
+    size_t pos = 0;
+    ResultValue interval(ResultValue::Parse(text, &pos));
+    const ResultValue *attributes = interval.Find("attributes");
+    ASSERT_TRUE(attributes != NULL);
+    EXPECT_EQ(expected_access_counts[i], attributes->Find("accessCount")->AsInt());
+    EXPECT_EQ(expected_cold_counts[i], attributes->Find("coldStatCount")->AsInt());
+    EXPECT_EQ(expected_read_counts[i],
+              interval.Find("read_histo")->Find("attributes")->Find("sampleCount")->AsInt());
+  }
+  fclose(outfile);
+}
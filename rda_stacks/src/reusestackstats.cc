@@ -6,31 +6,120 @@
  */
 
 #include "reusestackstats.h"
+#include <algorithm>
 #include <cmath>
 #include <stdexcept>
 #include <boost/format.hpp>
+#include "rdbinary.h"
+#include "statswriter.h"
+
+PCStats::PCStats(int max_tracked_pcs) : max_tracked_pcs_(0), eviction_floor_(0), evicted_pcs_(0) {
+  SetMaxTrackedPCs(max_tracked_pcs);
+}
+
+PCStats::DistanceStats *PCStats::AdmitPC(address_t PC) {
+  StatsMap::iterator iter = stats_.find(PC);
+  if (iter != stats_.end()) return iter->second;
+  if (max_tracked_pcs_ > 0 && static_cast<int>(stats_.size()) >= max_tracked_pcs_) {
+    EvictColdest(std::max(1, max_tracked_pcs_ / kEvictionBatchDivisor));
+  }
+  DistanceStats *entry = new DistanceStats();
+  // space-saving: a newly admitted PC may have been evicted before, so it inherits the
+  // largest evicted count rather than starting at 0 and being evicted again immediately
+  entry->SetCountOffset(eviction_floor_);
+  stats_[PC] = entry;
+  return entry;
+}
 
 void PCStats::AddSample(address_t PC, acc_count_t distance) {
-  if (stats_.count(PC) == 0) {
-    //stats_.insert(std::pair<address_t, PCStats::DistanceStats>(PC,PCStats::DistanceStats()));
-    stats_[PC] = new DistanceStats();
+  AdmitPC(PC)->AddSample(distance);
+}
+
+void PCStats::Merge(const PCStats &other) {
+  for (StatsMap::const_iterator iter = other.stats_.begin(); iter != other.stats_.end(); ++iter) {
+    AdmitPC(iter->first)->Merge(*iter->second);
   }
-  stats_[PC]->AddSample(distance);
+  other_.Merge(other.other_);
+  evicted_pcs_ += other.evicted_pcs_;
+  eviction_floor_ = std::max(eviction_floor_, other.eviction_floor_);
 }
 
-std::string PCStats::GetStatsString() const {
-  std::string out("{");
-  for (std::tr1::unordered_map<address_t, DistanceStats*>::const_iterator iter = stats_.begin();
-       iter != stats_.end(); ++iter) {
-    out += boost::str(boost::format("0x%lx:%s, ") % iter->first % iter->second->GetStatsString());
+void PCStats::SetMaxTrackedPCs(int max_tracked_pcs) {
+  if (max_tracked_pcs < 0) throw std::invalid_argument("tracked PC limit must be >= 0");
+  max_tracked_pcs_ = max_tracked_pcs;
+  if (max_tracked_pcs_ > 0 && static_cast<int>(stats_.size()) > max_tracked_pcs_) {
+    EvictColdest(stats_.size() - max_tracked_pcs_);
+  }
+}
+
+acc_count_t PCStats::GetSampleCount(address_t PC) const {
+  StatsMap::const_iterator iter = stats_.find(PC);
+  if (iter == stats_.end()) return 0;
+  return iter->second->GetSampleCount();
+}
+
+// Evicts the 'count' entries with the lowest count estimates, folding their histograms into
+// the "other" entry. Done in batches so the selection cost is amortized over many admissions.
+void PCStats::EvictColdest(int count) {
+  if (count <= 0) return;
+  std::vector<std::pair<acc_count_t, address_t> > estimates;
+  estimates.reserve(stats_.size());
+  for (StatsMap::const_iterator iter = stats_.begin(); iter != stats_.end(); ++iter) {
+    estimates.push_back(std::make_pair(iter->second->GetCountEstimate(), iter->first));
+  }
+  if (count > static_cast<int>(estimates.size())) count = estimates.size();
+  std::nth_element(estimates.begin(), estimates.begin() + (count - 1), estimates.end());
+  for (int i = 0; i < count; i++) {
+    StatsMap::iterator victim = stats_.find(estimates[i].second);
+    eviction_floor_ = std::max(eviction_floor_, estimates[i].first);
+    other_.Merge(*victim->second);
+    delete victim->second;
+    stats_.erase(victim);
+    evicted_pcs_++;
+  }
+}
+
+void PCStats::WriteStats(StatsWriter *out) const {
+  out->Write("{");
+  for (StatsMap::const_iterator iter = stats_.begin(); iter != stats_.end(); ++iter) {
+    out->Printf("0x%"PRIaddr":", iter->first);
+    iter->second->WriteStats(out);
+    out->Write(", ");
+  }
+  out->Write("}");
+}
+
+void PCStats::WriteOtherStats(StatsWriter *out) const {
+  other_.WriteStats(out);
+}
+
+void PCStats::WriteBinary(BinaryResultWriter *out) const {
+  out->BeginDict();
+  for (StatsMap::const_iterator iter = stats_.begin(); iter != stats_.end(); ++iter) {
+    out->HexInt(iter->first);
+    iter->second->WriteBinary(out);
   }
-  out += "}";
+  out->End();
+}
+
+void PCStats::WriteOtherBinary(BinaryResultWriter *out) const {
+  other_.WriteBinary(out);
+}
+
+std::string PCStats::GetStatsString() const {
+  std::string out;
+  StatsWriter writer(&out);
+  WriteStats(&writer);
+  writer.Flush();
   return out;
 }
 
+std::string PCStats::GetOtherStatsString() const {
+  return other_.GetStatsString();
+}
+
 PCStats::~PCStats() {
-  for (std::tr1::unordered_map<address_t, DistanceStats*>::iterator iter = stats_.begin();
-       iter != stats_.end(); ++iter) {
+  for (StatsMap::iterator iter = stats_.begin(); iter != stats_.end(); ++iter) {
     delete iter->second;
   }
 }
@@ -39,32 +128,88 @@ const double PCStats::DistanceStats::kDumpColdMissValue = pow(2, 63);
 const double PCStats::DistanceStats::kDumpInvalMissValue = pow(2, 62);
 
 PCStats::DistanceStats::DistanceStats() : total_distance_(0), sample_count_(0), cold_miss_count_(0),
-        inval_miss_count_(0) {
+        inval_miss_count_(0), count_offset_(0) {
       distance_histogram_.resize(kHistogramSize);
       bucket_avg_.resize(kHistogramSize);
 }
 
-std::string PCStats::DistanceStats::GetStatsString() const {
-  std::string out = boost::str(boost::format("(%d,%u,") % total_distance_ % sample_count_);
-  out += "{";  // begin histo data dict
-  if (distance_histogram_[0]) out += str(boost::format("0:(%u,0.0),") % distance_histogram_[0]);
+void PCStats::DistanceStats::WriteStats(StatsWriter *out) const {
+  out->Printf("(%"PRId64",%"PRIacc",", total_distance_, sample_count_);
+  out->Write("{");  // begin histo data dict
+  if (distance_histogram_[0]) out->Printf("0:(%"PRIacc",0.0),", distance_histogram_[0]);
   for (unsigned int i = 1; i < distance_histogram_.size(); i++){
     if (distance_histogram_[i]) {
-      out += str(boost::format("%f:(%u,%f),")
-          % pow(2, (i-1) / static_cast<double>(kHistogramDensity))
-          % distance_histogram_[i]
-          % bucket_avg_[i]);
+      out->Printf("%f:(%"PRIacc",%f),", pow(2, (i-1) / static_cast<double>(kHistogramDensity)),
+                  distance_histogram_[i], bucket_avg_[i]);
     }
   }
-  out += str(boost::format("%f:%u,") % kDumpInvalMissValue % inval_miss_count_);
-  out += str(boost::format("%f:%u") % kDumpColdMissValue % cold_miss_count_);
+  out->Printf("%f:%"PRIacc",", kDumpInvalMissValue, inval_miss_count_);
+  out->Printf("%f:%"PRIacc, kDumpColdMissValue, cold_miss_count_);
   // could make the inf dist bucket match the format of others but its actually different usage
   // so will leave it as an int rather than a tuple for now, until/unless that creates problems
   //out += str(boost::format("%f:(%u,%f)") % kDumpInfDistValue % cold_miss_count_ % kDumpInfDistValue);
-  out += "})";  // end histo data dict
+  out->Write("})");  // end histo data dict
+}
+
+void PCStats::DistanceStats::WriteBinary(BinaryResultWriter *out) const {
+  out->BeginTuple();
+  out->Int(total_distance_);
+  out->Int(sample_count_);
+  out->BeginDict();
+  if (distance_histogram_[0]) {
+    out->Int(0);
+    out->BeginTuple();
+    out->Int(distance_histogram_[0]);
+    out->Double(0.0, 1);
+    out->End();
+  }
+  for (unsigned int i = 1; i < distance_histogram_.size(); i++){
+    if (distance_histogram_[i]) {
+      out->Pow2(i - 1, kHistogramDensity);
+      out->BeginTuple();
+      out->Int(distance_histogram_[i]);
+      out->Double(bucket_avg_[i], 6);
+      out->End();
+    }
+  }
+  out->Double(kDumpInvalMissValue, 6);
+  out->Int(inval_miss_count_);
+  out->Double(kDumpColdMissValue, 6);
+  out->Int(cold_miss_count_);
+  out->End();
+  out->End();
+}
+
+std::string PCStats::DistanceStats::GetStatsString() const {
+  std::string out;
+  StatsWriter writer(&out);
+  WriteStats(&writer);
+  writer.Flush();
   return out;
 }
 
+void PCStats::DistanceStats::Merge(const DistanceStats &other) {
+  if (sample_count_ + other.sample_count_ >= kAccessCountMax) {
+    throw std::overflow_error("Per-PC sample count overflow");
+  }
+  total_distance_ += other.total_distance_;
+  sample_count_ += other.sample_count_;
+  cold_miss_count_ += other.cold_miss_count_;
+  inval_miss_count_ += other.inval_miss_count_;
+  if (other.distance_histogram_.size() > distance_histogram_.size()) {
+    distance_histogram_.resize(other.distance_histogram_.size(), 0);
+    bucket_avg_.resize(other.distance_histogram_.size(), 0.0f);
+  }
+  for (unsigned int i = 0; i < other.distance_histogram_.size(); i++) {
+    acc_count_t merged = distance_histogram_[i] + other.distance_histogram_[i];
+    if (merged == 0) continue;
+    bucket_avg_[i] = (distance_histogram_[i] * static_cast<double>(bucket_avg_[i]) +
+                      other.distance_histogram_[i] * static_cast<double>(other.bucket_avg_[i]))
+                     / merged;
+    distance_histogram_[i] = merged;
+  }
+}
+
 void PCStats::DistanceStats::AddSample(acc_count_t distance) {
   if (sample_count_++ >= kAccessCountMax) throw std::overflow_error("Per-PC sample count overflow");
   if (distance < kAccessCountMax) {
@@ -104,7 +249,8 @@ const double ReuseStackStats::kDumpInvalMissValue = pow(2, 62);
 ReuseStackStats::ReuseStackStats(int block_size)
     : kBlockSize(block_size), sample_count_(0), cold_miss_count_(0), inval_miss_count_(0),
       total_distance_(0), current_prediction_accesses_(0), total_prediction_accesses_(0),
-      total_prediction_hits_(0)
+      total_prediction_hits_(0), interval_base_samples_(0), interval_base_cold_(0),
+      interval_base_inval_(0), interval_base_distance_(0)
 {
     distance_histogram_.resize(kHistogramSize, 0);
     target_hit_rates_.push_back(0.5);
@@ -154,6 +300,74 @@ void ReuseStackStats::AddSample(address_t address, acc_count_t distance) {
   }
 }
 
+void ReuseStackStats::Merge(const ReuseStackStats &other) {
+  if (kBlockSize != other.kBlockSize) {
+    throw std::invalid_argument("cannot merge stats with different block sizes");
+  }
+  if (sample_count_ + other.sample_count_ >= kAccessCountMax) {
+    throw std::overflow_error("Sample count overflow");
+  }
+  sample_count_ += other.sample_count_;
+  if (other.distance_histogram_.size() > distance_histogram_.size()) {
+    distance_histogram_.resize(other.distance_histogram_.size(), 0);
+  }
+  for (unsigned int i = 0; i < other.distance_histogram_.size(); i++) {
+    distance_histogram_[i] += other.distance_histogram_[i];
+  }
+  cold_miss_count_ += other.cold_miss_count_;
+  inval_miss_count_ += other.inval_miss_count_;
+  total_distance_ += other.total_distance_;
+  current_prediction_accesses_ += other.current_prediction_accesses_;
+  total_prediction_accesses_ += other.total_prediction_accesses_;
+  total_prediction_hits_ += other.total_prediction_hits_;
+  for (std::map<acc_count_t, acc_count_t>::const_iterator iter =
+       other.current_prediction_hits_.begin(); iter != other.current_prediction_hits_.end(); ++iter) {
+    current_prediction_hits_[iter->first] += iter->second;
+  }
+  // prediction periods are summed period by period
+  for (std::map<acc_count_t, std::vector<acc_count_t> >::const_iterator iter =
+       other.ratio_predictions_.begin(); iter != other.ratio_predictions_.end(); ++iter) {
+    std::vector<acc_count_t> &preds = ratio_predictions_[iter->first];
+    if (iter->second.size() > preds.size()) preds.resize(iter->second.size(), 0);
+    for (unsigned int i = 0; i < iter->second.size(); i++) preds[i] += iter->second[i];
+  }
+  if (other.prediction_accesses_.size() > prediction_accesses_.size()) {
+    prediction_accesses_.resize(other.prediction_accesses_.size(), 0);
+  }
+  for (unsigned int i = 0; i < other.prediction_accesses_.size(); i++) {
+    prediction_accesses_[i] += other.prediction_accesses_[i];
+  }
+}
+
+void ReuseStackStats::AddDumpedStats(const std::vector<HistogramEntry> &histogram,
+                                     int64_t total_distance, acc_count_t prediction_accesses,
+                                     acc_count_t prediction_hits) {
+  for (unsigned int i = 0; i < histogram.size(); i++) {
+    double value = histogram[i].first;
+    acc_count_t count = histogram[i].second;
+    sample_count_ += count;
+    if (value == kDumpColdMissValue) {
+      cold_miss_count_ += count;
+    } else if (value == kDumpInvalMissValue) {
+      inval_miss_count_ += count;
+    } else if (value < 0.0) {
+      throw std::invalid_argument("Bad histogram value");
+    } else {
+      unsigned int bucket = 0;
+      if (value > 0.0) {
+        double exponent = log2(value) * kHistogramDensity;
+        if (exponent < 0.0) throw std::invalid_argument("Bad histogram value");
+        bucket = static_cast<unsigned int>(exponent + 0.5) + 1;
+      }
+      if (bucket >= distance_histogram_.size()) distance_histogram_.resize(bucket + 1, 0);
+      distance_histogram_[bucket] += count;
+    }
+  }
+  total_distance_ += total_distance;
+  total_prediction_accesses_ += prediction_accesses;
+  total_prediction_hits_ += prediction_hits;
+}
+
 void ReuseStackStats::SetRatioPredictionSizes(const std::vector<int> &sizes) {
   current_prediction_hits_.clear();
   for (unsigned int i = 0; i < sizes.size(); i++){
@@ -210,19 +424,44 @@ std::vector<ReuseStackStats::HistogramEntry> ReuseStackStats::GetHistogram() con
   return histogram;
 }
 
-std::string ReuseStackStats::GetHistogramString() const {
-  std::string out = "{";  // begin histo data dict
-  if (distance_histogram_[0]) out += str(boost::format("%u:%u, ") % 0 % distance_histogram_[0]);
+void ReuseStackStats::WriteHistogram(StatsWriter *out) const {
+  out->Write("{");  // begin histo data dict
+  if (distance_histogram_[0]) out->Printf("0:%"PRIacc", ", distance_histogram_[0]);
+  for (unsigned int i = 1; i < distance_histogram_.size(); i++){
+    if (distance_histogram_[i]) {
+      out->Printf("%lf:%"PRIacc", ", pow(2, (i-1) / static_cast<double>(kHistogramDensity)),
+                  distance_histogram_[i]);
+    }
+  }
+  out->Printf("%lf:%d, ", kDumpInvalMissValue, inval_miss_count_);
+  out->Printf("%lf:%d", kDumpColdMissValue, cold_miss_count_);
+  out->Write("}");  // end histo data dict
+}
+
+void ReuseStackStats::WriteBinaryHistogram(BinaryResultWriter *out) const {
+  out->BeginDict();
+  if (distance_histogram_[0]) {
+    out->Int(0);
+    out->Int(distance_histogram_[0]);
+  }
   for (unsigned int i = 1; i < distance_histogram_.size(); i++){
     if (distance_histogram_[i]) {
-      out += str(boost::format("%lf:%u, ")
-          % pow(2, (i-1) / static_cast<double>(kHistogramDensity))
-          % distance_histogram_[i]);
+      out->Pow2(i - 1, kHistogramDensity);
+      out->Int(distance_histogram_[i]);
     }
   }
-  out += str(boost::format("%lf:%u, ") % kDumpInvalMissValue % inval_miss_count_);
-  out += str(boost::format("%lf:%u") % kDumpColdMissValue % cold_miss_count_);
-  out += "}";  // end histo data dict
+  out->Double(kDumpInvalMissValue, 6);
+  out->Int(inval_miss_count_);
+  out->Double(kDumpColdMissValue, 6);
+  out->Int(cold_miss_count_);
+  out->End();
+}
+
+std::string ReuseStackStats::GetHistogramString() const {
+  std::string out;
+  StatsWriter writer(&out);
+  WriteHistogram(&writer);
+  writer.Flush();
   return out;
 }
 
@@ -244,7 +483,28 @@ acc_count_t ReuseStackStats::GetTargetSize(double target_hit_rate) {
   throw std::runtime_error("got to end of histogram without finding target size");
 }
 
-std::string ReuseStackStats::GetAttributes() const {
+ReuseStackStats ReuseStackStats::GetIntervalStats() const {
+  ReuseStackStats interval(kBlockSize);
+  interval.distance_histogram_ = distance_histogram_;
+  for (unsigned int i = 0; i < interval_base_histogram_.size(); i++) {
+    interval.distance_histogram_[i] -= interval_base_histogram_[i];
+  }
+  interval.sample_count_ = sample_count_ - interval_base_samples_;
+  interval.cold_miss_count_ = cold_miss_count_ - interval_base_cold_;
+  interval.inval_miss_count_ = inval_miss_count_ - interval_base_inval_;
+  interval.total_distance_ = total_distance_ - interval_base_distance_;
+  return interval;
+}
+
+void ReuseStackStats::EndInterval() {
+  interval_base_histogram_ = distance_histogram_;
+  interval_base_samples_ = sample_count_;
+  interval_base_cold_ = cold_miss_count_;
+  interval_base_inval_ = inval_miss_count_;
+  interval_base_distance_ = total_distance_;
+}
+
+std::vector<acc_count_t> ReuseStackStats::GetTargetSizes() const {
   acc_count_t cumulative_hitcount = 0;
   // convert hit rate to hit count
   std::vector<acc_count_t> target_hits(target_hit_rates_.size(), 0);
@@ -267,42 +527,95 @@ std::string ReuseStackStats::GetAttributes() const {
       }
     }
   }
+  return target_sizes;
+}
 
+void ReuseStackStats::WriteAttributes(StatsWriter *out) const {
+  std::vector<acc_count_t> target_sizes(GetTargetSizes());
   //begin attributes
-  std::string out = str(boost::format("'sampleCount':%d, ") % sample_count_);
-  out += str(boost::format("'totalDist':%d, ") % total_distance_);
-  out += str(boost::format("'avgDist':%.2f, ") %
-             (static_cast<double>(total_distance_) /
-             (sample_count_ - cold_miss_count_ - inval_miss_count_)));
-  out += str(boost::format("'coldStatCount':%d, ") % cold_miss_count_);
-  out += str(boost::format("'invalStatCount':%d, ") % inval_miss_count_);
-  out += str(boost::format("'medianDist':%d, ") % target_sizes[0]);
-  out += str(boost::format("'totalPredictionAccesses':%d, ") % total_prediction_accesses_);
-  out += str(boost::format("'totalPredictionHits':%d, ") % total_prediction_hits_);
+  out->Printf("'sampleCount':%"PRIacc", ", sample_count_);
+  out->Printf("'totalDist':%"PRId64", ", total_distance_);
+  out->Printf("'avgDist':%.2f, ", static_cast<double>(total_distance_) /
+              (sample_count_ - cold_miss_count_ - inval_miss_count_));
+  out->Printf("'coldStatCount':%d, ", cold_miss_count_);
+  out->Printf("'invalStatCount':%d, ", inval_miss_count_);
+  out->Printf("'medianDist':%"PRIacc", ", target_sizes[0]);
+  out->Printf("'totalPredictionAccesses':%"PRIacc", ", total_prediction_accesses_);
+  out->Printf("'totalPredictionHits':%"PRIacc", ", total_prediction_hits_);
 
   for (unsigned int j = 0; j < target_hit_rates_.size(); j++) {
-    out += str(boost::format("'hit%dpct':%d, ") % static_cast<int>(target_hit_rates_[j]*100)
-        % target_sizes[j]);
+    out->Printf("'hit%dpct':%"PRIacc", ", static_cast<int>(target_hit_rates_[j]*100),
+                target_sizes[j]);
   }
   // don't terminate attribute dict, will be terminated by caller
+}
+
+void ReuseStackStats::WriteBinaryAttributes(BinaryResultWriter *out) const {
+  std::vector<acc_count_t> target_sizes(GetTargetSizes());
+  out->IntItem("sampleCount", sample_count_);
+  out->IntItem("totalDist", total_distance_);
+  out->String("avgDist");
+  out->Double(static_cast<double>(total_distance_) /
+              (sample_count_ - cold_miss_count_ - inval_miss_count_), 2);
+  out->IntItem("coldStatCount", cold_miss_count_);
+  out->IntItem("invalStatCount", inval_miss_count_);
+  out->IntItem("medianDist", target_sizes[0]);
+  out->IntItem("totalPredictionAccesses", total_prediction_accesses_);
+  out->IntItem("totalPredictionHits", total_prediction_hits_);
+  for (unsigned int j = 0; j < target_hit_rates_.size(); j++) {
+    char name[32];
+    snprintf(name, sizeof(name), "hit%dpct", static_cast<int>(target_hit_rates_[j]*100));
+    out->IntItem(name, target_sizes[j]);
+  }
+}
+
+std::string ReuseStackStats::GetAttributes() const {
+  std::string out;
+  StatsWriter writer(&out);
+  WriteAttributes(&writer);
+  writer.Flush();
   return out;
 }
 
-std::string ReuseStackStats::GetPredictions() const {
-  std::string out = "{ ";
+void ReuseStackStats::WritePredictions(StatsWriter *out) const {
+  out->Write("{ ");
   for (std::map<acc_count_t, std::vector<acc_count_t> >::const_iterator iter
        = ratio_predictions_.begin();
        iter != ratio_predictions_.end(); ++iter) { //for each prediction size
-    out += str(boost::format("%d: [") % iter->first);  // map size->list of predictions
+    out->Printf("%"PRIacc": [", iter->first);  // map size->list of predictions
     for (unsigned int i = 0; i < iter->second.size(); i++) {
-      out += str(boost::format("%u, ") % iter->second[i]);
+      out->Printf("%"PRIacc", ", iter->second[i]);
     }
-    out += "], ";
+    out->Write("], ");
   }
-  out += "'accesses': [";
+  out->Write("'accesses': [");
   for (unsigned int i = 0; i < prediction_accesses_.size(); i++) {
-    out += str(boost::format("%u, ") % prediction_accesses_[i]);
+    out->Printf("%"PRIacc", ", prediction_accesses_[i]);
   }
-  out += "]}\n";
+  out->Write("]}\n");
+}
+
+void ReuseStackStats::WriteBinaryPredictions(BinaryResultWriter *out) const {
+  out->BeginDict();
+  for (std::map<acc_count_t, std::vector<acc_count_t> >::const_iterator iter
+       = ratio_predictions_.begin();
+       iter != ratio_predictions_.end(); ++iter) {
+    out->Int(iter->first);
+    out->BeginList();
+    for (unsigned int i = 0; i < iter->second.size(); i++) out->Int(iter->second[i]);
+    out->End();
+  }
+  out->String("accesses");
+  out->BeginList();
+  for (unsigned int i = 0; i < prediction_accesses_.size(); i++) out->Int(prediction_accesses_[i]);
+  out->End();
+  out->End();
+}
+
+std::string ReuseStackStats::GetPredictions() const {
+  std::string out;
+  StatsWriter writer(&out);
+  WritePredictions(&writer);
+  writer.Flush();
   return out;
 }
@@ -14,13 +14,28 @@
 #include <tr1/unordered_map>
 #include "reusestack-common.h"
 
+class BinaryResultWriter;
+class StatsWriter;
+
+/*
+ * Per-PC distance histograms. By default every PC gets its own histogram. With a nonzero
+ * tracked-PC limit, only the heaviest PCs (by sample count, estimated space-saving style) keep
+ * full histograms and everything else is aggregated into a single "other" entry.
+ */
 class PCStats {
 public:
   class DistanceStats {
   public:
     DistanceStats();
     void AddSample(acc_count_t distance);
+    void Merge(const DistanceStats &other);
     std::string GetStatsString() const;
+    void WriteStats(StatsWriter *out) const;
+    void WriteBinary(BinaryResultWriter *out) const;
+    acc_count_t GetSampleCount() const { return sample_count_; }
+    // space-saving count estimate: samples seen plus the count inherited at admission
+    acc_count_t GetCountEstimate() const { return sample_count_ + count_offset_; }
+    void SetCountOffset(acc_count_t offset) { count_offset_ = offset; }
   private:
     static const int kHistogramDensity = 2; ///< number of histogram buckets per power of 2
     static const int kInitialHistogramBuckets = 8; ///< initial number of buckets (dynamically resized)
@@ -33,12 +48,41 @@ public:
     acc_count_t inval_miss_count_;
     std::vector<acc_count_t> distance_histogram_;
     std::vector<float> bucket_avg_;
+    acc_count_t count_offset_;
   };
+  PCStats() : max_tracked_pcs_(0), eviction_floor_(0), evicted_pcs_(0) {}
+  explicit PCStats(int max_tracked_pcs);
   void AddSample(address_t PC, acc_count_t distance);
+  // Adds all of other's samples. PCs new to this table are admitted subject to the limit.
+  void Merge(const PCStats &other);
+  // 0 means unlimited. Lowering the limit below the current PC count evicts immediately.
+  void SetMaxTrackedPCs(int max_tracked_pcs);
+  int GetMaxTrackedPCs() const { return max_tracked_pcs_; }
+  bool IsBounded() const { return max_tracked_pcs_ > 0; }
+  int GetTrackedPCCount() const { return stats_.size(); }
+  acc_count_t GetSampleCount(address_t PC) const;
+  acc_count_t GetOtherSampleCount() const { return other_.GetSampleCount(); }
+  acc_count_t GetEvictedPCCount() const { return evicted_pcs_; }
   std::string GetStatsString() const;
+  std::string GetOtherStatsString() const;  // aggregate of all evicted PCs
+  // same output as the Get*String() versions, without building it in memory
+  void WriteStats(StatsWriter *out) const;
+  void WriteOtherStats(StatsWriter *out) const;
+  // binary format versions of the above (see rdbinary.h)
+  void WriteBinary(BinaryResultWriter *out) const;
+  void WriteOtherBinary(BinaryResultWriter *out) const;
   ~PCStats();
 private:
-  std::tr1::unordered_map<address_t, DistanceStats *> stats_;
+  typedef std::tr1::unordered_map<address_t, DistanceStats *> StatsMap;
+  static const int kEvictionBatchDivisor = 8; ///< evict 1/8 of the table when it fills
+  DistanceStats *AdmitPC(address_t PC);
+  void EvictColdest(int count);
+  StatsMap stats_;
+  int max_tracked_pcs_;
+  DistanceStats other_;
+  acc_count_t eviction_floor_; ///< largest count estimate evicted so far
+  acc_count_t evicted_pcs_;
+  DISALLOW_COPY_AND_ASSIGN(PCStats);
 };
 
 class ReuseStackStats {
@@ -46,6 +90,12 @@ public:
   typedef std::pair<double, acc_count_t> HistogramEntry;
   ReuseStackStats(int block_size);
   void AddSample(address_t address, acc_count_t distance);
+  // Adds all of other's samples and prediction counts. Block sizes must match.
+  void Merge(const ReuseStackStats &other);
+  // Adds counts from a dumped histogram (as from GetHistogram()) plus the totals the histogram
+  // does not preserve, e.g. to recompute attributes when merging result files.
+  void AddDumpedStats(const std::vector<HistogramEntry> &histogram, int64_t total_distance,
+                      acc_count_t prediction_accesses, acc_count_t prediction_hits);
 
   void SetRatioPredictionSizes(const std::vector<int> &sizes);
   std::vector<int> GetRatioPredictionSizes() const;
@@ -62,10 +112,26 @@ public:
   std::string GetHistogramString() const;  // Return histogram as a dictionary
   std::string GetAttributes() const;  // return only dictionary elements, not a full dict
   std::string GetPredictions() const;  // Return dictionary
+  // same output as the Get*() versions, without building it in memory
+  void WriteHistogram(StatsWriter *out) const;
+  void WriteAttributes(StatsWriter *out) const;
+  void WritePredictions(StatsWriter *out) const;
+  // binary format versions; attributes are written as items of a dict opened by the caller
+  void WriteBinaryHistogram(BinaryResultWriter *out) const;
+  void WriteBinaryAttributes(BinaryResultWriter *out) const;
+  void WriteBinaryPredictions(BinaryResultWriter *out) const;
   std::vector<HistogramEntry> GetHistogram() const;
   acc_count_t GetTargetSize(double target_hit_rate);
 
+  // Interval support: stats for the samples added since the last EndInterval(). Only a
+  // snapshot of the counts is kept, so memory does not grow with the number of intervals.
+  ReuseStackStats GetIntervalStats() const;
+  void EndInterval();
+
 private:
+  // cache sizes needed for each of target_hit_rates_
+  std::vector<acc_count_t> GetTargetSizes() const;
+
   static const int kHistogramDensity = 10; ///< number of histogram buckets per power of 2
   static const int kInitialHistogramBuckets = 20; ///< initial number of buckets (dynamically resized)
   static const int kHistogramSize = kInitialHistogramBuckets * kHistogramDensity; ///< total size of the histogram
@@ -84,6 +150,12 @@ private:
   std::map<acc_count_t, std::vector<acc_count_t> > ratio_predictions_;
   std::vector<acc_count_t> prediction_accesses_;
   std::vector<double> target_hit_rates_;
+  // snapshot of the counts at the end of the last interval
+  std::vector<acc_count_t> interval_base_histogram_;
+  acc_count_t interval_base_samples_;
+  int32_t interval_base_cold_;
+  int32_t interval_base_inval_;
+  int64_t interval_base_distance_;
 };
 
 #endif /* REUSESTACKSTATS_H_ */
@@ -130,3 +130,113 @@ TEST_F(ReuseStackStatsTest, HistogramSize) {
   EXPECT_FLOAT_EQ(99.0, total_dist);
   printf("%s\n", stats_.GetHistogramString().c_str());
 }
+
+// Without a limit every PC keeps its own histogram
+TEST(PCStatsTest, Unbounded) {
+  PCStats stats;
+  for (address_t pc = 0; pc < 100; pc++) {
+    stats.AddSample(pc, pc);
+  }
+  EXPECT_FALSE(stats.IsBounded());
+  EXPECT_EQ(100, stats.GetTrackedPCCount());
+  EXPECT_EQ(0U, stats.GetOtherSampleCount());
+  EXPECT_EQ(0U, stats.GetEvictedPCCount());
+}
+
+// Heavy PCs survive a stream of one-off PCs, and no samples are lost
+TEST(PCStatsTest, HeavyHitters) {
+  PCStats stats(16);
+  for (int i = 0; i < 1000; i++) {
+    stats.AddSample(1, 4);
+    stats.AddSample(2, 8);
+    stats.AddSample(1000 + i, 16);
+  }
+  EXPECT_LE(stats.GetTrackedPCCount(), 16);
+  EXPECT_EQ(1000U, stats.GetSampleCount(1));
+  EXPECT_EQ(1000U, stats.GetSampleCount(2));
+  acc_count_t tracked = 0;
+  for (int i = 0; i < 1000; i++) {
+    tracked += stats.GetSampleCount(1000 + i);
+  }
+  EXPECT_EQ(1000U, tracked + stats.GetOtherSampleCount());
+  EXPECT_GT(stats.GetEvictedPCCount(), 0U);
+}
+
+// Lowering the limit evicts down to the new size immediately
+TEST(PCStatsTest, LowerLimit) {
+  PCStats stats;
+  for (address_t pc = 0; pc < 64; pc++) {
+    for (address_t i = 0; i <= pc; i++) stats.AddSample(pc, i);
+  }
+  stats.SetMaxTrackedPCs(8);
+  EXPECT_EQ(8, stats.GetTrackedPCCount());
+  for (address_t pc = 56; pc < 64; pc++) {
+    EXPECT_EQ(pc + 1, stats.GetSampleCount(pc));
+  }
+  EXPECT_EQ(56U * 57U / 2, stats.GetOtherSampleCount());
+  EXPECT_THROW(stats.SetMaxTrackedPCs(-1), std::invalid_argument);
+}
+
+// Merging stats gives the same result as adding all samples to one
+TEST_F(ReuseStackStatsTest, Merge) {
+  ReuseStackStats other(kDefaultBlockSize), combined(kDefaultBlockSize);
+  for (acc_count_t i = 0; i < 100; i++) {
+    stats_.AddSample(0, i);
+    combined.AddSample(0, i);
+    other.AddSample(0, i * 1000);
+    combined.AddSample(0, i * 1000);
+  }
+  other.AddSample(0, kColdMiss);
+  combined.AddSample(0, kColdMiss);
+  stats_.Merge(other);
+  EXPECT_EQ(combined.GetHistogramString(), stats_.GetHistogramString());
+  EXPECT_EQ(combined.GetAttributes(), stats_.GetAttributes());
+  ReuseStackStats wrong_size(kDefaultBlockSize * 2);
+  EXPECT_THROW(stats_.Merge(wrong_size), std::invalid_argument);
+}
+
+// Stats rebuilt from a dumped histogram have the same attributes
+TEST_F(ReuseStackStatsTest, AddDumpedStats) {
+  for (acc_count_t i = 0; i < 1000; i++) stats_.AddSample(0, i * i);
+  stats_.AddSample(0, kInvalidationMiss);
+  ReuseStackStats rebuilt(kDefaultBlockSize);
+  rebuilt.AddDumpedStats(stats_.GetHistogram(), stats_.GetTotalDistance(), 1001, 0);
+  EXPECT_EQ(stats_.GetHistogramString(), rebuilt.GetHistogramString());
+  EXPECT_EQ(stats_.GetAttributes(), rebuilt.GetAttributes());
+}
+
+TEST(PCStatsTest, Merge) {
+  PCStats stats, other;
+  for (address_t pc = 0; pc < 10; pc++) {
+    stats.AddSample(pc, 1);
+    other.AddSample(pc + 5, 2);
+  }
+  stats.Merge(other);
+  EXPECT_EQ(15, stats.GetTrackedPCCount());
+  EXPECT_EQ(1U, stats.GetSampleCount(0));
+  EXPECT_EQ(2U, stats.GetSampleCount(5));
+  EXPECT_EQ(1U, stats.GetSampleCount(14));
+  PCStats bounded(4);
+  bounded.Merge(stats);
+  EXPECT_LE(bounded.GetTrackedPCCount(), 4);
+  acc_count_t total = bounded.GetOtherSampleCount();
+  for (address_t pc = 0; pc < 15; pc++) total += bounded.GetSampleCount(pc);
+  EXPECT_EQ(20U, total);
+}
+
+// Interval stats only contain the samples since the last interval, and add up to the total
+TEST_F(ReuseStackStatsTest, Intervals) {
+  ReuseStackStats total(kDefaultBlockSize);
+  for (acc_count_t i = 0; i < 50; i++) stats_.AddSample(0, i);
+  stats_.AddSample(0, kColdMiss);
+  total.Merge(stats_.GetIntervalStats());
+  stats_.EndInterval();
+  EXPECT_EQ(0U, stats_.GetIntervalStats().GetTotalSamples());
+  for (acc_count_t i = 0; i < 20; i++) stats_.AddSample(0, i * 100);
+  ReuseStackStats interval(stats_.GetIntervalStats());
+  EXPECT_EQ(20U, interval.GetTotalSamples());
+  EXPECT_EQ(0U, interval.GetColdSamples());
+  EXPECT_EQ(19000, interval.GetTotalDistance());
+  total.Merge(interval);
+  EXPECT_EQ(stats_.GetHistogramString(), total.GetHistogramString());
+}
@@ -0,0 +1,131 @@
+#ifndef SAMPLETABLE_H_
+#define SAMPLETABLE_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "reusestack-common.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * The active sampled addresses of one thread, kept contiguous (structure of arrays: the
+ * addresses in one aligned array, the T records they belong to in another) so that matching
+ * an access against all of them is a few vector compares instead of a list walk. Order is not
+ * kept: removal moves the last entry into the hole. Once the table is big enough for the scan
+ * to cost more than hashing, a counting Bloom filter turns away most addresses that aren't in
+ * it (about 2% false positives at 300 entries) before the scan.
+ */
+template<class T> class SampleTable {
+public:
+  SampleTable() : addresses_(NULL), entries_(NULL), size_(0), capacity_(0) {
+    memset(filter_, 0, sizeof(filter_));
+  }
+  ~SampleTable() {
+    free(addresses_);
+    free(entries_);
+  }
+  void Add(address_t address, T *entry) {
+    if (size_ == capacity_) Grow();
+    addresses_[size_] = address;
+    entries_[size_] = entry;
+    size_++;
+    uint64_t hash = Hash(address);
+    filter_[FirstSlot(hash)]++;
+    filter_[SecondSlot(hash)]++;
+  }
+  // Removes 'entry'; returns false if it is not in the table
+  bool Remove(const T *entry) {
+    for (int i = 0; i < size_; i++) {
+      if (entries_[i] == entry) {
+        uint64_t hash = Hash(addresses_[i]);
+        filter_[FirstSlot(hash)]--;
+        filter_[SecondSlot(hash)]--;
+        size_--;
+        addresses_[i] = addresses_[size_];
+        entries_[i] = entries_[size_];
+        return true;
+      }
+    }
+    return false;
+  }
+  // The first index at or after 'start' holding 'address', or -1
+  int Find(address_t address, int start = 0) const {
+    if (start == 0 && size_ >= kFilterMinSize && !MayContain(address)) return -1;
+    int i = start;
+#if defined(__SSE2__)
+    if (i & 1) {  // get to a 16-byte boundary
+      if (i < size_ && addresses_[i] == address) return i;
+      i++;
+    }
+    const __m128i key = _mm_set1_epi64x(address);
+    for (; i + 4 <= size_; i += 4) {
+      __m128i low = _mm_load_si128(reinterpret_cast<const __m128i *>(addresses_ + i));
+      __m128i high = _mm_load_si128(reinterpret_cast<const __m128i *>(addresses_ + i + 2));
+      if (_mm_movemask_epi8(_mm_or_si128(Match64(low, key), Match64(high, key))) != 0) break;
+    }
+#endif
+    for (; i < size_; i++) {
+      if (addresses_[i] == address) return i;
+    }
+    return -1;
+  }
+  address_t address(int index) const { return addresses_[index]; }
+  T *entry(int index) const { return entries_[index]; }
+  int size() const { return size_; }
+  // False if 'address' is certainly not in the table
+  bool MayContain(address_t address) const {
+    uint64_t hash = Hash(address);
+    return filter_[FirstSlot(hash)] != 0 && filter_[SecondSlot(hash)] != 0;
+  }
+
+private:
+  static const int kInitialCapacity = 16;
+  static const int kFilterBits = 12;
+  static const int kFilterMinSize = 16;
+  static uint64_t Hash(address_t address) { return address * 0x9e3779b97f4a7c15ULL; }
+  static int FirstSlot(uint64_t hash) { return hash >> (64 - kFilterBits); }
+  static int SecondSlot(uint64_t hash) {
+    return (hash >> (64 - 2 * kFilterBits)) & ((1 << kFilterBits) - 1);
+  }
+#if defined(__SSE2__)
+  // SSE2 has no 64-bit compare: a lane matches when both of its 32-bit halves do
+  static __m128i Match64(__m128i values, __m128i key) {
+    __m128i halves = _mm_cmpeq_epi32(values, key);
+    return _mm_and_si128(halves, _mm_shuffle_epi32(halves, _MM_SHUFFLE(2, 3, 0, 1)));
+  }
+#endif
+  void Grow() {
+    int capacity = capacity_ == 0 ? kInitialCapacity : capacity_ * 2;
+    void *addresses;
+    if (posix_memalign(&addresses, 64, capacity * sizeof(address_t)) != 0) throw std::bad_alloc();
+    T **entries = static_cast<T **>(malloc(capacity * sizeof(T *)));
+    if (entries == NULL) {
+      free(addresses);
+      throw std::bad_alloc();
+    }
+    for (int i = 0; i < size_; i++) {
+      static_cast<address_t *>(addresses)[i] = addresses_[i];
+      entries[i] = entries_[i];
+    }
+    free(addresses_);
+    free(entries_);
+    addresses_ = static_cast<address_t *>(addresses);
+    entries_ = entries;
+    capacity_ = capacity;
+  }
+
+  address_t *addresses_;  ///< 64-byte aligned
+  T **entries_;
+  int size_;
+  int capacity_;
+  uint16_t filter_[1 << kFilterBits];  ///< entries hashing to each slot, by either hash
+  DISALLOW_COPY_AND_ASSIGN(SampleTable);
+};
+
+template<class T> const int SampleTable<T>::kInitialCapacity;
+template<class T> const int SampleTable<T>::kFilterBits;
+template<class T> const int SampleTable<T>::kFilterMinSize;
+
+#endif /* SAMPLETABLE_H_ */
@@ -0,0 +1,78 @@
+#include <gtest/gtest.h>
+#include "sampletable.h"
+
+struct Sample {
+  int id;
+};
+
+TEST(SampleTableTest, FindAndRemove) {
+  SampleTable<Sample> table;
+  EXPECT_EQ(-1, table.Find(64));
+  // enough entries to grow the table and go through the vector path, plus an odd tail
+  const int kSamples = 37;
+  Sample samples[kSamples];
+  for (int i = 0; i < kSamples; i++) {
+    samples[i].id = i;
+    table.Add(0x7fff00000000ULL + i * 64, &samples[i]);
+  }
+  EXPECT_EQ(kSamples, table.size());
+  for (int i = 0; i < kSamples; i++) {
+    int index = table.Find(0x7fff00000000ULL + i * 64);
+    ASSERT_GE(index, 0);
+    EXPECT_EQ(i, table.entry(index)->id);
+    // same upper half, different lower half: no match
+    EXPECT_EQ(-1, table.Find(0x7fff00000000ULL + i * 64 + 8));
+  }
+  EXPECT_TRUE(table.Remove(&samples[3]));
+  EXPECT_FALSE(table.Remove(&samples[3]));
+  EXPECT_EQ(kSamples - 1, table.size());
+  EXPECT_EQ(-1, table.Find(0x7fff00000000ULL + 3 * 64));
+  EXPECT_GE(table.Find(0x7fff00000000ULL + (kSamples - 1) * 64), 0);
+}
+
+// Several threads can sample the same address
+TEST(SampleTableTest, Duplicates) {
+  SampleTable<Sample> table;
+  Sample samples[20];
+  for (int i = 0; i < 20; i++) {
+    samples[i].id = i;
+    table.Add(i % 5 == 0 ? 64000 : 128 + i * 64, &samples[i]);
+  }
+  int matches = 0;
+  for (int i = table.Find(64000); i >= 0; i = table.Find(64000, i + 1)) {
+    EXPECT_EQ(0, table.entry(i)->id % 5);
+    matches++;
+  }
+  EXPECT_EQ(4, matches);
+}
+
+// The filter never turns away an address in the table, and forgets removed ones
+TEST(SampleTableTest, Filter) {
+  SampleTable<Sample> table;
+  const int kSamples = 300;
+  Sample samples[kSamples];
+  for (int i = 0; i < kSamples; i++) {
+    samples[i].id = i;
+    // a few duplicates, so that removing one copy must keep the other
+    table.Add((i % 100) * 4096 + 64, &samples[i]);
+  }
+  int false_positives = 0;
+  for (int i = 0; i < 10000; i++) {
+    address_t address = 0x10000000ULL + i * 64;
+    if (table.MayContain(address)) false_positives++;
+    EXPECT_EQ(-1, table.Find(address));
+  }
+  EXPECT_LT(false_positives, 10000 * 5 / 100);
+  for (int i = 0; i < kSamples; i++) {
+    if (i >= 100) {
+      EXPECT_TRUE(table.Remove(&samples[i]));
+    }
+  }
+  for (int i = 0; i < 100; i++) {
+    int index = table.Find(i * 4096 + 64);
+    ASSERT_GE(index, 0);
+    EXPECT_EQ(i, table.entry(index)->id);
+  }
+  for (int i = 0; i < 100; i++) EXPECT_TRUE(table.Remove(&samples[i]));
+  for (int i = 0; i < 100; i++) EXPECT_FALSE(table.MayContain(i * 4096 + 64));
+}
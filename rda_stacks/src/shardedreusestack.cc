@@ -0,0 +1,165 @@
+#include "shardedreusestack.h"
+#include <limits>
+#include <stdexcept>
+#include "spscring.h"
+
+const int ShardedReuseStack::kDefaultShards;
+const int ShardedReuseStack::kSpinsBeforePark;
+
+ShardedReuseStack::ShardedReuseStack(FILE *outfile, int granularity, int shards, int threads)
+    : block_bytes_(granularity), clock_(0), tot_addrs_(0), stack_size_(0), local_shards_(shards),
+      query_stamp_(0), stop_(false) {
+  if (shards < 1) throw std::invalid_argument("sharded stacks need at least 1 shard");
+  if (threads < 1 || threads > shards) {
+    throw std::invalid_argument("query threads must be between 1 and the number of shards");
+  }
+  shards_.resize(shards);
+  local_shards_ = shards / threads;
+  for (int t = 1; t < threads; t++) {
+    QueryWorker *worker = new QueryWorker();
+    worker->stack = this;
+    worker->first_shard = t * shards / threads;
+    worker->end_shard = (t + 1) * shards / threads;
+    if (pthread_create(&worker->thread, NULL, QueryWorkerMain, worker) != 0) {
+      delete worker;
+      StopWorkers();
+      throw std::runtime_error("could not start a query thread");
+    }
+    workers_.push_back(worker);
+  }
+}
+
+ShardedReuseStack::~ShardedReuseStack() {
+  StopWorkers();
+}
+
+void ShardedReuseStack::StopWorkers() {
+  stop_ = true;
+  __sync_synchronize();
+  for (size_t i = 0; i < workers_.size(); i++) {
+    Wake(workers_[i]);
+    pthread_join(workers_[i]->thread, NULL);
+    delete workers_[i];
+  }
+  workers_.clear();
+}
+
+void *ShardedReuseStack::QueryWorkerMain(void *arg) {
+  QueryWorker *worker = static_cast<QueryWorker *>(arg);
+  worker->stack->RunQueries(worker);
+  return NULL;
+}
+
+void ShardedReuseStack::RunQueries(QueryWorker *worker) {
+  uint64_t seen = 0;
+  for (int spins = 0; !stop_; spins++) {
+    if (worker->posted == seen) {
+      if (spins < kSpinsBeforePark) {
+        SpscRing<acc_count_t>::Wait(spins);
+        continue;
+      }
+      // idle: sleep until Wake. Setting parked before the last check pairs with the poster
+      // setting posted before it checks parked, so one of the two sees the other.
+      pthread_mutex_lock(&worker->mutex);
+      worker->parked = true;
+      __sync_synchronize();
+      while (worker->posted == seen && !stop_) pthread_cond_wait(&worker->wake, &worker->mutex);
+      worker->parked = false;
+      pthread_mutex_unlock(&worker->mutex);
+      spins = 0;
+      continue;
+    }
+    spins = 0;
+    seen = worker->posted;
+    __sync_synchronize();
+    worker->count = CountAfter(worker->first_shard, worker->end_shard, query_stamp_);
+    __sync_synchronize();
+    worker->answered = seen;
+  }
+}
+
+void ShardedReuseStack::Wake(QueryWorker *worker) {
+  if (!worker->parked) return;
+  pthread_mutex_lock(&worker->mutex);
+  pthread_cond_signal(&worker->wake);
+  pthread_mutex_unlock(&worker->mutex);
+}
+
+acc_count_t ShardedReuseStack::CountAfter(int first_shard, int end_shard,
+                                          acc_count_t stamp) const {
+  acc_count_t count = 0;
+  for (int s = first_shard; s < end_shard; s++) count += shards_[s].stamps.CountAfter(stamp);
+  return count;
+}
+
+// Fans the query out to the workers and answers for the local shards meanwhile
+acc_count_t ShardedReuseStack::CountAfter(acc_count_t stamp) {
+  if (workers_.empty()) return CountAfter(0, shards_.size(), stamp);
+  query_stamp_ = stamp;
+  __sync_synchronize();
+  for (size_t i = 0; i < workers_.size(); i++) workers_[i]->posted = workers_[i]->posted + 1;
+  __sync_synchronize();
+  for (size_t i = 0; i < workers_.size(); i++) Wake(workers_[i]);
+  acc_count_t count = CountAfter(0, local_shards_, stamp);
+  for (size_t i = 0; i < workers_.size(); i++) {
+    QueryWorker *worker = workers_[i];
+    for (int spins = 0; worker->answered != worker->posted; spins++) {
+      SpscRing<acc_count_t>::Wait(spins);
+    }
+    __sync_synchronize();
+    count += worker->count;
+  }
+  return count;
+}
+
+/*
+ * Holes work as in TreeReuseStack: an invalidated block's timestamp stays live, and the oldest
+ * hole is filled (its timestamp removed) by the first access that comes from below it. The
+ * accessed block's old timestamp then becomes a hole itself.
+ */
+acc_count_t ShardedReuseStack::StackAccess(address_t addr) {
+  if (++clock_ >= kAccessCountMax) {
+    throw std::overflow_error("Overflow in number of references!");
+  }
+  int owner = ShardOf(addr);
+  Shard &shard = shards_[owner];
+  std::tr1::unordered_map<address_t, acc_count_t>::iterator last = shard.last_access.find(addr);
+  bool found = last != shard.last_access.end();
+  acc_count_t distance = kStackNotFound;
+  acc_count_t last_stamp = 0;  // like TreeReuseStack, cold blocks come from below everything
+  if (found) {
+    last_stamp = last->second;
+    distance = CountAfter(last_stamp);
+  }
+  if (!holes_.empty() && last_stamp < holes_.begin()->first) {
+    std::map<acc_count_t, int>::iterator hole = holes_.begin();
+    shards_[hole->second].stamps.Remove(hole->first);
+    holes_.erase(hole);
+    if (found) holes_[last_stamp] = owner;
+  } else if (found) {
+    shard.stamps.Remove(last_stamp);
+  }
+  if (found) {
+    last->second = clock_;
+  } else {
+    ++tot_addrs_;
+    if (++stack_size_ > std::numeric_limits<int32_t>::max()) {
+      throw std::overflow_error("Stack size overflow (2G entries fits in memory? really?)");
+    }
+    shard.last_access[addr] = clock_;
+  }
+  shard.stamps.Append(clock_);
+  return distance;
+}
+
+acc_count_t ShardedReuseStack::SnoopInvalidate(address_t addr) {
+  int owner = ShardOf(addr);
+  Shard &shard = shards_[owner];
+  std::tr1::unordered_map<address_t, acc_count_t>::iterator last = shard.last_access.find(addr);
+  if (last == shard.last_access.end()) return kStackNotFound;
+  acc_count_t stamp = last->second;
+  holes_[stamp] = owner;
+  shard.last_access.erase(last);
+  --stack_size_;
+  return stamp;
+}
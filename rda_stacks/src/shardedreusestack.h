@@ -0,0 +1,91 @@
+#ifndef SHARDEDREUSESTACK_H_
+#define SHARDEDREUSESTACK_H_
+
+#include <pthread.h>
+#include <stdio.h>
+#include <map>
+#include <tr1/unordered_map>
+#include <vector>
+#include "livetimestamps.h"
+#include "reusestack-common.h"
+
+/*
+ * Exact reuse stack partitioned by block address. Every access gets a global timestamp, and each
+ * shard keeps the timestamps of its own blocks' latest accesses in a Fenwick tree. The distance
+ * of a block last accessed at t is the number of live timestamps after t, summed over all shards.
+ * Invalidations leave holes the way TreeReuseStack does, so the distances are the same.
+ *
+ * With more than one query thread, each thread owns a range of shards and every distance query
+ * fans out to them. The handoff costs a few cache misses per access, so this only pays off for
+ * stacks much larger than the caches, where the shards' trees stay in their own threads' caches.
+ * A worker that has seen no query for kSpinsBeforePark polls sleeps until the next one.
+ */
+class ShardedReuseStack : public ReuseStackImplInterface {
+public:
+  static const int kDefaultShards = 16;
+  static const int kSpinsBeforePark = 1 << 12;
+  // 'threads' answer queries, including the caller's; throws std::invalid_argument unless
+  // 1 <= threads <= shards
+  ShardedReuseStack(FILE *outfile, int granularity, int shards = kDefaultShards,
+                    int threads = 1);
+  virtual ~ShardedReuseStack();
+  virtual acc_count_t SnoopInvalidate(address_t addr);
+  virtual acc_count_t StackAccess(address_t addr);
+  virtual acc_count_t GetStackSize() { return stack_size_; }
+  acc_count_t getTotAddrs() { return tot_addrs_; }
+
+private:
+  // One partition of the stack
+  struct Shard {
+    std::tr1::unordered_map<address_t, acc_count_t> last_access;  ///< block -> timestamp
+    LiveTimestamps stamps;
+  };
+  // A thread answering queries for shards [first_shard, end_shard)
+  struct QueryWorker {
+    QueryWorker() : posted(0), answered(0), count(0), parked(false) {
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&wake, NULL);
+    }
+    ~QueryWorker() {
+      pthread_cond_destroy(&wake);
+      pthread_mutex_destroy(&mutex);
+    }
+    ShardedReuseStack *stack;
+    int first_shard;
+    int end_shard;
+    pthread_t thread;
+    volatile uint64_t posted;
+    volatile uint64_t answered;
+    volatile acc_count_t count;
+    volatile bool parked;  ///< waiting on 'wake'; whoever posts a query must signal it
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    char padding[64];  ///< keeps the next worker's counters off this cache line
+  };
+
+  int ShardOf(address_t addr) const {
+    uint64_t block = addr / block_bytes_;
+    return ((block * 0x9E3779B97F4A7C15ULL) >> 32) % shards_.size();
+  }
+  acc_count_t CountAfter(acc_count_t stamp);
+  acc_count_t CountAfter(int first_shard, int end_shard, acc_count_t stamp) const;
+  static void *QueryWorkerMain(void *arg);
+  void RunQueries(QueryWorker *worker);
+  static void Wake(QueryWorker *worker);
+  void StopWorkers();
+
+  const int block_bytes_;
+  std::vector<Shard> shards_;
+  std::map<acc_count_t, int> holes_;  ///< timestamps of invalidated blocks -> shard
+  acc_count_t clock_;  ///< the latest timestamp
+  acc_count_t tot_addrs_;  ///< total unique addresses ever seen
+  acc_count_t stack_size_;  ///< blocks in the stack, not counting holes
+  // query fan-out; the caller answers for shards [0, local_shards_)
+  std::vector<QueryWorker *> workers_;
+  int local_shards_;
+  volatile acc_count_t query_stamp_;
+  volatile bool stop_;
+  DISALLOW_COPY_AND_ASSIGN(ShardedReuseStack);
+};
+
+#endif /* SHARDEDREUSESTACK_H_ */
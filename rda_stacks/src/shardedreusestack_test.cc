@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include "shardedreusestack.h"
+#include "treereusestack.h"
+
+// Random accesses and invalidations; every distance must match the splay tree's
+static void CompareWithTree(int shards, int threads, int references, int blocks) {
+  TreeReuseStack tree(NULL, 8);
+  ShardedReuseStack sharded(NULL, 8, shards, threads);
+  unsigned int seed = 12345;
+  for (int i = 0; i < references; i++) {
+    address_t block = (rand_r(&seed) % blocks + 1) * 8;
+    if (rand_r(&seed) % 8 == 0) {
+      ASSERT_EQ(tree.SnoopInvalidate(block) == kStackNotFound,
+                sharded.SnoopInvalidate(block) == kStackNotFound) << "reference " << i;
+    } else {
+      ASSERT_EQ(tree.StackAccess(block), sharded.StackAccess(block)) << "reference " << i;
+    }
+    ASSERT_EQ(tree.GetStackSize(), sharded.GetStackSize());
+  }
+  EXPECT_EQ(tree.getTotAddrs(), sharded.getTotAddrs());
+}
+
+TEST(ShardedReuseStackTest, Basic) {
+  ShardedReuseStack stack(NULL, 8, 4);
+  EXPECT_EQ(kStackNotFound, stack.StackAccess(8));
+  EXPECT_EQ(kStackNotFound, stack.StackAccess(16));
+  EXPECT_EQ(kStackNotFound, stack.StackAccess(24));
+  EXPECT_EQ(0, stack.StackAccess(24));
+  EXPECT_EQ(2, stack.StackAccess(8));
+  EXPECT_EQ(3, stack.GetStackSize());
+  // the hole keeps 16's place until an access from below fills it
+  EXPECT_NE(kStackNotFound, stack.SnoopInvalidate(16));
+  EXPECT_EQ(kStackNotFound, stack.SnoopInvalidate(16));
+  EXPECT_EQ(2, stack.GetStackSize());
+  EXPECT_EQ(1, stack.StackAccess(24));
+  EXPECT_EQ(kStackNotFound, stack.StackAccess(32));
+  EXPECT_EQ(2, stack.StackAccess(8));
+}
+
+TEST(ShardedReuseStackTest, SameAsTree) {
+  CompareWithTree(1, 1, 200000, 5000);
+  CompareWithTree(16, 1, 200000, 5000);
+  CompareWithTree(7, 1, 100000, 100);
+}
+
+TEST(ShardedReuseStackTest, QueryThreads) {
+  CompareWithTree(8, 3, 20000, 2000);
+}
+
+// Workers that have been idle long enough to sleep still answer, and still stop
+TEST(ShardedReuseStackTest, IdleWorkers) {
+  ShardedReuseStack stack(NULL, 8, 4, 4);
+  for (int i = 1; i <= 4; i++) EXPECT_EQ(kStackNotFound, stack.StackAccess(i * 8));
+  usleep(100000);
+  EXPECT_EQ(3, stack.StackAccess(8));
+  usleep(100000);
+  EXPECT_EQ(0, stack.StackAccess(8));
+  EXPECT_EQ(3, stack.StackAccess(16));
+}
+
+TEST(ShardedReuseStackTest, BadSizes) {
+  EXPECT_THROW(ShardedReuseStack(NULL, 8, 0, 1), std::invalid_argument);
+  EXPECT_THROW(ShardedReuseStack(NULL, 8, 4, 0), std::invalid_argument);
+  EXPECT_THROW(ShardedReuseStack(NULL, 8, 4, 5), std::invalid_argument);
+}
@@ -0,0 +1,66 @@
+#ifndef SHARERDIRECTORY_H_
+#define SHARERDIRECTORY_H_
+
+#include <limits>
+#include <tr1/unordered_map>
+#include "reusestack-common.h"
+
+/*
+ * Per-block bitmask of the stacks (threads or pair caches) that may hold each block, so a write
+ * only has to snoop the actual sharers instead of every other stack. A sharer's bit is set when
+ * it accesses the block and cleared when another sharer writes it, so the mask is always a
+ * superset of the stacks that hold the block and snooping only the mask changes no results.
+ * With more than kMaskBits sharers, sharers s, s + kMaskBits, s + 2 * kMaskBits... share bit
+ * s % kMaskBits, and a set bit means that any of them may hold the block.
+ */
+class SharerDirectory {
+public:
+  typedef uint64_t SharerMask;
+  static const int kMaskBits = 64;
+  explicit SharerDirectory(int block_bytes, int max_sharers = kMaskBits)
+      : block_bytes_(block_bytes), folded_(max_sharers > kMaskBits) {}
+
+  // Records 'sharer' for every block that ReuseStack::Access(address, size) touches
+  void AddAccess(address_t address, int size, int sharer) {
+    SharerMask bit = Bit(sharer);
+    address_t max_address = std::numeric_limits<int64_t>::max() - block_bytes_;
+    address_t addr = address;
+    do {
+      sharers_[addr / block_bytes_] |= bit;
+      if (addr > max_address) break;
+      addr += block_bytes_;
+    } while (address + size > addr);
+  }
+  // Records the access and makes 'writer' the only sharer of the block that ReuseStack::Snoop
+  // invalidates. Returns the other sharers, which must be snooped. When sharers are folded the
+  // writer's own bit may stand for others too, so it is returned and the caller skips the writer.
+  SharerMask Write(address_t address, int size, int writer) {
+    AddAccess(address, size, writer);
+    SharerMask &mask = sharers_[address / block_bytes_];
+    SharerMask others = folded_ ? mask : mask & ~Bit(writer);
+    mask = Bit(writer);
+    return others;
+  }
+  SharerMask GetSharers(address_t block) const {
+    std::tr1::unordered_map<address_t, SharerMask>::const_iterator iter = sharers_.find(block);
+    return iter == sharers_.end() ? 0 : iter->second;
+  }
+  size_t size() const { return sharers_.size(); }
+  static SharerMask Bit(int sharer) {
+    return static_cast<SharerMask>(1) << (sharer % kMaskBits);
+  }
+  // Returns the lowest sharer in *mask and removes it, for iterating over a mask
+  static int PopSharer(SharerMask *mask) {
+    int sharer = __builtin_ctzll(*mask);
+    *mask &= *mask - 1;
+    return sharer;
+  }
+
+private:
+  const int block_bytes_;
+  const bool folded_;  ///< more sharers than mask bits
+  std::tr1::unordered_map<address_t, SharerMask> sharers_;
+  DISALLOW_COPY_AND_ASSIGN(SharerDirectory);
+};
+
+#endif /* SHARERDIRECTORY_H_ */
@@ -0,0 +1,84 @@
+#include <vector>
+#include <gtest/gtest.h>
+#include "sharerdirectory.h"
+#include "reusestack.h"
+
+TEST(SharerDirectoryTest, Basic) {
+  SharerDirectory dir(64);
+  EXPECT_EQ(0U, dir.GetSharers(0));
+  dir.AddAccess(0, 4, 0);
+  dir.AddAccess(8, 4, 3);
+  dir.AddAccess(100, 4, 63);
+  EXPECT_EQ(SharerDirectory::Bit(0) | SharerDirectory::Bit(3), dir.GetSharers(0));
+  EXPECT_EQ(SharerDirectory::Bit(63), dir.GetSharers(1));
+
+  // the writer becomes the only sharer, and the others are returned to be snooped
+  SharerDirectory::SharerMask others = dir.Write(16, 4, 3);
+  EXPECT_EQ(SharerDirectory::Bit(0), others);
+  EXPECT_EQ(SharerDirectory::Bit(3), dir.GetSharers(0));
+  EXPECT_EQ(0U, dir.Write(16, 4, 3));
+  EXPECT_EQ(SharerDirectory::Bit(3), dir.Write(0, 4, 5));
+
+  // larger accesses add the sharer to the same blocks that ReuseStack::Access touches
+  dir.AddAccess(120, 72, 7);
+  EXPECT_TRUE(dir.GetSharers(1) & SharerDirectory::Bit(7));
+  EXPECT_TRUE(dir.GetSharers(2) & SharerDirectory::Bit(7));
+  EXPECT_EQ(0U, dir.GetSharers(3));
+
+  SharerDirectory::SharerMask mask = SharerDirectory::Bit(2) | SharerDirectory::Bit(40);
+  EXPECT_EQ(2, SharerDirectory::PopSharer(&mask));
+  EXPECT_EQ(40, SharerDirectory::PopSharer(&mask));
+  EXPECT_EQ(0U, mask);
+}
+
+// Snooping only the directory's sharers gives the same distances as snooping every stack
+void CheckMatchesBroadcast(int threads) {
+  const int kBlock = 64;
+  std::vector<ReuseStack *> broadcast(threads);
+  std::vector<ReuseStack *> directed(threads);
+  for (int i = 0; i < threads; i++) {
+    broadcast[i] = new ReuseStack(stdout, kBlock, ReuseStack::kTreeStack);
+    directed[i] = new ReuseStack(stdout, kBlock, ReuseStack::kTreeStack);
+  }
+  SharerDirectory dir(kBlock, threads);
+  for (int n = 0; n < 20000; n++) {
+    int thread = (n * 7) % threads;
+    address_t address = (n * 2654435761U) % 4096;
+    int size = 1 + n % 16;
+    bool is_write = n % 5 == 0;
+    ReuseStackBase::AccessType type = is_write ? ReuseStackBase::kWrite : ReuseStackBase::kRead;
+    EXPECT_EQ(broadcast[thread]->Access(address, size, type),
+              directed[thread]->Access(address, size, type));
+    if (is_write) {
+      for (int i = 0; i < threads; i++) {
+        if (i != thread) broadcast[i]->Snoop(address, size);
+      }
+      SharerDirectory::SharerMask sharers = dir.Write(address, size, thread);
+      while (sharers) {
+        for (int i = SharerDirectory::PopSharer(&sharers); i < threads;
+             i += SharerDirectory::kMaskBits) {
+          if (i != thread) directed[i]->Snoop(address, size);
+        }
+      }
+    } else {
+      dir.AddAccess(address, size, thread);
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    delete broadcast[i];
+    delete directed[i];
+  }
+}
+
+TEST(SharerDirectoryTest, MatchesBroadcast) {
+  CheckMatchesBroadcast(4);
+}
+
+// Past 64 sharers the bits are shared, and a write must still reach the writer's bit-mates
+TEST(SharerDirectoryTest, FoldedMatchesBroadcast) {
+  SharerDirectory dir(64, 130);
+  dir.AddAccess(0, 4, 70);
+  EXPECT_EQ(SharerDirectory::Bit(6), dir.GetSharers(0));
+  EXPECT_EQ(SharerDirectory::Bit(6), dir.Write(0, 4, 6));
+  CheckMatchesBroadcast(130);
+}
@@ -0,0 +1,75 @@
+#ifndef SPSCRING_H_
+#define SPSCRING_H_
+
+#include <sched.h>
+#include <stdexcept>
+#include <vector>
+#include "reusestack-common.h"
+
+/*
+ * Bounded ring of T between one producer thread and one consumer thread, without locks. The
+ * consumer looks at the front element and pops it only when done with it, so Empty() on the
+ * producer side means everything pushed so far has been handled. Both sides spin (yielding
+ * after a while) when the ring is full or empty. Only the x86 memory model is supported: stores
+ * are not reordered with other stores, so publishing an index only needs a compiler barrier.
+ */
+template<class T> class SpscRing {
+public:
+  static const int kSpinsBeforeYield = 64;
+  // 'capacity' is rounded up to a power of 2
+  explicit SpscRing(int capacity) : head_(0), tail_(0) {
+    if (capacity < 1) throw std::invalid_argument("rings need room for at least 1 element");
+    int size = 1;
+    while (size < capacity) size <<= 1;
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+  // producer side
+  void Push(const T &value) {
+    for (int spins = 0; tail_ - head_ > mask_; spins++) Wait(spins);
+    slots_[tail_ & mask_] = value;
+    Barrier();
+    tail_ = tail_ + 1;
+  }
+  bool Empty() const { return head_ == tail_; }
+  void WaitUntilEmpty() const {
+    for (int spins = 0; !Empty(); spins++) Wait(spins);
+  }
+  // consumer side. Front returns false if the ring is empty.
+  bool Front(T *value) const {
+    if (head_ == tail_) return false;
+    Barrier();
+    *value = slots_[head_ & mask_];
+    return true;
+  }
+  void Pop() {
+    Barrier();
+    head_ = head_ + 1;
+  }
+  int capacity() const { return mask_ + 1; }
+  // Spins for a while, then gives the other side a chance to run on an oversubscribed host
+  static void Wait(int spins) {
+    if (spins < kSpinsBeforeYield) {
+      __asm__ __volatile__("pause");
+    } else {
+      sched_yield();
+    }
+  }
+
+private:
+  static void Barrier() { __asm__ __volatile__("" : : : "memory"); }
+
+  // padded onto separate cache lines, so the two sides do not bounce one line between them
+  char padding0_[64];
+  volatile uint64_t head_;  ///< written by the consumer
+  char padding1_[64 - sizeof(uint64_t)];
+  volatile uint64_t tail_;  ///< written by the producer
+  char padding2_[64 - sizeof(uint64_t)];
+  std::vector<T> slots_;
+  uint64_t mask_;
+  DISALLOW_COPY_AND_ASSIGN(SpscRing);
+};
+
+template<class T> const int SpscRing<T>::kSpinsBeforeYield;
+
+#endif /* SPSCRING_H_ */
@@ -0,0 +1,66 @@
+#include <pthread.h>
+#include <gtest/gtest.h>
+#include "spscring.h"
+
+static const uint64_t kTransferCount = 1000000;
+
+TEST(SpscRingTest, Basic) {
+  SpscRing<int> ring(5);
+  EXPECT_EQ(8, ring.capacity());
+  EXPECT_TRUE(ring.Empty());
+  int value;
+  EXPECT_FALSE(ring.Front(&value));
+  for (int i = 0; i < 8; i++) ring.Push(i);
+  EXPECT_FALSE(ring.Empty());
+  for (int i = 0; i < 8; i++) {
+    ASSERT_TRUE(ring.Front(&value));
+    EXPECT_EQ(i, value);
+    ASSERT_TRUE(ring.Front(&value));  // stays until popped
+    EXPECT_EQ(i, value);
+    ring.Pop();
+  }
+  EXPECT_TRUE(ring.Empty());
+  // wraps around
+  for (int i = 0; i < 20; i++) {
+    ring.Push(i);
+    ASSERT_TRUE(ring.Front(&value));
+    EXPECT_EQ(i, value);
+    ring.Pop();
+  }
+  EXPECT_THROW(SpscRing<int> bad(0), std::invalid_argument);
+}
+
+static void *Consume(void *arg) {
+  SpscRing<uint64_t> *ring = static_cast<SpscRing<uint64_t> *>(arg);
+  uint64_t *sum = new uint64_t(0);
+  uint64_t expected = 0;
+  int spins = 0;
+  while (expected < kTransferCount) {
+    uint64_t value;
+    if (!ring->Front(&value)) {
+      SpscRing<uint64_t>::Wait(spins++);
+      continue;
+    }
+    spins = 0;
+    if (value != expected) break;  // out of order, the sum will be off
+    *sum += value;
+    expected++;
+    ring->Pop();
+  }
+  return sum;
+}
+
+// Everything arrives once and in order, with a ring small enough to fill up often
+TEST(SpscRingTest, Transfer) {
+  SpscRing<uint64_t> ring(64);
+  pthread_t consumer;
+  ASSERT_EQ(0, pthread_create(&consumer, NULL, Consume, &ring));
+  for (uint64_t i = 0; i < kTransferCount; i++) ring.Push(i);
+  ring.WaitUntilEmpty();
+  void *result;
+  pthread_join(consumer, &result);
+  uint64_t *sum = static_cast<uint64_t *>(result);
+  EXPECT_EQ(kTransferCount * (kTransferCount - 1) / 2, *sum);
+  delete sum;
+  EXPECT_TRUE(ring.Empty());
+}
@@ -6,8 +6,12 @@
  */
 
 #include "stackholder.h"
+#include "shardedreusestack.h"
+#include "statswriter.h"
 #include "version.h"
 #include <algorithm>
+#include <cstdlib>
+#include <new>
 
 using std::map;
 using std::string;
@@ -15,17 +19,32 @@ using std::vector;
 using std::tr1::unordered_map;
 
 const int StackHolder::kDefaultGranularity;
-// index 0 not used
-const int StackHolder::share_map_[9] = {0,0,0,1,1,2,2,3,3};
+const int StackHolder::kDefaultMaxThreads;
+const int StackHolder::kMaxLevels;
+const int StackHolder::VariantWorker::kRingSize;
+const int StackHolder::kMergeBatch;
 
 StackHolder::StackHolder(const string& statsfile_name, int granularity,
-                         const std::string& stack_type)
+                         const std::string& stack_type, int max_threads)
     throw(std::invalid_argument)
     : do_inval_(true), do_shared_(false), do_single_stacks_(true), do_sim_stacks_(true),
       do_lazy_stacks_(false), do_oracular_stacks_(false), merge_interleave_(1),
-      global_enable_(true), do_prefetch_(false), do_fetch_(false), simulated_shared_stack_(NULL),
-      statsfile_name_(statsfile_name), statsfile_(NULL), granularity_(granularity), PC_stats_(),
-      PC_read_stats_() {
+      global_enable_(true), do_prefetch_(false), do_fetch_(false), interval_length_(0),
+      interval_refs_(0), interval_count_(0), replay_threads_(1), shard_threads_(1),
+      variant_threads_(false),
+      worker_failed_(false), concurrent_shared_(false), shared_log_(NULL), merger_(NULL),
+      merge_pause_depth_(0), pc_stats_group_(kNoGroup), threads_(NULL), max_threads_(max_threads),
+      thread_count_(0),
+      threads_reserved_(0), simulated_shared_stack_(NULL),
+      statsfile_name_(statsfile_name), statsfile_(NULL), granularity_(granularity),
+      sim_sharers_(granularity, max_threads), PC_stats_(), PC_read_stats_() {
+  // the page ownership tables bound the thread ids
+  if (max_threads < 1 || max_threads > PageOwnershipTable::kMaxThreads) {
+    throw std::invalid_argument("bad maximum thread count");
+  }
+  thread_order_.resize(max_threads_);
+  for (int g = 0; g < kGroupCount; g++) workers_[g] = NULL;
+  RdaInitLock(&merge_lock_);
   statsfile_ = fopen(statsfile_name_.c_str(), "w");
   if (statsfile_ == NULL) throw std::invalid_argument("Could not open file for writing");
   if (stack_type == "exact") {
@@ -34,127 +53,455 @@ StackHolder::StackHolder(const string& statsfile_name, int granularity,
   else if (stack_type == "approximate") {
     stack_type_ = ReuseStack::kApproximateStack;
   }
+  else if (stack_type == "sharded") {
+    stack_type_ = ReuseStack::kShardedStack;
+  }
   else {
-    throw std::invalid_argument("stack type must be \"exact\" or \"approximate\"");
+    fclose(statsfile_);
+    throw std::invalid_argument("stack type must be \"exact\", \"approximate\" or \"sharded\"");
+  }
+  // new[] does not honor the records' cache line alignment
+  void *records;
+  if (posix_memalign(&records, 64, max_threads_ * sizeof(ThreadRecord)) != 0) {
+    fclose(statsfile_);
+    throw std::bad_alloc();
   }
+  threads_ = static_cast<ThreadRecord *>(records);
+  for (int i = 0; i < max_threads_; i++) new (&threads_[i]) ThreadRecord();
+  set_topology(CacheTopology::kDefaultSpec);
 }
 
 StackHolder::~StackHolder() {
+  StopVariantWorkers();
+  binary_out_.reset();  // flushes
   fclose(statsfile_);
   // delay the deletion until after the dump in case we crashed, we might still get the info
-  for (std::vector<int>::iterator iter(threads_seen_.begin());
-       iter != threads_seen_.end(); ++iter) {
-    int i = *iter;
-    if (do_single_stacks()) delete single_stacks_[i];
-    if (do_sim_stacks()) delete sim_stacks_[i];
-    if (do_lazy_stacks()) delete lazy_stacks_[i];
-    if (do_oracular_stacks()) delete oracular_stacks_[i];
+  for (int i = 0; i < max_threads_; i++) {
+    ThreadRecord &record = threads_[i];
+    delete record.single_stack;
+    delete record.sim_stack;
+    delete record.lazy_stack;
+    delete record.oracular_stack;
+    delete record.prefetcher;
+    delete record.buffered_accesses;
+    delete record.invalidations;
+    record.~ThreadRecord();
   }
+  free(threads_);
   delete simulated_shared_stack_;
-  //delete pair shared stacks?
+  DeleteLevels();
+}
+
+void StackHolder::DeleteLevels() {
+  for (size_t l = 0; l < levels_.size(); l++) {
+    for (size_t i = 0; i < levels_[l]->stacks.size(); i++) delete levels_[l]->stacks[i];
+    delete levels_[l];
+  }
+  levels_.clear();
+}
+
+void StackHolder::set_topology(const std::string &spec) throw(std::invalid_argument) {
+  if (threads_reserved_ > 0) {
+    throw std::invalid_argument("the cache topology must be set before threads are allocated");
+  }
+  CacheTopology topology(spec);
+  if (topology.GetLevelCount() > kMaxLevels) {
+    throw std::invalid_argument("too many cache topology levels");
+  }
+  topology_ = topology;
+  DeleteLevels();
+  for (int l = 0; l < topology_.GetLevelCount(); l++) {
+    // no level has more domains than threads
+    levels_.push_back(new SharedLevel(granularity_, max_threads_));
+  }
 }
 
-void StackHolder::Allocate(int thread) {
-  threads_seen_.push_back(thread);
-  threads_enabled_[thread] = true;
+void StackHolder::Allocate(int thread) throw(std::invalid_argument) {
+  ThreadRecord &record = GetRecord(thread);
+  if (concurrent_shared_ && do_inval()) {
+    throw std::invalid_argument("concurrent shared stacks cannot be combined with private ones");
+  }
+  if (!__sync_bool_compare_and_swap(&record.state, kNewThread, kRegistering)) return;
 
   if (do_inval()) {
     if (do_single_stacks()) {
-      single_stacks_[thread] = new ReuseStack(statsfile_, granularity_, stack_type_);
-      single_stacks_[thread]->SetRatioPredictionSizes(ratio_prediction_sizes_);
+      record.single_stack = new ReuseStack(statsfile_, granularity_, stack_type_);
+      record.single_stack->SetRatioPredictionSizes(ratio_prediction_sizes_);
     }
 
     if (do_sim_stacks()) {
-        sim_stacks_[thread] = new ReuseStack(statsfile_, granularity_, stack_type_);
-        sim_stacks_[thread]->SetRatioPredictionSizes(ratio_prediction_sizes_);
-        prefetchers_[thread] = new PrefetchArbiter();
-        prefetchers_[thread]->AddPrefetcher(new StridePrefetcher());
-        //prefetchers_[thread]->AddPrefetcher(new DCUPrefetcher());
+        record.sim_stack = new ReuseStack(statsfile_, granularity_, stack_type_);
+        record.sim_stack->SetRatioPredictionSizes(ratio_prediction_sizes_);
+        record.prefetcher = new PrefetchArbiter();
+        record.prefetcher->AddPrefetcher(new StridePrefetcher());
+        //record.prefetcher->AddPrefetcher(new DCUPrefetcher());
     }
 
     if (do_lazy_stacks()) {
-        lazy_stacks_[thread] = new ReuseStack(statsfile_, granularity_, stack_type_);
-        lazy_stacks_[thread]->SetRatioPredictionSizes(ratio_prediction_sizes_);
+        record.lazy_stack = new ReuseStack(statsfile_, granularity_, stack_type_);
+        record.lazy_stack->SetRatioPredictionSizes(ratio_prediction_sizes_);
     }
     if (do_oracular_stacks()) {
-        oracular_stacks_[thread] = new ReuseStack(statsfile_, granularity_, stack_type_);
-        oracular_stacks_[thread]->SetRatioPredictionSizes(ratio_prediction_sizes_);
+        record.oracular_stack = new ReuseStack(statsfile_, granularity_, stack_type_);
+        record.oracular_stack->SetRatioPredictionSizes(ratio_prediction_sizes_);
+    }
+    if (do_lazy_stacks() || do_oracular_stacks()) {
+      record.buffered_accesses = new RefBuffer();
+      record.invalidations = new RefBuffer();
     }
   }
 
   if (do_shared()) {
-    if (pair_share_stacks_.count(share_map_[thread]) == 0) {
-      pair_share_stacks_[share_map_[thread]] = new ReuseStack(statsfile_, granularity_, stack_type_);
-      pair_share_stacks_[share_map_[thread]]->SetRatioPredictionSizes(pair_prediction_sizes_);
+    for (size_t l = 0; l < levels_.size(); l++) {
+      record.domain_stacks[l] = InstallSharedStack(
+          &levels_[l]->stacks[topology_.DomainOf(l, thread)], domain_prediction_sizes_);
     }
-    if (simulated_shared_stack_ == NULL) {
-      simulated_shared_stack_ = new ReuseStack(statsfile_, granularity_, stack_type_);
-      simulated_shared_stack_->SetRatioPredictionSizes(shared_prediction_sizes_);
+    InstallSharedStack(&simulated_shared_stack_, shared_prediction_sizes_);
+  }
+
+  record.enabled = true;
+  int slot = __sync_fetch_and_add(&threads_reserved_, 1);
+  // the enabled variants are known now; nobody can reference anything before this is published
+  if (slot == 0) StartVariantWorkers();
+  thread_order_[slot] = thread;
+  record.state = kRegistered;
+  // publish in slot order, so readers only ever see filled-in slots below thread_count_
+  while (thread_count_ != slot) {}
+  __sync_synchronize();
+  thread_count_ = slot + 1;
+}
+
+// Creates the stack in *slot unless another thread got there first
+ReuseStackBase *StackHolder::InstallSharedStack(ReuseStackBase **slot,
+                                                const std::vector<int> &sizes) {
+  if (*slot == NULL) {
+    ReuseStackBase *stack = new ReuseStack(statsfile_, granularity_, stack_type_,
+                                           shard_threads_);
+    std::vector<int> prediction_sizes(sizes);
+    stack->SetRatioPredictionSizes(prediction_sizes);
+    if (!__sync_bool_compare_and_swap(slot, static_cast<ReuseStackBase *>(NULL), stack)) {
+      delete stack;
     }
   }
+  return *slot;
 }
 
-void StackHolder::Fetch(int thread, address_t PC, int size) {
-  if ( !global_enable_ || !threads_enabled_[thread]) return;
-  if (do_fetch()) sim_stacks_[thread]->Access(PC, size, ReuseStack::kFetch);
+void StackHolder::set_variant_threads(bool enable) throw(std::invalid_argument) {
+  if (threads_reserved_ > 0) {
+    throw std::invalid_argument("variant threads must be set before threads are allocated");
+  }
+  variant_threads_ = enable;
 }
 
-acc_count_t StackHolder::Access(int thread, address_t address, int size, address_t PC, bool is_write) {
-  if ( !global_enable_ || !threads_enabled_[thread]) return 0;
-  acc_count_t distance = 0;
+void StackHolder::set_replay_threads(int threads) throw(std::invalid_argument) {
+  if (threads < 1 || threads > max_threads_) {
+    throw std::invalid_argument("replay threads must be between 1 and the thread limit");
+  }
+  replay_threads_ = threads;
+  replay_pool_.reset();
+}
+
+void StackHolder::set_shard_threads(int threads) throw(std::invalid_argument) {
+  if (threads_reserved_ > 0) {
+    throw std::invalid_argument("shard threads must be set before threads are allocated");
+  }
+  if (threads < 1 || threads > ShardedReuseStack::kDefaultShards) {
+    throw std::invalid_argument("shard threads must be between 1 and the number of shards");
+  }
+  shard_threads_ = threads;
+}
+
+void StackHolder::set_concurrent_shared(bool enable) throw(std::invalid_argument) {
+  if (threads_reserved_ > 0) {
+    throw std::invalid_argument("concurrent shared must be set before threads are allocated");
+  }
+  concurrent_shared_ = enable;
+}
+
+bool StackHolder::IsGroupEnabled(int group) {
+  switch (group) {
+    case kSingleGroup: return do_inval() && do_single_stacks();
+    case kSimGroup: return do_inval() && do_sim_stacks();
+    case kBufferedGroup: return do_inval() && (do_lazy_stacks() || do_oracular_stacks());
+    case kSharedGroup: return do_shared();
+    case kDomainGroup: return do_shared() && !levels_.empty();
+    default: return false;
+  }
+}
+
+void StackHolder::StartVariantWorkers() {
+  // private overrides shared in stats keeping
+  if (IsGroupEnabled(kSimGroup)) {
+    pc_stats_group_ = kSimGroup;
+  } else if (IsGroupEnabled(kSharedGroup)) {
+    pc_stats_group_ = kSharedGroup;
+  } else {
+    pc_stats_group_ = kNoGroup;
+  }
+  if (concurrent_shared_ && do_shared()) {
+    shared_log_ = new OrderedRings<VariantRef>(max_threads_, VariantWorker::kRingSize);
+    merger_ = new VariantWorker(this, kSharedGroup, 1);  // reads shared_log_ instead
+    if (pthread_create(&merger_->thread, NULL, MergerMain, merger_) != 0) {
+      delete merger_;
+      delete shared_log_;
+      merger_ = NULL;
+      shared_log_ = NULL;
+      throw std::runtime_error("could not start the shared stack merger");
+    }
+  }
+  if (!variant_threads_) return;
+  for (int g = 0; g < kGroupCount; g++) {
+    if (!IsGroupEnabled(g) || (shared_log_ && (g == kSharedGroup || g == kDomainGroup))) continue;
+    VariantWorker *worker = new VariantWorker(this, static_cast<VariantGroup>(g),
+                                              VariantWorker::kRingSize);
+    if (pthread_create(&worker->thread, NULL, VariantWorkerMain, worker) != 0) {
+      delete worker;  // this group stays on the caller's thread
+      continue;
+    }
+    workers_[g] = worker;
+  }
+}
+
+void StackHolder::StopVariantWorkers() {
+  for (int g = 0; g < kGroupCount; g++) {
+    if (!workers_[g]) continue;
+    workers_[g]->stop = true;
+    pthread_join(workers_[g]->thread, NULL);
+    delete workers_[g];
+    workers_[g] = NULL;
+  }
+  if (merger_) {
+    merger_->stop = true;  // after merging everything that was logged
+    pthread_join(merger_->thread, NULL);
+    delete merger_;
+    delete shared_log_;
+    merger_ = NULL;
+    shared_log_ = NULL;
+  }
+}
+
+void *StackHolder::VariantWorkerMain(void *arg) {
+  VariantWorker *worker = static_cast<VariantWorker *>(arg);
+  VariantRef ref;
+  for (int spins = 0; ; spins++) {
+    if (!worker->refs.Front(&ref)) {
+      if (worker->stop) break;
+      SpscRing<VariantRef>::Wait(spins);
+      continue;
+    }
+    spins = 0;
+    if (!worker->failed) worker->holder->RunGroup(worker, worker->group, ref);
+    worker->refs.Pop();
+  }
+  return NULL;
+}
+
+bool StackHolder::RunGroup(VariantWorker *worker, int group, const VariantRef &ref) {
   try {
+    ProcessRef(group, ref);
+    return true;
+  } catch (std::bad_alloc &e) {
+    worker->bad_alloc = true;
+  } catch (std::exception &e) {
+    worker->error = e.what();
+  }
+  worker->failed = true;
+  worker_failed_ = true;
+  return false;
+}
 
-    if (do_inval()) {
-      if (do_single_stacks()) {
-        single_stacks_[thread]->Access(address, size,
-            is_write ? ReuseStack::kWrite : ReuseStack::kRead);
-      }
-      if (do_sim_stacks()) {
-        distance = sim_stacks_[thread]->Access(address, size, 
-					       is_write ? ReuseStack::kWrite : ReuseStack::kRead);
-        if (is_write) {
-          for (vector<int>::iterator iter(threads_seen_.begin());
-               iter != threads_seen_.end(); ++iter) {
-            int i = *iter;
-            if (i != thread) sim_stacks_[i]->Snoop(address, size);
-          }
-        }
-        address_t addr;
-        if (do_prefetch() &&
-            (addr = prefetchers_[thread]->Access(address / granularity_, PC, distance,
-						 is_write ? ReuseStack::kWrite : ReuseStack::kRead)) != kAddressMax){
-          sim_stacks_[thread]->Prefetch(addr * granularity_);
-        }
+void *StackHolder::MergerMain(void *arg) {
+  VariantWorker *merger = static_cast<VariantWorker *>(arg);
+  merger->holder->MergeSharedLog(merger);
+  return NULL;
+}
+
+// Applies the logged references to the shared and level stacks in timestamp order. The interval
+// lengths count merged references, so intervals end here.
+void StackHolder::MergeSharedLog(VariantWorker *merger) {
+  bool domains = IsGroupEnabled(kDomainGroup);
+  VariantRef ref;
+  for (int spins = 0; ; spins++) {
+    if (!shared_log_->Front(&ref)) {
+      if (merger->stop && shared_log_->popped() == shared_log_->pushed()) break;
+      SpscRing<VariantRef>::Wait(spins);
+      continue;
+    }
+    spins = 0;
+    RdaGetLock(&merge_lock_);
+    for (int i = 0; i < kMergeBatch && shared_log_->Front(&ref); i++) {
+      if (!merger->failed && RunGroup(merger, kSharedGroup, ref) &&
+          (!domains || RunGroup(merger, kDomainGroup, ref))) {
+        if (++interval_refs_ == interval_length_) WriteIntervals();
       }
-      if (do_lazy_stacks()) lazy_stacks_[thread]->Access(address, size, is_write ? ReuseStack::kWrite : ReuseStack::kRead);
-      if (do_lazy_stacks() || do_oracular_stacks()) {
-        //pre-inval buffering
-        BufferedRef bRef;
-        bRef.address = address;
-        bRef.is_write = is_write;
-        //bRef.cpu = thread;
-        bRef.size = size;
-        buffered_accesses_[thread].push_back(bRef);
+      shared_log_->Pop();
+    }
+    RdaReleaseLock(&merge_lock_);
+  }
+}
+
+void StackHolder::PauseMerger() {
+  if (merge_pause_depth_++ == 0) RdaGetLock(&merge_lock_);
+}
+
+void StackHolder::ResumeMerger() {
+  if (--merge_pause_depth_ == 0) RdaReleaseLock(&merge_lock_);
+}
+
+void StackHolder::WaitForVariantWorkers() {
+  if (shared_log_) shared_log_->WaitUntilPopped(shared_log_->pushed());
+  for (int g = 0; g < kGroupCount; g++) {
+    if (workers_[g]) workers_[g]->refs.WaitUntilEmpty();
+  }
+}
+
+void StackHolder::Drain() {
+  WaitForVariantWorkers();
+  if (!worker_failed_) return;
+  for (int g = 0; g <= kGroupCount; g++) {
+    VariantWorker *worker = g < kGroupCount ? workers_[g] : merger_;
+    if (!worker || !worker->failed) continue;
+    if (worker->bad_alloc) throw std::bad_alloc();
+    throw std::runtime_error(worker->error);
+  }
+}
+
+// Hands the reference to every enabled group, on its thread or right here. Returns the distance
+// for the PC stats if that group ran here.
+acc_count_t StackHolder::Dispatch(const VariantRef &ref) {
+  if (worker_failed_) Drain();
+  acc_count_t distance = 0;
+  // fetches only go to the sim stacks
+  int groups = ref.type == ReuseStack::kFetch ? kSimGroup + 1 : kGroupCount;
+  for (int g = ref.type == ReuseStack::kFetch ? kSimGroup : 0; g < groups; g++) {
+    if (workers_[g]) {
+      workers_[g]->refs.Push(ref);
+    } else if (IsGroupEnabled(g)) {
+      acc_count_t dist = ProcessRef(g, ref);
+      if (g == pc_stats_group_) distance = dist;
+    }
+  }
+  return distance;
+}
+
+acc_count_t StackHolder::ProcessRef(int group, const VariantRef &ref) {
+  ThreadRecord &record = threads_[ref.thread];
+  ReuseStackBase::AccessType type = static_cast<ReuseStackBase::AccessType>(ref.type);
+  acc_count_t distance = 0;
+  switch (group) {
+    case kSingleGroup:
+      record.single_stack->Access(ref.address, ref.size, type);
+      break;
+    case kSimGroup:
+      distance = AccessSimStacks(ref);
+      break;
+    case kBufferedGroup:
+      if (do_lazy_stacks()) record.lazy_stack->Access(ref.address, ref.size, type);
+      //pre-inval buffering
+      record.buffered_accesses->Append(ref.address, ref.size, type == ReuseStack::kWrite);
+      // for the private page check at the end of the region
+      TouchPages(kBufferedGroup, ref.thread, ref.address, ref.size);
+      break;
+    case kSharedGroup:
+      distance = simulated_shared_stack_->Access(ref.address, ref.size, type);
+      break;
+    case kDomainGroup:
+      AccessDomainStacks(ref);
+      break;
+  }
+  if (group == pc_stats_group_ && type != ReuseStack::kFetch) {
+    PC_stats_.AddSample(ref.PC, distance);
+    if (type == ReuseStack::kRead) PC_read_stats_.AddSample(ref.PC, distance);
+  }
+  return distance;
+}
+
+acc_count_t StackHolder::AccessSimStacks(const VariantRef &ref) {
+  ThreadRecord &record = threads_[ref.thread];
+  ReuseStackBase::AccessType type = static_cast<ReuseStackBase::AccessType>(ref.type);
+  acc_count_t distance = record.sim_stack->Access(ref.address, ref.size, type);
+  // nobody else can hold a block of a private page, so there is nothing to invalidate
+  if (TouchPages(kSimGroup, ref.thread, ref.address, ref.size)) {
+    // nothing to record or snoop
+  } else if (type == ReuseStack::kWrite) {
+    SharerDirectory::SharerMask sharers = sim_sharers_.Write(ref.address, ref.size, ref.thread);
+    while (sharers) {
+      // past SharerDirectory::kMaskBits threads, a bit stands for every kMaskBits-th thread
+      for (int t = SharerDirectory::PopSharer(&sharers); t < max_threads_;
+           t += SharerDirectory::kMaskBits) {
+        ReuseStackBase *stack = threads_[t].sim_stack;
+        if (t != ref.thread && stack) stack->Snoop(ref.address, ref.size);
       }
     }
+  } else {
+    sim_sharers_.AddAccess(ref.address, ref.size, ref.thread);
+  }
+  address_t addr;
+  if (type != ReuseStack::kFetch && do_prefetch() &&
+      (addr = record.prefetcher->Access(ref.address / granularity_, ref.PC, distance,
+                                        type)) != kAddressMax) {
+    record.sim_stack->Prefetch(addr * granularity_);
+    if (!TouchPages(kSimGroup, ref.thread, addr * granularity_, 1)) {
+      sim_sharers_.AddAccess(addr * granularity_, 1, ref.thread);
+    }
+  }
+  return distance;
+}
 
-    if (do_shared()) {
-      acc_count_t dist = simulated_shared_stack_->Access(address, size, is_write ? ReuseStack::kWrite : ReuseStack::kRead);
-      if (!do_inval() || !do_sim_stacks()) distance = dist;  // private overrides shared in stats keeping
-      pair_share_stacks_[share_map_[thread]]->Access(address, size, is_write ? ReuseStack::kWrite : ReuseStack::kRead);
-      if (is_write) {
-        for (vector<int>::iterator iter(threads_seen_.begin());
-             iter != threads_seen_.end(); ++iter) {
-          int i = *iter;
-          if (share_map_[i] != share_map_[thread]) {
-            pair_share_stacks_[share_map_[i]]->Snoop(address, size);
-          }
+void StackHolder::AccessDomainStacks(const VariantRef &ref) {
+  ThreadRecord &record = threads_[ref.thread];
+  ReuseStackBase::AccessType type = static_cast<ReuseStackBase::AccessType>(ref.type);
+  bool private_page = TouchPages(kDomainGroup, ref.thread, ref.address, ref.size);
+  for (size_t l = 0; l < levels_.size(); l++) {
+    SharedLevel &level = *levels_[l];
+    record.domain_stacks[l]->Access(ref.address, ref.size, type);
+    int domain = topology_.DomainOf(l, ref.thread);
+    if (private_page) {
+      // nothing to record or snoop
+    } else if (type == ReuseStack::kWrite) {
+      SharerDirectory::SharerMask sharers = level.sharers.Write(ref.address, ref.size, domain);
+      while (sharers) {
+        for (int d = SharerDirectory::PopSharer(&sharers); d < max_threads_;
+             d += SharerDirectory::kMaskBits) {
+          if (d != domain && level.stacks[d]) level.stacks[d]->Snoop(ref.address, ref.size);
         }
       }
+    } else {
+      level.sharers.AddAccess(ref.address, ref.size, domain);
+    }
+  }
+}
+
+void StackHolder::Fetch(int thread, address_t PC, int size) {
+  ThreadRecord &record = GetRecord(thread);
+  if ( !global_enable_ || !record.enabled) return;
+  if (do_fetch()) {
+    VariantRef ref = {PC, PC, size, static_cast<int16_t>(thread), ReuseStack::kFetch};
+    Dispatch(ref);
+  }
+}
+
+acc_count_t StackHolder::Access(int thread, address_t address, int size, address_t PC, bool is_write) {
+  ThreadRecord &record = GetRecord(thread);
+  if ( !global_enable_ || !record.enabled) return 0;
+  VariantRef ref = {address, PC, size, static_cast<int16_t>(thread),
+                    is_write ? ReuseStack::kWrite : ReuseStack::kRead};
+  if (shared_log_) {
+    // may run concurrently with other threads' Access, so a failure is only reported
+    if (worker_failed_) Drain();
+    shared_log_->Push(thread, ref);  // the merger does the rest
+    return 0;
+  }
+  acc_count_t distance = 0;
+  try {
+    distance = Dispatch(ref);
+    if (pc_stats_group_ == kNoGroup) {
+      PC_stats_.AddSample(PC, 0);
+      if (!is_write) PC_read_stats_.AddSample(PC, 0);
     }
-    PC_stats_.AddSample(PC, distance);
-    if (!is_write) {
-      PC_read_stats_.AddSample(PC, distance);
+    if (++interval_refs_ == interval_length_) {
+      Drain();
+      WriteIntervals();
     }
   } catch (std::bad_alloc ex) {
     DumpStatsPython(""); //make sure we dump our stats because they are still useful
@@ -163,28 +510,79 @@ acc_count_t StackHolder::Access(int thread, address_t address, int size, address
   return distance;
 }
 
+// Pages holding the blocks that ReuseStack::Access(address, size) touches
+void StackHolder::GetPageRange(address_t address, int size, address_t *first,
+                               address_t *last) const {
+  address_t end = address + (size > 0 ? size - 1 : 0);
+  if (end < address) end = kAddressMax;
+  *first = PageOwnershipTable::PageOf(address - address % granularity_);
+  address_t last_block = end - end % granularity_;
+  *last = PageOwnershipTable::PageOf(std::max(last_block, last_block + granularity_ - 1));
+}
+
+bool StackHolder::TouchPages(VariantGroup group, int thread, address_t address, int size) {
+  PageOwnershipTable &pages = group == kSimGroup ? sim_pages_ :
+      (group == kDomainGroup ? domain_pages_ : buffered_pages_);
+  address_t first, last;
+  GetPageRange(address, size, &first, &last);
+  bool is_private = true;
+  for (address_t page = first; page <= last && page >= first; page++) {
+    address_t base = page << PageOwnershipTable::kPageBits;
+    int previous_owner;
+    if (pages.Touch(base, thread, &previous_owner)) continue;
+    is_private = false;
+    if (previous_owner == PageOwnershipTable::kNoOwner) continue;
+    // the owner's accesses were not recorded while the page was private
+    if (group == kSimGroup) {
+      sim_sharers_.AddAccess(base, PageOwnershipTable::kPageBytes, previous_owner);
+    } else if (group == kDomainGroup) {
+      for (size_t l = 0; l < levels_.size(); l++) {
+        levels_[l]->sharers.AddAccess(base, PageOwnershipTable::kPageBytes,
+                                      topology_.DomainOf(l, previous_owner));
+      }
+    }
+  }
+  return is_private;
+}
+
+bool StackHolder::IsPrivateAccess(int thread, address_t address, int size) const {
+  address_t first, last;
+  GetPageRange(address, size, &first, &last);
+  for (address_t page = first; page <= last && page >= first; page++) {
+    if (!buffered_pages_.IsPrivate(page << PageOwnershipTable::kPageBits, thread)) return false;
+  }
+  return true;
+}
+
 void StackHolder::AddRatioPredictionSize(int size) {
+  Drain();
+  MergerPause pause(this);
   if (do_inval()) {
-    for (vector<int>::iterator iter(threads_seen_.begin()); iter != threads_seen_.end(); ++iter) {
-      int j = *iter;
-      if (do_single_stacks()) single_stacks_[j]->AddRatioPredictionSize(size);
-      if (do_sim_stacks()) sim_stacks_[j]->AddRatioPredictionSize(size);
-      if (do_lazy_stacks()) lazy_stacks_[j]->AddRatioPredictionSize(size);
-      if (do_oracular_stacks()) oracular_stacks_[j]->AddRatioPredictionSize(size);
+    for (int n = 0; n < thread_count_; n++) {
+      ThreadRecord &record = threads_[thread_order_[n]];
+      if (do_single_stacks()) record.single_stack->AddRatioPredictionSize(size);
+      if (do_sim_stacks()) record.sim_stack->AddRatioPredictionSize(size);
+      if (do_lazy_stacks()) record.lazy_stack->AddRatioPredictionSize(size);
+      if (do_oracular_stacks()) record.oracular_stack->AddRatioPredictionSize(size);
     }
   }
   ratio_prediction_sizes_.push_back(size);
 }
 
 void StackHolder::AddPairPredictionSize(int size) {
-  for (map<int, ReuseStackBase *>::iterator iter(pair_share_stacks_.begin());
-       iter != pair_share_stacks_.end(); ++iter) {
-    iter->second->AddRatioPredictionSize(size);
+  Drain();
+  MergerPause pause(this);
+  for (size_t l = 0; l < levels_.size(); l++) {
+    for (size_t i = 0; i < levels_[l]->stacks.size(); i++) {
+      if (levels_[l]->stacks[i]) levels_[l]->stacks[i]->AddRatioPredictionSize(size);
+    }
   }
-  pair_prediction_sizes_.push_back(size);
+  domain_prediction_sizes_.push_back(size);
 }
 
 void StackHolder::AddSharedPredictionSize(int size) {
+  Drain();
+  MergerPause pause(this);
   if (simulated_shared_stack_ != NULL) {
     simulated_shared_stack_->AddRatioPredictionSize(size);
   }
@@ -193,6 +591,8 @@ void StackHolder::AddSharedPredictionSize(int size) {
 
 void StackHolder::EndParallelRegion() {
   try {
+    Drain();
+    MergerPause pause(this);
 //        for(std::set<int>::iterator iter = memhier->cpp->threadsSeen.begin(); iter !=
 //               memhier->cpp->threadsSeen.end(); ++iter){
 //            int i = *iter;
@@ -246,49 +646,25 @@ void StackHolder::EndParallelRegion() {
 //            }
 //        }
     if (do_inval()) {
-      if (do_lazy_stacks() || do_oracular_stacks()){
-        //for inval stacks, pass over references in all threads for writes,
-        //doing invalidations for previous interval
-        for (vector<int>::iterator thread_iter(threads_seen_.begin());
-             thread_iter !=  threads_seen_.end(); ++thread_iter){
-          int thread = *thread_iter;
-          for (vector<BufferedRef>::iterator ref_iter(buffered_accesses_[thread].begin());
-               ref_iter != buffered_accesses_[thread].end(); ++ref_iter) {
-            if ((*ref_iter).is_write) {
-              //each write invalidates all other threads
-              for (vector<int>::iterator iter(threads_seen_.begin());
-                   iter != threads_seen_.end(); ++iter){
-                int i = *iter;
-                if (i != thread) {
-                  if (do_oracular_stacks()) {
-                    oracular_stacks_[i]->Snoop((*ref_iter).address, (*ref_iter).size);
-                  }
-                  //also do invals for post_inval (already did accesses)
-                  if (do_lazy_stacks()) {
-                    lazy_stacks_[i]->Snoop((*ref_iter).address, (*ref_iter).size);
-                  }
-                }
-              }
-            }
-          }
+      if (do_lazy_stacks() || do_oracular_stacks()) {
+        // First collect each thread's invalidating writes, then replay each thread's stacks:
+        // they only depend on the other threads' invalidations and their own references, so
+        // both passes can be spread over the replay pool.
+        int count = thread_count_;
+        if (replay_threads_ > 1 && count > 1) {
+          if (!replay_pool_) replay_pool_.reset(new WorkerPool(replay_threads_));
+          replay_pool_->ParallelFor(count, CollectInvalidationsTask, this);
+          replay_pool_->ParallelFor(count, ReplayTask, this);
+        } else {
+          for (int n = 0; n < count; n++) CollectInvalidations(n);
+          for (int n = 0; n < count; n++) ReplayThread(n);
         }
-      }
-      if (do_oracular_stacks()){
-        //pass over all references, doing accesses for previous interval
-        for (vector<int>::iterator thread_iter(threads_seen_.begin());
-             thread_iter !=  threads_seen_.end(); ++thread_iter){
-          int thread = *thread_iter;
-          for (vector<BufferedRef>::iterator ref_iter(buffered_accesses_[thread].begin());
-               ref_iter != buffered_accesses_[thread].end(); ++ref_iter) {
-            oracular_stacks_[thread]->Access(ref_iter->address, ref_iter->size, 
-                ref_iter->is_write ? ReuseStack::kWrite : ReuseStack::kRead);
-          }
-          buffered_accesses_[thread].clear();
+        // the region has been replayed (lazy-only runs included)
+        for (int t = 0; t < count; t++) {
+          threads_[thread_order_[t]].buffered_accesses->Clear();
+          threads_[thread_order_[t]].invalidations->Clear();
         }
       }
-      else {
-        //printf("warning: reuse_timedec called with doSimOnly\n");
-      }
     }
   } catch (std::bad_alloc ex) {
 //    attr_value_t attr = SIM_make_attr_string("");
@@ -299,56 +675,213 @@ void StackHolder::EndParallelRegion() {
  }
 }
 
+void StackHolder::CollectInvalidationsTask(void *holder, int index) {
+  static_cast<StackHolder *>(holder)->CollectInvalidations(index);
+}
+
+void StackHolder::ReplayTask(void *holder, int index) {
+  static_cast<StackHolder *>(holder)->ReplayThread(index);
+}
+
+// Copies the writes of the 'index'th registered thread that can invalidate other threads
+void StackHolder::CollectInvalidations(int index) {
+  int thread = thread_order_[index];
+  ThreadRecord &record = threads_[thread];
+  RefBuffer::Reader buffered(*record.buffered_accesses);
+  BufferedRef ref;
+  while (buffered.Next(&ref)) {
+    if (ref.is_write && !IsPrivateAccess(thread, ref.address, ref.size)) {
+      record.invalidations->Append(ref.address, ref.size, true);
+    }
+  }
+}
+
+// Replays the region for the 'index'th registered thread: the invalidations from every other
+// thread, in registration order, then (oracular) its own references
+void StackHolder::ReplayThread(int index) {
+  int thread = thread_order_[index];
+  ThreadRecord &record = threads_[thread];
+  for (int n = 0; n < thread_count_; n++) {
+    int writer = thread_order_[n];
+    if (writer == thread) continue;
+    RefBuffer::Reader invalidations(*threads_[writer].invalidations);
+    BufferedRef ref;
+    while (invalidations.Next(&ref)) {
+      if (do_oracular_stacks()) record.oracular_stack->Snoop(ref.address, ref.size);
+      //also do invals for post_inval (already did accesses)
+      if (do_lazy_stacks()) record.lazy_stack->Snoop(ref.address, ref.size);
+    }
+  }
+  if (do_oracular_stacks()) {
+    RefBuffer::Reader buffered(*record.buffered_accesses);
+    BufferedRef ref;
+    while (buffered.Next(&ref)) {
+      record.oracular_stack->Access(ref.address, ref.size,
+          ref.is_write ? ReuseStack::kWrite : ReuseStack::kRead);
+    }
+  }
+}
+
 void StackHolder::UpdateRatioPredictions() {
+  Drain();
+  MergerPause pause(this);
   if (do_inval()) {
-    for (vector<int>::iterator thread_iter(threads_seen_.begin());
-         thread_iter != threads_seen_.end(); ++thread_iter) {
-      int thread = *thread_iter;
-      if (do_single_stacks()) single_stacks_[thread]->UpdateRatioPredictions();
-      if (do_sim_stacks()) sim_stacks_[thread]->UpdateRatioPredictions();
-      if (do_lazy_stacks()) lazy_stacks_[thread]->UpdateRatioPredictions();
-      if (do_oracular_stacks()) oracular_stacks_[thread]->UpdateRatioPredictions();
+    for (int n = 0; n < thread_count_; n++) {
+      ThreadRecord &record = threads_[thread_order_[n]];
+      if (do_single_stacks()) record.single_stack->UpdateRatioPredictions();
+      if (do_sim_stacks()) record.sim_stack->UpdateRatioPredictions();
+      if (do_lazy_stacks()) record.lazy_stack->UpdateRatioPredictions();
+      if (do_oracular_stacks()) record.oracular_stack->UpdateRatioPredictions();
     }
   }
   // track total/region accesses here? or leave to caches as currently?
   if (do_shared()) {
-    for (map<int, ReuseStackBase *>::iterator it(pair_share_stacks_.begin());
-         it != pair_share_stacks_.end(); ++it) {
-      int i = it->first;
-      pair_share_stacks_[i]->UpdateRatioPredictions();
+    for (size_t l = 0; l < levels_.size(); l++) {
+      for (size_t i = 0; i < levels_[l]->stacks.size(); i++) {
+        if (levels_[l]->stacks[i]) levels_[l]->stacks[i]->UpdateRatioPredictions();
+      }
     }
     simulated_shared_stack_->UpdateRatioPredictions();
   }
 }
 
+void StackHolder::EndInterval() {
+  WaitForVariantWorkers();
+  MergerPause pause(this);
+  WriteIntervals();
+}
+
+void StackHolder::WriteIntervals() {
+  int i = interval_count_++;
+  char name[64];
+  if (binary_out_) {
+    snprintf(name, sizeof(name), "intervalRefs[%d]", i);
+    binary_out_->BeginRecord(BinaryResultWriter::kIntervalRecord, name);
+    binary_out_->Int(interval_refs_);
+  } else {
+    fprintf(statsfile_, "#rdinterval intervalRefs[%d] = %"PRIacc"\n", i, interval_refs_);
+  }
+  interval_refs_ = 0;
+  if (do_inval()) {
+    for (int n = 0; n < thread_count_; n++) {
+      int t = thread_order_[n];
+      ThreadRecord &record = threads_[t];
+      if (do_single_stacks()) {
+        snprintf(name, sizeof(name), "singleStacks[%d][%d]", t, i);
+        WriteInterval(name, record.single_stack);
+      }
+      if (do_sim_stacks()) {
+        snprintf(name, sizeof(name), "simStacks[%d][%d]", t, i);
+        WriteInterval(name, record.sim_stack);
+      }
+      if (do_lazy_stacks()) {
+        snprintf(name, sizeof(name), "delayStacks[%d][%d]", t, i);
+        WriteInterval(name, record.lazy_stack);
+      }
+      if (do_oracular_stacks()) {
+        snprintf(name, sizeof(name), "preStacks[%d][%d]", t, i);
+        WriteInterval(name, record.oracular_stack);
+      }
+    }
+  }
+  if (do_shared()) {
+    snprintf(name, sizeof(name), "simSharedStack[%d]", i);
+    WriteInterval(name, simulated_shared_stack_);
+    for (size_t l = 0; l < levels_.size(); l++) {
+      for (int d = 0; d < max_threads_; d++) {
+        if (!levels_[l]->stacks[d]) continue;
+        snprintf(name, sizeof(name), "%sStacks[%d][%d]", topology_.GetLevel(l).name.c_str(), d, i);
+        WriteInterval(name, levels_[l]->stacks[d]);
+      }
+    }
+  }
+  // make the interval visible to anyone watching the output while the run continues
+  FlushStats();
+}
+
+// The empty 'name = {}' that the #rddata lines for 'name[...]' are added to
+void StackHolder::WriteResultDict(const char *name) {
+  if (binary_out_) {
+    binary_out_->BeginRecord(BinaryResultWriter::kAssignmentRecord, name);
+    binary_out_->BeginDict();
+    binary_out_->End();
+  } else {
+    fprintf(statsfile_, "%s = {}\n", name);
+  }
+}
+
+void StackHolder::WriteInterval(const char *name, ReuseStackBase *stack) {
+  if (binary_out_) {
+    binary_out_->BeginRecord(BinaryResultWriter::kIntervalRecord, name);
+    stack->DumpIntervalBinary(binary_out_.get());
+  } else {
+    fprintf(statsfile_, "#rdinterval %s = ", name);
+    stack->DumpInterval();
+  }
+}
+
+void StackHolder::WriteStack(const char *name, const ReuseStackBase *stack) {
+  if (binary_out_) {
+    binary_out_->BeginRecord(BinaryResultWriter::kDataRecord, name);
+    stack->DumpStatisticsBinary(binary_out_.get());
+  } else {
+    fprintf(statsfile_, "#rddata %s = ", name);
+    stack->DumpStatistics();
+  }
+}
+
 void StackHolder::DumpStatsPython(const std::string &extra) {
+  WaitForVariantWorkers();  // dump what there is even if a variant thread failed
+  MergerPause pause(this);
   //fprintf(memhier->cpp->stackOutfile, "from appendArray import appendArray\n");
-  fprintf(statsfile_, "#librda version %s\n", LIBRDA_GIT_VERSION);
-  fprintf(statsfile_, "singleStacks = {}\nsimStacks = {}\ndelayStacks = {}\n"
-          "preStacks = {}\n");
-  fprintf(statsfile_, "pairStacks = {}\n");
-  fprintf(statsfile_, "cacheHits = {}\npairHits = {}\nshareHits = {}\n");
-  fprintf(statsfile_, "prefetchStats = {}\n");
+  static const char *kResultDicts[] = {"singleStacks", "simStacks", "delayStacks", "preStacks",
+      NULL, "cacheHits", "pairHits", "shareHits", "prefetchStats"};  // NULL: the level stacks
+  // close the last partial interval so the intervals add up to the whole-run histograms
+  if (interval_count_ > 0 && interval_refs_ > 0) WriteIntervals();
+  if (binary_out_) {
+    binary_out_->Text(string("#librda version ") + LIBRDA_GIT_VERSION);
+  } else {
+    fprintf(statsfile_, "#librda version %s\n", LIBRDA_GIT_VERSION);
+  }
+  char name[64];
+  for (unsigned int i = 0; i < sizeof(kResultDicts) / sizeof(kResultDicts[0]); i++) {
+    if (kResultDicts[i]) {
+      WriteResultDict(kResultDicts[i]);
+      continue;
+    }
+    for (int l = 0; l < topology_.GetLevelCount(); l++) {
+      snprintf(name, sizeof(name), "%sStacks", topology_.GetLevel(l).name.c_str());
+      WriteResultDict(name);
+    }
+  }
   //d4fprintf(statsfile_,"cacheHits[%d] = {}\n", 1);
   if (do_inval()) {
-    for (vector<int>::iterator iter(threads_seen_.begin()); iter != threads_seen_.end(); ++iter){
-      int i = *iter;
+    for (int n = 0; n < thread_count_; n++) {
+      int i = thread_order_[n];
+      ThreadRecord &record = threads_[i];
       if (do_single_stacks()) {
-        fprintf(statsfile_, "#rddata singleStacks[%d] = ", i);
-        single_stacks_[i]->DumpStatistics();
+        snprintf(name, sizeof(name), "singleStacks[%d]", i);
+        WriteStack(name, record.single_stack);
       }
       if (do_sim_stacks()){
-        fprintf(statsfile_, "#rddata simStacks[%d] = ", i);
-        sim_stacks_[i]->DumpStatistics();
-        fprintf(statsfile_, "prefetchStats[%d] = %s\n", i, prefetchers_[i]->GetStatsString().c_str());
+        snprintf(name, sizeof(name), "simStacks[%d]", i);
+        WriteStack(name, record.sim_stack);
+        if (binary_out_) {
+          snprintf(name, sizeof(name), "prefetchStats[%d]", i);
+          binary_out_->BeginRecord(BinaryResultWriter::kAssignmentRecord, name);
+          record.prefetcher->WriteStatsBinary(binary_out_.get());
+        } else {
+          fprintf(statsfile_, "prefetchStats[%d] = %s\n", i,
+                  record.prefetcher->GetStatsString().c_str());
+        }
       }
       if (do_lazy_stacks()){
-        fprintf(statsfile_, "#rddata delayStacks[%d] = ", i);
-        lazy_stacks_[i]->DumpStatistics();
+        snprintf(name, sizeof(name), "delayStacks[%d]", i);
+        WriteStack(name, record.lazy_stack);
       }
       if (do_oracular_stacks()){
-        fprintf(statsfile_, "#rddata preStacks[%d] =  ", i);
-        oracular_stacks_[i]->DumpStatistics();
+        snprintf(name, sizeof(name), "preStacks[%d]", i);
+        WriteStack(name, record.oracular_stack);
       }
 
   //    printf("%d local period ends (barriers)\n", memhier->cpp->localEndPeriodCount[i]);
@@ -363,21 +896,59 @@ void StackHolder::DumpStatsPython(const std::string &extra) {
     }
   }
   if (do_shared()){
-    fprintf(statsfile_, "#rddata simSharedStack = ");
-    simulated_shared_stack_->DumpStatistics();
-    for (map<int, ReuseStackBase *>::iterator it(pair_share_stacks_.begin());
-         it != pair_share_stacks_.end(); ++it) {
-      int i = it->first;
-      fprintf(statsfile_, "#rddata pairStacks[%d] = ", i);
-      //memhier->cpp->pairShareStacks[memhier->cpp->shareMap[i]]->DumpStatistics();
-      it->second->DumpStatistics();
+    WriteStack("simSharedStack", simulated_shared_stack_);
+    for (size_t l = 0; l < levels_.size(); l++) {
+      for (int d = 0; d < max_threads_; d++) {
+        if (!levels_[l]->stacks[d]) continue;
+        snprintf(name, sizeof(name), "%sStacks[%d]", topology_.GetLevel(l).name.c_str(), d);
+        WriteStack(name, levels_[l]->stacks[d]);
+      }
     }
   }
-  fprintf(statsfile_, "PCDist = %s\n", PC_stats_.GetStatsString().c_str());
-  fprintf(statsfile_, "PCDistRead = %s\n", PC_read_stats_.GetStatsString().c_str());
-  fprintf(statsfile_, "%s", extra.c_str());
+  if (binary_out_) {
+    WriteBinaryPCStats();
+    if (!extra.empty()) binary_out_->Text(extra);
+    binary_out_->Flush();
+    return;
+  }
+  StatsWriter out(statsfile_);
+  out.Write("PCDist = ");
+  PC_stats_.WriteStats(&out);
+  out.Write("\nPCDistRead = ");
+  PC_read_stats_.WriteStats(&out);
+  out.Write("\n");
+  if (PC_stats_.IsBounded()) {
+    out.Write("PCDistOther = ");
+    PC_stats_.WriteOtherStats(&out);
+    out.Write("\nPCDistReadOther = ");
+    PC_read_stats_.WriteOtherStats(&out);
+    out.Write("\n");
+  }
+  out.Write(extra);
+}
+
+void StackHolder::WriteBinaryPCStats() {
+  binary_out_->BeginRecord(BinaryResultWriter::kAssignmentRecord, "PCDist");
+  PC_stats_.WriteBinary(binary_out_.get());
+  binary_out_->BeginRecord(BinaryResultWriter::kAssignmentRecord, "PCDistRead");
+  PC_read_stats_.WriteBinary(binary_out_.get());
+  if (PC_stats_.IsBounded()) {
+    binary_out_->BeginRecord(BinaryResultWriter::kAssignmentRecord, "PCDistOther");
+    PC_stats_.WriteOtherBinary(binary_out_.get());
+    binary_out_->BeginRecord(BinaryResultWriter::kAssignmentRecord, "PCDistReadOther");
+    PC_read_stats_.WriteOtherBinary(binary_out_.get());
+  }
 }
 
-bool StackHolder::IsNewThread(int thread) {
-  return std::find(threads_seen_.begin(), threads_seen_.end(), thread) == threads_seen_.end();
+void StackHolder::FlushStats() {
+  if (binary_out_) binary_out_->Flush();
+  fflush(statsfile_);
+}
+
+void StackHolder::set_binary_output(bool binary) {
+  if (binary && !binary_out_) {
+    binary_out_.reset(new BinaryResultWriter(statsfile_));
+  } else if (!binary) {
+    binary_out_.reset();
+  }
 }
@@ -8,6 +8,7 @@
 #ifndef STACKHOLDER_H_
 #define STACKHOLDER_H_
 
+#include <pthread.h>
 #include <stdio.h>
 
 #include <map>
@@ -16,9 +17,19 @@
 #include <tr1/unordered_map>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+#include "cachetopology.h"
+#include "orderedrings.h"
+#include "rdbinary.h"
+#include "rda-sync.h"
+#include "pageownershiptable.h"
+#include "refbuffer.h"
 #include "reusestack.h"
+#include "sharerdirectory.h"
+#include "spscring.h"
 #include "strideprefetcher.h"
 #include "globalstreamprefetcher.h"
+#include "workerpool.h"
 
 /*
  * Abstract out handling of reuse stacks. Include allocation and Access, specify what kinds
@@ -27,32 +38,49 @@
 class StackHolder {
 public:
   const static int kDefaultGranularity = 64;
+  const static int kDefaultMaxThreads = 64;
+  const static int kMaxLevels = 4;  ///< shared levels in the cache topology
 
-  StackHolder(const std::string& statsfile_name, int granularity, const std::string& stack_type)
-      throw(std::invalid_argument);
+  // Thread ids must be less than 'max_threads', which sizes the per-thread state
+  StackHolder(const std::string& statsfile_name, int granularity, const std::string& stack_type,
+              int max_threads = kDefaultMaxThreads) throw(std::invalid_argument);
   ~StackHolder();
-  void Allocate(int thread);
+  // Registers a thread and creates its stacks. Safe to call concurrently for different threads.
+  void Allocate(int thread) throw(std::invalid_argument);
+  // Access and Fetch calls must not overlap (the pintools hold a lock around them), except with
+  // concurrent_shared. Both throw std::invalid_argument for thread ids Allocate would reject.
   acc_count_t Access(int thread, address_t address, int size, address_t PC, bool is_write);
   void Fetch(int thread, address_t PC, int size);
+  // Waits until the variant threads have handled every reference passed in so far. Everything
+  // that reads the stacks does this first; throws if a variant thread failed.
+  void Drain();
   void AddRatioPredictionSize(int size);
+  // for the domain stacks of every topology level (originally only the pair level)
   void AddPairPredictionSize(int size);
   void AddSharedPredictionSize(int size);
   void EndParallelRegion();
   // called at the same time as reuse_hit_ratios() in memstat
   void UpdateRatioPredictions();
+  // Stream the histogram deltas of every stack since the previous interval as #rdinterval lines
+  void EndInterval();
   void DumpStatsPython(const std::string &extra);
-  void FlushStats() { fflush(statsfile_); }
+  void FlushStats();
   std::string GetStatsFileName() { return statsfile_name_; }
   FILE * GetStatsFileHandle() { return statsfile_; }
   // Returns true if 'thread' is not yet tracked by the stackholder
-  bool IsNewThread(int thread);
+  bool IsNewThread(int thread) { return GetRecord(thread).state == kNewThread; }
 
-  void SetThreadEnabled(int thread, bool enable) { threads_enabled_[thread] = enable; }
-  bool GetThreadEnabled(int thread) { return threads_enabled_[thread]; }
-  int GetPairCache(int thread) { return share_map_[thread]; }
+  void SetThreadEnabled(int thread, bool enable) { GetRecord(thread).enabled = enable; }
+  bool GetThreadEnabled(int thread) { return GetRecord(thread).enabled; }
+  // the sharing domain (and domain stack) of 'thread' at topology level 'level'
+  int GetDomain(int level, int thread) { return topology_.DomainOf(level, thread); }
 
   bool do_inval() { return do_inval_; }
   void set_do_inval(bool inval) { do_inval_ = inval; }
+  const CacheTopology &topology() { return topology_; }
+  // The shared cache levels to model when do_shared is set, see CacheTopology for the format.
+  // Must be set before any thread is allocated.
+  void set_topology(const std::string &spec) throw(std::invalid_argument);
   bool do_shared() {return do_shared_; }
   void set_do_shared(bool shared) { do_shared_ = shared; }
   bool do_single_stacks() { return do_single_stacks_; }
@@ -71,10 +99,157 @@ public:
   void set_do_prefetch(bool prefetch) { do_prefetch_ = prefetch; }
   bool do_fetch() { return do_fetch_; }
   void set_do_fetch(bool fetch) { do_fetch_ = fetch; }
+  int pc_stats_limit() { return PC_stats_.GetMaxTrackedPCs(); }
+  // Keep full histograms only for the heaviest 'limit' PCs (0 = unlimited)
+  void set_pc_stats_limit(int limit) {
+    PC_stats_.SetMaxTrackedPCs(limit);
+    PC_read_stats_.SetMaxTrackedPCs(limit);
+  }
+  acc_count_t interval_length() { return interval_length_; }
+  // End an interval automatically every 'length' references (0 = only on explicit EndInterval)
+  void set_interval_length(acc_count_t length) { interval_length_ = length; }
+  int interval_count() { return interval_count_; }
   int granularity() { return granularity_; }
+  int max_threads() { return max_threads_; }
+  int replay_threads() { return replay_threads_; }
+  // Threads (including the caller's) for the lazy/oracular replay in EndParallelRegion. Throws
+  // std::invalid_argument unless 1 <= threads <= max_threads().
+  void set_replay_threads(int threads) throw(std::invalid_argument);
+  int shard_threads() { return shard_threads_; }
+  // With the "sharded" stack type, threads (including the caller's) answering the distance
+  // queries of each shared and level stack. Set before any thread is allocated; throws
+  // std::invalid_argument unless 1 <= threads <= ShardedReuseStack::kDefaultShards.
+  void set_shard_threads(int threads) throw(std::invalid_argument);
+  bool variant_threads() { return variant_threads_; }
+  // Update each stack variant (single, sim, lazy/oracular buffering, shared, topology levels) on
+  // its own thread, fed through a ring by Access, which then returns 0 instead of the distance.
+  // Must be set before any thread is allocated.
+  void set_variant_threads(bool enable) throw(std::invalid_argument);
+  bool concurrent_shared() { return concurrent_shared_; }
+  // Let threads call Access concurrently, without a lock, when only shared stacks are kept
+  // (do_shared without do_inval). Each thread logs its references with a global timestamp and a
+  // merger thread applies them to the shared and level stacks in timestamp order, which gives
+  // the results of serializing the calls in that order. Access then returns 0. Must be set
+  // before any thread is allocated; the other calls still have to be serialized.
+  void set_concurrent_shared(bool enable) throw(std::invalid_argument);
+  bool binary_output() { return binary_out_ != NULL; }
+  // Write the binary format (see rdbinary.h) instead of text. Set before anything is written.
+  void set_binary_output(bool binary);
+  // For appending records after DumpStatsPython in binary mode, NULL in text mode
+  BinaryResultWriter *GetBinaryWriter() { return binary_out_.get(); }
 
 private:
-  const static int share_map_[9];
+  enum ThreadState { kNewThread, kRegistering, kRegistered };
+  /*
+   * Everything kept for one thread, so that the per-reference path indexes one cache-aligned
+   * record instead of doing a map lookup per stack. Records never move once allocated.
+   */
+  struct ThreadRecord {
+    ThreadRecord() : state(kNewThread), enabled(false), single_stack(NULL), sim_stack(NULL),
+        lazy_stack(NULL), oracular_stack(NULL), prefetcher(NULL), buffered_accesses(NULL),
+        invalidations(NULL) {
+      for (int i = 0; i < kMaxLevels; i++) domain_stacks[i] = NULL;
+    }
+    volatile int state;
+    bool enabled;
+    ReuseStackBase *single_stack;
+    ReuseStackBase *sim_stack;
+    ReuseStackBase *lazy_stack;
+    ReuseStackBase *oracular_stack;
+    ReuseStackBase *domain_stacks[kMaxLevels];  ///< shared with the rest of the domain
+    PrefetchArbiter *prefetcher;
+    RefBuffer *buffered_accesses;  ///< for lazy/oracular replay at the end of the region
+    RefBuffer *invalidations;  ///< the writes from buffered_accesses that other threads snoop
+  } __attribute__((aligned(64)));
+  ThreadRecord &GetRecord(int thread) {
+    if (static_cast<unsigned>(thread) >= static_cast<unsigned>(max_threads_)) {
+      throw std::invalid_argument("thread id out of range");
+    }
+    return threads_[thread];
+  }
+
+  // The stacks of one topology level, and which of them may hold each block
+  struct SharedLevel {
+    SharedLevel(int granularity, int domains)
+        : stacks(domains, static_cast<ReuseStackBase *>(NULL)), sharers(granularity, domains) {}
+    std::vector<ReuseStackBase *> stacks;  ///< indexed by domain
+    SharerDirectory sharers;  ///< by domain
+  };
+
+  // The stack variants that are updated independently of each other for each reference
+  enum VariantGroup {
+    kSingleGroup,
+    kSimGroup,  ///< with prefetching and fetches
+    kBufferedGroup,  ///< lazy stacks and the lazy/oracular replay buffers
+    kSharedGroup,
+    kDomainGroup,  ///< the topology level stacks
+    kGroupCount,
+    kNoGroup = kGroupCount
+  };
+  struct VariantRef {
+    address_t address;
+    address_t PC;
+    int size;
+    int16_t thread;
+    uint8_t type;  ///< a ReuseStackBase::AccessType
+  };
+  // The thread and ring of a variant group that runs on its own thread
+  struct VariantWorker {
+    static const int kRingSize = 4096;
+    VariantWorker(StackHolder *holder, VariantGroup group, int ring_size) : holder(holder),
+        group(group), refs(ring_size), stop(false), failed(false), bad_alloc(false) {}
+    StackHolder *holder;
+    VariantGroup group;
+    SpscRing<VariantRef> refs;
+    pthread_t thread;
+    volatile bool stop;
+    volatile bool failed;  ///< the rest of the references are dropped
+    bool bad_alloc;
+    std::string error;
+  };
+
+  bool IsGroupEnabled(int group);
+  void StartVariantWorkers();
+  void StopVariantWorkers();
+  static void *VariantWorkerMain(void *arg);
+  // Returns false if the reference failed, which stops the worker
+  bool RunGroup(VariantWorker *worker, int group, const VariantRef &ref);
+  static void *MergerMain(void *arg);
+  void MergeSharedLog(VariantWorker *merger);
+  // Keeps the merger away from the stacks, for everything that reads or changes them. Nests.
+  void PauseMerger();
+  void ResumeMerger();
+  class MergerPause {
+  public:
+    explicit MergerPause(StackHolder *holder) : holder_(holder) { holder_->PauseMerger(); }
+    ~MergerPause() { holder_->ResumeMerger(); }
+  private:
+    StackHolder *holder_;
+  };
+  void WriteIntervals();
+  // Like Drain, but leaves failures to be reported later
+  void WaitForVariantWorkers();
+  acc_count_t Dispatch(const VariantRef &ref);
+  // Updates the stacks of one variant group, and the PC stats if they come from that group.
+  // Returns the distance the group measured, if any.
+  acc_count_t ProcessRef(int group, const VariantRef &ref);
+  acc_count_t AccessSimStacks(const VariantRef &ref);
+  void AccessDomainStacks(const VariantRef &ref);
+  void DeleteLevels();
+  static void CollectInvalidationsTask(void *holder, int index);
+  static void ReplayTask(void *holder, int index);
+  void CollectInvalidations(int index);
+  void ReplayThread(int index);
+  ReuseStackBase *InstallSharedStack(ReuseStackBase **slot, const std::vector<int> &sizes);
+  void GetPageRange(address_t address, int size, address_t *first, address_t *last) const;
+  // Records that 'thread' touched the pages of an access in the page table of 'group', returns
+  // true if all are private to it
+  bool TouchPages(VariantGroup group, int thread, address_t address, int size);
+  bool IsPrivateAccess(int thread, address_t address, int size) const;
+  void WriteResultDict(const char *name);
+  void WriteStack(const char *name, const ReuseStackBase *stack);
+  void WriteInterval(const char *name, ReuseStackBase *stack);
+  void WriteBinaryPCStats();
 
   bool do_inval_;
   bool do_shared_;
@@ -86,30 +261,50 @@ private:
   bool global_enable_;
   bool do_prefetch_;
   bool do_fetch_;
+  acc_count_t interval_length_;
+  acc_count_t interval_refs_;  ///< references since the last interval ended
+  int interval_count_;
+  int replay_threads_;
+  boost::scoped_ptr<WorkerPool> replay_pool_;  ///< created on first use
+  int shard_threads_;
+  bool variant_threads_;
+  VariantWorker *workers_[kGroupCount];  ///< NULL for groups updated on the caller's thread
+  volatile bool worker_failed_;
+  bool concurrent_shared_;
+  static const int kMergeBatch = 1024;  ///< references merged per acquisition of merge_lock_
+  OrderedRings<VariantRef> *shared_log_;  ///< per-thread logs, with concurrent_shared
+  VariantWorker *merger_;
+  RdaLock merge_lock_;  ///< held by the merger while it updates the stacks
+  int merge_pause_depth_;
+  int pc_stats_group_;  ///< the group whose distance goes into the PC stats
 
-  // invalidation stacks
-  std::map<int, ReuseStackBase *> single_stacks_;
-  std::map<int, ReuseStackBase *> sim_stacks_;
-  std::map<int, ReuseStackBase *> lazy_stacks_;
-  std::map<int, ReuseStackBase *> oracular_stacks_;
+  // per-thread stacks, indexed by thread id
+  ThreadRecord *threads_;
+  int max_threads_;  ///< entries of threads_
+  std::vector<int> thread_order_;  ///< registered threads, in registration order
+  volatile int thread_count_;  ///< entries of thread_order_ that are fully registered
+  int threads_reserved_;  ///< entries of thread_order_ claimed by registering threads
   // Shared stack
   ReuseStackBase* simulated_shared_stack_;
-  std::map<int, ReuseStackBase *> pair_share_stacks_;
-
-  std::map<int, PrefetchArbiter *> prefetchers_;//just private for now
-
-  std::vector<int> threads_seen_;
-  std::map<int, bool> threads_enabled_;
+  CacheTopology topology_;
+  std::vector<SharedLevel *> levels_;  ///< one per topology level
 
   std::string statsfile_name_;
   FILE * statsfile_;
+  boost::scoped_ptr<BinaryResultWriter> binary_out_;
   int granularity_;
-
-  std::map<int, std::vector<BufferedRef> > buffered_accesses_;
+  // Writes to pages only one thread has touched skip the sharer directories and snoops below.
+  // The directories only record accesses to shared pages. Each group that checks for private
+  // pages has its own table, so that the groups can run on different threads.
+  PageOwnershipTable sim_pages_;
+  PageOwnershipTable buffered_pages_;
+  PageOwnershipTable domain_pages_;
+  // which sim stacks may hold each block, so writes only snoop those
+  SharerDirectory sim_sharers_;
 
   std::vector<int> ratio_prediction_sizes_;
   std::vector<int> shared_prediction_sizes_;
-  std::vector<int> pair_prediction_sizes_;
+  std::vector<int> domain_prediction_sizes_;
 
   ReuseStack::StackImplementationTypes stack_type_;
 
@@ -0,0 +1,121 @@
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <gtest/gtest.h>
+#include "stackholder.h"
+#include "shardedreusestack.h"
+
+using std::string;
+
+// StackHolder's settings for application and helper threads. (stackholder_test.cc, the old
+// trace comparison, is not built.)
+class StackHolderThreadsTest : public testing::Test {
+protected:
+  static const int kThreads = 4;
+  static const int kRefsPerThread = 20000;
+  static string OutputPath(const char *name) {
+    std::ostringstream path;
+    path << "/tmp/stackholderthreads_test_" << getpid() << "_" << name;
+    return path.str();
+  }
+  static string ReadAll(const string &path) {
+    std::ifstream in(path.c_str());
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+  }
+  static address_t Address(int thread, int i) {
+    return ((i * 7919 + thread * 131) % 3000) * 8;
+  }
+  static void ConfigureShared(StackHolder *stacks, bool concurrent) {
+    stacks->set_do_inval(false);
+    stacks->set_do_shared(true);
+    stacks->set_topology("pair:2:1");
+    stacks->set_concurrent_shared(concurrent);
+    stacks->AddSharedPredictionSize(2048);
+    stacks->set_interval_length(7000);
+    for (int t = 0; t < kThreads; t++) stacks->Allocate(t);
+  }
+};
+
+// Concurrent shared stacks (the lock-free alternative to a pipeline for shared-only runs) give
+// exactly what the locked stacks give for the same order of references
+TEST_F(StackHolderThreadsTest, ConcurrentSharedSameAsDirect) {
+  string direct_path(OutputPath("shared_direct"));
+  string concurrent_path(OutputPath("shared_concurrent"));
+  {
+    StackHolder direct(direct_path, 64, "exact");
+    StackHolder concurrent(concurrent_path, 64, "exact");
+    ConfigureShared(&direct, false);
+    ConfigureShared(&concurrent, true);
+    EXPECT_THROW(concurrent.set_concurrent_shared(false), std::invalid_argument);
+    for (int i = 0; i < kRefsPerThread; i++) {
+      int thread = i % kThreads;
+      direct.Access(thread, Address(thread, i), 4, 0x400000 + i % 7, i % 3 == 0);
+      concurrent.Access(thread, Address(thread, i), 4, 0x400000 + i % 7, i % 3 == 0);
+      if (i % 5000 == 4999) {
+        direct.EndParallelRegion();
+        concurrent.EndParallelRegion();
+      }
+    }
+    direct.DumpStatsPython("");
+    concurrent.DumpStatsPython("");
+  }
+  string expected(ReadAll(direct_path));
+  EXPECT_FALSE(expected.empty());
+  EXPECT_EQ(expected, ReadAll(concurrent_path));
+  unlink(direct_path.c_str());
+  unlink(concurrent_path.c_str());
+}
+
+TEST_F(StackHolderThreadsTest, BadReplayThreads) {
+  string path(OutputPath("replay"));
+  {
+    StackHolder stacks(path, 64, "exact", 8);
+    EXPECT_THROW(stacks.set_replay_threads(0), std::invalid_argument);
+    EXPECT_THROW(stacks.set_replay_threads(9), std::invalid_argument);
+    stacks.set_replay_threads(8);
+    EXPECT_EQ(8, stacks.replay_threads());
+  }
+  unlink(path.c_str());
+}
+
+TEST_F(StackHolderThreadsTest, BadShardThreads) {
+  string path(OutputPath("shards"));
+  {
+    StackHolder stacks(path, 64, "sharded");
+    EXPECT_THROW(stacks.set_shard_threads(0), std::invalid_argument);
+    EXPECT_THROW(stacks.set_shard_threads(ShardedReuseStack::kDefaultShards + 1),
+                 std::invalid_argument);
+    stacks.set_shard_threads(2);
+    stacks.Allocate(0);
+    EXPECT_THROW(stacks.set_shard_threads(1), std::invalid_argument);
+  }
+  unlink(path.c_str());
+}
+
+// Past 64 threads the thread state is sized by the stack holder, and a write still invalidates
+// the threads that share its sharer directory bit
+TEST_F(StackHolderThreadsTest, WideThreadLimit) {
+  const int kThreads = 130;
+  string path(OutputPath("many"));
+  {
+    EXPECT_THROW(StackHolder(path, 64, "exact", 0), std::invalid_argument);
+    StackHolder stacks(path, 64, "exact", kThreads);
+    stacks.set_do_single_stacks(false);
+    stacks.set_do_shared(true);
+    for (int t = 0; t < kThreads; t++) stacks.Allocate(t);
+    EXPECT_EQ(kColdMiss, stacks.Access(70, 0x1000, 4, 0, false));
+    EXPECT_EQ(kColdMiss, stacks.Access(6, 0x1000, 4, 0, true));
+    EXPECT_EQ(kInvalidationMiss, stacks.Access(70, 0x1000, 4, 0, false));
+    EXPECT_EQ(0u, stacks.Access(6, 0x1000, 4, 0, true));
+    EXPECT_EQ(kInvalidationMiss, stacks.Access(70, 0x1000, 4, 0, false));
+
+    EXPECT_THROW(stacks.Access(kThreads, 0, 4, 0, false), std::invalid_argument);
+    EXPECT_THROW(stacks.Fetch(kThreads, 0, 4), std::invalid_argument);
+    EXPECT_THROW(stacks.IsNewThread(kThreads), std::invalid_argument);
+    EXPECT_THROW(stacks.SetThreadEnabled(-1, true), std::invalid_argument);
+    EXPECT_THROW(stacks.GetThreadEnabled(kThreads), std::invalid_argument);
+  }
+  unlink(path.c_str());
+}
@@ -0,0 +1,75 @@
+#include "statswriter.h"
+#include <cstdarg>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+const int StatsWriter::kBufferSize;
+
+StatsWriter::StatsWriter(FILE *file) : file_(file), string_(NULL), buffer_(new char[kBufferSize]),
+    used_(0) {
+}
+
+StatsWriter::StatsWriter(std::string *out) : file_(NULL), string_(out),
+    buffer_(new char[kBufferSize]), used_(0) {
+}
+
+StatsWriter::~StatsWriter() {
+  Flush();
+  delete[] buffer_;
+}
+
+void StatsWriter::Flush() {
+  if (used_ == 0) return;
+  if (string_) {
+    string_->append(buffer_, used_);
+  } else if (fwrite(buffer_, 1, used_, file_) != used_) {
+    used_ = 0;
+    throw std::runtime_error("error writing stats");
+  }
+  used_ = 0;
+}
+
+void StatsWriter::Write(const char *text) {
+  Write(text, strlen(text));
+}
+
+void StatsWriter::Write(const char *text, size_t length) {
+  if (used_ + length > static_cast<size_t>(kBufferSize)) {
+    Flush();
+    if (length > static_cast<size_t>(kBufferSize)) {
+      if (string_) {
+        string_->append(text, length);
+      } else if (fwrite(text, 1, length, file_) != length) {
+        throw std::runtime_error("error writing stats");
+      }
+      return;
+    }
+  }
+  memcpy(buffer_ + used_, text, length);
+  used_ += length;
+}
+
+void StatsWriter::Printf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer_ + used_, kBufferSize - used_, format, args);
+  va_end(args);
+  if (length < 0) throw std::runtime_error("error formatting stats");
+  if (used_ + length < static_cast<size_t>(kBufferSize)) {
+    used_ += length;
+    return;
+  }
+  // didn't fit: flush and format again at the start of the buffer (or on the heap if huge)
+  Flush();
+  va_start(args, format);
+  if (length < kBufferSize) {
+    vsnprintf(buffer_, kBufferSize, format, args);
+    used_ = length;
+  } else {
+    std::vector<char> big(length + 1);
+    vsnprintf(&big[0], length + 1, format, args);
+    Write(&big[0], length);
+  }
+  va_end(args);
+}
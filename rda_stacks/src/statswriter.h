@@ -0,0 +1,32 @@
+#ifndef STATSWRITER_H_
+#define STATSWRITER_H_
+
+#include <cstdio>
+#include <string>
+#include "reusestack-common.h"
+
+/*
+ * Buffered writer for stats dumps. Entries are formatted directly into a fixed-size buffer which
+ * is written out whenever it fills, so dumping huge tables (e.g. millions of PCs) never builds
+ * the whole dump in memory. Can also append to a string, for the Get*String() interfaces.
+ */
+class StatsWriter {
+public:
+  static const int kBufferSize = 64 * 1024;
+  explicit StatsWriter(FILE *file);
+  explicit StatsWriter(std::string *out);
+  ~StatsWriter();  // flushes
+  void Write(const char *text);
+  void Write(const std::string &text) { Write(text.data(), text.size()); }
+  void Write(const char *text, size_t length);
+  void Printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  void Flush();
+private:
+  FILE *file_;
+  std::string *string_;
+  char *buffer_;
+  size_t used_;
+  DISALLOW_COPY_AND_ASSIGN(StatsWriter);
+};
+
+#endif /* STATSWRITER_H_ */
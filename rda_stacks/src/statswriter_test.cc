@@ -0,0 +1,64 @@
+#include <gtest/gtest.h>
+#include <boost/lexical_cast.hpp>
+#include "statswriter.h"
+#include "reusestackstats.h"
+
+using std::string;
+
+// Writes entries that cross buffer boundaries, including some larger than the buffer
+static void WriteEntries(StatsWriter *out, string *expected) {
+  string big(StatsWriter::kBufferSize + 100, 'x');
+  for (int i = 0; i < 20000; i++) {
+    out->Printf("%d:%s, ", i, i % 5000 == 0 ? big.c_str() : "y");
+    *expected += boost::lexical_cast<string>(i) + ":" + (i % 5000 == 0 ? big : "y") + ", ";
+    if (i % 7000 == 0) {
+      out->Write(big);
+      *expected += big;
+    }
+  }
+}
+
+TEST(StatsWriterTest, String) {
+  string out, expected;
+  {
+    StatsWriter writer(&out);
+    WriteEntries(&writer, &expected);
+  }
+  EXPECT_EQ(expected, out);
+}
+
+TEST(StatsWriterTest, File) {
+  FILE *file = tmpfile();
+  ASSERT_TRUE(file != NULL);
+  string expected;
+  {
+    StatsWriter writer(file);
+    WriteEntries(&writer, &expected);
+  }
+  rewind(file);
+  string contents;
+  char buffer[4096];
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) contents.append(buffer, count);
+  fclose(file);
+  EXPECT_EQ(expected, contents);
+}
+
+// Streaming PC stats to a file gives the same bytes as the string version
+TEST(StatsWriterTest, PCStats) {
+  PCStats stats;
+  for (address_t i = 0; i < 50000; i++) stats.AddSample(i % 3000, i % 1000);
+  FILE *file = tmpfile();
+  ASSERT_TRUE(file != NULL);
+  {
+    StatsWriter writer(file);
+    stats.WriteStats(&writer);
+  }
+  rewind(file);
+  string contents;
+  char buffer[4096];
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) contents.append(buffer, count);
+  fclose(file);
+  EXPECT_EQ(stats.GetStatsString(), contents);
+}
@@ -7,6 +7,7 @@
 
 #include <boost/format.hpp>
 #include "strideprefetcher.h"
+#include "rdbinary.h"
 
 const int StridePrefetcher::kStrideTableSize;
 const int StridePrefetcher::Min_Conf;
@@ -98,6 +99,13 @@ std::string StridePrefetcher::GetStatsString() {
   return out;
 }
 
+// like GetStatsString, which has no name
+void StridePrefetcher::WriteStatsBinary(BinaryResultWriter *out) {
+  out->IntItem("prefetches", prefetches_);
+  out->IntItem("miss_triggers", miss_triggers_);
+  out->IntItem("prefetch_hit_triggers", prefetch_hit_triggers_);
+}
+
 StridePrefetcher::~StridePrefetcher() {
   std::tr1::unordered_map<address_t, StrideEntry*>::iterator iter;
   for (iter = stride_table_.begin(); iter != stride_table_.end(); ++iter) {
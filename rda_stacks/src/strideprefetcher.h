@@ -19,6 +19,7 @@ public:
     prefetch_hit_triggers_(0) {}
   virtual address_t Access(address_t addr, address_t PC, acc_count_t distance, bool write);
   virtual std::string GetStatsString();
+  virtual void WriteStatsBinary(BinaryResultWriter *out);
   virtual ~StridePrefetcher();
 private:
   std::tr1::unordered_set<address_t> prefetch_record_;
@@ -229,6 +229,50 @@ TEST(SyncTest, SleepingBarrierTest2Sleepers) {
   delete barrier;
 }
 
+static const int kWideThreadCount = 20;  // more than two barrier groups
 
+void *WideBarrierWorker(void *arg) {
+  long threadid = reinterpret_cast<long>(arg);
+  for (int i = 0; i < kBarrierLoops; i++) {
+    if (threadid == (1 + i) % kWideThreadCount) value++;
+    barrier->WaitStart(threadid);
+    if (threadid == (2 + i) % kWideThreadCount) value++;
+    barrier->WaitStage(1, threadid);
+    if (threadid == (3 + i) % kWideThreadCount) value++;
+    barrier->WaitStage(2, threadid);
+  }
+  return reinterpret_cast<void *>(0);
+}
 
+TEST(SyncTest, WideBarrierTest) {
+  barrier = new MultistageBarrier();
+  pthread_t threads[kWideThreadCount];
+  barrier->Init(NULL, kWideThreadCount);
+  value = 0;
+  for (int i = 0; i < kWideThreadCount; i++) {
+    ASSERT_EQ(i, barrier->AddThread());
+  }
+  EXPECT_EQ(-1, barrier->AddThread());
+  CreateThreads(threads, kWideThreadCount, WideBarrierWorker, NULL);
+  CleanUp(threads, kWideThreadCount);
+  EXPECT_EQ(3 * kBarrierLoops, value);
+  delete barrier;
+}
 
+TEST(SyncTest, AdjacentSleepersSkipGroups) {
+  CircularThreadQueue<ParallelSampledStack *> queue;
+  queue.Initialize(kWideThreadCount);
+  barrier = new MultistageBarrier();
+  barrier->Init(&queue, kWideThreadCount);
+  for (int i = 0; i < kWideThreadCount; i++) {
+    ASSERT_EQ(i, barrier->AddThread());
+    queue.AddThread(NULL);
+  }
+  // put all of the second group and the first thread of the third to sleep
+  const int fanout = MultistageBarrier::kBarrierFanout;
+  for (int i = fanout - 1; i <= 2 * fanout; i++) barrier->Sleep(i);
+  EXPECT_EQ(2 * fanout + 1, barrier->GetAdjacentSleepers(fanout - 2));
+  for (int i = 2 * fanout + 1; i < kWideThreadCount; i++) barrier->Sleep(i);
+  EXPECT_EQ(0, barrier->GetAdjacentSleepers(fanout - 2));
+  delete barrier;
+}
@@ -13,6 +13,7 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 #include "reusestack-common.h"
 #include "rda-sync.h"
 
@@ -47,8 +48,7 @@ public:
 
 class ThreadedOutputTrace  {
 public:
-  const static int kMaxThreads = 8;
-  void Init(std::string filename) {
+  void Init(std::string filename, int max_threads) {
   }
   void CleanUp() {
 
@@ -97,20 +97,21 @@ private:
 
 class ThreadedOutputTrace  {
 public:
-  const static int kMaxThreads = 8;
-  void Init(std::string filename) {
+  void Init(std::string filename, int max_threads) {
     tracefile_.exceptions(std::ofstream::eofbit | std::ofstream::failbit | std::ofstream::badbit);
     tracefile_.open(filename.c_str(), std::ios::out);
-    for (int i = 0; i < kMaxThreads; i++) {
+    buffers_.resize(max_threads);
+    for (int i = 0; i < max_threads; i++) {
       buffers_[i] = new std::vector<TraceElement>;
     }
     RdaInitLock(&lock_);
   }
   void CleanUp() {
     tracefile_.close();
-    for (int i = 0; i < kMaxThreads; i++) {
+    for (size_t i = 0; i < buffers_.size(); i++) {
       delete buffers_[i];
     }
+    buffers_.clear();
   }
   void TraceNewSampledAddress(int thread, address_t address) {
     buffers_[thread]->push_back(TraceElement(TraceElement::kNewAddress, thread, address, false));
@@ -120,7 +121,7 @@ public:
   }
   void TraceMerge(int thread) {
     LockHolder l(&lock_);//necessary? or ensure called by only one thread?
-    for (int i = 0; i < kMaxThreads; i++) {
+    for (size_t i = 0; i < buffers_.size(); i++) {
       for (std::vector<TraceElement>::iterator it = buffers_[i]->begin(); it != buffers_[i]->end();
           ++it) {
         if (it->type == TraceElement::kNewAddress) {
@@ -147,7 +148,7 @@ private:
     tracefile_ << "A " << thread << " " << std::hex << address
         << (is_write ? " w" : " r") << std::endl;
   }
-  std::vector<TraceElement> *buffers_[kMaxThreads];
+  std::vector<std::vector<TraceElement> *> buffers_;
   std::ofstream tracefile_;
   RdaLock lock_;
   acc_count_t newaddrs_;
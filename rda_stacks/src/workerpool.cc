@@ -0,0 +1,87 @@
+#include "workerpool.h"
+#include <new>
+#include <stdexcept>
+
+WorkerPool::WorkerPool(int threads) : generation_(0), busy_workers_(0), function_(NULL),
+    context_(NULL), count_(0), next_index_(0), bad_alloc_(false) {
+  if (threads < 1) throw std::invalid_argument("worker pools need at least 1 thread");
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&start_cond_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+  for (int i = 1; i < threads; i++) {
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, WorkerMain, this) != 0) break;  // run with fewer
+    workers_.push_back(worker);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  pthread_mutex_lock(&mutex_);
+  generation_ = -1;
+  pthread_cond_broadcast(&start_cond_);
+  pthread_mutex_unlock(&mutex_);
+  for (size_t i = 0; i < workers_.size(); i++) pthread_join(workers_[i], NULL);
+  pthread_cond_destroy(&done_cond_);
+  pthread_cond_destroy(&start_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void *WorkerPool::WorkerMain(void *arg) {
+  WorkerPool *pool = static_cast<WorkerPool *>(arg);
+  int seen_generation = 0;
+  pthread_mutex_lock(&pool->mutex_);
+  while (true) {
+    while (pool->generation_ == seen_generation) {
+      pthread_cond_wait(&pool->start_cond_, &pool->mutex_);
+    }
+    if (pool->generation_ == -1) break;
+    seen_generation = pool->generation_;
+    pthread_mutex_unlock(&pool->mutex_);
+    pool->RunTasks();
+    pthread_mutex_lock(&pool->mutex_);
+    if (--pool->busy_workers_ == 0) pthread_cond_signal(&pool->done_cond_);
+  }
+  pthread_mutex_unlock(&pool->mutex_);
+  return NULL;
+}
+
+void WorkerPool::RunTasks() {
+  int index;
+  while ((index = __sync_fetch_and_add(&next_index_, 1)) < count_) {
+    try {
+      function_(context_, index);
+    } catch (std::bad_alloc &e) {
+      pthread_mutex_lock(&mutex_);
+      bad_alloc_ = true;
+      pthread_mutex_unlock(&mutex_);
+    } catch (std::exception &e) {
+      pthread_mutex_lock(&mutex_);
+      if (error_.empty()) error_ = e.what();
+      pthread_mutex_unlock(&mutex_);
+    }
+  }
+}
+
+void WorkerPool::ParallelFor(int count, TaskFunction function, void *context) {
+  pthread_mutex_lock(&mutex_);
+  function_ = function;
+  context_ = context;
+  count_ = count;
+  next_index_ = 0;
+  bad_alloc_ = false;
+  error_.clear();
+  busy_workers_ = workers_.size();
+  generation_++;
+  pthread_cond_broadcast(&start_cond_);
+  pthread_mutex_unlock(&mutex_);
+
+  RunTasks();
+
+  pthread_mutex_lock(&mutex_);
+  while (busy_workers_ > 0) pthread_cond_wait(&done_cond_, &mutex_);
+  bool bad_alloc = bad_alloc_;
+  std::string error(error_);
+  pthread_mutex_unlock(&mutex_);
+  if (bad_alloc) throw std::bad_alloc();
+  if (!error.empty()) throw std::runtime_error(error);
+}
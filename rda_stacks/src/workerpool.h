@@ -0,0 +1,44 @@
+#ifndef WORKERPOOL_H_
+#define WORKERPOOL_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "reusestack-common.h"
+
+/*
+ * A fixed set of worker threads for fork-join parallel loops. The calling thread works too, so
+ * a pool of n threads starts n - 1 workers; they sleep between loops.
+ */
+class WorkerPool {
+public:
+  typedef void (*TaskFunction)(void *context, int index);
+  explicit WorkerPool(int threads);
+  ~WorkerPool();
+  // Calls function(context, i) for every i in [0, count), spread over the pool, and returns
+  // when all calls are done. If a call throws, the rest of the loop still runs and the first
+  // exception is rethrown here: std::bad_alloc as itself, anything else as std::runtime_error.
+  void ParallelFor(int count, TaskFunction function, void *context);
+  int thread_count() const { return workers_.size() + 1; }
+
+private:
+  static void *WorkerMain(void *arg);
+  void RunTasks();
+
+  std::vector<pthread_t> workers_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t start_cond_;
+  pthread_cond_t done_cond_;
+  int generation_;  ///< incremented for each loop, and to -1 to stop the workers
+  int busy_workers_;
+  // the current loop
+  TaskFunction function_;
+  void *context_;
+  int count_;
+  volatile int next_index_;
+  bool bad_alloc_;
+  std::string error_;
+  DISALLOW_COPY_AND_ASSIGN(WorkerPool);
+};
+
+#endif /* WORKERPOOL_H_ */
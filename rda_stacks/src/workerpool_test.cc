@@ -0,0 +1,44 @@
+#include <new>
+#include <stdexcept>
+#include <vector>
+#include <gtest/gtest.h>
+#include "workerpool.h"
+
+static void CountCall(void *context, int index) {
+  std::vector<int> *calls = static_cast<std::vector<int> *>(context);
+  __sync_fetch_and_add(&(*calls)[index], 1);
+}
+
+TEST(WorkerPoolTest, EveryIndexOnce) {
+  for (int threads = 1; threads <= 4; threads++) {
+    WorkerPool pool(threads);
+    EXPECT_EQ(threads, pool.thread_count());
+    for (int loop = 0; loop < 50; loop++) {
+      std::vector<int> calls(loop * 3, 0);
+      pool.ParallelFor(calls.size(), CountCall, &calls);
+      for (size_t i = 0; i < calls.size(); i++) ASSERT_EQ(1, calls[i]) << threads << " " << i;
+    }
+  }
+}
+
+static void ThrowSome(void *context, int index) {
+  if (index == 7) throw std::invalid_argument("seven");
+  if (context == NULL) return;
+  if (index == 9) throw std::bad_alloc();
+  CountCall(context, index);
+}
+
+TEST(WorkerPoolTest, Exceptions) {
+  WorkerPool pool(3);
+  std::vector<int> calls(20, 0);
+  EXPECT_THROW(pool.ParallelFor(calls.size(), ThrowSome, &calls), std::bad_alloc);
+  // the other calls still ran
+  for (size_t i = 0; i < calls.size(); i++) EXPECT_EQ(i == 7 || i == 9 ? 0 : 1, calls[i]) << i;
+  try {
+    pool.ParallelFor(8, ThrowSome, NULL);
+    FAIL();
+  } catch (std::runtime_error &e) {
+    EXPECT_STREQ("seven", e.what());
+  }
+  EXPECT_THROW(WorkerPool bad(0), std::invalid_argument);
+}